@@ -32,24 +32,70 @@
 
 #include <naf/nafmodule.h>
 #include <naf/nafconfig.h>
+#include <naf/naftimer.h>
 
+#include <gnr/gnrnode.h>
 #include "core.h"
 #include "msg.h"
 #include "node.h"
+#include "delay.h"
+#include "peer.h"
 
 #define GNR_DEBUG_DEFAULT 0
 int gnr__debug = GNR_DEBUG_DEFAULT;
 struct nafmodule *gnr__module = NULL;
 
 
+/*
+ * Event handlers are kept on a list, newest first, which is compiled into
+ * a flat array for each event type holding just the handlers that want it
+ * (and one more for the batch handlers), so throwing an event doesn't look
+ * at the ones that don't.  This works the same way as the message handler
+ * chains; see mh_compile() in msg.c.
+ */
+#define GNR_EVENT_NTYPES 3 /* NODEUP, NODEDOWN, NODEFLAGCHANGE */
+
 struct evhandler {
 	struct nafmodule *evh_mod;
 	gnr_eventhandlerfunc_t evh_func;
+	gnr_eventbatchfunc_t evh_batchfunc;
 	gnr_event_t evh_evmask;
 	struct evhandler *evh__next;
 };
 static struct evhandler *gnr__evhlist = NULL;
 
+struct evdispatch {
+	struct nafmodule *mod;
+	gnr_eventhandlerfunc_t func;
+	gnr_eventbatchfunc_t batchfunc;
+	gnr_event_t evmask;
+};
+static struct evdispatch *gnr__evdispatch[GNR_EVENT_NTYPES];
+static struct evdispatch *gnr__evbatchdispatch = NULL;
+static gnr_event_t gnr__evbatchmask = GNR_EVENTMASK_NONE;
+static int gnr__evdispatchstale = 0;
+static int gnr__evdispatchbusy = 0;
+
+/*
+ * Events waiting for the batch handlers.  There's at most one for each
+ * node that hasn't been delivered yet, which the node points to, so a new
+ * event for the same node can be folded into it.  (While a batch is being
+ * delivered, its entries are "inflight", and a node can have a newer one
+ * as well, which keeps track of the older.)
+ */
+struct gnr_evpending {
+	struct gnr_event_info gei;
+	struct gnr_event_ei_nodechange ei;
+	int inflight;
+	int release; /* node's gone offline; gnr_node__release() it after */
+	struct gnr_evpending *older;
+	struct gnr_evpending *next, **prevp;
+};
+#define GNR_EVENT_SLABOBJS 64
+static naf_slabcache_t *gnr__evqslab = NULL;
+static struct gnr_evpending *gnr__evq = NULL, **gnr__evqtail = &gnr__evq;
+static struct naf_timer gnr__evqtimer;
+
 static struct evhandler *evh__alloc(struct nafmodule *mod)
 {
 	struct evhandler *evh;
@@ -83,26 +129,127 @@ static void evh__freeall(struct nafmodule *mod, struct evhandler *evh)
 	return;
 }
 
-static struct evhandler *evh_find(struct nafmodule *ownermod, gnr_eventhandlerfunc_t func)
+static struct evhandler *evh_find(struct nafmodule *ownermod, gnr_eventhandlerfunc_t func, gnr_eventbatchfunc_t batchfunc)
 {
 	struct evhandler *evh;
 
 	for (evh = gnr__evhlist; evh; evh = evh->evh__next) {
 		if ((evh->evh_mod == ownermod) &&
-				(evh->evh_func == func)) 
+				(evh->evh_func == func) &&
+				(evh->evh_batchfunc == batchfunc))
 			return evh;
 	}
 
 	return NULL;
 }
 
+static int evh_typeindex(gnr_event_t ev)
+{
+	int i;
+
+	for (i = 0; i < GNR_EVENT_NTYPES; i++) {
+		if (ev == ((gnr_event_t)1 << i))
+			return i;
+	}
+
+	return -1;
+}
+
+static void evh_uncompile(void)
+{
+	int type;
+
+	for (type = 0; type < GNR_EVENT_NTYPES; type++) {
+		naf_free(gnr__module, gnr__evdispatch[type]);
+		gnr__evdispatch[type] = NULL;
+	}
+	naf_free(gnr__module, gnr__evbatchdispatch);
+	gnr__evbatchdispatch = NULL;
+
+	return;
+}
+
+static struct evdispatch *evh_compileone(int batch, gnr_event_t evmask)
+{
+	struct evhandler *evh;
+	struct evdispatch *ed, *edv;
+	int n;
+
+	for (evh = gnr__evhlist, n = 0; evh; evh = evh->evh__next) {
+		if ((!!evh->evh_batchfunc == batch) && (evh->evh_evmask & evmask))
+			n++;
+	}
+
+	if (!(edv = naf_malloc(gnr__module, sizeof(struct evdispatch) * (n + 1))))
+		return NULL;
+
+	for (evh = gnr__evhlist, ed = edv; evh; evh = evh->evh__next) {
+		if ((!!evh->evh_batchfunc != batch) || !(evh->evh_evmask & evmask))
+			continue;
+		ed->mod = evh->evh_mod;
+		ed->func = evh->evh_func;
+		ed->batchfunc = evh->evh_batchfunc;
+		ed->evmask = evh->evh_evmask;
+		ed++;
+	}
+	memset(ed, 0, sizeof(struct evdispatch));
+
+	return edv;
+}
+
+static void evh_compile(void)
+{
+	struct evhandler *evh;
+	int type;
+
+	gnr__evbatchmask = GNR_EVENTMASK_NONE;
+	for (evh = gnr__evhlist; evh; evh = evh->evh__next) {
+		if (evh->evh_batchfunc)
+			gnr__evbatchmask |= evh->evh_evmask;
+	}
+
+	/* Someone's still using the old arrays; try again when they're done. */
+	if (gnr__evdispatchbusy) {
+		gnr__evdispatchstale = 1;
+		return;
+	}
+	gnr__evdispatchstale = 0;
+
+	evh_uncompile();
+
+	for (type = 0; type < GNR_EVENT_NTYPES; type++) {
+		if (!(gnr__evdispatch[type] = evh_compileone(0, (gnr_event_t)1 << type)))
+			goto nomem;
+	}
+	if (!(gnr__evbatchdispatch = evh_compileone(1, GNR_EVENTMASK_ALL)))
+		goto nomem;
+
+	return;
+nomem:
+	dprintf(gnr__module, "evh_compile: out of memory; events will walk the handler list\n");
+	evh_uncompile();
+	return;
+}
+
+static void evh_dispatchdone(void)
+{
+
+	if (--gnr__evdispatchbusy)
+		return;
+
+	if (gnr__evdispatchstale)
+		evh_compile();
+
+	return;
+}
+
 int gnr_event_register(struct nafmodule *mod, gnr_eventhandlerfunc_t evfunc, gnr_event_t evmask)
 {
 	struct evhandler *evh;
 
 	if (!mod || !evfunc)
 		return -1;
-	if (evh_find(mod, evfunc))
+	if (evh_find(mod, evfunc, NULL))
 		return -1;
 
 	if (!(evh = evh__alloc(gnr__module)))
@@ -114,39 +261,294 @@ int gnr_event_register(struct nafmodule *mod, gnr_eventhandlerfunc_t evfunc, gnr
 	evh->evh__next = gnr__evhlist;
 	gnr__evhlist = evh;
 
+	evh_compile();
+
 	return 0;
 }
 
-int gnr_event_unregister(struct nafmodule *mod, gnr_eventhandlerfunc_t func)
+int gnr_event_register_batch(struct nafmodule *mod, gnr_eventbatchfunc_t batchfunc, gnr_event_t evmask)
 {
-	struct evhandler *cur, **prev;
+	struct evhandler *evh;
 
-	if (!mod || !func)
+	if (!mod || !batchfunc)
+		return -1;
+	if (evh_find(mod, NULL, batchfunc))
 		return -1;
 
+	if (!(evh = evh__alloc(gnr__module)))
+		return -1;
+	evh->evh_mod = mod;
+	evh->evh_batchfunc = batchfunc;
+	evh->evh_evmask = evmask;
+
+	evh->evh__next = gnr__evhlist;
+	gnr__evhlist = evh;
+
+	evh_compile();
+
+	return 0;
+}
+
+static int evh_remove(struct nafmodule *mod, gnr_eventhandlerfunc_t func, gnr_eventbatchfunc_t batchfunc)
+{
+	struct evhandler *cur, **prev;
+
 	for (prev = &gnr__evhlist; (cur = *prev); ) {
 		if ((cur->evh_mod == mod) &&
-				(cur->evh_func == func)) {
+				(cur->evh_func == func) &&
+				(cur->evh_batchfunc == batchfunc)) {
 			*prev = cur->evh__next;
 			evh__free(gnr__module, cur);
 		} else
 			prev = &cur->evh__next;
 	}
 
+	evh_compile();
+
 	return 0;
 }
 
+int gnr_event_unregister(struct nafmodule *mod, gnr_eventhandlerfunc_t func)
+{
+
+	if (!mod || !func)
+		return -1;
+
+	return evh_remove(mod, func, NULL);
+}
+
+int gnr_event_unregister_batch(struct nafmodule *mod, gnr_eventbatchfunc_t batchfunc)
+{
+
+	if (!mod || !batchfunc)
+		return -1;
+
+	return evh_remove(mod, NULL, batchfunc);
+}
+
+
+static void evq_append(struct gnr_evpending *ep)
+{
+
+	ep->next = NULL;
+	ep->prevp = gnr__evqtail;
+	*gnr__evqtail = ep;
+	gnr__evqtail = &ep->next;
+
+	if (!naf_timer_isarmed(&gnr__evqtimer))
+		naf_timer_arm(&gnr__evqtimer, 0);
+
+	return;
+}
+
+static void evq_unlink(struct gnr_evpending *ep)
+{
+
+	*ep->prevp = ep->next;
+	if (ep->next)
+		ep->next->prevp = ep->prevp;
+	else
+		gnr__evqtail = ep->prevp;
+
+	return;
+}
+
+static void evq_setinfo(struct gnr_evpending *ep, struct gnr_event_info *gei)
+{
+
+	ep->gei = *gei;
+	if (gei->gei_extinfo) {
+		memcpy(&ep->ei, gei->gei_extinfo, sizeof(struct gnr_event_ei_nodechange));
+		ep->gei.gei_extinfo = (void *)&ep->ei;
+	}
+
+	return;
+}
+
+/*
+ * Queue an event for the batch handlers, or fold it into the one the node
+ * already has waiting.
+ */
+static void gnr_event__defer(struct gnr_event_info *gei)
+{
+	struct gnrnode *gn = gei->gei_node;
+	struct gnr_evpending *ep, *newep;
+
+	if ((ep = gn->evpending) && !ep->inflight) {
+
+		/* Anything but it going away is covered by what's waiting. */
+		if (gei->gei_event != GNR_EVENT_NODEDOWN)
+			return;
+
+		if ((ep->gei.gei_event == GNR_EVENT_NODEUP) ||
+				!(gnr__evbatchmask & GNR_EVENT_NODEDOWN)) {
+			/* Never seen at all, or nobody's interested in it going. */
+			evq_unlink(ep);
+			if ((gn->evpending = ep->older))
+				gn->evpending->release = 1;
+			naf_slab_free(gnr__evqslab, ep);
+			return;
+		}
+
+		/* A flag change, which doesn't matter anymore. */
+		evq_unlink(ep);
+		evq_setinfo(ep, gei);
+		ep->release = 1;
+		evq_append(ep);
+		return;
+	}
+
+	if ((gnr__evbatchmask & gei->gei_event) &&
+			(newep = naf_slab_alloc(gnr__evqslab))) {
+		memset(newep, 0, sizeof(struct gnr_evpending));
+		evq_setinfo(newep, gei);
+		newep->older = ep;
+		newep->release = (gei->gei_event == GNR_EVENT_NODEDOWN);
+		evq_append(newep);
+		gn->evpending = newep;
+
+	} else if (ep && (gei->gei_event == GNR_EVENT_NODEDOWN))
+		ep->release = 1; /* has to wait for the batch it's in */
+
+	return;
+}
+
+static void evq_finish(struct gnr_evpending *ep)
+{
+	struct gnrnode *gn = ep->gei.gei_node;
+
+	if (gn->evpending == ep) {
+		gn->evpending = NULL;
+		if (ep->release)
+			gnr_node__release(gn);
+	} else if (gn->evpending)
+		gn->evpending->older = NULL;
+
+	naf_slab_free(gnr__evqslab, ep);
+
+	return;
+}
+
+static void evq_deliver(struct nafmodule *mod, gnr_eventbatchfunc_t batchfunc, gnr_event_t evmask, struct gnr_evpending *batch, struct gnr_event_info **geiv)
+{
+	struct gnr_evpending *ep;
+	int n;
+
+	for (ep = batch, n = 0; ep; ep = ep->next) {
+		if (evmask & ep->gei.gei_event)
+			geiv[n++] = &ep->gei;
+	}
+
+	if (n)
+		batchfunc(mod, n, geiv);
+
+	return;
+}
+
+/*
+ * Hand everything that's waiting to the batch handlers.  Events thrown
+ * while they're running wait for the next pass.
+ */
+static void gnr_event__flush(void)
+{
+	struct gnr_evpending *batch, *ep;
+	struct gnr_event_info **geiv;
+	int count;
+
+	naf_timer_cancel(&gnr__evqtimer);
+
+	if (!(batch = gnr__evq))
+		return;
+	gnr__evq = NULL;
+	gnr__evqtail = &gnr__evq;
+
+	for (ep = batch, count = 0; ep; ep = ep->next, count++)
+		ep->inflight = 1;
+
+	if (gnr__debug > 1)
+		dvprintf(gnr__module, "gnr_event__flush: delivering %d events\n", count);
+
+	if ((geiv = naf_malloc(gnr__module, sizeof(struct gnr_event_info *) * count))) {
+		struct evdispatch *ed;
+		struct evhandler *evh;
+
+		gnr__evdispatchbusy++;
+		if ((ed = gnr__evbatchdispatch)) {
+			for ( ; ed->batchfunc; ed++)
+				evq_deliver(ed->mod, ed->batchfunc, ed->evmask, batch, geiv);
+		} else {
+			for (evh = gnr__evhlist; evh; evh = evh->evh__next) {
+				if (evh->evh_batchfunc)
+					evq_deliver(evh->evh_mod, evh->evh_batchfunc, evh->evh_evmask, batch, geiv);
+			}
+		}
+		evh_dispatchdone();
+
+		naf_free(gnr__module, geiv);
+	} else
+		dvprintf(gnr__module, "gnr_event__flush: out of memory; dropping %d events\n", count);
+
+	while ((ep = batch)) {
+		batch = ep->next;
+		evq_finish(ep);
+	}
+
+	return;
+}
+
+static void gnr_event__flushhandler(struct nafmodule *mod, struct naf_timer *timer, void *data)
+{
+
+	gnr_event__flush();
+
+	return;
+}
+
+/* Throw away whatever's waiting (at shutdown), releasing the nodes. */
+void gnr_event__discard(void)
+{
+	struct gnr_evpending *ep;
+
+	naf_timer_cancel(&gnr__evqtimer);
+
+	while ((ep = gnr__evq)) {
+		gnr__evq = ep->next;
+		ep->inflight = 1;
+		evq_finish(ep);
+	}
+	gnr__evqtail = &gnr__evq;
+
+	return;
+}
+
+/*
+ * Handlers registered with gnr_event_register() are called right away;
+ * the event is then queued for the batch handlers, if any of them want it.
+ */
 int gnr_event_throw(struct gnr_event_info *gei)
 {
+	struct evdispatch *ed;
 	struct evhandler *evh;
+	int type;
 
 	if (!gei)
 		return -1;
 
-	for (evh = gnr__evhlist; evh; evh = evh->evh__next) {
-		if (evh->evh_evmask & gei->gei_event)
-			evh->evh_func(evh->evh_mod, gei);
+	gnr__evdispatchbusy++;
+	if (((type = evh_typeindex(gei->gei_event)) != -1) &&
+			(ed = gnr__evdispatch[type])) {
+		for ( ; ed->func; ed++)
+			ed->func(ed->mod, gei);
+	} else {
+		for (evh = gnr__evhlist; evh; evh = evh->evh__next) {
+			if (evh->evh_func && (evh->evh_evmask & gei->gei_event))
+				evh->evh_func(evh->evh_mod, gei);
+		}
 	}
+	evh_dispatchdone();
+
+	if (gei->gei_node && gnr__evqslab)
+		gnr_event__defer(gei);
 
 	return 0;
 }
@@ -155,7 +557,14 @@ static int modinit(struct nafmodule *mod)
 {
 
 	gnr_msg__register(mod); /* must be first */
+
+	memset(gnr__evdispatch, 0, sizeof(gnr__evdispatch));
+	if (!(gnr__evqslab = naf_slab_create(mod, "eventqueue", sizeof(struct gnr_evpending), GNR_EVENT_SLABOBJS)))
+		return -1;
+	naf_timer_init(&gnr__evqtimer, mod, gnr_event__flushhandler, NULL);
+
 	gnr_node__register(mod);
+	gnr_delay__register(mod);
 
 	return 0;
 }
@@ -163,28 +572,28 @@ static int modinit(struct nafmodule *mod)
 static int modshutdown(struct nafmodule *mod)
 {
 
+	gnr_delay__unregister(mod);
 	gnr_node__unregister(mod);
 	gnr_msg__unregister(mod); /* must be last */
 
+	gnr_event__discard();
+	naf_slab_destroy(gnr__evqslab);
+	gnr__evqslab = NULL;
+
+	evh_uncompile();
 	evh__freeall(mod, gnr__evhlist);
+	gnr__evhlist = NULL;
 
 	gnr__module = NULL;
 
 	return 0;
 }
 
-static void timerhandler(struct nafmodule *mod)
-{
-
-	gnr_node__timeout(mod);
-
-	return;
-}
-
 static void freetag(struct nafmodule *mod, void *object, const char *tagname, char tagtype, void *tagdata)
 {
 
-	if (strcmp(tagname, "module.gnrmsg_outputfunc") == 0) {
+	if ((strcmp(tagname, "module.gnrmsg_outputfunc") == 0) ||
+			(strcmp(tagname, "module.gnrmsg_batchoutputfunc") == 0)) {
 
 		/* pointer to non-dynamic object */
 
@@ -204,6 +613,24 @@ static void signalhandler(struct nafmodule *mod, struct nafmodule *source, int s
 
 		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "debug",
 					      gnr__debug, GNR_DEBUG_DEFAULT);
+		NAFCONFIG_UPDATEBOOLMODPARMDEF(mod, "routequeue",
+					       gnr__routequeue, GNR_ROUTEQUEUE_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "routequeuemax",
+					      gnr__routequeuemax, GNR_ROUTEQUEUEMAX_DEFAULT);
+		if (gnr__routequeuemax < 1)
+			gnr__routequeuemax = 1;
+		NAFCONFIG_UPDATEBOOLMODPARMDEF(mod, "delayeddelivery",
+					       gnr__delayeddelivery, GNR_DELAYEDDELIVERY_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "delaymax",
+					      gnr__delaymax, GNR_DELAYMAX_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "delayttl",
+					      gnr__delayttl, GNR_DELAYTTL_DEFAULT);
+		if (gnr__delayttl < 1)
+			gnr__delayttl = 1;
+		NAFCONFIG_UPDATESTRMODPARMDEF(mod, "delayspool",
+					      gnr__delayspool, GNR_DELAYSPOOL_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "delayspoolmax",
+					      gnr__delayspoolmax, GNR_DELAYSPOOLMAX_DEFAULT);
 	}
 
 	return;
@@ -219,15 +646,17 @@ static int modfirst(struct nafmodule *mod)
 	mod->shutdown = modshutdown;
 	mod->signal = signalhandler;
 	mod->freetag = freetag;
-	mod->timerfreq = 15;
-	mod->timer = timerhandler;
 
 	return 0;
 }
 
 int gnr_core_register(void)
 {
-	return naf_module__registerresident("gnr", modfirst, NAF_MODULE_PRI_SECONDPASS);
+
+	if (naf_module__registerresident("gnr", modfirst, NAF_MODULE_PRI_SECONDPASS) == -1)
+		return -1;
+
+	return gnr_peer__register();
 }
 
 
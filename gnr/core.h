@@ -26,6 +26,7 @@ extern int gnr__debug;
 extern struct nafmodule *gnr__module;
 
 int gnr_event_throw(struct gnr_event_info *gei);
+void gnr_event__discard(void);
 
 #endif /* ndef __CORE_H__ */
 
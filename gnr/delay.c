@@ -0,0 +1,641 @@
+/*
+ * gnr - Generic interNode message Routing
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * gnr is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * gnr is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Delayed delivery.
+ *
+ * When a message can't be delivered right now (the destination user is
+ * between clients, say, with only a prorogued session holding their place),
+ * whoever notices sets GNR_MSG_ROUTEFLAG_DELAYED on it, usually the target
+ * module's output function.  gnr then keeps a copy in a queue for the
+ * destination, and routes it again once that node comes up
+ * (GNR_EVENT_NODEUP), or its owner says it can take messages again
+ * (gnr_node_reattached()).  Each message that is still waiting delayttl seconds
+ * after it was parked is dropped.
+ *
+ * Each destination holds up to delaymax messages in memory.  Past that, if
+ * there's a delayspool file, they're appended to it instead: the file is
+ * mapped, and each destination's spooled messages are chained through it by
+ * offset.  The file is thrown away once nothing in it is waiting anymore.
+ * It's scratch space, not a journal; nothing is read back from it after a
+ * restart.
+ *
+ * The copy has the message's fields, but not its tags, which are hints that
+ * may point into whatever the original was parsed from.  A message with a
+ * msgbuf can only be kept if it has a msgbuf_clonefunc, and is never spooled.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+#include <naf/nafmodule.h>
+#include <naf/naftimer.h>
+
+#include <gnr/gnrmsg.h>
+#include <gnr/gnrnode.h>
+#include <gnr/gnrevents.h>
+#include "core.h"
+#include "node.h"
+#include "delay.h"
+
+int gnr__delayeddelivery = GNR_DELAYEDDELIVERY_DEFAULT;
+int gnr__delaymax = GNR_DELAYMAX_DEFAULT;
+int gnr__delayttl = GNR_DELAYTTL_DEFAULT;
+char *gnr__delayspool = GNR_DELAYSPOOL_DEFAULT;
+int gnr__delayspoolmax = GNR_DELAYSPOOLMAX_DEFAULT;
+
+/* A message held in memory.  Lives in the copy's own arena. */
+struct gnr_delayent {
+	struct gnrmsg *gm;
+	char *srcmodname;
+	time_t parked;
+	struct gnr_delayent *next;
+};
+
+/*
+ * Everything waiting for one destination.  Spool offsets are stored plus
+ * one, so that zero means none.
+ */
+struct gnr_delayq {
+	char *canonname;
+	char *service;
+	naf_u32_t namehash;
+	struct gnr_delayent *head, **tail;
+	int count;
+	naf_u32_t spoolhead, spooltail;
+	int spoolcount;
+	int redeliver;
+	struct naf_timer timer; /* when the oldest expires, or redelivery */
+	struct gnr_delayq *next;
+};
+
+#define GNR_DELAY_HASHSIZE 64
+static struct gnr_delayq *gnr__delayq[GNR_DELAY_HASHSIZE];
+static int gnr__delayactive = 0;
+
+/*
+ * A spooled message: this header, then each string (NUL included) that has
+ * a nonzero length, in gnr_delay__recstrs() order.
+ */
+#define GNR_DELAY_RECSTRS 8
+struct gnr_delayrec {
+	naf_u32_t len; /* whole record, padded */
+	naf_u32_t next; /* next record for the same destination */
+	naf_u32_t msgflags;
+	naf_u16_t type;
+	naf_u16_t pad;
+	naf_u32_t parked;
+	naf_u32_t strlens[GNR_DELAY_RECSTRS]; /* 0 means NULL */
+};
+#define GNR_DELAY_RECALIGN(n) (((n) + 7) & ~7)
+
+#define GNR_DELAY_SPOOLCHUNK 65536
+static int gnr__spoolfd = -1;
+static char *gnr__spoolpath = NULL;
+static naf_u8_t *gnr__spoolmap = NULL;
+static naf_u32_t gnr__spoolmaplen = 0;
+static naf_u32_t gnr__spoolend = 0;
+static int gnr__spoollive = 0;
+
+
+static void gnr_delay__recstrs(struct gnrmsg *gm, char **srcmodname, char ***strs)
+{
+
+	strs[0] = srcmodname;
+	strs[1] = &gm->srcname;
+	strs[2] = &gm->srcnameservice;
+	strs[3] = &gm->destname;
+	strs[4] = &gm->destnameservice;
+	strs[5] = &gm->msgtexttype;
+	strs[6] = &gm->msgtext;
+	strs[7] = &gm->groupname;
+
+	return;
+}
+
+static void gnr_delay__freemsg(struct nafmodule *mod, struct gnrmsg *gm)
+{
+
+	if (gm->msgbuf && gm->msgbuf_freefunc)
+		gm->msgbuf_freefunc(gm);
+	gnr_msg_free(gnr__module, gm);
+
+	return;
+}
+
+/* Copy out what's needed to render gm again later. */
+static struct gnrmsg *gnr_delay__clone(struct gnrmsg *gm, const char *srcmodname, char **srcmodnameret)
+{
+	struct gnrmsg *ngm;
+	char *srcmn = (char *)srcmodname, **from[GNR_DELAY_RECSTRS], **to[GNR_DELAY_RECSTRS];
+	int i;
+
+	if (gm->msgbuf && !gm->msgbuf_clonefunc)
+		return NULL;
+
+	if (!(ngm = gnr_msg_new(gnr__module)))
+		return NULL;
+
+	gnr_delay__recstrs(gm, &srcmn, from);
+	gnr_delay__recstrs(ngm, srcmodnameret, to);
+	for (i = 0; i < GNR_DELAY_RECSTRS; i++) {
+		*to[i] = NULL;
+		if (*from[i] && !(*to[i] = gnr_msg_strdup(ngm, *from[i]))) {
+			gnr_msg_free(gnr__module, ngm);
+			return NULL;
+		}
+	}
+	ngm->type = gm->type;
+	ngm->msgflags = gm->msgflags;
+
+	if (gm->msgbuf) {
+		if (!(ngm->msgbuf = gm->msgbuf_clonefunc(gm))) {
+			gnr_msg_free(gnr__module, ngm);
+			return NULL;
+		}
+		ngm->msgbuflen = gm->msgbuflen;
+		ngm->msgbuf_clonefunc = gm->msgbuf_clonefunc;
+		ngm->msgbuf_freefunc = gm->msgbuf_freefunc;
+	}
+
+	return ngm;
+}
+
+
+static void gnr_delay__spoolclose(void)
+{
+
+#ifdef HAVE_MMAP
+	if (gnr__spoolmap)
+		munmap(gnr__spoolmap, gnr__spoolmaplen);
+#endif
+	gnr__spoolmap = NULL;
+	gnr__spoolmaplen = gnr__spoolend = 0;
+	gnr__spoollive = 0;
+
+	if (gnr__spoolfd != -1) {
+		close(gnr__spoolfd);
+		unlink(gnr__spoolpath);
+	}
+	gnr__spoolfd = -1;
+
+	naf_free(gnr__module, gnr__spoolpath);
+	gnr__spoolpath = NULL;
+
+	return;
+}
+
+/* Make room for len more bytes at the end of the spool. */
+static int gnr_delay__spoolreserve(naf_u32_t len)
+{
+#ifdef HAVE_MMAP
+	naf_u8_t *map;
+	naf_u32_t maplen;
+
+	if ((gnr__spoolfd == -1) && gnr__delayspool) {
+		if (!(gnr__spoolpath = naf_strdup(gnr__module, gnr__delayspool)))
+			return -1;
+		/*
+		 * Always a new file, so that a link left where the spool
+		 * goes can't point us at something else.  One that's just
+		 * left over from before (or that link) is removed first.
+		 */
+		if (((gnr__spoolfd = open(gnr__spoolpath, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) == -1) &&
+				(errno == EEXIST) && (unlink(gnr__spoolpath) == 0))
+			gnr__spoolfd = open(gnr__spoolpath, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+		if (gnr__spoolfd == -1) {
+			dvprintf(gnr__module, "unable to open delay spool %s\n", gnr__spoolpath);
+			naf_free(gnr__module, gnr__spoolpath);
+			gnr__spoolpath = NULL;
+			return -1;
+		}
+	}
+	if (gnr__spoolfd == -1)
+		return -1;
+
+	if ((gnr__spoolend + len) > (naf_u32_t)gnr__delayspoolmax)
+		return -1;
+	if ((gnr__spoolend + len) <= gnr__spoolmaplen)
+		return 0;
+
+	maplen = ((gnr__spoolend + len + GNR_DELAY_SPOOLCHUNK - 1) / GNR_DELAY_SPOOLCHUNK) * GNR_DELAY_SPOOLCHUNK;
+	if (ftruncate(gnr__spoolfd, maplen) == -1)
+		return -1;
+	map = (naf_u8_t *)mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, gnr__spoolfd, 0);
+	if (map == (naf_u8_t *)MAP_FAILED)
+		return -1;
+
+	if (gnr__spoolmap)
+		munmap(gnr__spoolmap, gnr__spoolmaplen);
+	gnr__spoolmap = map;
+	gnr__spoolmaplen = maplen;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static int gnr_delay__spool(struct gnr_delayq *q, struct gnrmsg *gm, const char *srcmodname)
+{
+	struct gnr_delayrec *rec;
+	char *srcmn = (char *)srcmodname, **strs[GNR_DELAY_RECSTRS];
+	naf_u32_t len, off;
+	naf_u8_t *p;
+	int i;
+
+	if (gm->msgbuf)
+		return -1;
+
+	gnr_delay__recstrs(gm, &srcmn, strs);
+	len = sizeof(struct gnr_delayrec);
+	for (i = 0; i < GNR_DELAY_RECSTRS; i++) {
+		if (*strs[i])
+			len += strlen(*strs[i]) + 1;
+	}
+	len = GNR_DELAY_RECALIGN(len);
+
+	if (gnr_delay__spoolreserve(len) == -1)
+		return -1;
+
+	off = gnr__spoolend;
+	rec = (struct gnr_delayrec *)(gnr__spoolmap + off);
+	memset(rec, 0, sizeof(struct gnr_delayrec));
+	rec->len = len;
+	rec->type = gm->type;
+	rec->msgflags = gm->msgflags;
+	rec->parked = (naf_u32_t)time(NULL);
+
+	p = (naf_u8_t *)(rec + 1);
+	for (i = 0; i < GNR_DELAY_RECSTRS; i++) {
+		if (!*strs[i])
+			continue;
+		rec->strlens[i] = strlen(*strs[i]) + 1;
+		memcpy(p, *strs[i], rec->strlens[i]);
+		p += rec->strlens[i];
+	}
+	gnr__spoolend += len;
+
+	if (q->spooltail)
+		((struct gnr_delayrec *)(gnr__spoolmap + q->spooltail - 1))->next = off + 1;
+	else
+		q->spoolhead = off + 1;
+	q->spooltail = off + 1;
+	q->spoolcount++;
+	gnr__spoollive++;
+
+	return 0;
+}
+
+/* Rebuild the message at off; the spool may be remapped after this. */
+static struct gnrmsg *gnr_delay__unspool(naf_u32_t off, char **srcmodnameret, naf_u32_t *nextret)
+{
+	struct gnr_delayrec *rec = (struct gnr_delayrec *)(gnr__spoolmap + off - 1);
+	struct gnrmsg *gm;
+	char **strs[GNR_DELAY_RECSTRS];
+	naf_u8_t *p;
+	int i;
+
+	*nextret = rec->next;
+
+	if (!(gm = gnr_msg_new(gnr__module)))
+		return NULL;
+	gm->type = rec->type;
+	gm->msgflags = rec->msgflags;
+
+	gnr_delay__recstrs(gm, srcmodnameret, strs);
+	p = (naf_u8_t *)(rec + 1);
+	for (i = 0; i < GNR_DELAY_RECSTRS; i++) {
+		*strs[i] = NULL;
+		if (!rec->strlens[i])
+			continue;
+		if (!(*strs[i] = gnr_msg_alloc(gm, rec->strlens[i]))) {
+			gnr_msg_free(gnr__module, gm);
+			return NULL;
+		}
+		memcpy(*strs[i], p, rec->strlens[i]);
+		p += rec->strlens[i];
+	}
+
+	return gm;
+}
+
+static void gnr_delay__spooldone(int count)
+{
+
+	if ((gnr__spoollive -= count) <= 0)
+		gnr_delay__spoolclose();
+
+	return;
+}
+
+
+static struct gnr_delayq *gnr_delay__find(const char *name, const char *service, naf_u32_t hash)
+{
+	struct gnr_delayq *q;
+
+	for (q = gnr__delayq[hash % GNR_DELAY_HASHSIZE]; q; q = q->next) {
+		if ((q->namehash == hash) &&
+				gnr_node__canoneq(q->canonname, name) &&
+				(strcasecmp(q->service, service) == 0))
+			return q;
+	}
+
+	return NULL;
+}
+
+static void gnr_delay__unlink(struct gnr_delayq *q)
+{
+	struct gnr_delayq **prev;
+
+	for (prev = &gnr__delayq[q->namehash % GNR_DELAY_HASHSIZE]; *prev; prev = &(*prev)->next) {
+		if (*prev == q) {
+			*prev = q->next;
+			break;
+		}
+	}
+
+	return;
+}
+
+/* Deliver (or drop) everything on q, and free it.  q must be unlinked. */
+static void gnr_delay__flush(struct gnr_delayq *q, int deliver)
+{
+	struct gnr_delayent *ent;
+	struct gnrmsg *gm;
+	char *srcmodname;
+	naf_u32_t off, next;
+
+	naf_timer_cancel(&q->timer);
+
+	if (!deliver && (q->count + q->spoolcount) && (gnr__debug > 0))
+		dvprintf(gnr__module, "delayed delivery: dropping %d messages for %s[%s]\n", q->count + q->spoolcount, q->canonname, q->service);
+
+	while ((ent = q->head)) {
+		q->head = ent->next;
+
+		gm = ent->gm;
+		if (!deliver || (gnr_msg_enqueue(ent->srcmodname ? naf_module_findbyname(gnr__module, ent->srcmodname) : NULL, gm, gnr_delay__freemsg) == -1))
+			gnr_delay__freemsg(gnr__module, gm);
+	}
+
+	if (q->spoolcount) {
+		for (off = deliver ? q->spoolhead : 0; off; off = next) {
+			srcmodname = NULL;
+			if (!(gm = gnr_delay__unspool(off, &srcmodname, &next)))
+				break;
+			if (gnr_msg_enqueue(srcmodname ? naf_module_findbyname(gnr__module, srcmodname) : NULL, gm, gnr_delay__freemsg) == -1)
+				gnr_delay__freemsg(gnr__module, gm);
+		}
+		gnr_delay__spooldone(q->spoolcount);
+	}
+
+	naf_free(gnr__module, q->canonname);
+	naf_free(gnr__module, q->service);
+	naf_free(gnr__module, q);
+
+	return;
+}
+
+/*
+ * Drop whatever on q has been waiting delayttl seconds.  Messages are only
+ * spooled once the in-memory list is full, and only appended to either, so
+ * the oldest is always the first in memory, or else the first in the spool.
+ * Returns how long until the next one is due, or -1 if q is empty.
+ */
+static int gnr_delay__expire(struct gnr_delayq *q)
+{
+	struct gnr_delayent *ent;
+	struct gnr_delayrec *rec;
+	time_t now, parked = 0;
+	int dropped = 0;
+
+	now = time(NULL);
+
+	while ((ent = q->head)) {
+		if ((ent->parked + gnr__delayttl) > now)
+			return (int)(ent->parked + gnr__delayttl - now);
+		if (!(q->head = ent->next))
+			q->tail = &q->head;
+		q->count--;
+		gnr_delay__freemsg(gnr__module, ent->gm);
+		dropped++;
+	}
+
+	while (q->spoolhead) {
+		rec = (struct gnr_delayrec *)(gnr__spoolmap + q->spoolhead - 1);
+		parked = (time_t)rec->parked;
+		if ((parked + gnr__delayttl) > now)
+			break;
+		if (!(q->spoolhead = rec->next))
+			q->spooltail = 0;
+		q->spoolcount--;
+		dropped++;
+		gnr_delay__spooldone(1);
+	}
+
+	if (dropped && (gnr__debug > 0))
+		dvprintf(gnr__module, "delayed delivery: dropping %d messages for %s[%s] after %d seconds\n", dropped, q->canonname, q->service, gnr__delayttl);
+
+	if (q->spoolhead)
+		return (int)(parked + gnr__delayttl - now);
+
+	return -1;
+}
+
+static void gnr_delay__timeout(struct nafmodule *mod, struct naf_timer *timer, void *data)
+{
+	struct gnr_delayq *q = (struct gnr_delayq *)data;
+	int next;
+
+	if (!q->redeliver && ((next = gnr_delay__expire(q)) != -1)) {
+		naf_timer_arm(&q->timer, next * 1000);
+		return;
+	}
+
+	gnr_delay__unlink(q);
+	gnr_delay__flush(q, q->redeliver);
+
+	return;
+}
+
+static struct gnr_delayq *gnr_delay__getq(const char *name, const char *service)
+{
+	struct gnr_delayq *q;
+	naf_u32_t hash;
+
+	hash = gnr_node_namehash(name);
+	if ((q = gnr_delay__find(name, service, hash)))
+		return q;
+
+	if (!(q = naf_malloc(gnr__module, sizeof(struct gnr_delayq))))
+		return NULL;
+	memset(q, 0, sizeof(struct gnr_delayq));
+	if (!(q->canonname = gnr_node__canonname(name)) ||
+			!(q->service = naf_strdup(gnr__module, service))) {
+		naf_free(gnr__module, q->canonname);
+		naf_free(gnr__module, q);
+		return NULL;
+	}
+	q->namehash = hash;
+	q->tail = &q->head;
+	naf_timer_init(&q->timer, gnr__module, gnr_delay__timeout, (void *)q);
+	naf_timer_arm(&q->timer, gnr__delayttl * 1000);
+
+	q->next = gnr__delayq[hash % GNR_DELAY_HASHSIZE];
+	gnr__delayq[hash % GNR_DELAY_HASHSIZE] = q;
+
+	return q;
+}
+
+/*
+ * Keep a copy of gm (which has GNR_MSG_ROUTEFLAG_DELAYED set) until its
+ * destination comes up.  The caller still owns gm.  Returns -1 if it had to
+ * be dropped instead.
+ */
+int gnr_delay__park(struct nafmodule *srcmod, struct gnrmsg *gm)
+{
+	struct gnr_delayq *q;
+	struct gnr_delayent *ent;
+	struct gnrmsg *ngm;
+	char *srcmodname = NULL;
+
+	if (!gnr__delayactive || !gnr__delayeddelivery || !gm->destname || !gm->destnameservice)
+		goto drop;
+
+	if (!(q = gnr_delay__getq(gm->destname, gm->destnameservice)))
+		goto drop;
+
+	if ((q->count < gnr__delaymax) && !q->spoolcount) {
+		if (!(ngm = gnr_delay__clone(gm, srcmod ? srcmod->name : NULL, &srcmodname)))
+			goto drop;
+		if (!(ent = gnr_msg_alloc(ngm, sizeof(struct gnr_delayent)))) {
+			gnr_delay__freemsg(gnr__module, ngm);
+			goto drop;
+		}
+		ent->gm = ngm;
+		ent->srcmodname = srcmodname;
+		ent->parked = time(NULL);
+		ent->next = NULL;
+		*q->tail = ent;
+		q->tail = &ent->next;
+		q->count++;
+
+	} else if (gnr_delay__spool(q, gm, srcmod ? srcmod->name : NULL) == -1)
+		goto drop;
+
+	if (gnr__debug > 1)
+		dvprintf(gnr__module, "delayed delivery: holding message for %s[%s] (%d in memory, %d spooled)\n", gm->destname, gm->destnameservice, q->count, q->spoolcount);
+
+	return 0;
+
+drop:
+	if (gnr__debug > 0)
+		dvprintf(gnr__module, "delayed delivery: dropping message for %s[%s]\n", gm->destname, gm->destnameservice);
+	return -1;
+}
+
+/*
+ * Redeliver from the next pass of the main loop, once whoever brought the
+ * node up (or back, through gnr_node_reattached()) is done.
+ */
+void gnr_delay__ready(struct gnrnode *gn)
+{
+	struct gnr_delayq *q;
+
+	if (!gn || !(q = gnr_delay__find(gn->name, gn->service, gn->namehash)))
+		return;
+
+	q->redeliver = 1;
+	naf_timer_arm(&q->timer, 0);
+
+	return;
+}
+
+static void gnr_delay__nodeup(struct nafmodule *mod, struct gnr_event_info *gei)
+{
+
+	gnr_delay__ready(gei->gei_node);
+
+	return;
+}
+
+
+int gnr_delay__register(struct nafmodule *mod)
+{
+
+	memset(gnr__delayq, 0, sizeof(gnr__delayq));
+
+	if (gnr_event_register(mod, gnr_delay__nodeup, GNR_EVENT_NODEUP) == -1)
+		return -1;
+	gnr__delayactive = 1;
+
+	return 0;
+}
+
+int gnr_delay__unregister(struct nafmodule *mod)
+{
+	struct gnr_delayq *q;
+	int i;
+
+	gnr__delayactive = 0;
+	gnr_event_unregister(mod, gnr_delay__nodeup);
+
+	for (i = 0; i < GNR_DELAY_HASHSIZE; i++) {
+		while ((q = gnr__delayq[i])) {
+			gnr__delayq[i] = q->next;
+			gnr_delay__flush(q, 0);
+		}
+	}
+	gnr_delay__spoolclose();
+
+	naf_free(mod, gnr__delayspool);
+	gnr__delayspool = NULL;
+
+	return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * gnr - Generic interNode message Routing
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * gnr is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * gnr is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __DELAY_H__
+#define __DELAY_H__
+
+#include <gnr/gnrmsg.h>
+
+int gnr_delay__register(struct nafmodule *mod);
+int gnr_delay__unregister(struct nafmodule *mod);
+
+int gnr_delay__park(struct nafmodule *srcmod, struct gnrmsg *gm);
+void gnr_delay__ready(struct gnrnode *gn);
+
+#define GNR_DELAYEDDELIVERY_DEFAULT 0
+extern int gnr__delayeddelivery;
+#define GNR_DELAYMAX_DEFAULT 32
+extern int gnr__delaymax;
+#define GNR_DELAYTTL_DEFAULT 600
+extern int gnr__delayttl;
+#define GNR_DELAYSPOOL_DEFAULT NULL
+extern char *gnr__delayspool;
+#define GNR_DELAYSPOOLMAX_DEFAULT 1048576
+extern int gnr__delayspoolmax;
+
+#endif /* ndef __DELAY_H__ */
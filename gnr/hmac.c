@@ -0,0 +1,232 @@
+/*
+ * gnr - Generic interNode message Routing
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * gnr is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * gnr is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * HMAC-SHA256 (RFC 2104, FIPS 180-2), for authenticating peers.
+ *
+ * naf_u32_t may be wider than 32 bits, so everything is masked back down.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include <naf/naftypes.h>
+
+#include "hmac.h"
+
+#define U32(x) ((x) & 0xffffffffUL)
+#define ROTR(x, n) U32(((x) >> (n)) | ((x) << (32 - (n))))
+
+static const naf_u32_t gnr_sha256__k[64] = {
+	0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
+	0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+	0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
+	0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+	0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+	0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+	0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL,
+	0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+	0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL,
+	0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+	0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL,
+	0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+	0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL,
+	0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+	0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+	0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL,
+};
+
+static void gnr_sha256__init(struct gnr_sha256 *sh)
+{
+
+	sh->state[0] = 0x6a09e667UL;
+	sh->state[1] = 0xbb67ae85UL;
+	sh->state[2] = 0x3c6ef372UL;
+	sh->state[3] = 0xa54ff53aUL;
+	sh->state[4] = 0x510e527fUL;
+	sh->state[5] = 0x9b05688cUL;
+	sh->state[6] = 0x1f83d9abUL;
+	sh->state[7] = 0x5be0cd19UL;
+	sh->count[0] = sh->count[1] = 0;
+	sh->buflen = 0;
+
+	return;
+}
+
+static void gnr_sha256__block(struct gnr_sha256 *sh, const naf_u8_t *blk)
+{
+	naf_u32_t w[64], v[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = ((naf_u32_t)blk[i*4] << 24) | ((naf_u32_t)blk[i*4+1] << 16) |
+			((naf_u32_t)blk[i*4+2] << 8) | (naf_u32_t)blk[i*4+3];
+	}
+	for ( ; i < 64; i++) {
+		t1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+		t2 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+		w[i] = U32(t1 + w[i-7] + t2 + w[i-16]);
+	}
+
+	for (i = 0; i < 8; i++)
+		v[i] = sh->state[i];
+
+	for (i = 0; i < 64; i++) {
+		t1 = U32(v[7] + (ROTR(v[4], 6) ^ ROTR(v[4], 11) ^ ROTR(v[4], 25)) +
+			((v[4] & v[5]) ^ (~v[4] & v[6])) + gnr_sha256__k[i] + w[i]);
+		t2 = U32((ROTR(v[0], 2) ^ ROTR(v[0], 13) ^ ROTR(v[0], 22)) +
+			((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2])));
+		v[7] = v[6];
+		v[6] = v[5];
+		v[5] = v[4];
+		v[4] = U32(v[3] + t1);
+		v[3] = v[2];
+		v[2] = v[1];
+		v[1] = v[0];
+		v[0] = U32(t1 + t2);
+	}
+
+	for (i = 0; i < 8; i++)
+		sh->state[i] = U32(sh->state[i] + v[i]);
+
+	return;
+}
+
+static void gnr_sha256__update(struct gnr_sha256 *sh, const naf_u8_t *data, int len)
+{
+
+	if ((sh->count[1] = U32(sh->count[1] + len)) < (naf_u32_t)len)
+		sh->count[0]++;
+
+	while (len > 0) {
+		int n = GNR_HMAC_BLOCKLEN - sh->buflen;
+
+		if (n > len)
+			n = len;
+		memcpy(sh->buf + sh->buflen, data, n);
+		sh->buflen += n;
+		data += n;
+		len -= n;
+
+		if (sh->buflen == GNR_HMAC_BLOCKLEN) {
+			gnr_sha256__block(sh, sh->buf);
+			sh->buflen = 0;
+		}
+	}
+
+	return;
+}
+
+static void gnr_sha256__final(struct gnr_sha256 *sh, naf_u8_t *out)
+{
+	naf_u32_t hi, lo;
+	naf_u8_t pad[GNR_HMAC_BLOCKLEN + 8];
+	int padlen, i;
+
+	/* Length in bits. */
+	hi = U32((sh->count[0] << 3) | (sh->count[1] >> 29));
+	lo = U32(sh->count[1] << 3);
+
+	padlen = ((sh->buflen < 56) ? 56 : 120) - sh->buflen;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 4; i++) {
+		pad[padlen + i] = (naf_u8_t)(hi >> (24 - i * 8));
+		pad[padlen + 4 + i] = (naf_u8_t)(lo >> (24 - i * 8));
+	}
+	gnr_sha256__update(sh, pad, padlen + 8);
+
+	for (i = 0; i < 8; i++) {
+		out[i*4] = (naf_u8_t)(sh->state[i] >> 24);
+		out[i*4+1] = (naf_u8_t)(sh->state[i] >> 16);
+		out[i*4+2] = (naf_u8_t)(sh->state[i] >> 8);
+		out[i*4+3] = (naf_u8_t)sh->state[i];
+	}
+
+	return;
+}
+
+void gnr_hmac_init(struct gnr_hmac *hm, const naf_u8_t *key, int keylen)
+{
+	naf_u8_t k[GNR_HMAC_BLOCKLEN], ipad[GNR_HMAC_BLOCKLEN], opad[GNR_HMAC_BLOCKLEN];
+	int i;
+
+	memset(k, 0, sizeof(k));
+	if (keylen > GNR_HMAC_BLOCKLEN) {
+		gnr_sha256__init(&hm->inner);
+		gnr_sha256__update(&hm->inner, key, keylen);
+		gnr_sha256__final(&hm->inner, k);
+	} else if (keylen > 0)
+		memcpy(k, key, keylen);
+
+	for (i = 0; i < GNR_HMAC_BLOCKLEN; i++) {
+		ipad[i] = k[i] ^ 0x36;
+		opad[i] = k[i] ^ 0x5c;
+	}
+
+	gnr_sha256__init(&hm->inner);
+	gnr_sha256__update(&hm->inner, ipad, sizeof(ipad));
+	gnr_sha256__init(&hm->outer);
+	gnr_sha256__update(&hm->outer, opad, sizeof(opad));
+
+	memset(k, 0, sizeof(k));
+
+	return;
+}
+
+void gnr_hmac_update(struct gnr_hmac *hm, const naf_u8_t *data, int len)
+{
+
+	gnr_sha256__update(&hm->inner, data, len);
+
+	return;
+}
+
+void gnr_hmac_final(struct gnr_hmac *hm, naf_u8_t *out)
+{
+	naf_u8_t ihash[GNR_HMAC_LEN];
+
+	gnr_sha256__final(&hm->inner, ihash);
+	gnr_sha256__update(&hm->outer, ihash, sizeof(ihash));
+	gnr_sha256__final(&hm->outer, out);
+
+	return;
+}
+
+/* Compare two MACs without giving away where they differ. */
+int gnr_hmac_equal(const naf_u8_t *a, const naf_u8_t *b)
+{
+	naf_u8_t diff = 0;
+	int i;
+
+	for (i = 0; i < GNR_HMAC_LEN; i++)
+		diff |= a[i] ^ b[i];
+
+	return diff == 0;
+}
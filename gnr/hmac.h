@@ -0,0 +1,42 @@
+/*
+ * gnr - Generic interNode message Routing
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * gnr is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * gnr is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __HMAC_H__
+#define __HMAC_H__
+
+#define GNR_HMAC_LEN 32 /* SHA-256 */
+#define GNR_HMAC_BLOCKLEN 64
+
+struct gnr_sha256 {
+	naf_u32_t state[8];
+	naf_u32_t count[2]; /* bytes so far, high then low */
+	naf_u8_t buf[GNR_HMAC_BLOCKLEN];
+	int buflen;
+};
+
+struct gnr_hmac {
+	struct gnr_sha256 inner;
+	struct gnr_sha256 outer;
+};
+
+void gnr_hmac_init(struct gnr_hmac *hm, const naf_u8_t *key, int keylen);
+void gnr_hmac_update(struct gnr_hmac *hm, const naf_u8_t *data, int len);
+void gnr_hmac_final(struct gnr_hmac *hm, naf_u8_t *out);
+int gnr_hmac_equal(const naf_u8_t *a, const naf_u8_t *b);
+
+#endif /* ndef __HMAC_H__ */
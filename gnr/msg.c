@@ -26,6 +26,9 @@
 #ifdef HAVE_STDIO_H
 #include <stdio.h>
 #endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
@@ -37,20 +40,74 @@
 #include <naf/nafmodule.h>
 #include <naf/nafrpc.h>
 #include <naf/naftag.h>
+#include <naf/naftimer.h>
 
 #include <gnr/gnrmsg.h>
 #include <gnr/gnrnode.h>
 #include "core.h"
+#include "msg.h"
+#include "delay.h"
 
 struct mhlist {
 	int position;
 	struct nafmodule *module;
 	gnrmsg_msghandlerfunc_t handlerfunc;
 	char *description;
+	naf_u32_t typemask;
+	gnrmsg_msgflag_t skipflags;
 	struct mhlist *next;
 };
 static struct mhlist *gnr__msghandlers[GNR_MSG_MSGHANDLER_STAGE_MAX+1];
 
+/*
+ * The handler chains are compiled into a flat array per stage and message
+ * type, holding only the handlers that want that type, so routing a message
+ * doesn't make calls that do nothing.  The arrays are rebuilt when handlers
+ * are added or removed.  A stage that isn't compiled (or a message type
+ * without an array) falls back to walking the chain.
+ */
+struct mhdispatch {
+	gnrmsg_msghandlerfunc_t handlerfunc;
+	struct nafmodule *module;
+	gnrmsg_msgflag_t skipflags;
+};
+static struct mhdispatch *gnr__msgdispatch[GNR_MSG_MSGHANDLER_STAGE_MAX+1][GNR_MSG_MSGTYPE_MAX+1];
+static int gnr__msgdispatchstale[GNR_MSG_MSGHANDLER_STAGE_MAX+1];
+static int gnr__msgdispatchbusy = 0;
+
+#define GNR_MSG_SLABOBJS 32
+static naf_slabcache_t *gnr__msgslab = NULL;
+
+/*
+ * Message arenas.  See gnr_msg_alloc().  Blocks come from their own slab,
+ * so they're recycled rather than going back to the allocator every time;
+ * anything too big for a block, and any buffer handed over with
+ * gnr_msg_adopt(), is kept on a list of extras to be freed with the rest.
+ */
+#define GNR_MSG_ARENABLOCKLEN 512
+#define GNR_MSG_ARENASLABOBJS 32
+#define GNR_MSG_ARENAALIGN(n) (((n) + 7) & ~7)
+
+struct gnrmsg_arenablock {
+	struct gnrmsg_arenablock *next;
+	int used;
+};
+#define GNR_MSG_ARENABLOCKDATA (GNR_MSG_ARENABLOCKLEN - (int)GNR_MSG_ARENAALIGN(sizeof(struct gnrmsg_arenablock)))
+
+struct gnrmsg_arenaextra {
+	struct nafmodule *owner;
+	void *buf;
+	struct gnrmsg_arenaextra *next;
+};
+
+/* Lives at the start of the first block. */
+struct gnrmsg_arena {
+	struct gnrmsg_arenablock *blocks;
+	struct gnrmsg_arenaextra *extras;
+};
+
+static naf_slabcache_t *gnr__arenaslab = NULL;
+
 static struct mhlist *mh_alloc(void)
 {
 	struct mhlist *mh;
@@ -105,44 +162,174 @@ static struct mhlist *mh_remove(int stage, gnrmsg_msghandlerfunc_t handlerfunc)
 	return NULL;
 }
 
-int gnr_msg_addmsghandler(struct nafmodule *mod, int stage, int position, gnrmsg_msghandlerfunc_t handlerfunc, const char *desc)
+static int mh_wantstype(struct mhlist *mh, gnrmsg_msgtype_t type)
+{
+
+	if (type >= 32)
+		return mh->typemask == GNR_MSG_TYPEMASK_ALL;
+
+	return !!(mh->typemask & GNR_MSG_TYPEMASK(type));
+}
+
+static void mh_uncompile(int stage)
+{
+	int type;
+
+	for (type = 0; type <= GNR_MSG_MSGTYPE_MAX; type++) {
+		naf_free(gnr__module, gnr__msgdispatch[stage][type]);
+		gnr__msgdispatch[stage][type] = NULL;
+	}
+
+	return;
+}
+
+static void mh_compile(int stage)
 {
 	struct mhlist *mh;
+	int type;
+
+	/* Someone's still using the old arrays; try again when they're done. */
+	if (gnr__msgdispatchbusy) {
+		gnr__msgdispatchstale[stage] = 1;
+		return;
+	}
+	gnr__msgdispatchstale[stage] = 0;
+
+	mh_uncompile(stage);
+
+	for (type = 0; type <= GNR_MSG_MSGTYPE_MAX; type++) {
+		struct mhdispatch *md;
+		int n;
+
+		for (mh = gnr__msghandlers[stage], n = 0; mh; mh = mh->next) {
+			if (mh_wantstype(mh, type))
+				n++;
+		}
+
+		if (!(md = naf_malloc(gnr__module, sizeof(struct mhdispatch) * (n + 1)))) {
+			dvprintf(gnr__module, "mh_compile: out of memory; stage %d will walk the handler list\n", stage);
+			mh_uncompile(stage);
+			return;
+		}
+		gnr__msgdispatch[stage][type] = md;
+
+		for (mh = gnr__msghandlers[stage]; mh; mh = mh->next) {
+			if (!mh_wantstype(mh, type))
+				continue;
+			md->handlerfunc = mh->handlerfunc;
+			md->module = mh->module;
+			md->skipflags = mh->skipflags;
+			md++;
+		}
+		memset(md, 0, sizeof(struct mhdispatch));
+	}
 
-	if (stage > GNR_MSG_MSGHANDLER_STAGE_MAX)
+	return;
+}
+
+static void mh_dispatchdone(void)
+{
+	int stage;
+
+	if (--gnr__msgdispatchbusy)
+		return;
+
+	for (stage = 0; stage <= GNR_MSG_MSGHANDLER_STAGE_MAX; stage++) {
+		if (gnr__msgdispatchstale[stage])
+			mh_compile(stage);
+	}
+
+	return;
+}
+
+/*
+ * Run one stage's handlers over a message.  In the routing stage, this
+ * stops at the first handler that takes the message, and sets targetmod.
+ */
+static void mh_dispatch(int stage, struct gnrmsg *gm, struct gnrmsg_handler_info *gmhi)
+{
+	struct mhdispatch *md;
+	struct mhlist *mh;
+
+	if ((gm->type <= GNR_MSG_MSGTYPE_MAX) &&
+			(md = gnr__msgdispatch[stage][gm->type])) {
+
+		for ( ; md->handlerfunc; md++) {
+			if (gm->msgflags & md->skipflags)
+				continue;
+			if (md->handlerfunc(md->module, stage, gm, gmhi) &&
+					(stage == GNR_MSG_MSGHANDLER_STAGE_ROUTING)) {
+				gmhi->targetmod = md->module;
+				break;
+			}
+		}
+
+		return;
+	}
+
+	for (mh = gnr__msghandlers[stage]; mh; mh = mh->next) {
+		if (!mh_wantstype(mh, gm->type) || (gm->msgflags & mh->skipflags))
+			continue;
+		if (mh->handlerfunc(mh->module, stage, gm, gmhi) &&
+				(stage == GNR_MSG_MSGHANDLER_STAGE_ROUTING)) {
+			gmhi->targetmod = mh->module;
+			break;
+		}
+	}
+
+	return;
+}
+
+int gnr_msg_addmsghandler_filtered(struct nafmodule *mod, int stage, int position, gnrmsg_msghandlerfunc_t handlerfunc, const char *desc, naf_u32_t typemask, gnrmsg_msgflag_t skipflags)
+{
+	struct mhlist *mh;
+
+	if ((stage < 0) || (stage > GNR_MSG_MSGHANDLER_STAGE_MAX))
 		return -1;
 
 	if ((position < GNR_MSG_MSGHANDLER_POS_MIN) ||
 			(position > GNR_MSG_MSGHANDLER_POS_MAX))
 		return -1;
 
+	if (!typemask)
+		return -1;
+
 	if (!(mh = mh_alloc()))
 		return -1;
 
 	mh->position = position;
 	mh->module = mod;
 	mh->handlerfunc = handlerfunc;
+	mh->typemask = typemask;
+	mh->skipflags = skipflags;
 	if (!(mh->description = naf_strdup(gnr__module, desc))) {
 		mh_free(mh);
 		return -1;
 	}
 
 	mh_insert(stage, mh);
+	mh_compile(stage);
 
 	return 0;
 }
 
+int gnr_msg_addmsghandler(struct nafmodule *mod, int stage, int position, gnrmsg_msghandlerfunc_t handlerfunc, const char *desc)
+{
+	return gnr_msg_addmsghandler_filtered(mod, stage, position, handlerfunc, desc, GNR_MSG_TYPEMASK_ALL, GNR_MSG_MSGFLAG_NONE);
+}
+
 int gnr_msg_remmsghandler(struct nafmodule *mod, int stage, gnrmsg_msghandlerfunc_t handlerfunc)
 {
 	struct mhlist *mh;
 
-	if (stage > GNR_MSG_MSGHANDLER_STAGE_MAX)
+	if ((stage < 0) || (stage > GNR_MSG_MSGHANDLER_STAGE_MAX))
 		return -1;
 
 	if (!(mh = mh_remove(stage, handlerfunc)))
 		return -1;
 
 	mh_free(mh);
+	mh_compile(stage);
 
 	return 0;
 }
@@ -172,6 +359,8 @@ static void __rpc_gnr_listmsghandlers(struct nafmodule *mod, naf_rpc_req_t *req)
 					naf_rpc_addarg_scalar(mod, ptop, "position", mh->position);
 					naf_rpc_addarg_string(mod, ptop, "module", mh->module->name);
 					naf_rpc_addarg_string(mod, ptop, "description", mh->description);
+					naf_rpc_addarg_scalar(mod, ptop, "typemask", mh->typemask);
+					naf_rpc_addarg_scalar(mod, ptop, "skipflags", mh->skipflags);
 				}
 			}
 		}
@@ -187,23 +376,158 @@ struct gnrmsg *gnr_msg_new(struct nafmodule *mod)
 {
 	struct gnrmsg *gm;
 
-	if (!(gm = naf_malloc(mod, sizeof(struct gnrmsg))))
+	if (!(gm = naf_slab_alloc(gnr__msgslab)))
 		return NULL;
-	memset(gm, 0, sizeof(struct gnrmsg));
+	memset(gm, 0, naf_slab_objlen(gm));
 
 	return gm;
 }
 
+static void gnr_msg__arena_release(struct gnrmsg_arena *arena)
+{
+	struct gnrmsg_arenablock *blk, *next;
+	struct gnrmsg_arenaextra *ex;
+
+	if (!arena)
+		return;
+
+	for (ex = arena->extras; ex; ex = ex->next)
+		naf_free(ex->owner, ex->buf);
+
+	/* The last block holds the arena itself. */
+	for (blk = arena->blocks; blk; blk = next) {
+		next = blk->next;
+		naf_slab_free(gnr__arenaslab, blk);
+	}
+
+	return;
+}
+
 void gnr_msg_free(struct nafmodule *mod, struct gnrmsg *gm)
 {
 
 	naf_tag_freelist(&gm->taglist, (void *)gm);
 
-	naf_free(mod, gm);
+	gnr_msg__arena_release((struct gnrmsg_arena *)gm->arena);
+
+	naf_slab_free(gnr__msgslab, gm);
 
 	return;
 }
 
+static void *gnr_msg__arena_carve(struct gnrmsg_arena *arena, int len)
+{
+	struct gnrmsg_arenablock *blk = arena->blocks;
+	void *ret;
+
+	if (blk->used + len > GNR_MSG_ARENABLOCKDATA) {
+		if (!(blk = naf_slab_alloc(gnr__arenaslab)))
+			return NULL;
+		blk->used = 0;
+		blk->next = arena->blocks;
+		arena->blocks = blk;
+	}
+
+	ret = (naf_u8_t *)blk + GNR_MSG_ARENAALIGN(sizeof(struct gnrmsg_arenablock)) + blk->used;
+	blk->used += len;
+
+	return ret;
+}
+
+static struct gnrmsg_arena *gnr_msg__arena(struct gnrmsg *gm)
+{
+	struct gnrmsg_arenablock *blk;
+	struct gnrmsg_arena *arena;
+
+	if (gm->arena)
+		return (struct gnrmsg_arena *)gm->arena;
+
+	if (!gnr__arenaslab || !(blk = naf_slab_alloc(gnr__arenaslab)))
+		return NULL;
+	blk->next = NULL;
+	blk->used = GNR_MSG_ARENAALIGN(sizeof(struct gnrmsg_arena));
+
+	arena = (struct gnrmsg_arena *)((naf_u8_t *)blk + GNR_MSG_ARENAALIGN(sizeof(struct gnrmsg_arenablock)));
+	arena->blocks = blk;
+	arena->extras = NULL;
+
+	return (struct gnrmsg_arena *)(gm->arena = arena);
+}
+
+static int gnr_msg__arena_addextra(struct gnrmsg_arena *arena, struct nafmodule *owner, void *buf)
+{
+	struct gnrmsg_arenaextra *ex;
+
+	if (!(ex = gnr_msg__arena_carve(arena, GNR_MSG_ARENAALIGN(sizeof(struct gnrmsg_arenaextra)))))
+		return -1;
+	ex->owner = owner;
+	ex->buf = buf;
+	ex->next = arena->extras;
+	arena->extras = ex;
+
+	return 0;
+}
+
+/*
+ * Allocate len bytes that live exactly as long as gm does: they're freed,
+ * along with everything else allocated this way, by gnr_msg_free().  This
+ * is meant for the message's strings, its protocol-specific hints, and
+ * anything else the source module would otherwise have to free one piece
+ * at a time.
+ */
+void *gnr_msg_alloc(struct gnrmsg *gm, int len)
+{
+	struct gnrmsg_arena *arena;
+	void *buf;
+
+	if (!gm || (len < 0) || !(arena = gnr_msg__arena(gm)))
+		return NULL;
+
+	len = GNR_MSG_ARENAALIGN(len ? len : 1);
+	if (len <= (GNR_MSG_ARENABLOCKDATA / 2))
+		return gnr_msg__arena_carve(arena, len);
+
+	if (!(buf = naf_malloc(gnr__module, len)))
+		return NULL;
+	if (gnr_msg__arena_addextra(arena, gnr__module, buf) == -1) {
+		naf_free(gnr__module, buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+char *gnr_msg_strdup(struct gnrmsg *gm, const char *str)
+{
+	char *ret;
+	int len;
+
+	if (!str)
+		return NULL;
+
+	len = strlen(str);
+	if (!(ret = gnr_msg_alloc(gm, len + 1)))
+		return NULL;
+	memcpy(ret, str, len + 1);
+
+	return ret;
+}
+
+/*
+ * Give gm a buffer that was allocated with naf_malloc(mod, ...); it will be
+ * freed with the message.  That way, the message's fields can point into
+ * (say) the packet it was parsed from, instead of being copied out of it.
+ */
+int gnr_msg_adopt(struct nafmodule *mod, struct gnrmsg *gm, void *buf)
+{
+	struct gnrmsg_arena *arena;
+
+	if (!mod || !gm || !buf || !(arena = gnr_msg__arena(gm)))
+		return -1;
+
+	return gnr_msg__arena_addextra(arena, mod, buf);
+}
+
 
 int gnr_msg_clonetags(struct gnrmsg *destgm, struct gnrmsg *srcgm)
 {
@@ -250,22 +574,76 @@ int gnr_msg_tag_fetch(struct nafmodule *mod, struct gnrmsg *gm, const char *name
 	return naf_tag_fetch(&gm->taglist, mod, name, typeret, dataret);
 }
 
+int gnr_msg_tag_addatom(struct nafmodule *mod, struct gnrmsg *gm, naf_tagatom_t atom, char type, void *data)
+{
 
-int gnr_msg_route(struct nafmodule *srcmod, struct gnrmsg *gm)
+	if (!gm)
+		return -1;
+
+	return naf_tag_addatom(&gm->taglist, mod, atom, type, data);
+}
+
+int gnr_msg_tag_removeatom(struct nafmodule *mod, struct gnrmsg *gm, naf_tagatom_t atom, char *typeret, void **dataret)
 {
-	struct gnrmsg_handler_info gmhi;
-	struct mhlist *mh;
-#ifdef GNR_MSG_PERF
-	struct timeval tvin, tvout;
 
-	memset(&tvin, 0, sizeof(struct timeval));
-	memset(&tvout, 0, sizeof(struct timeval));
+	if (!gm)
+		return -1;
 
-	gettimeofday(&tvin, NULL);
-#endif
-	gmhi.srcmod = srcmod;
-	gmhi.destconn = NULL;
-	gmhi.targetmod = NULL;
+	return naf_tag_removeatom(&gm->taglist, mod, atom, typeret, dataret);
+}
+
+int gnr_msg_tag_ispresentatom(struct nafmodule *mod, struct gnrmsg *gm, naf_tagatom_t atom)
+{
+
+	if (!gm)
+		return -1;
+
+	return naf_tag_ispresentatom(&gm->taglist, mod, atom);
+}
+
+int gnr_msg_tag_fetchatom(struct nafmodule *mod, struct gnrmsg *gm, naf_tagatom_t atom, char *typeret, void **dataret)
+{
+
+	if (!gm)
+		return -1;
+
+	return naf_tag_fetchatom(&gm->taglist, mod, atom, typeret, dataret);
+}
+
+/*
+ * Same as naf_conn_extslot_register(), for messages.  Messages don't live
+ * long, so there's seldom one around that predates a slot.
+ */
+int gnr_msg_extslot_register(struct nafmodule *mod, int size)
+{
+
+	if (!mod || (size <= 0) || !gnr__msgslab)
+		return -1;
+
+	return naf_slab_extend(gnr__msgslab, size);
+}
+
+void *gnr_msg_extslot(struct gnrmsg *gm, int slot)
+{
+
+	if (!gm || (slot < (int)sizeof(struct gnrmsg)) || (slot >= naf_slab_objlen(gm)))
+		return NULL;
+
+	return (naf_u8_t *)gm + slot;
+}
+
+
+/*
+ * Fill in the handler info for a message about to be routed.  Returns -1 if
+ * the message can't be routed at all.
+ */
+static int gnr_msg__prepare(struct nafmodule *srcmod, struct gnrmsg *gm, struct gnrmsg_handler_info *gmhi)
+{
+
+	gmhi->srcmod = srcmod;
+	gmhi->destconn = NULL;
+	gmhi->targetmod = NULL;
+	gmhi->srcnode = gmhi->destnode = NULL;
 
 	/* Make sure we're routing a sane message... */
 	if (!gm || !gm->srcname || !gm->srcnameservice ||
@@ -279,12 +657,12 @@ int gnr_msg_route(struct nafmodule *srcmod, struct gnrmsg *gm)
 		return -1;
 	}
 
-	gmhi.srcnode = gnr_node_findbyname(gm->srcname, gm->srcnameservice);
-	gmhi.destnode = gnr_node_findbyname(gm->destname, gm->destnameservice);
+	gmhi->srcnode = gnr_node_findbyname(gm->srcname, gm->srcnameservice);
+	gmhi->destnode = gnr_node_findbyname(gm->destname, gm->destnameservice);
 
 	if (gnr__debug > 0) {
 		dvprintf(gnr__module, "gnr_msg_route: from %s, %s[%s] -> %s[%s], msgtext = (%s) '%s', msgflags = %08lx, srconn = %d\n",
-				srcmod,
+				srcmod ? srcmod->name : "unknown",
 				gm->srcname, gm->srcnameservice,
 				gm->destname, gm->destnameservice,
 				gm->msgtexttype ? gm->msgtexttype : "type not specified",
@@ -292,34 +670,58 @@ int gnr_msg_route(struct nafmodule *srcmod, struct gnrmsg *gm)
 				gm->srcconn ? gm->srcconn->cid : -1);
 	}
 
+	return 0;
+}
+
+static gnrmsg_outputfunc_t gnr_msg__outputfunc(struct nafmodule *targetmod)
+{
+	gnrmsg_outputfunc_t outf = NULL;
+
+	naf_module_tag_fetch(gnr__module, targetmod, "module.gnrmsg_outputfunc", NULL, (void **)&outf);
+
+	return outf;
+}
+
+int gnr_msg_route(struct nafmodule *srcmod, struct gnrmsg *gm)
+{
+	struct gnrmsg_handler_info gmhi;
+#ifdef GNR_MSG_PERF
+	struct timeval tvin, tvout;
+
+	memset(&tvin, 0, sizeof(struct timeval));
+	memset(&tvout, 0, sizeof(struct timeval));
+
+	gettimeofday(&tvin, NULL);
+#endif
+
+	if (gnr_msg__prepare(srcmod, gm, &gmhi) == -1)
+		return -1;
+
+	gnr__msgdispatchbusy++;
+
 	/* First, pre-route. (handler return value is ignored) */
-	for (mh = gnr__msghandlers[GNR_MSG_MSGHANDLER_STAGE_PREROUTING]; mh; mh = mh->next) {
-		mh->handlerfunc(mh->module, GNR_MSG_MSGHANDLER_STAGE_PREROUTING, gm, &gmhi);
-	}
+	mh_dispatch(GNR_MSG_MSGHANDLER_STAGE_PREROUTING, gm, &gmhi);
 
 	/* Next, route. */
-	for (mh = gnr__msghandlers[GNR_MSG_MSGHANDLER_STAGE_ROUTING]; mh; mh = mh->next) {
-		if (mh->handlerfunc(mh->module, GNR_MSG_MSGHANDLER_STAGE_ROUTING, gm, &gmhi)) {
-			gmhi.targetmod = mh->module;
-			break;
-		}
-	}
+	mh_dispatch(GNR_MSG_MSGHANDLER_STAGE_ROUTING, gm, &gmhi);
 
 	/* Then post-route. */
-	for (mh = gnr__msghandlers[GNR_MSG_MSGHANDLER_STAGE_POSTROUTING]; mh; mh = mh->next) {
-		mh->handlerfunc(mh->module, GNR_MSG_MSGHANDLER_STAGE_POSTROUTING, gm, &gmhi);
-	}
+	mh_dispatch(GNR_MSG_MSGHANDLER_STAGE_POSTROUTING, gm, &gmhi);
 
-	/* And finally, output. */
-	if (gmhi.targetmod) {
-		gnrmsg_outputfunc_t outf = NULL;
+	mh_dispatchdone();
 
-		naf_module_tag_fetch(gnr__module, gmhi.targetmod, "module.gnrmsg_outputfunc", NULL, (void **)&outf);
+	/* And finally, output. */
+	if (gmhi.targetmod && !(gm->routeflags & GNR_MSG_ROUTEFLAG_DELAYED)) {
+		gnrmsg_outputfunc_t outf;
 
-		if (outf)
+		if ((outf = gnr_msg__outputfunc(gmhi.targetmod)))
 			outf(gmhi.targetmod, gm, &gmhi);
 	}
 
+	/* A handler or the output function may have decided it has to wait. */
+	if (gm->routeflags & GNR_MSG_ROUTEFLAG_DELAYED)
+		gnr_delay__park(srcmod, gm);
+
 #ifdef GNR_MSG_PERF
 	gettimeofday(&tvout, NULL);
 
@@ -337,10 +739,238 @@ int gnr_msg_route(struct nafmodule *srcmod, struct gnrmsg *gm)
 }
 
 
+/*
+ * Queued routing.
+ *
+ * With routequeue on, gnr_msg_enqueue() just puts the message on a queue,
+ * and the whole queue is routed in one go from a zero-length timer, which
+ * the main loop runs once per pass.  Each handler stage is run over the
+ * entire batch before the next one starts, and output is grouped by target
+ * module and destination node, so that a module with a batch output
+ * function (see gnr_msg_register_batch()) gets every message bound for the
+ * same place in a single call.  Messages for the same destination are
+ * delivered in the order they were queued.
+ *
+ * The queue never gets deeper than routequeuemax: a producer that finds it
+ * full routes the backlog itself before its message is queued.
+ */
+struct gnrmsg_qent {
+	struct gnrmsg *gm;
+	struct nafmodule *srcmod;
+	gnrmsg_releasefunc_t releasefunc;
+	struct gnrmsg_handler_info gmhi;
+	int seq;
+	struct gnrmsg_qent *next;
+};
+
+int gnr__routequeue = GNR_ROUTEQUEUE_DEFAULT;
+int gnr__routequeuemax = GNR_ROUTEQUEUEMAX_DEFAULT;
+
+static struct gnrmsg_qent *gnr__msgq = NULL, **gnr__msgqtail = &gnr__msgq;
+static int gnr__msgqlen = 0;
+static naf_slabcache_t *gnr__msgqslab = NULL;
+static struct naf_timer gnr__msgqtimer;
+
+static int gnr_msg__qentcmp(const void *v1, const void *v2)
+{
+	const struct gnrmsg_qent *q1 = *(const struct gnrmsg_qent **)v1;
+	const struct gnrmsg_qent *q2 = *(const struct gnrmsg_qent **)v2;
+
+	if (q1->gmhi.targetmod != q2->gmhi.targetmod)
+		return (q1->gmhi.targetmod < q2->gmhi.targetmod) ? -1 : 1;
+	if (q1->gmhi.destnode != q2->gmhi.destnode)
+		return (q1->gmhi.destnode < q2->gmhi.destnode) ? -1 : 1;
+
+	return q1->seq - q2->seq;
+}
+
+static void gnr_msg__outputbatch(struct gnrmsg_qent **qv, int count)
+{
+	struct gnrmsg **gmv = NULL;
+	struct gnrmsg_handler_info **gmhiv = NULL;
+	int i, j;
+
+	qsort(qv, count, sizeof(struct gnrmsg_qent *), gnr_msg__qentcmp);
+
+	if ((gmv = naf_malloc(gnr__module, sizeof(struct gnrmsg *) * count)) &&
+			(gmhiv = naf_malloc(gnr__module, sizeof(struct gnrmsg_handler_info *) * count))) {
+		for (i = 0; i < count; i++) {
+			gmv[i] = qv[i]->gm;
+			gmhiv[i] = &qv[i]->gmhi;
+		}
+	} else {
+		naf_free(gnr__module, gmv);
+		gmv = NULL;
+	}
+
+	for (i = 0; i < count; i = j) {
+		struct nafmodule *targetmod = qv[i]->gmhi.targetmod;
+		gnrmsg_batchoutputfunc_t boutf = NULL;
+		gnrmsg_outputfunc_t outf;
+
+		for (j = i + 1; j < count; j++) {
+			if ((qv[j]->gmhi.targetmod != targetmod) ||
+					(qv[j]->gmhi.destnode != qv[i]->gmhi.destnode))
+				break;
+		}
+
+		if (!targetmod)
+			continue;
+
+		naf_module_tag_fetch(gnr__module, targetmod, "module.gnrmsg_batchoutputfunc", NULL, (void **)&boutf);
+		if (boutf && gmv) {
+			boutf(targetmod, j - i, gmv + i, gmhiv + i);
+			continue;
+		}
+
+		if ((outf = gnr_msg__outputfunc(targetmod))) {
+			int k;
+
+			for (k = i; k < j; k++)
+				outf(targetmod, qv[k]->gm, &qv[k]->gmhi);
+		}
+	}
+
+	naf_free(gnr__module, gmv);
+	naf_free(gnr__module, gmhiv);
+
+	return;
+}
+
+/*
+ * Route everything that's queued right now.  Anything queued while this is
+ * running (by an output function, say) waits for the next pass.
+ */
+static void gnr_msg__drain(void)
+{
+	struct gnrmsg_qent *batch, *q, **qv;
+	int count, i, stage;
+
+	naf_timer_cancel(&gnr__msgqtimer);
+
+	if (!(batch = gnr__msgq))
+		return;
+	count = gnr__msgqlen;
+	gnr__msgq = NULL;
+	gnr__msgqtail = &gnr__msgq;
+	gnr__msgqlen = 0;
+
+	if (gnr__debug > 1)
+		dvprintf(gnr__module, "gnr_msg__drain: routing %d queued messages\n", count);
+
+	for (q = batch, i = 0; q; q = q->next, i++) {
+		q->seq = i;
+		if (gnr_msg__prepare(q->srcmod, q->gm, &q->gmhi) == -1)
+			q->seq = -1;
+	}
+
+	gnr__msgdispatchbusy++;
+	for (stage = 0; stage <= GNR_MSG_MSGHANDLER_STAGE_MAX; stage++) {
+		for (q = batch; q; q = q->next) {
+			if (q->seq != -1)
+				mh_dispatch(stage, q->gm, &q->gmhi);
+		}
+	}
+	mh_dispatchdone();
+
+	if ((qv = naf_malloc(gnr__module, sizeof(struct gnrmsg_qent *) * count))) {
+		for (q = batch, i = 0; q; q = q->next) {
+			if ((q->seq != -1) &&
+					!(q->gm->routeflags & GNR_MSG_ROUTEFLAG_DELAYED))
+				qv[i++] = q;
+		}
+		gnr_msg__outputbatch(qv, i);
+		naf_free(gnr__module, qv);
+	} else {
+		for (q = batch; q; q = q->next) {
+			gnrmsg_outputfunc_t outf;
+
+			if ((q->seq != -1) && q->gmhi.targetmod &&
+					!(q->gm->routeflags & GNR_MSG_ROUTEFLAG_DELAYED) &&
+					(outf = gnr_msg__outputfunc(q->gmhi.targetmod)))
+				outf(q->gmhi.targetmod, q->gm, &q->gmhi);
+		}
+	}
+
+	for (q = batch; q; q = q->next) {
+		if ((q->seq != -1) &&
+				(q->gm->routeflags & GNR_MSG_ROUTEFLAG_DELAYED))
+			gnr_delay__park(q->srcmod, q->gm);
+	}
+
+	while ((q = batch)) {
+		batch = q->next;
+
+		if (q->releasefunc)
+			q->releasefunc(q->srcmod, q->gm);
+		naf_slab_free(gnr__msgqslab, q);
+	}
+
+	return;
+}
+
+static void gnr_msg__drainhandler(struct nafmodule *mod, struct naf_timer *timer, void *data)
+{
+
+	gnr_msg__drain();
+
+	return;
+}
+
+/*
+ * Hand gm to gnr for routing.  On success, gnr owns the message and will
+ * call releasefunc(srcmod, gm) once it's been routed, which must free it
+ * (and whatever it points to); gm must not be touched after that.  That
+ * may happen before this returns, if queueing is off.  On failure, the
+ * caller still owns gm.
+ */
+int gnr_msg_enqueue(struct nafmodule *srcmod, struct gnrmsg *gm, gnrmsg_releasefunc_t releasefunc)
+{
+	struct gnrmsg_qent *q;
+
+	if (!gm)
+		return -1;
+
+	if (!gnr__routequeue || !gnr__msgqslab) {
+		gnr_msg_route(srcmod, gm);
+		if (releasefunc)
+			releasefunc(srcmod, gm);
+		return 0;
+	}
+
+	if (gnr__msgqlen >= gnr__routequeuemax)
+		gnr_msg__drain();
+
+	if (!(q = naf_slab_alloc(gnr__msgqslab)))
+		return -1;
+	memset(q, 0, sizeof(struct gnrmsg_qent));
+	q->gm = gm;
+	q->srcmod = srcmod;
+	q->releasefunc = releasefunc;
+
+	*gnr__msgqtail = q;
+	gnr__msgqtail = &q->next;
+	if (!gnr__msgqlen++)
+		naf_timer_arm(&gnr__msgqtimer, 0);
+
+	return 0;
+}
+
+
 int gnr_msg__register(struct nafmodule *mod)
 {
 
-	memset(gnr__msghandlers, 0, sizeof(struct mhlist)*(GNR_MSG_MSGHANDLER_STAGE_MAX+1));
+	memset(gnr__msghandlers, 0, sizeof(gnr__msghandlers));
+	memset(gnr__msgdispatch, 0, sizeof(gnr__msgdispatch));
+	memset(gnr__msgdispatchstale, 0, sizeof(gnr__msgdispatchstale));
+
+	if (!(gnr__msgslab = naf_slab_create(mod, "msgs", sizeof(struct gnrmsg), GNR_MSG_SLABOBJS)))
+		return -1;
+	if (!(gnr__msgqslab = naf_slab_create(mod, "msgqueue", sizeof(struct gnrmsg_qent), GNR_MSG_SLABOBJS)))
+		return -1;
+	if (!(gnr__arenaslab = naf_slab_create(mod, "msgarena", GNR_MSG_ARENABLOCKLEN, GNR_MSG_ARENASLABOBJS)))
+		return -1;
+	naf_timer_init(&gnr__msgqtimer, mod, gnr_msg__drainhandler, NULL);
 
 	naf_rpc_register_method(mod, "listmsghandlers", __rpc_gnr_listmsghandlers, "List registered message handlers");
 
@@ -349,9 +979,23 @@ int gnr_msg__register(struct nafmodule *mod)
 
 int gnr_msg__unregister(struct nafmodule *mod)
 {
+	int stage;
 
 	naf_rpc_unregister_method(mod, "listmsghandlers");
 
+	gnr_msg__drain();
+	naf_slab_destroy(gnr__msgqslab);
+	gnr__msgqslab = NULL;
+
+	for (stage = 0; stage <= GNR_MSG_MSGHANDLER_STAGE_MAX; stage++)
+		mh_uncompile(stage);
+
+	naf_slab_destroy(gnr__msgslab);
+	gnr__msgslab = NULL;
+
+	naf_slab_destroy(gnr__arenaslab);
+	gnr__arenaslab = NULL;
+
 	return 0;
 }
 
@@ -373,11 +1017,28 @@ int gnr_msg_register(struct nafmodule *mod, gnrmsg_outputfunc_t outputfunc)
 	return 0;
 }
 
+/*
+ * A module can also have a batch output function, which queued routing uses
+ * in preference to the plain one.
+ */
+int gnr_msg_register_batch(struct nafmodule *mod, gnrmsg_batchoutputfunc_t batchoutputfunc)
+{
+
+	if (!mod || !batchoutputfunc)
+		return -1;
+
+	return naf_module_tag_add(gnr__module, mod, "module.gnrmsg_batchoutputfunc", 'V', (void *)batchoutputfunc);
+}
+
 int gnr_msg_unregister(struct nafmodule *mod)
 {
 	void *outputfunc;
 
+	/* Its messages may still be queued, or be headed its way. */
+	gnr_msg__drain();
+
 	naf_module_tag_remove(gnr__module, mod, "module.gnrmsg_outputfunc", NULL, (void **)&outputfunc);
+	naf_module_tag_remove(gnr__module, mod, "module.gnrmsg_batchoutputfunc", NULL, (void **)&outputfunc);
 
 	return 0;
 }
@@ -22,5 +22,10 @@
 int gnr_msg__register(struct nafmodule *mod);
 int gnr_msg__unregister(struct nafmodule *mod);
 
+#define GNR_ROUTEQUEUE_DEFAULT 0
+extern int gnr__routequeue;
+#define GNR_ROUTEQUEUEMAX_DEFAULT 1024
+extern int gnr__routequeuemax;
+
 #endif /* ndef __MSG_H__ */
 
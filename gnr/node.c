@@ -43,11 +43,17 @@
 #include <naf/nafrpc.h>
 #include <naf/nafstats.h>
 #include <naf/naftag.h>
+#include <naf/naftimer.h>
 
 #include <gnr/gnrnode.h>
 #include <gnr/gnrmsg.h>
 #include <gnr/gnrevents.h>
 #include "core.h"
+#include "delay.h"
+#include "node.h"
+
+#define GNR_NODE_SLABOBJS 64
+static naf_slabcache_t *gnr__nodeslab = NULL;
 
 
 int gnr_node_tag_add(struct nafmodule *mod, struct gnrnode *gn, const char *name, char type, void *data)
@@ -86,6 +92,61 @@ int gnr_node_tag_fetch(struct nafmodule *mod, struct gnrnode *gn, const char *na
 	return naf_tag_fetch(&gn->taglistv, (void *)mod, name, typeret, dataret);
 }
 
+int gnr_node_tag_addatom(struct nafmodule *mod, struct gnrnode *gn, naf_tagatom_t atom, char type, void *data)
+{
+
+	if (!gn)
+		return -1;
+
+	return naf_tag_addatom(&gn->taglistv, mod, atom, type, data);
+}
+
+int gnr_node_tag_removeatom(struct nafmodule *mod, struct gnrnode *gn, naf_tagatom_t atom, char *typeret, void **dataret)
+{
+
+	if (!gn)
+		return -1;
+
+	return naf_tag_removeatom(&gn->taglistv, mod, atom, typeret, dataret);
+}
+
+int gnr_node_tag_ispresentatom(struct nafmodule *mod, struct gnrnode *gn, naf_tagatom_t atom)
+{
+
+	if (!gn)
+		return -1;
+
+	return naf_tag_ispresentatom(&gn->taglistv, mod, atom);
+}
+
+int gnr_node_tag_fetchatom(struct nafmodule *mod, struct gnrnode *gn, naf_tagatom_t atom, char *typeret, void **dataret)
+{
+
+	if (!gn)
+		return -1;
+
+	return naf_tag_fetchatom(&gn->taglistv, mod, atom, typeret, dataret);
+}
+
+/* Same as naf_conn_extslot_register(), for nodes. */
+int gnr_node_extslot_register(struct nafmodule *mod, int size)
+{
+
+	if (!mod || (size <= 0) || !gnr__nodeslab)
+		return -1;
+
+	return naf_slab_extend(gnr__nodeslab, size);
+}
+
+void *gnr_node_extslot(struct gnrnode *gn, int slot)
+{
+
+	if (!gn || (slot < (int)sizeof(struct gnrnode)) || (slot >= naf_slab_objlen(gn)))
+		return NULL;
+
+	return (naf_u8_t *)gn + slot;
+}
+
 
 static int gnr_event_throw_withnode(gnr_event_t ev, struct gnrnode *node, struct gnr_event_ei_nodechange *ei)
 {
@@ -111,66 +172,188 @@ static struct {
 } gnr__nodestats;
 
 
-#define GNR_NODE_HASH_SIZE 64
-static struct gnrnode *gnr__nodehash[GNR_NODE_HASH_SIZE];
-typedef naf_u16_t gnr_nhkey_t;
+/*
+ * Nodes are hashed on their canonical name (lowercased, with the spaces
+ * taken out), which is worked out once when the node comes online, so
+ * comparisons only have to normalize the name being looked up.
+ *
+ * The table doubles whenever it has as many nodes as buckets.  Rather than
+ * rehashing everything at once, the old table is drained a few buckets at a
+ * time as nodes are added, and lookups look in both until it's empty.
+ * Nothing is moved while the table is being walked (gnr__nodehash_busy),
+ * since the walkers call out to other modules.
+ */
+#define GNR_NODE_HASH_MINSIZE 64
+#define GNR_NODE_HASH_MIGRATESTEP 8
+static struct {
+	struct gnrnode **buckets;
+	int size;
+} gnr__nodehash[2]; /* [1] is the new table during a resize */
+static int gnr__nodehash_migrated = -1; /* old buckets drained, or -1 */
+static naf_u32_t gnr__nodehash_count = 0;
+static int gnr__nodehash_busy = 0;
+
+/* FNV-1a over the canonical form of name. */
+naf_u32_t gnr_node_namehash(const char *name)
+{
+	naf_u32_t h = 2166136261UL;
+
+	for (; *name; name++) {
+		if (*name != ' ')
+			h = ((h ^ (unsigned char)tolower(*name)) * 16777619UL) & 0xffffffff;
+	}
+
+	return h;
+}
 
-static gnr_nhkey_t gnr_node__hash_getkey(const char *name)
+char *gnr_node__canonname(const char *name)
 {
-	gnr_nhkey_t key;
+	char *canon, *c;
 
-	for (key = 0; *name; name++) {
-		if (*name != ' ') {
-			key ^= (gnr_nhkey_t)tolower(*name);
-			key <<= 1;
-		}
+	if (!(canon = naf_malloc(gnr__module, strlen(name) + 1)))
+		return NULL;
+
+	for (c = canon; *name; name++) {
+		if (*name != ' ')
+			*(c++) = tolower(*name);
 	}
+	*c = '\0';
 
-	return key;
+	return canon;
 }
 
-static int gnr_node__hash_getidx(const char *name)
+/* Compare a canonical name against one that may not be. */
+int gnr_node__canoneq(const char *canon, const char *name)
 {
-	return gnr_node__hash_getkey(name) % GNR_NODE_HASH_SIZE;
+
+	for (; *name; name++) {
+		if (*name == ' ')
+			continue;
+		if (*canon != tolower(*name))
+			return 0;
+		canon++;
+	}
+
+	return *canon == '\0';
 }
 
-static void gnr_node__hash_init(void)
+static int gnr_node__hash_alloc(int t, int size)
 {
-	int i;
 
-	for (i = 0; i < GNR_NODE_HASH_SIZE; i++)
-		gnr__nodehash[i] = NULL;
+	if (!(gnr__nodehash[t].buckets = naf_malloc(gnr__module, sizeof(struct gnrnode *) * size)))
+		return -1;
+	memset(gnr__nodehash[t].buckets, 0, sizeof(struct gnrnode *) * size);
+	gnr__nodehash[t].size = size;
+
+	return 0;
+}
+
+static void gnr_node__hash_link(int t, struct gnrnode *gn)
+{
+	struct gnrnode **head;
+
+	head = &gnr__nodehash[t].buckets[gn->namehash & (gnr__nodehash[t].size - 1)];
+	gn->next = *head;
+	*head = gn;
 
 	return;
 }
 
+static void gnr_node__hash_migrate(int steps)
+{
+
+	if ((gnr__nodehash_migrated == -1) || gnr__nodehash_busy)
+		return;
+
+	for (; steps && (gnr__nodehash_migrated < gnr__nodehash[0].size); steps--) {
+		struct gnrnode *gn;
+
+		while ((gn = gnr__nodehash[0].buckets[gnr__nodehash_migrated])) {
+			gnr__nodehash[0].buckets[gnr__nodehash_migrated] = gn->next;
+			gnr_node__hash_link(1, gn);
+		}
+		gnr__nodehash_migrated++;
+	}
+
+	if (gnr__nodehash_migrated == gnr__nodehash[0].size) {
+		naf_free(gnr__module, gnr__nodehash[0].buckets);
+		gnr__nodehash[0] = gnr__nodehash[1];
+		gnr__nodehash[1].buckets = NULL;
+		gnr__nodehash[1].size = 0;
+		gnr__nodehash_migrated = -1;
+	}
+
+	return;
+}
+
+static int gnr_node__hash_init(void)
+{
+
+	memset(gnr__nodehash, 0, sizeof(gnr__nodehash));
+	gnr__nodehash_migrated = -1;
+	gnr__nodehash_count = 0;
+	gnr__nodehash_busy = 0;
+
+	return gnr_node__hash_alloc(0, GNR_NODE_HASH_MINSIZE);
+}
+
+/*
+ * For walking the whole table: the old table's buckets come first, then
+ * the new one's.
+ */
+static int gnr_node__hash_nbuckets(void)
+{
+	return gnr__nodehash[0].size + gnr__nodehash[1].size;
+}
+
+static struct gnrnode **gnr_node__hash_bucket(int n)
+{
+
+	if (n < gnr__nodehash[0].size)
+		return &gnr__nodehash[0].buckets[n];
+
+	return &gnr__nodehash[1].buckets[n - gnr__nodehash[0].size];
+}
+
 static int gnr_node__hash_add(struct gnrnode *gn)
 {
-	int idx;
 
-	idx = gnr_node__hash_getidx(gn->name);
+	if (!gnr__nodehash[0].buckets)
+		return -1;
+
+	if ((gnr__nodehash_migrated == -1) && !gnr__nodehash_busy &&
+			(gnr__nodehash_count >= (naf_u32_t)gnr__nodehash[0].size)) {
+		if (gnr_node__hash_alloc(1, gnr__nodehash[0].size * 2) != -1)
+			gnr__nodehash_migrated = 0;
+	}
+	gnr_node__hash_migrate(GNR_NODE_HASH_MIGRATESTEP);
 
-	gn->next = gnr__nodehash[idx];
-	gnr__nodehash[idx] = gn;
+	gnr_node__hash_link((gnr__nodehash_migrated != -1) ? 1 : 0, gn);
+	gnr__nodehash_count++;
 
 	return 0;
 }
 
 static struct gnrnode *gnr_node__hash_remove(struct gnrnode *gn)
 {
-	int idx;
-	struct gnrnode *cur, **prev;
+	int t;
 
-	idx = gnr_node__hash_getidx(gn->name);
+	for (t = 0; t < 2; t++) {
+		struct gnrnode *cur, **prev;
 
-	for (prev = &gnr__nodehash[idx]; (cur = *prev); ) {
+		if (!gnr__nodehash[t].buckets)
+			continue;
 
-		if (cur == gn) {
-			*prev = cur->next;
-			return cur;
-		}
+		for (prev = &gnr__nodehash[t].buckets[gn->namehash & (gnr__nodehash[t].size - 1)]; (cur = *prev); ) {
 
-		prev = &cur->next;
+			if (cur == gn) {
+				*prev = cur->next;
+				gnr__nodehash_count--;
+				return cur;
+			}
+
+			prev = &cur->next;
+		}
 	}
 
 	return NULL;
@@ -210,45 +393,80 @@ static void freenode(struct gnrnode *gn, int reason)
 	else
 		gnr__nodestats.peered--;
 
+	naf_timer_cancel(&gn->expiry);
+
+	/* A batch handler still has to see it go; it'll be released after. */
+	if (gn->evpending)
+		return;
+
+	gnr_node__release(gn);
+
+	return;
+}
+
+/*
+ * Free a node that's gone offline.  Normally that's done right away, but
+ * if its NODEDOWN is waiting for a batch event handler, gnr_event_throw()
+ * keeps it and does this once the event has been delivered.
+ */
+void gnr_node__release(struct gnrnode *gn)
+{
+
 	naf_tag_freelist(&gn->taglistv, gn);
 	naf_free(gnr__module, gn->name);
 	naf_free(gnr__module, gn->service);
-	naf_free(gnr__module, gn);
+	naf_free(gnr__module, gn->canonname);
+	naf_slab_free(gnr__nodeslab, gn);
 
 	return;
 }
 
-static void gnr_node__hash_timeout(void)
+/*
+ * Peered and external nodes expire ttl seconds after they were last used.
+ * Each one keeps a timer for that, but gnr_node_usehit() doesn't touch it;
+ * when it goes off, it's pushed back if the node has been used since (or
+ * is still referenced).  Local nodes, and nodes with no TTL, don't have
+ * their timer armed at all.
+ */
+static void gnr_node__expire(struct nafmodule *mod, struct naf_timer *timer, void *data)
 {
-	int idx;
+	struct gnrnode *gn = (struct gnrnode *)data;
 	time_t now;
 
-	now = time(NULL);
+	if ((gn->metric == GNR_NODE_METRIC_LOCAL) || (gn->ttl == -1))
+		return;
 
-	for (idx = 0; idx < GNR_NODE_HASH_SIZE; idx++) {
-		struct gnrnode *cur, **prev;
+	now = time(NULL);
 
-		for (prev = &gnr__nodehash[idx]; (cur = *prev); ) {
+	if (gn->refcount > 0) {
+		naf_timer_arm(timer, gn->ttl * 1000);
+		return;
+	}
+	if ((now - gn->lastuse) < gn->ttl) {
+		naf_timer_arm(timer, (gn->ttl - (now - gn->lastuse)) * 1000);
+		return;
+	}
 
-			if (cur->metric == GNR_NODE_METRIC_LOCAL) {
-				/* local nodes never time out */
-				prev = &cur->next;
-				continue;
-			}
+	gnr_node_offline(gn, GNR_NODE_OFFLINE_REASON_TIMEOUT);
 
-			if ((cur->ttl == -1) ||
-					(cur->refcount > 0) ||
-					((now - cur->lastuse) < cur->ttl)) {
-				prev = &cur->next;
-				continue;
-			}
+	return;
+}
 
-			*prev = cur->next;
+static void gnr_node__expiry_update(struct gnrnode *gn)
+{
+	long left;
 
-			freenode(cur, GNR_NODE_OFFLINE_REASON_TIMEOUT);
-		}
+	if ((gn->metric == GNR_NODE_METRIC_LOCAL) || (gn->ttl == -1)) {
+		naf_timer_cancel(&gn->expiry);
+		return;
 	}
 
+	left = gn->ttl - (time(NULL) - gn->lastuse);
+	if (left < 0)
+		left = 0;
+
+	naf_timer_arm(&gn->expiry, left * 1000);
+
 	return;
 }
 
@@ -256,18 +474,25 @@ static void gnr_node__hash_free(void)
 {
 	int i;
 
-	for (i = 0; i < GNR_NODE_HASH_SIZE; i++) {
-		struct gnrnode *cur;
+	gnr__nodehash_busy++;
+	for (i = 0; i < gnr_node__hash_nbuckets(); i++) {
+		struct gnrnode *cur, **head;
 
-		for (cur = gnr__nodehash[i]; cur; ) {
-			struct gnrnode *tmp;
-
-			tmp = cur->next;
+		head = gnr_node__hash_bucket(i);
+		while ((cur = *head)) {
+			*head = cur->next;
 			freenode(cur, GNR_NODE_OFFLINE_REASON_UNKNOWN);
-			cur = tmp;
 		}
-		gnr__nodehash[i] = NULL;
 	}
+	gnr__nodehash_busy--;
+
+	for (i = 0; i < 2; i++) {
+		naf_free(gnr__module, gnr__nodehash[i].buckets);
+		gnr__nodehash[i].buckets = NULL;
+		gnr__nodehash[i].size = 0;
+	}
+	gnr__nodehash_migrated = -1;
+	gnr__nodehash_count = 0;
 
 	return;
 }
@@ -316,14 +541,18 @@ struct gnrnode *gnr_node_find(struct nafmodule *mod, int (*matcher)(struct nafmo
 	if (!matcher)
 		return NULL;
 
-	for (idx = 0; idx < GNR_NODE_HASH_SIZE; idx++) {
+	gnr__nodehash_busy++;
+	for (idx = 0; idx < gnr_node__hash_nbuckets(); idx++) {
 		struct gnrnode *gn;
 
-		for (gn = gnr__nodehash[idx]; gn; gn = gn->next) {
-			if (matcher(mod, gn, data))
+		for (gn = *gnr_node__hash_bucket(idx); gn; gn = gn->next) {
+			if (matcher(mod, gn, data)) {
+				gnr__nodehash_busy--;
 				return gn;
+			}
 		}
 	}
+	gnr__nodehash_busy--;
 
 	return NULL;
 }
@@ -338,35 +567,46 @@ void gnr_node_offline_many(struct nafmodule *mod, int (*matcher)(struct nafmodul
 	if (!matcher)
 		return;
 
-	for (idx = 0; idx < GNR_NODE_HASH_SIZE; idx++) {
+	gnr__nodehash_busy++;
+	for (idx = 0; idx < gnr_node__hash_nbuckets(); idx++) {
 		struct gnrnode *cur, **prev;
 
-		for (prev = &gnr__nodehash[idx]; (cur = *prev); ) {
+		for (prev = gnr_node__hash_bucket(idx); (cur = *prev); ) {
 
 			if (matcher(mod, cur, data)) {
 				*prev = cur->next;
+				gnr__nodehash_count--;
 				freenode(cur, reason);
 			} else
 				prev = &cur->next;
 		}
 	}
+	gnr__nodehash_busy--;
 
 	return;
 }
 
-struct gnrnode *gnr_node_findbyname(const char *name, const char *service)
+/*
+ * For callers that look the same name up more than once: hash is
+ * gnr_node_namehash(name).
+ */
+struct gnrnode *gnr_node_findbyhash(const char *name, naf_u32_t hash, const char *service)
 {
-	int idx;
-	struct gnrnode *gn;
+	int t;
 
 	if (!name)
 		return NULL;
 
-	idx = gnr_node__hash_getidx(name);
+	for (t = 0; t < 2; t++) {
+		struct gnrnode *gn;
+
+		if (!gnr__nodehash[t].buckets)
+			continue;
 
-	for (gn = gnr__nodehash[idx]; gn; gn = gn->next) {
+		for (gn = gnr__nodehash[t].buckets[hash & (gnr__nodehash[t].size - 1)]; gn; gn = gn->next) {
 
-		if (gnr_node_namecmp(gn->name, name) == 0) {
+			if ((gn->namehash != hash) || !gnr_node__canoneq(gn->canonname, name))
+				continue;
 
 			/* If service isn't specified, match on any */
 			if (service && (strcasecmp(gn->service, service) != 0))
@@ -379,29 +619,47 @@ struct gnrnode *gnr_node_findbyname(const char *name, const char *service)
 	return NULL;
 }
 
+struct gnrnode *gnr_node_findbyname(const char *name, const char *service)
+{
+
+	if (!name)
+		return NULL;
+
+	return gnr_node_findbyhash(name, gnr_node_namehash(name), service);
+}
+
 struct gnrnode *gnr_node_online(struct nafmodule *owner, const char *name, const char *service, naf_u32_t flags, int metric)
 {
 	struct gnrnode *gn;
+	naf_u32_t hash;
 
 	if (!owner || !name || !service)
 		return NULL;
 
-	if ((gn = gnr_node_findbyname(name, service)))
+	hash = gnr_node_namehash(name);
+	if ((gn = gnr_node_findbyhash(name, hash, service)))
 		return gn;
 
-	if (!(gn = naf_malloc(gnr__module, sizeof(struct gnrnode))))
+	if (!(gn = naf_slab_alloc(gnr__nodeslab)))
 		return NULL;
-	memset(gn, 0, sizeof(struct gnrnode));
+	memset(gn, 0, naf_slab_objlen(gn));
 
 	if (!(gn->name = naf_strdup(gnr__module, name))) {
-		naf_free(gnr__module, gn);
+		naf_slab_free(gnr__nodeslab, gn);
 		return NULL;
 	}
 	if (!(gn->service = naf_strdup(gnr__module, service))) {
 		naf_free(gnr__module, gn->name);
-		naf_free(gnr__module, gn);
+		naf_slab_free(gnr__nodeslab, gn);
 		return NULL;
 	}
+	if (!(gn->canonname = gnr_node__canonname(name))) {
+		naf_free(gnr__module, gn->name);
+		naf_free(gnr__module, gn->service);
+		naf_slab_free(gnr__nodeslab, gn);
+		return NULL;
+	}
+	gn->namehash = hash;
 	gn->flags = flags;
 	gn->metric = metric;
 	gn->ownermod = owner;
@@ -412,8 +670,17 @@ struct gnrnode *gnr_node_online(struct nafmodule *owner, const char *name, const
 
 	if (gn->metric > GNR_NODE_METRIC_LOCAL)
 		gn->ttl = GNR_NODE_TTL_DEFAULT;
+	naf_timer_init(&gn->expiry, gnr__module, gnr_node__expire, (void *)gn);
+
+	if (gnr_node__hash_add(gn) == -1) {
+		naf_free(gnr__module, gn->name);
+		naf_free(gnr__module, gn->service);
+		naf_free(gnr__module, gn->canonname);
+		naf_slab_free(gnr__nodeslab, gn);
+		return NULL;
+	}
 
-	gnr_node__hash_add(gn);
+	gnr_node__expiry_update(gn);
 
 	gnr__nodestats.total++;
 	if (gn->metric == GNR_NODE_METRIC_LOCAL)
@@ -450,6 +717,22 @@ void gnr_node_usehit(struct gnrnode *gn)
 	return;
 }
 
+/*
+ * The owner can take messages for gn again, without it ever having gone
+ * offline (a new client picked up a prorogued session, say).  Anything
+ * that was delayed for it goes out now.
+ */
+void gnr_node_reattached(struct gnrnode *gn)
+{
+
+	if (!gn)
+		return;
+
+	gnr_delay__ready(gn);
+
+	return;
+}
+
 /* Remetric'ing is a complicated thing. It's probably broken. */
 int gnr_node_remetric(struct gnrnode *gn, int newmetric)
 {
@@ -487,6 +770,7 @@ int gnr_node_remetric(struct gnrnode *gn, int newmetric)
 
 
 	gnr_node_usehit(gn);
+	gnr_node__expiry_update(gn);
 
 	return 0;
 }
@@ -504,6 +788,7 @@ int gnr_node_setttl(struct gnrnode *gn, int newttl)
 		gn->ttl = GNR_NODE_TTL_DEFAULT;
 	else
 		gn->ttl = newttl;
+	gnr_node__expiry_update(gn);
 
 	return 0;
 }
@@ -643,7 +928,7 @@ static void __rpc_gnr_listnodes(struct nafmodule *mod, naf_rpc_req_t *req)
 		index = idx->data.scalar;
 
 		if (index != -1) {
-			if ((index >= GNR_NODE_HASH_SIZE) || (index < 0)) {
+			if ((index >= gnr_node__hash_nbuckets()) || (index < 0)) {
 				req->status = NAF_RPC_STATUS_INVALIDARGS;
 				return;
 			}
@@ -665,10 +950,10 @@ static void __rpc_gnr_listnodes(struct nafmodule *mod, naf_rpc_req_t *req)
 	}
 
 	if (index == -1) {
-		for (index = 0; index < GNR_NODE_HASH_SIZE; index++)
-			listnodes_putnodes(mod, head, gnr__nodehash[index], wanttags, -1);
+		for (index = 0; index < gnr_node__hash_nbuckets(); index++)
+			listnodes_putnodes(mod, head, *gnr_node__hash_bucket(index), wanttags, -1);
 	} else
-		listnodes_putnodes(mod, head, gnr__nodehash[index], wanttags, -1);
+		listnodes_putnodes(mod, head, *gnr_node__hash_bucket(index), wanttags, -1);
 
 	req->status = NAF_RPC_STATUS_SUCCESS;
 
@@ -726,18 +1011,14 @@ static void __rpc_gnr_getnodeinfo(struct nafmodule *mod, naf_rpc_req_t *req)
 }
 
 
-void gnr_node__timeout(struct nafmodule *mod)
-{
-
-	gnr_node__hash_timeout();
-
-	return;
-}
-
 int gnr_node__register(struct nafmodule *mod)
 {
 
-	gnr_node__hash_init();
+	if (gnr_node__hash_init() == -1)
+		return -1;
+
+	if (!(gnr__nodeslab = naf_slab_create(mod, "nodes", sizeof(struct gnrnode), GNR_NODE_SLABOBJS)))
+		return -1;
 
 	naf_stats_register_longstat(mod, "nodes.current.total", &gnr__nodestats.total);
 	naf_stats_register_longstat(mod, "nodes.current.local", &gnr__nodestats.local);
@@ -766,6 +1047,10 @@ int gnr_node__unregister(struct nafmodule *mod)
 	naf_stats_unregisterstat(mod, "nodes.current.external");
 
 	gnr_node__hash_free();
+	gnr_event__discard(); /* releases nodes held for it */
+
+	naf_slab_destroy(gnr__nodeslab);
+	gnr__nodeslab = NULL;
 
 	return 0;
 }
@@ -19,9 +19,14 @@
 #ifndef __NODE_H__
 #define __NODE_H__
 
+#include <gnr/gnrnode.h>
+
 int gnr_node__register(struct nafmodule *mod);
 int gnr_node__unregister(struct nafmodule *mod);
-void gnr_node__timeout(struct nafmodule *mod);
+
+char *gnr_node__canonname(const char *name);
+int gnr_node__canoneq(const char *canon, const char *name);
+void gnr_node__release(struct gnrnode *gn);
 
 #endif /* ndef __NODE_H__ */
 
@@ -0,0 +1,1178 @@
+/*
+ * gnr - Generic interNode message Routing
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * gnr is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * gnr is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * gnrpeer: routing between gnr instances.
+ *
+ * Each instance has a name, and links to the others over TCP: it connects
+ * out to everything listed in its peers option, and takes whatever comes
+ * in on a gnrpeer listener.  (If two instances list each other, they end up
+ * with two links; the one started by the instance with the lesser name is
+ * kept.)  The peers are expected to form a full mesh -- nothing is
+ * forwarded on to a third instance.
+ *
+ * Once a link is up, each side tells the other about all of its local nodes
+ * (except GNR_NODE_FLAG_LOCALONLY ones), and then about each one that comes
+ * or goes.  Those become peered nodes here, owned by this module, and last
+ * until the peer says they're gone or the link drops.  Since every instance
+ * knows about every node on its peers, a node that isn't in the directory
+ * isn't on any of them, so there's no need to ask around (or to remember
+ * negative answers).
+ *
+ * A message for a peered node is routed to it (GNR_MSG_ROUTEFLAG_ROUTED_PEER)
+ * and goes out over the link it was learned on.  On the other side it's
+ * routed again, as if it came from a local module, except that it's never
+ * sent back out to a peer.
+ *
+ * Everything on a link is a frame: a four byte header (magic, frame type,
+ * payload length), then the payload.  Integers are in network order, and
+ * strings are a 16 bit length followed by that many bytes, no NUL.
+ *
+ * All of the instances share a secret, and a link isn't used until each side
+ * has proven it knows it: the HELLO frames carry a random challenge, and each
+ * side answers the other's with an AUTH frame holding an HMAC-SHA256 of that
+ * challenge and both names.  Links are only taken from the addresses in the
+ * allow option and from peers given by address.  Nothing on a link is
+ * encrypted, though, so the listener belongs on a private network.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h> /* gethostname() */
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <naf/nafmodule.h>
+#include <naf/nafconn.h>
+#include <naf/nafconfig.h>
+#include <naf/nafrpc.h>
+#include <naf/naftimer.h>
+#include <naf/nafbufutils.h>
+
+#include <gnr/gnrmsg.h>
+#include <gnr/gnrnode.h>
+#include <gnr/gnrevents.h>
+#include "core.h"
+#include "hmac.h"
+#include "peer.h"
+
+#define GNRPEER_MAGIC 0x67
+#define GNRPEER_VERSION 0x0002
+#define GNRPEER_HDRLEN 4
+#define GNRPEER_MAXLEN 16384
+#define GNRPEER_BUFLEN (GNRPEER_HDRLEN + GNRPEER_MAXLEN)
+
+#define GNRPEER_HDR_MAGIC(x) naf_byte_get8(x)
+#define GNRPEER_HDR_TYPE(x) naf_byte_get8((x) + 1)
+#define GNRPEER_HDR_LEN(x) naf_byte_get16((x) + 2)
+
+#define GNRPEER_FRAME_HELLO    0x01 /* version, name, challenge */
+#define GNRPEER_FRAME_NODEUP   0x02 /* name, service */
+#define GNRPEER_FRAME_NODEDOWN 0x03 /* name, service */
+#define GNRPEER_FRAME_MSG      0x04 /* type, msgflags, then the strings (see gnrpeer__putmsg()) */
+#define GNRPEER_FRAME_AUTH     0x05 /* answer to the other side's challenge */
+
+#define GNRPEER_CHALLENGELEN 16
+#define GNRPEER_RANDOMSRC "/dev/urandom"
+
+/* Metric for the nodes we learn from peers; they're always one hop away. */
+#define GNRPEER_METRIC 1
+
+#define GNRPEER_RETRY_DEFAULT 10
+static int gnrpeer__retry = GNRPEER_RETRY_DEFAULT;
+#define GNRPEER_DEBUG_DEFAULT 0
+static int gnrpeer__debug = GNRPEER_DEBUG_DEFAULT;
+static char *gnrpeer__name = NULL;
+static char *gnrpeer__peers = NULL;
+static char *gnrpeer__secret = NULL;
+static struct in_addr *gnrpeer__allowed = NULL; /* allow, and peers by address */
+static int gnrpeer__nallowed = 0;
+static int gnrpeer__randomfd = -1;
+
+static struct nafmodule *gnrpeer__module = NULL;
+static naf_tagatom_t gnrpeer__atom_link = -1;
+static int gnrpeer__slot_link = -1;
+
+/* A peer from the peers option, which we keep a link to. */
+struct gnrpeer_remote {
+	char *addr; /* host:port */
+	naf_conn_cid_t cid; /* current link, or 0 */
+	struct naf_timer retry;
+	struct gnrpeer_remote *next;
+};
+static struct gnrpeer_remote *gnrpeer__remotes = NULL;
+
+/* Kept in each link's connection slot. */
+struct gnrpeer_link {
+	char *name; /* the peer's, once it's proven who it is */
+	char *hello; /* the name it claims, until then */
+	naf_u8_t challenge[GNRPEER_CHALLENGELEN]; /* the one we sent it */
+	int outgoing; /* we started it */
+	struct gnrpeer_remote *remote; /* restarted if it drops */
+	int nodes; /* learned over this link */
+};
+
+static struct gnrpeer_link *gnrpeer__link(struct nafconn *conn)
+{
+	return (struct gnrpeer_link *)naf_conn_extslot(conn, gnrpeer__slot_link);
+}
+
+
+static int gnrpeer__reqframe(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *buf)
+{
+	naf_u8_t *newbuf = NULL;
+
+	if (!buf && !(buf = newbuf = naf_malloc_type(mod, NAF_MEM_TYPE_NETBUF, GNRPEER_BUFLEN)))
+		return -1;
+
+	if (naf_conn_reqread(conn, buf, GNRPEER_HDRLEN, 0) == -1) {
+		naf_free(mod, newbuf);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int gnrpeer__startframe(struct nafmodule *mod, naf_sbuf_t *sb, naf_u8_t type, int len)
+{
+
+	if ((len > GNRPEER_MAXLEN) ||
+			(naf_sbuf_init(mod, sb, NULL, GNRPEER_HDRLEN + len) == -1))
+		return -1;
+
+	naf_sbuf_put8(sb, GNRPEER_MAGIC);
+	naf_sbuf_put8(sb, type);
+	naf_sbuf_put16(sb, len);
+
+	return 0;
+}
+
+/* Send the frame in sb, which is consumed either way. */
+static int gnrpeer__sendframe(struct nafmodule *mod, struct nafconn *conn, naf_sbuf_t *sb)
+{
+
+	if (naf_conn_reqwrite(conn, sb->sbuf_buf, sb->sbuf_pos) == -1) {
+		naf_sbuf_free(mod, sb);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int gnrpeer__strlen(const char *str)
+{
+	return 2 + (str ? strlen(str) : 0);
+}
+
+static void gnrpeer__putstr(naf_sbuf_t *sb, const char *str)
+{
+	int len = str ? strlen(str) : 0;
+
+	naf_sbuf_put16(sb, len);
+	if (len)
+		naf_sbuf_putraw(sb, (const naf_u8_t *)str, len);
+
+	return;
+}
+
+/*
+ * Point at the next string in sb, which isn't terminated.  Returns -1 if
+ * the frame is too short.
+ */
+static int gnrpeer__getstr(naf_sbuf_t *sb, const char **strret, int *lenret)
+{
+	int len;
+
+	if (naf_sbuf_bytesremaining(sb) < 2)
+		return -1;
+	len = naf_sbuf_get16(sb);
+	if (naf_sbuf_bytesremaining(sb) < len)
+		return -1;
+
+	*strret = (const char *)naf_sbuf_getposptr(sb);
+	*lenret = len;
+	naf_sbuf_advance(sb, len);
+
+	return 0;
+}
+
+/* Same, but copied into buf (of buflen bytes) and terminated. */
+static int gnrpeer__getstrbuf(naf_sbuf_t *sb, char *buf, int buflen)
+{
+	const char *str;
+	int len;
+
+	if ((gnrpeer__getstr(sb, &str, &len) == -1) || (len >= buflen))
+		return -1;
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+
+	return 0;
+}
+
+
+static int gnrpeer__random(struct nafmodule *mod, naf_u8_t *buf, int buflen)
+{
+
+	if ((gnrpeer__randomfd == -1) &&
+			((gnrpeer__randomfd = open(GNRPEER_RANDOMSRC, O_RDONLY)) == -1)) {
+		dvprintf(mod, "%s: %s\n", GNRPEER_RANDOMSRC, strerror(errno));
+		return -1;
+	}
+
+	if (read(gnrpeer__randomfd, buf, buflen) != buflen) {
+		dvprintf(mod, "%s: short read\n", GNRPEER_RANDOMSRC);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The answer to a challenge: HMAC(secret, challenge, from, to), where from
+ * is the side answering.  Putting the names in means an answer can't be
+ * bounced back at the side that made it.
+ */
+static void gnrpeer__answer(const naf_u8_t *challenge, const char *from, const char *to, naf_u8_t *out)
+{
+	struct gnr_hmac hm;
+	naf_u8_t len[2];
+
+	gnr_hmac_init(&hm, (const naf_u8_t *)gnrpeer__secret, strlen(gnrpeer__secret));
+	gnr_hmac_update(&hm, challenge, GNRPEER_CHALLENGELEN);
+	naf_byte_put16(len, strlen(from));
+	gnr_hmac_update(&hm, len, 2);
+	gnr_hmac_update(&hm, (const naf_u8_t *)from, strlen(from));
+	naf_byte_put16(len, strlen(to));
+	gnr_hmac_update(&hm, len, 2);
+	gnr_hmac_update(&hm, (const naf_u8_t *)to, strlen(to));
+	gnr_hmac_final(&hm, out);
+
+	return;
+}
+
+static int gnrpeer__sendhello(struct nafmodule *mod, struct nafconn *conn, struct gnrpeer_link *link)
+{
+	naf_sbuf_t sb;
+
+	if (gnrpeer__random(mod, link->challenge, GNRPEER_CHALLENGELEN) == -1)
+		return -1;
+
+	if (gnrpeer__startframe(mod, &sb, GNRPEER_FRAME_HELLO, 2 + gnrpeer__strlen(gnrpeer__name) + GNRPEER_CHALLENGELEN) == -1)
+		return -1;
+	naf_sbuf_put16(&sb, GNRPEER_VERSION);
+	gnrpeer__putstr(&sb, gnrpeer__name);
+	naf_sbuf_putraw(&sb, link->challenge, GNRPEER_CHALLENGELEN);
+
+	return gnrpeer__sendframe(mod, conn, &sb);
+}
+
+static int gnrpeer__sendauth(struct nafmodule *mod, struct nafconn *conn, struct gnrpeer_link *link, const naf_u8_t *challenge)
+{
+	naf_sbuf_t sb;
+	naf_u8_t mac[GNR_HMAC_LEN];
+
+	gnrpeer__answer(challenge, gnrpeer__name, link->hello, mac);
+
+	if (gnrpeer__startframe(mod, &sb, GNRPEER_FRAME_AUTH, GNR_HMAC_LEN) == -1)
+		return -1;
+	naf_sbuf_putraw(&sb, mac, GNR_HMAC_LEN);
+
+	return gnrpeer__sendframe(mod, conn, &sb);
+}
+
+static int gnrpeer__sendnode(struct nafmodule *mod, struct nafconn *conn, naf_u8_t type, struct gnrnode *gn)
+{
+	naf_sbuf_t sb;
+
+	if (gnrpeer__startframe(mod, &sb, type, gnrpeer__strlen(gn->name) + gnrpeer__strlen(gn->service)) == -1)
+		return -1;
+	gnrpeer__putstr(&sb, gn->name);
+	gnrpeer__putstr(&sb, gn->service);
+
+	return gnrpeer__sendframe(mod, conn, &sb);
+}
+
+/* Nodes we tell our peers about. */
+static int gnrpeer__isexported(struct gnrnode *gn)
+{
+	return (gn->metric == GNR_NODE_METRIC_LOCAL) &&
+			!(gn->flags & GNR_NODE_FLAG_LOCALONLY);
+}
+
+static int gnrpeer__dumpnodes__matcher(struct nafmodule *mod, struct gnrnode *gn, const void *data)
+{
+
+	if (gnrpeer__isexported(gn))
+		gnrpeer__sendnode(mod, (struct nafconn *)data, GNRPEER_FRAME_NODEUP, gn);
+
+	return 0; /* keep going */
+}
+
+struct gnrpeer_nodebcast {
+	naf_u8_t type;
+	struct gnrnode *gn;
+};
+
+static int gnrpeer__nodebcast__matcher(struct nafmodule *mod, struct nafconn *conn, const void *data)
+{
+	const struct gnrpeer_nodebcast *nb = (const struct gnrpeer_nodebcast *)data;
+	struct gnrpeer_link *link;
+
+	if ((link = gnrpeer__link(conn)) && link->name)
+		gnrpeer__sendnode(mod, conn, nb->type, nb->gn);
+
+	return 0; /* keep going */
+}
+
+static void gnrpeer__nodeevent(struct nafmodule *mod, struct gnr_event_info *gei)
+{
+	struct gnrpeer_nodebcast nb;
+
+	if (!gei->gei_node || !gnrpeer__isexported(gei->gei_node))
+		return;
+
+	nb.type = (gei->gei_event == GNR_EVENT_NODEUP) ? GNRPEER_FRAME_NODEUP : GNRPEER_FRAME_NODEDOWN;
+	nb.gn = gei->gei_node;
+	naf_conn_findbyowner(mod, mod, gnrpeer__nodebcast__matcher, &nb);
+
+	return;
+}
+
+
+/* The link a peered node was learned on, if it's one of ours. */
+static naf_conn_cid_t gnrpeer__nodelink(struct nafmodule *mod, struct gnrnode *gn)
+{
+	naf_conn_cid_t cid = 0;
+
+	if (!gn || (gn->ownermod != mod))
+		return 0;
+	if (gnr_node_tag_fetchatom(mod, gn, gnrpeer__atom_link, NULL, (void **)&cid) == -1)
+		return 0;
+
+	return cid;
+}
+
+static void gnrpeer__handlenodeup(struct nafmodule *mod, struct nafconn *conn, struct gnrpeer_link *link, const char *name, const char *service)
+{
+	struct gnrnode *gn;
+	struct nafconn *oldconn;
+	naf_conn_cid_t oldcid;
+
+	if ((gn = gnr_node_findbyname(name, service))) {
+
+		if (gn->metric == GNR_NODE_METRIC_LOCAL) {
+			if (gnrpeer__debug > 0)
+				dvprintf(mod, "[cid %lu] %s says %s[%s] is there, but it's here\n", conn->cid, link->name, name, service);
+			return;
+		}
+
+		/* We only knew of it from the outside; the peer knows better. */
+		if (gn->ownermod != mod) {
+			gnr_node_offline(gn, GNR_NODE_OFFLINE_REASON_UNKNOWN);
+			gn = NULL;
+		}
+	}
+
+	if (gn) {
+		/* Moved from one peer to another, or relearned on a new link. */
+		if ((oldcid = gnrpeer__nodelink(mod, gn)) == conn->cid)
+			return;
+		if ((oldconn = naf_conn_findbycid(mod, oldcid)) && gnrpeer__link(oldconn))
+			gnrpeer__link(oldconn)->nodes--;
+		gnr_node_tag_removeatom(mod, gn, gnrpeer__atom_link, NULL, NULL);
+		gnr_node_tag_addatom(mod, gn, gnrpeer__atom_link, 'I', (void *)conn->cid);
+		link->nodes++;
+		return;
+	}
+
+	if (!(gn = gnr_node_online(mod, name, service, GNR_NODE_FLAG_NONE, GNRPEER_METRIC)))
+		return;
+	if (gnr_node_tag_addatom(mod, gn, gnrpeer__atom_link, 'I', (void *)conn->cid) == -1) {
+		gnr_node_offline(gn, GNR_NODE_OFFLINE_REASON_UNKNOWN);
+		return;
+	}
+	gnr_node_ref(mod, gn); /* it lasts as long as the peer says so */
+	link->nodes++;
+
+	if (gnrpeer__debug > 1)
+		dvprintf(mod, "[cid %lu] %s[%s] is on %s\n", conn->cid, name, service, link->name);
+
+	return;
+}
+
+static void gnrpeer__handlenodedown(struct nafmodule *mod, struct nafconn *conn, struct gnrpeer_link *link, const char *name, const char *service)
+{
+	struct gnrnode *gn;
+
+	if (!(gn = gnr_node_findbyname(name, service)) ||
+			(gnrpeer__nodelink(mod, gn) != conn->cid))
+		return;
+
+	link->nodes--;
+	gnr_node_unref(mod, gn);
+	gnr_node_offline(gn, GNR_NODE_OFFLINE_REASON_DISCONNECTED);
+
+	return;
+}
+
+static int gnrpeer__linkdown__matcher(struct nafmodule *mod, struct gnrnode *gn, const void *data)
+{
+	naf_conn_cid_t cid = (naf_conn_cid_t)data;
+
+	if (gnrpeer__nodelink(mod, gn) != cid)
+		return 0;
+
+	gnr_node_unref(mod, gn);
+
+	return 1; /* take it offline */
+}
+
+struct gnrpeer_findlink {
+	const char *name;
+	struct nafconn *except;
+};
+
+static int gnrpeer__findlink__matcher(struct nafmodule *mod, struct nafconn *conn, const void *data)
+{
+	const struct gnrpeer_findlink *fl = (const struct gnrpeer_findlink *)data;
+	struct gnrpeer_link *link;
+
+	if ((conn == fl->except) || !(link = gnrpeer__link(conn)) || !link->name)
+		return 0;
+
+	return strcmp(link->name, fl->name) == 0;
+}
+
+/*
+ * Of two links between the same pair of instances, keep the one started by
+ * the instance with the lesser name (or, if they were started from the same
+ * side, the newer one).  Returns nonzero if conn should be dropped.
+ *
+ * Whichever one goes, if it was one we're supposed to keep up, the one that
+ * stays takes its place, so it isn't just started up again.
+ */
+static int gnrpeer__isduplicate(struct nafmodule *mod, struct nafconn *conn, struct gnrpeer_link *link)
+{
+	struct gnrpeer_findlink fl;
+	struct nafconn *other;
+	struct gnrpeer_link *otherlink, *droplink, *keeplink;
+	naf_conn_cid_t keepcid;
+	const char *mine, *theirs;
+
+	fl.name = link->name;
+	fl.except = conn;
+	if (!(other = naf_conn_findbyowner(mod, mod, gnrpeer__findlink__matcher, &fl)))
+		return 0;
+	otherlink = gnrpeer__link(other);
+
+	mine = link->outgoing ? gnrpeer__name : link->name;
+	theirs = otherlink->outgoing ? gnrpeer__name : otherlink->name;
+
+	if (strcmp(mine, theirs) <= 0) {
+		droplink = otherlink;
+		keeplink = link;
+		keepcid = conn->cid;
+	} else {
+		droplink = link;
+		keeplink = otherlink;
+		keepcid = other->cid;
+	}
+
+	if (droplink->remote && !keeplink->remote) {
+		keeplink->remote = droplink->remote;
+		keeplink->remote->cid = keepcid;
+	}
+	droplink->remote = NULL;
+
+	if (droplink == link)
+		return 1;
+
+	naf_conn_schedulekill(other);
+
+	return 0;
+}
+
+static int gnrpeer__handlehello(struct nafmodule *mod, struct nafconn *conn, struct gnrpeer_link *link, naf_sbuf_t *sb)
+{
+	char name[GNR_NODE_NAME_MAXLEN+1];
+	naf_u16_t version;
+
+	if (link->name || link->hello)
+		return -1; /* only once */
+
+	if (naf_sbuf_bytesremaining(sb) < 2)
+		return -1;
+	if ((version = naf_sbuf_get16(sb)) != GNRPEER_VERSION) {
+		dvprintf(mod, "[cid %lu] peer speaks version %u, not %u\n", conn->cid, version, GNRPEER_VERSION);
+		return -1;
+	}
+	if ((gnrpeer__getstrbuf(sb, name, sizeof(name)) == -1) || !strlen(name) ||
+			(naf_sbuf_bytesremaining(sb) < GNRPEER_CHALLENGELEN))
+		return -1;
+
+	if (strcmp(name, gnrpeer__name) == 0) {
+		dvprintf(mod, "[cid %lu] connected to ourself\n", conn->cid);
+		return -1;
+	}
+
+	if (!(link->hello = naf_strdup(mod, name)))
+		return -1;
+
+	return gnrpeer__sendauth(mod, conn, link, naf_sbuf_getposptr(sb));
+}
+
+static int gnrpeer__handleauth(struct nafmodule *mod, struct nafconn *conn, struct gnrpeer_link *link, naf_sbuf_t *sb)
+{
+	naf_u8_t mac[GNR_HMAC_LEN];
+
+	if (!link->hello || (naf_sbuf_bytesremaining(sb) < GNR_HMAC_LEN))
+		return -1;
+
+	gnrpeer__answer(link->challenge, link->hello, gnrpeer__name, mac);
+	if (!gnr_hmac_equal(mac, naf_sbuf_getposptr(sb))) {
+		dvprintf(mod, "[cid %lu] %s doesn't know the secret\n", conn->cid, link->hello);
+		return -1;
+	}
+
+	link->name = link->hello;
+	link->hello = NULL;
+
+	if (gnrpeer__isduplicate(mod, conn, link)) {
+		if (gnrpeer__debug > 0)
+			dvprintf(mod, "[cid %lu] already linked to %s\n", conn->cid, link->name);
+		return -1;
+	}
+
+	if (gnrpeer__debug > 0)
+		dvprintf(mod, "[cid %lu] linked to %s\n", conn->cid, link->name);
+
+	gnr_node_find(mod, gnrpeer__dumpnodes__matcher, conn);
+
+	return 0;
+}
+
+static int gnrpeer__handlemsg(struct nafmodule *mod, struct nafconn *conn, struct gnrpeer_link *link, naf_sbuf_t *sb)
+{
+	struct gnrmsg *gm;
+	char **strs[7];
+	int i;
+
+	if (naf_sbuf_bytesremaining(sb) < 6)
+		return -1;
+
+	if (!(gm = gnr_msg_new(mod)))
+		return 0;
+	gm->type = naf_sbuf_get16(sb);
+	gm->msgflags = naf_sbuf_get32(sb);
+
+	strs[0] = &gm->srcname;
+	strs[1] = &gm->srcnameservice;
+	strs[2] = &gm->destname;
+	strs[3] = &gm->destnameservice;
+	strs[4] = &gm->msgtexttype;
+	strs[5] = &gm->msgtext;
+	strs[6] = &gm->groupname;
+	for (i = 0; i < 7; i++) {
+		const char *str;
+		int len;
+
+		if (gnrpeer__getstr(sb, &str, &len) == -1) {
+			gnr_msg_free(mod, gm);
+			return -1;
+		}
+		if (!len)
+			continue; /* NULL */
+		if (!(*strs[i] = gnr_msg_alloc(gm, len + 1))) {
+			gnr_msg_free(mod, gm);
+			return 0;
+		}
+		memcpy(*strs[i], str, len);
+		(*strs[i])[len] = '\0';
+	}
+
+	/* A peer can only speak for the nodes it told us about. */
+	if (gnrpeer__nodelink(mod, gnr_node_findbyname(gm->srcname, gm->srcnameservice)) != conn->cid) {
+		if (gnrpeer__debug > 0)
+			dvprintf(mod, "[cid %lu] dropping message from %s[%s], which isn't on %s\n", conn->cid, gm->srcname ? gm->srcname : "(none)", gm->srcnameservice ? gm->srcnameservice : "(none)", link->name);
+		gnr_msg_free(mod, gm);
+		return 0;
+	}
+
+	if (gnr_msg_enqueue(mod, gm, gnr_msg_free) == -1)
+		gnr_msg_free(mod, gm);
+
+	return 0;
+}
+
+static int gnrpeer__handleframe(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *buf, int buflen)
+{
+	struct gnrpeer_link *link;
+	char name[GNR_NODE_NAME_MAXLEN+1], service[GNR_NODE_NAME_MAXLEN+1];
+	naf_sbuf_t sb;
+	naf_u8_t type = GNRPEER_HDR_TYPE(buf);
+
+	if (!(link = gnrpeer__link(conn)))
+		return -1;
+
+	naf_sbuf_init(mod, &sb, buf + GNRPEER_HDRLEN, buflen - GNRPEER_HDRLEN);
+
+	if (type == GNRPEER_FRAME_HELLO)
+		return gnrpeer__handlehello(mod, conn, link, &sb);
+	if (type == GNRPEER_FRAME_AUTH)
+		return link->name ? -1 : gnrpeer__handleauth(mod, conn, link, &sb);
+
+	if (!link->name)
+		return -1; /* has to prove who it is first */
+
+	if ((type == GNRPEER_FRAME_NODEUP) || (type == GNRPEER_FRAME_NODEDOWN)) {
+
+		if ((gnrpeer__getstrbuf(&sb, name, sizeof(name)) == -1) ||
+				(gnrpeer__getstrbuf(&sb, service, sizeof(service)) == -1))
+			return -1;
+
+		if (type == GNRPEER_FRAME_NODEUP)
+			gnrpeer__handlenodeup(mod, conn, link, name, service);
+		else
+			gnrpeer__handlenodedown(mod, conn, link, name, service);
+
+		return 0;
+
+	} else if (type == GNRPEER_FRAME_MSG)
+		return gnrpeer__handlemsg(mod, conn, link, &sb);
+
+	if (gnrpeer__debug > 0)
+		dvprintf(mod, "[cid %lu] ignoring unknown frame type 0x%02x\n", conn->cid, type);
+
+	return 0;
+}
+
+static int gnrpeer__handleread(struct nafmodule *mod, struct nafconn *conn)
+{
+	naf_u8_t *buf;
+	int buflen;
+
+	if (naf_conn_takeread(conn, &buf, &buflen) == -1)
+		return -1;
+
+	if ((GNRPEER_HDR_MAGIC(buf) != GNRPEER_MAGIC) ||
+			(GNRPEER_HDR_LEN(buf) > GNRPEER_MAXLEN)) {
+		dvprintf(mod, "[cid %lu] invalid frame from peer\n", conn->cid);
+		goto errout;
+	}
+
+	if (buflen != (GNRPEER_HDR_LEN(buf) + GNRPEER_HDRLEN)) {
+		if (naf_conn_reqread(conn, buf, GNRPEER_HDRLEN + GNRPEER_HDR_LEN(buf), buflen) == -1)
+			goto errout;
+		return 0; /* continue later */
+	}
+
+	if (gnrpeer__handleframe(mod, conn, buf, buflen) == -1)
+		goto errout;
+
+	if (gnrpeer__reqframe(mod, conn, buf) == -1)
+		goto errout;
+
+	return 0;
+errout:
+	naf_free(mod, buf);
+	return -1;
+}
+
+
+static int gnrpeer__msgrouting(struct nafmodule *mod, int stage, struct gnrmsg *gm, struct gnrmsg_handler_info *gmhi)
+{
+
+	/* Peers are a full mesh, so anything from one stays here. */
+	if (gmhi->srcmod == mod)
+		return 0;
+
+	if (!gmhi->destnode || !gnrpeer__nodelink(mod, gmhi->destnode))
+		return 0;
+
+	gm->routeflags |= GNR_MSG_ROUTEFLAG_ROUTED_PEER;
+
+	return 1;
+}
+
+static int gnrpeer__outputfunc(struct nafmodule *mod, struct gnrmsg *gm, struct gnrmsg_handler_info *gmhi)
+{
+	struct nafconn *conn;
+	naf_sbuf_t sb;
+	int len;
+
+	if (!(conn = naf_conn_findbycid(mod, gnrpeer__nodelink(mod, gmhi->destnode))))
+		return -1;
+
+	len = 2 + 4 +
+		gnrpeer__strlen(gm->srcname) + gnrpeer__strlen(gm->srcnameservice) +
+		gnrpeer__strlen(gm->destname) + gnrpeer__strlen(gm->destnameservice) +
+		gnrpeer__strlen(gm->msgtexttype) + gnrpeer__strlen(gm->msgtext) +
+		gnrpeer__strlen(gm->groupname);
+	if (gnrpeer__startframe(mod, &sb, GNRPEER_FRAME_MSG, len) == -1) {
+		if (gnrpeer__debug > 0)
+			dvprintf(mod, "[cid %lu] unable to send %d byte message to %s[%s]\n", conn->cid, len, gm->destname, gm->destnameservice);
+		return -1;
+	}
+	naf_sbuf_put16(&sb, gm->type);
+	naf_sbuf_put32(&sb, gm->msgflags);
+	gnrpeer__putstr(&sb, gm->srcname);
+	gnrpeer__putstr(&sb, gm->srcnameservice);
+	gnrpeer__putstr(&sb, gm->destname);
+	gnrpeer__putstr(&sb, gm->destnameservice);
+	gnrpeer__putstr(&sb, gm->msgtexttype);
+	gnrpeer__putstr(&sb, gm->msgtext);
+	gnrpeer__putstr(&sb, gm->groupname);
+
+	return gnrpeer__sendframe(mod, conn, &sb);
+}
+
+
+static void gnrpeer__connectremote(struct nafmodule *mod, struct naf_timer *timer, void *data)
+{
+	struct gnrpeer_remote *rem = (struct gnrpeer_remote *)data;
+	struct nafconn *conn;
+	struct gnrpeer_link *link;
+
+	if (rem->cid && naf_conn_findbycid(mod, rem->cid))
+		return;
+	rem->cid = 0;
+
+	if (gnrpeer__debug > 0)
+		dvprintf(mod, "connecting to peer %s\n", rem->addr);
+
+	if (!(conn = naf_conn_connect(mod, rem->addr, GNRPEER_DEFAULTPORT, 0)) ||
+			!(link = gnrpeer__link(conn))) {
+		if (conn)
+			naf_conn_schedulekill(conn);
+		naf_timer_arm(&rem->retry, gnrpeer__retry * 1000);
+		return;
+	}
+	link->outgoing = 1;
+	link->remote = rem;
+	rem->cid = conn->cid;
+
+	return;
+}
+
+static void gnrpeer__freeremotes(struct nafmodule *mod)
+{
+	struct gnrpeer_remote *rem;
+	struct nafconn *conn;
+
+	while ((rem = gnrpeer__remotes)) {
+		gnrpeer__remotes = rem->next;
+
+		/* The link can stay up, but won't be restarted. */
+		if (rem->cid && (conn = naf_conn_findbycid(mod, rem->cid)) && gnrpeer__link(conn))
+			gnrpeer__link(conn)->remote = NULL;
+		naf_timer_cancel(&rem->retry);
+		naf_free(mod, rem->addr);
+		naf_free(mod, rem);
+	}
+
+	return;
+}
+
+static void gnrpeer__setremotes(struct nafmodule *mod, const char *peers)
+{
+	char *list, *addr, *next;
+
+	gnrpeer__freeremotes(mod);
+
+	if (!peers || !(list = naf_strdup(mod, peers)))
+		return;
+
+	for (addr = list; addr; addr = next) {
+		struct gnrpeer_remote *rem;
+
+		if ((next = strchr(addr, ',')))
+			*(next++) = '\0';
+		while (*addr == ' ')
+			addr++;
+		if (!strlen(addr))
+			continue;
+
+		if (!(rem = naf_malloc(mod, sizeof(struct gnrpeer_remote))))
+			break;
+		memset(rem, 0, sizeof(struct gnrpeer_remote));
+		if (!(rem->addr = naf_strdup(mod, addr))) {
+			naf_free(mod, rem);
+			break;
+		}
+		naf_timer_init(&rem->retry, mod, gnrpeer__connectremote, (void *)rem);
+		naf_timer_arm(&rem->retry, 0);
+
+		rem->next = gnrpeer__remotes;
+		gnrpeer__remotes = rem;
+	}
+
+	naf_free(mod, list);
+
+	return;
+}
+
+static int gnrpeer__countaddrs(const char *addrs)
+{
+	int n = 1;
+
+	if (!addrs)
+		return 0;
+	while ((addrs = strchr(addrs, ','))) {
+		addrs++;
+		n++;
+	}
+
+	return n;
+}
+
+static void gnrpeer__addallowed(struct nafmodule *mod, struct in_addr *allowed, int *nallowed, const char *addrs)
+{
+	char *list, *addr, *next, *port;
+
+	if (!addrs || !(list = naf_strdup(mod, addrs)))
+		return;
+
+	for (addr = list; addr; addr = next) {
+
+		if ((next = strchr(addr, ',')))
+			*(next++) = '\0';
+		while (*addr == ' ')
+			addr++;
+		if ((port = strchr(addr, ':')))
+			*port = '\0';
+
+		/* Peers given by hostname have to be in allow, too. */
+		if (inet_pton(AF_INET, addr, &allowed[*nallowed]) == 1)
+			(*nallowed)++;
+	}
+
+	naf_free(mod, list);
+
+	return;
+}
+
+static void gnrpeer__setallowed(struct nafmodule *mod, const char *allow, const char *peers)
+{
+	struct in_addr *allowed;
+	int nallowed = 0;
+
+	if ((allowed = naf_malloc(mod, (gnrpeer__countaddrs(allow) + gnrpeer__countaddrs(peers) + 1) * sizeof(struct in_addr)))) {
+		gnrpeer__addallowed(mod, allowed, &nallowed, allow);
+		gnrpeer__addallowed(mod, allowed, &nallowed, peers);
+	}
+
+	naf_free(mod, gnrpeer__allowed);
+	gnrpeer__allowed = allowed;
+	gnrpeer__nallowed = nallowed;
+
+	return;
+}
+
+static int gnrpeer__isallowed(struct in_addr addr)
+{
+	int i;
+
+	for (i = 0; i < gnrpeer__nallowed; i++) {
+		if (gnrpeer__allowed[i].s_addr == addr.s_addr)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * gnrpeer->listpeers()
+ * IN:
+ *    None.
+ *
+ * OUT:
+ *    array peers {
+ *       array <name> {
+ *          scalar cid;
+ *          scalar nodes;
+ *          bool outgoing;
+ *          string remote; (if it's restarted when it drops)
+ *       }
+ *    }
+ */
+static int gnrpeer__listpeers__matcher(struct nafmodule *mod, struct nafconn *conn, const void *data)
+{
+	naf_rpc_arg_t **head = (naf_rpc_arg_t **)data, **plink;
+	struct gnrpeer_link *link;
+
+	if (!(link = gnrpeer__link(conn)) || !link->name)
+		return 0;
+
+	if ((plink = naf_rpc_addarg_array(mod, head, link->name))) {
+		naf_rpc_addarg_scalar(mod, plink, "cid", conn->cid);
+		naf_rpc_addarg_scalar(mod, plink, "nodes", link->nodes);
+		if (link->remote)
+			naf_rpc_addarg_string(mod, plink, "remote", link->remote->addr);
+		naf_rpc_addarg_bool(mod, plink, "outgoing", link->outgoing);
+	}
+
+	return 0; /* keep going */
+}
+
+static void __rpc_gnrpeer_listpeers(struct nafmodule *mod, naf_rpc_req_t *req)
+{
+	naf_rpc_arg_t **head;
+
+	if ((head = naf_rpc_addarg_array(mod, &req->returnargs, "peers")))
+		naf_conn_findbyowner(mod, mod, gnrpeer__listpeers__matcher, head);
+
+	req->status = NAF_RPC_STATUS_SUCCESS;
+
+	return;
+}
+
+
+static int takeconn(struct nafmodule *mod, struct nafconn *conn)
+{
+	struct gnrpeer_link *link;
+
+	conn->type &= ~NAF_CONN_TYPE_DETECTING;
+
+	if (!(link = gnrpeer__link(conn)))
+		return -1;
+
+	if (!gnrpeer__secret) {
+		if (gnrpeer__debug > 0)
+			dvprintf(mod, "[cid %lu] no secret set; refusing link\n", conn->cid);
+		naf_conn_schedulekill(conn);
+		return -1;
+	}
+
+	if ((conn->type & NAF_CONN_TYPE_CLIENT) && !gnrpeer__isallowed(conn->remoteendpoint.sin_addr)) {
+		dvprintf(mod, "[cid %lu] refusing link from %s, which isn't in allow or peers\n", conn->cid, inet_ntoa(conn->remoteendpoint.sin_addr));
+		naf_conn_schedulekill(conn);
+		return -1;
+	}
+
+	if ((gnrpeer__sendhello(mod, conn, link) == -1) ||
+			(gnrpeer__reqframe(mod, conn, NULL) == -1)) {
+		naf_conn_schedulekill(conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int connready(struct nafmodule *mod, struct nafconn *conn, naf_u16_t what)
+{
+
+	if (what & NAF_CONN_READY_READ) {
+		if (gnrpeer__handleread(mod, conn) == -1)
+			return -1;
+	}
+
+	if (what & NAF_CONN_READY_WRITE) {
+		naf_u8_t *buf;
+		int buflen;
+
+		if (naf_conn_takewrite(conn, &buf, &buflen) == -1)
+			return -1;
+		naf_free(mod, buf);
+	}
+
+	return 0;
+}
+
+static void connkill(struct nafmodule *mod, struct nafconn *conn)
+{
+	struct gnrpeer_link *link;
+
+	if (!(link = gnrpeer__link(conn)))
+		return;
+
+	if (link->name) {
+		if (gnrpeer__debug > 0)
+			dvprintf(mod, "[cid %lu] lost link to %s\n", conn->cid, link->name);
+		gnr_node_offline_many(mod, gnrpeer__linkdown__matcher, (void *)conn->cid, GNR_NODE_OFFLINE_REASON_DISCONNECTED);
+		naf_free(mod, link->name);
+		link->name = NULL;
+	}
+	naf_free(mod, link->hello);
+	link->hello = NULL;
+
+	if (link->remote && (link->remote->cid == conn->cid)) {
+		link->remote->cid = 0;
+		naf_timer_arm(&link->remote->retry, gnrpeer__retry * 1000);
+	}
+	link->remote = NULL;
+
+	return;
+}
+
+static void freetag(struct nafmodule *mod, void *object, const char *tagname, char tagtype, void *tagdata)
+{
+
+	if (strcmp(tagname, "gnrnode.peerlink") == 0)
+		; /* a cid */
+	else
+		dvprintf(mod, "freetag: unknown tag '%s'\n", tagname);
+
+	return;
+}
+
+static void signalhandler(struct nafmodule *mod, struct nafmodule *source, int signum)
+{
+
+	if (signum == NAF_SIGNAL_CONFCHANGE) {
+		char *peers = NULL, *name = NULL, *allow = NULL;
+		int hadsecret = !!gnrpeer__secret;
+
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "debug",
+					      gnrpeer__debug, GNRPEER_DEBUG_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "retry",
+					      gnrpeer__retry, GNRPEER_RETRY_DEFAULT);
+		if (gnrpeer__retry < 1)
+			gnrpeer__retry = 1;
+
+		/* The name can't change under links that are already up. */
+		if (!gnrpeer__name) {
+			char host[256];
+
+			NAFCONFIG_UPDATESTRMODPARMDEF(mod, "name", name, NULL);
+			if (!name && (gethostname(host, sizeof(host)) == 0)) {
+				host[sizeof(host) - 1] = '\0';
+				name = naf_strdup(mod, host);
+			}
+			gnrpeer__name = name;
+		}
+
+		NAFCONFIG_UPDATESTRMODPARMDEF(mod, "secret", gnrpeer__secret, NULL);
+		if (gnrpeer__secret && !strlen(gnrpeer__secret)) {
+			naf_free(mod, gnrpeer__secret);
+			gnrpeer__secret = NULL;
+		}
+		if (!gnrpeer__secret)
+			dprintf(mod, "no secret set; refusing all peer links\n");
+
+		NAFCONFIG_UPDATESTRMODPARMDEF(mod, "peers", peers, NULL);
+		if (!gnrpeer__name || !gnrpeer__secret)
+			; /* can't say hello */
+		else if (!hadsecret || !peers != !gnrpeer__peers ||
+				(peers && (strcmp(peers, gnrpeer__peers) != 0))) {
+			gnrpeer__setremotes(mod, peers);
+			naf_free(mod, gnrpeer__peers);
+			gnrpeer__peers = peers;
+			peers = NULL;
+		}
+		naf_free(mod, peers);
+
+		NAFCONFIG_UPDATESTRMODPARMDEF(mod, "allow", allow, NULL);
+		gnrpeer__setallowed(mod, allow, gnrpeer__peers);
+		naf_free(mod, allow);
+	}
+
+	return;
+}
+
+static int modinit(struct nafmodule *mod)
+{
+
+	gnrpeer__module = mod;
+
+	if ((gnrpeer__atom_link = naf_tag_atom("gnrnode.peerlink")) == -1)
+		return -1;
+	if ((gnrpeer__slot_link = naf_conn_extslot_register(mod, sizeof(struct gnrpeer_link))) == -1)
+		return -1;
+
+	naf_module_addprotosig(mod, (const naf_u8_t *)"\x67\x01", 2);
+
+	if (gnr_msg_register(mod, gnrpeer__outputfunc) == -1) {
+		dprintf(mod, "modinit: gnr_msg_register failed\n");
+		return -1;
+	}
+	gnr_msg_addmsghandler(mod, GNR_MSG_MSGHANDLER_STAGE_ROUTING, 60, gnrpeer__msgrouting, "Route to nodes on peers");
+	gnr_event_register(mod, gnrpeer__nodeevent, GNR_EVENT_NODEUP | GNR_EVENT_NODEDOWN);
+
+	naf_rpc_register_method(mod, "listpeers", __rpc_gnrpeer_listpeers, "List linked peers");
+
+	return 0;
+}
+
+static int modshutdown(struct nafmodule *mod)
+{
+
+	naf_rpc_unregister_method(mod, "listpeers");
+
+	gnr_event_unregister(mod, gnrpeer__nodeevent);
+	gnr_msg_remmsghandler(mod, GNR_MSG_MSGHANDLER_STAGE_ROUTING, gnrpeer__msgrouting);
+	gnr_msg_unregister(mod);
+
+	gnrpeer__freeremotes(mod);
+	naf_free(mod, gnrpeer__peers);
+	gnrpeer__peers = NULL;
+	naf_free(mod, gnrpeer__name);
+	gnrpeer__name = NULL;
+	naf_free(mod, gnrpeer__secret);
+	gnrpeer__secret = NULL;
+	naf_free(mod, gnrpeer__allowed);
+	gnrpeer__allowed = NULL;
+	gnrpeer__nallowed = 0;
+
+	if (gnrpeer__randomfd != -1) {
+		close(gnrpeer__randomfd);
+		gnrpeer__randomfd = -1;
+	}
+
+	gnrpeer__module = NULL;
+
+	return 0;
+}
+
+static int modfirst(struct nafmodule *mod)
+{
+
+	naf_module_setname(mod, "gnrpeer");
+	mod->init = modinit;
+	mod->shutdown = modshutdown;
+	mod->signal = signalhandler;
+	mod->freetag = freetag;
+	mod->takeconn = takeconn;
+	mod->connready = connready;
+	mod->connkill = connkill;
+
+	return 0;
+}
+
+int gnr_peer__register(void)
+{
+	return naf_module__registerresident("gnrpeer", modfirst, NAF_MODULE_PRI_THIRDPASS);
+}
@@ -55,6 +55,22 @@ typedef void (*gnr_eventhandlerfunc_t)(struct nafmodule *, struct gnr_event_info
 int gnr_event_register(struct nafmodule *mod, gnr_eventhandlerfunc_t evfunc, gnr_event_t evmask);
 int gnr_event_unregister(struct nafmodule *mod, gnr_eventhandlerfunc_t func);
 
+/*
+ * Deferred delivery.  Events for a batch handler are held until the end of
+ * the current pass of the main loop, and then handed over all at once, in
+ * the order they happened.  Events for the same node are coalesced first:
+ * a node that comes up and goes down again in the same pass produces
+ * nothing at all, and any number of flag changes become one (or none, if
+ * the node also came up or went down).
+ *
+ * gei_node is still valid while the batch handler runs, even for a
+ * NODEDOWN, but only as something to look at; it's already offline.
+ */
+typedef void (*gnr_eventbatchfunc_t)(struct nafmodule *, int count, struct gnr_event_info **geis);
+
+int gnr_event_register_batch(struct nafmodule *mod, gnr_eventbatchfunc_t batchfunc, gnr_event_t evmask);
+int gnr_event_unregister_batch(struct nafmodule *mod, gnr_eventbatchfunc_t batchfunc);
+
 
 #endif /* ndef __GNR_EVENTS_H__ */
 
@@ -38,6 +38,12 @@ typedef naf_u16_t gnrmsg_msgtype_t;
 #define GNR_MSG_MSGTYPE_GROUPPART    (gnrmsg_msgtype_t) 0x0004
 #define GNR_MSG_MSGTYPE_RENDEZVOUS   (gnrmsg_msgtype_t) 0x0005
 
+#define GNR_MSG_MSGTYPE_MAX          GNR_MSG_MSGTYPE_RENDEZVOUS
+
+/* Sets of message types, for gnr_msg_addmsghandler_filtered() */
+#define GNR_MSG_TYPEMASK(t)          ((naf_u32_t)1 << (t))
+#define GNR_MSG_TYPEMASK_ALL         ((naf_u32_t)0xffffffff)
+
 typedef naf_u32_t gnrmsg_msgflag_t;
 #define GNR_MSG_MSGFLAG_NONE         (gnrmsg_msgflag_t) 0x00000000
 #define GNR_MSG_MSGFLAG_AUTORESPONSE (gnrmsg_msgflag_t) 0x00000001
@@ -107,6 +113,8 @@ struct gnrmsg {
 
 	void *taglist;
 
+	void *arena; /* private to gnr; see gnr_msg_alloc() */
+
 };
 
 struct gnrmsg *gnr_msg_new(struct nafmodule *mod);
@@ -114,12 +122,39 @@ void gnr_msg_free(struct nafmodule *mod, struct gnrmsg *gm);
 
 int gnr_msg_route(struct nafmodule *srcmod, struct gnrmsg *gm);
 
+/*
+ * Memory that belongs to a message, and is all freed at once by
+ * gnr_msg_free().  gnr_msg_adopt() hands over a buffer allocated with
+ * naf_malloc(mod, ...), so that fields can point into it without copying.
+ */
+void *gnr_msg_alloc(struct gnrmsg *gm, int len);
+char *gnr_msg_strdup(struct gnrmsg *gm, const char *str);
+int gnr_msg_adopt(struct nafmodule *mod, struct gnrmsg *gm, void *buf);
+
+/*
+ * Route gm later in the same pass of the main loop, along with everything
+ * else queued, if the routequeue option is on (otherwise, right now).  gnr
+ * takes ownership and calls releasefunc to free the message once it's been
+ * routed, so whatever it points to must stay valid until then.  On failure
+ * (-1), the caller still owns it.
+ */
+typedef void (*gnrmsg_releasefunc_t)(struct nafmodule *mod, struct gnrmsg *gm);
+int gnr_msg_enqueue(struct nafmodule *srcmod, struct gnrmsg *gm, gnrmsg_releasefunc_t releasefunc);
+
 int gnr_msg_tag_add(struct nafmodule *mod, struct gnrmsg *gm, const char *name, char type, void *data);
 int gnr_msg_tag_remove(struct nafmodule *mod, struct gnrmsg *gm, const char *name, char *typeret, void **dataret);
 int gnr_msg_tag_ispresent(struct nafmodule *mod, struct gnrmsg *gm, const char *name);
 int gnr_msg_tag_fetch(struct nafmodule *mod, struct gnrmsg *gm, const char *name, char *typeret, void **dataret);
+int gnr_msg_tag_addatom(struct nafmodule *mod, struct gnrmsg *gm, naf_tagatom_t atom, char type, void *data);
+int gnr_msg_tag_removeatom(struct nafmodule *mod, struct gnrmsg *gm, naf_tagatom_t atom, char *typeret, void **dataret);
+int gnr_msg_tag_ispresentatom(struct nafmodule *mod, struct gnrmsg *gm, naf_tagatom_t atom);
+int gnr_msg_tag_fetchatom(struct nafmodule *mod, struct gnrmsg *gm, naf_tagatom_t atom, char *typeret, void **dataret);
 int gnr_msg_clonetags(struct gnrmsg *destgm, struct gnrmsg *srcgm);
 
+/* Extension slots; see naf_conn_extslot_register(). */
+int gnr_msg_extslot_register(struct nafmodule *mod, int size);
+void *gnr_msg_extslot(struct gnrmsg *gm, int slot);
+
 
 struct gnrmsg_handler_info {
 	struct nafmodule *srcmod;
@@ -165,6 +200,12 @@ typedef int (*gnrmsg_msghandlerfunc_t)(struct nafmodule *mod, int stage, struct
 #define GNR_MSG_MSGHANDLER_POS_MAX 100
 
 int gnr_msg_addmsghandler(struct nafmodule *mod, int stage, int position, gnrmsg_msghandlerfunc_t handlerfunc, const char *desc);
+/*
+ * Same, but the handler is only called for messages whose type is in
+ * typemask (GNR_MSG_TYPEMASK() bits) and which have none of skipflags set.
+ * A handler added with gnr_msg_addmsghandler() gets every message.
+ */
+int gnr_msg_addmsghandler_filtered(struct nafmodule *mod, int stage, int position, gnrmsg_msghandlerfunc_t handlerfunc, const char *desc, naf_u32_t typemask, gnrmsg_msgflag_t skipflags);
 int gnr_msg_remmsghandler(struct nafmodule *mod, int stage, gnrmsg_msghandlerfunc_t handlerfunc);
 
 /*
@@ -176,12 +217,21 @@ int gnr_msg_remmsghandler(struct nafmodule *mod, int stage, gnrmsg_msghandlerfun
  */
 typedef int (*gnrmsg_outputfunc_t)(struct nafmodule *mod, struct gnrmsg *gm, struct gnrmsg_handler_info *hinfo);
 
+/*
+ * Queued routing (the gnr routequeue option) hands the output function of a
+ * module that has one every message bound for the same destination node at
+ * once, in the order they were queued, so it can look the destination up
+ * once and let the writes go out together.
+ */
+typedef int (*gnrmsg_batchoutputfunc_t)(struct nafmodule *mod, int count, struct gnrmsg **gms, struct gnrmsg_handler_info **hinfos);
+
 
 /*
  * Modules that plan on making use of the gnr system must maintain a
  * registration.
  */
 int gnr_msg_register(struct nafmodule *mod, gnrmsg_outputfunc_t outputfunc);
+int gnr_msg_register_batch(struct nafmodule *mod, gnrmsg_batchoutputfunc_t batchoutputfunc);
 int gnr_msg_unregister(struct nafmodule *mod);
 
 
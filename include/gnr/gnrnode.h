@@ -26,6 +26,11 @@
 #include <configwin32.h>
 #endif
 
+#include <naf/naftag.h>
+#include <naf/naftimer.h>
+
+struct gnr_evpending; /* private to gnr */
+
 /*
  * gnrnode structures are kept for three types of nodes:
  *
@@ -82,6 +87,11 @@ struct gnrnode {
 
 	time_t createtime;
 
+	struct naf_timer expiry; /* private; see gnr_node__expire() */
+	struct gnr_evpending *evpending; /* private; see gnr_event_throw() */
+
+	char *canonname; /* name, lowercased and without spaces */
+	naf_u32_t namehash; /* gnr_node_namehash(name) */
 	struct gnrnode *next;
 };
 
@@ -96,6 +106,8 @@ struct gnr_event_ei_nodechange {
 
 int gnr_node_offline(struct gnrnode *gn, int reason);
 struct gnrnode *gnr_node_findbyname(const char *name, const char *service);
+naf_u32_t gnr_node_namehash(const char *name);
+struct gnrnode *gnr_node_findbyhash(const char *name, naf_u32_t hash, const char *service);
 struct gnrnode *gnr_node_online(struct nafmodule *mod, const char *name, const char *service, naf_u32_t flags, int metric);
 
 /*
@@ -111,6 +123,7 @@ int gnr_node_softeq(struct gnrnode *gn1, struct gnrnode *gn2);
 void gnr_node_away(struct gnrnode *gn, int val);
 void gnr_node_idle(struct gnrnode *gn, int seconds);
 void gnr_node_usehit(struct gnrnode *gn);
+void gnr_node_reattached(struct gnrnode *gn);
 int gnr_node_remetric(struct gnrnode *gn, int newmetric);
 int gnr_node_setttl(struct gnrnode *gn, int newttl);
 void gnr_node_ref(struct nafmodule *mod, struct gnrnode *gn);
@@ -120,6 +133,14 @@ int gnr_node_tag_add(struct nafmodule *mod, struct gnrnode *gn, const char *name
 int gnr_node_tag_remove(struct nafmodule *mod, struct gnrnode *gn, const char *name, char *typeret, void **dataret);
 int gnr_node_tag_ispresent(struct nafmodule *mod, struct gnrnode *gn, const char *name);
 int gnr_node_tag_fetch(struct nafmodule *mod, struct gnrnode *gn, const char *name, char *typeret, void **dataret);
+int gnr_node_tag_addatom(struct nafmodule *mod, struct gnrnode *gn, naf_tagatom_t atom, char type, void *data);
+int gnr_node_tag_removeatom(struct nafmodule *mod, struct gnrnode *gn, naf_tagatom_t atom, char *typeret, void **dataret);
+int gnr_node_tag_ispresentatom(struct nafmodule *mod, struct gnrnode *gn, naf_tagatom_t atom);
+int gnr_node_tag_fetchatom(struct nafmodule *mod, struct gnrnode *gn, naf_tagatom_t atom, char *typeret, void **dataret);
+
+/* Extension slots; see naf_conn_extslot_register(). */
+int gnr_node_extslot_register(struct nafmodule *mod, int size);
+void *gnr_node_extslot(struct gnrnode *gn, int slot);
 
 #endif /* __GNRNODE_H__ */
 
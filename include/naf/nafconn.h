@@ -28,6 +28,7 @@
 
 #include <naf/nafmodule.h>
 #include <naf/naftypes.h>
+#include <naf/naftag.h>
 
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
@@ -152,6 +153,7 @@ int naf_conn_reqread(struct nafconn *conn, unsigned char *buf, int buflen, int o
 int naf_conn_reqwrite(struct nafconn *conn, unsigned char *buf, int buflen);
 int naf_conn_takeread(struct nafconn *conn, unsigned char **bufp, int *buflenp);
 int naf_conn_takewrite(struct nafconn *conn, unsigned char **bufp, int *buflenp);
+int naf_conn_read(struct nafconn *conn, unsigned char *buf, int buflen);
 int naf_conn_setdelim(struct nafmodule *mod, struct nafconn *conn, const unsigned char *delim, const unsigned char delimlen);
 void naf_conn_setraw(struct nafconn *conn, int val);
 
@@ -162,9 +164,19 @@ void naf_conn_setraw(struct nafconn *conn, int val);
  * to the matcher function on each invocation.
  */
 struct nafconn *naf_conn_find(struct nafmodule *mod, int (*matcher)(struct nafmodule *, struct nafconn *, const void *), const void *data);
+
+/*
+ * Same as naf_conn_find(), but only visits connections owned by 'owner',
+ * or connections whose type includes 'type'.  The DETECTING and LISTENER
+ * types are indexed; anything else falls back to walking the whole list.
+ */
+struct nafconn *naf_conn_findbyowner(struct nafmodule *mod, struct nafmodule *owner, int (*matcher)(struct nafmodule *, struct nafconn *, const void *), const void *data);
+struct nafconn *naf_conn_findbytype(struct nafmodule *mod, naf_u32_t type, int (*matcher)(struct nafmodule *, struct nafconn *, const void *), const void *data);
+
 struct nafconn *naf_conn_findbycid(struct nafmodule *mod, naf_conn_cid_t cid);
 
 int naf_conn_startconnect(struct nafmodule *mod, struct nafconn *localconn, const char *host, int port);
+struct nafconn *naf_conn_connect(struct nafmodule *mod, const char *host, int port, naf_u32_t type);
 struct nafconn *naf_conn_addconn(struct nafmodule *mod, nbio_sockfd_t sfd, naf_u32_t type);
 
 char *naf_conn_getlocaladdrstr(struct nafmodule *mod, struct nafconn *conn);
@@ -185,8 +197,9 @@ char *naf_conn_getlocaladdrstr(struct nafmodule *mod, struct nafconn *conn);
  * have its ->freetag function called, at which point it should free any data
  * contained in the tag (provided as arguments to the function).
  *
- * Note that tagging should be considered a heavy-weight operation, and only
- * used when actually necessary.
+ * Tag names are interned, and the *atom() versions take the interned name
+ * (from naf_tag_atom()) instead of the string.  Use those for tags that are
+ * looked at on every message.
  *
  * There are a few standard (but not enforced) conventions for tags.  First,
  * the name should specify what kind of object to which it is attached. For
@@ -204,6 +217,22 @@ int naf_conn_tag_add(struct nafmodule *mod, struct nafconn *conn, const char *na
 int naf_conn_tag_remove(struct nafmodule *mod, struct nafconn *conn, const char *name, char *typeret, void **dataret);
 int naf_conn_tag_ispresent(struct nafmodule *mod, struct nafconn *conn, const char *name);
 int naf_conn_tag_fetch(struct nafmodule *mod, struct nafconn *conn, const char *name, char *typeret, void **dataret);
+int naf_conn_tag_addatom(struct nafmodule *mod, struct nafconn *conn, naf_tagatom_t atom, char type, void *data);
+int naf_conn_tag_removeatom(struct nafmodule *mod, struct nafconn *conn, naf_tagatom_t atom, char *typeret, void **dataret);
+int naf_conn_tag_ispresentatom(struct nafmodule *mod, struct nafconn *conn, naf_tagatom_t atom);
+int naf_conn_tag_fetchatom(struct nafmodule *mod, struct nafconn *conn, naf_tagatom_t atom, char *typeret, void **dataret);
+
+/*
+ * Extension slots.  A module that keeps per-connection state of a fixed
+ * size can register a slot for it at init time, instead of allocating it
+ * separately and hanging it off a tag.  The space is part of the connection
+ * itself and is zeroed when the connection is allocated; the module is
+ * responsible for tearing down whatever it keeps there (from connkill, for
+ * instance).  Connections allocated before the slot was registered don't
+ * have it, and naf_conn_extslot() returns NULL for them.
+ */
+int naf_conn_extslot_register(struct nafmodule *mod, int size);
+void *naf_conn_extslot(struct nafconn *conn, int slot);
 
 #endif /* __NAFCONN_H__ */
 
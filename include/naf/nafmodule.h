@@ -200,6 +200,15 @@ void naf_module_setstatusline(struct nafmodule *mod, const char *line);
 struct nafmodule *naf_module_findbyname(struct nafmodule *caller, const char *name);
 int naf_module__registerresident(const char *name, int (*firstproc)(struct nafmodule *), int startuppri);
 
+/*
+ * Claim new connections (on listeners that don't name an owner) that
+ * start with the given bytes.  Signatures are checked before any module's
+ * protocoldetect is called.  If two modules register the same signature,
+ * the first one to do so gets the connections.
+ */
+#define NAF_MODULE_PROTOSIG_MAXLEN 16
+int naf_module_addprotosig(struct nafmodule *mod, const naf_u8_t *sig, int siglen);
+
 int naf_module_tag_add(struct nafmodule *mod, struct nafmodule *target, const char *name, char type, void *data);
 int naf_module_tag_remove(struct nafmodule *mod, struct nafmodule *target, const char *name, char *typeret, void **dataret);
 int naf_module_tag_ispresent(struct nafmodule *mod, struct nafmodule *target, const char *name);
@@ -299,5 +308,31 @@ void naf_flmp_free(struct nafmodule *owner, naf_flmempool_t *flmp);
 void *naf_flmp_blkalloc(struct nafmodule*owner, naf_flmempool_t *flmp);
 void naf_flmp_blkfree(struct nafmodule *owner, naf_flmempool_t *flmp, void *block);
 
+/*
+ * Slab cache of fixed-size objects.  Objects are carved out of larger slabs
+ * and go back on their slab's free list when released, so a steady churn of
+ * allocations (connections coming and going, for instance) doesn't go
+ * through malloc at all.  One empty slab is kept around for reuse; any more
+ * than that are given back.  Slabs are charged to the owner like any other
+ * naf_malloc(), and per-cache counts show up in core->modmemoryuse().
+ *
+ * Objects are not zeroed.  Destroying a cache frees every slab in it,
+ * whether or not there are objects still in use.
+ *
+ * A cache can be extended after it's created, which is how the extension
+ * slots on connections, nodes, and messages get their space: every object
+ * allocated afterwards is len bytes longer, and the offset of those bytes
+ * is returned.  Objects allocated before then are left as they were;
+ * naf_slab_objlen() says how long a given object actually is.
+ */
+typedef struct naf_slabcache_s naf_slabcache_t;
+
+naf_slabcache_t *naf_slab_create(struct nafmodule *owner, const char *name, int objlen, int objsperslab);
+void naf_slab_destroy(naf_slabcache_t *sc);
+void *naf_slab_alloc(naf_slabcache_t *sc);
+void naf_slab_free(naf_slabcache_t *sc, void *obj);
+int naf_slab_extend(naf_slabcache_t *sc, int len);
+int naf_slab_objlen(void *obj);
+
 #endif /* __NAFMODULE_H__ */
 
@@ -28,6 +28,8 @@
 
 #include <naf/nafmodule.h>
 
+struct nafmodule; /* nafmodule.h may be on its way in through nafconn.h */
+
 /*
  * 'base class' API for tags.
  */
@@ -39,5 +41,17 @@ void naf_tag_iter(void **taglistv, struct nafmodule *mod, int (*uf)(struct nafmo
 void naf_tag_freelist(void **taglistv, void *user);
 int naf_tag_cloneall(void **desttaglistv, void **srctaglistv);
 
+/*
+ * Same as above, but with the name already interned.  Get the atom once
+ * (usually at init) with naf_tag_atom() and keep it.
+ */
+typedef int naf_tagatom_t;
+naf_tagatom_t naf_tag_atom(const char *name);
+const char *naf_tag_atomname(naf_tagatom_t atom);
+int naf_tag_addatom(void **taglistv, struct nafmodule *mod, naf_tagatom_t atom, char type, void *data);
+int naf_tag_removeatom(void **taglistv, struct nafmodule *mod, naf_tagatom_t atom, char *typeret, void **dataret);
+int naf_tag_ispresentatom(void **taglistv, struct nafmodule *mod, naf_tagatom_t atom);
+int naf_tag_fetchatom(void **taglistv, struct nafmodule *mod, naf_tagatom_t atom, char *typeret, void **dataret);
+
 #endif /* __NAFTAG_H__ */
 
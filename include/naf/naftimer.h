@@ -0,0 +1,68 @@
+/*
+ * naf - Networked Application Framework
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * naf is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * naf is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __NAFTIMER_H__
+#define __NAFTIMER_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#include <naf/nafmodule.h>
+#include <naf/naftypes.h>
+
+/*
+ * One-shot timers with millisecond resolution.
+ *
+ * Unlike mod->timer, which is called for the module as a whole every few
+ * seconds, these are meant for per-object deadlines (connection timeouts,
+ * cache entry expiry, etc).  Embed a struct naf_timer in the object, set it
+ * up once with naf_timer_init(), and then arm/cancel it as often as you
+ * like; both are O(1).  The callback is run from the main loop, after the
+ * timer has been disarmed, so it may rearm it.
+ *
+ * Timers owned by a module are cancelled when the module is unloaded, but
+ * anything that frees an object with an embedded timer must cancel it
+ * first.
+ */
+struct naf_timer;
+typedef void (*naf_timer_func_t)(struct nafmodule *mod, struct naf_timer *timer, void *data);
+
+struct naf_timer {
+	/* private */
+	naf_u32_t expires;
+	struct naf_timer *next;
+	struct naf_timer **prevp;
+
+	struct nafmodule *owner;
+	naf_timer_func_t func;
+	void *data;
+};
+
+void naf_timer_init(struct naf_timer *timer, struct nafmodule *owner, naf_timer_func_t func, void *data);
+int naf_timer_arm(struct naf_timer *timer, naf_u32_t msec); /* rearms if already armed */
+void naf_timer_cancel(struct naf_timer *timer);
+int naf_timer_isarmed(struct naf_timer *timer);
+
+/* Milliseconds on an arbitrary monotonic clock. */
+naf_u32_t naf_timer_now(void);
+
+#endif /* __NAFTIMER_H__ */
@@ -627,7 +627,9 @@ modinit(struct nafmodule *mod)
 		dprintf(mod, "modinit: gsr_msg_register failed\n");
 		return -1;
 	}
-	gnr_msg_addmsghandler(mod, GNR_MSG_MSGHANDLER_STAGE_ROUTING, 30, totr_msgroutinghandler, "Off-the-record messaging");
+	gnr_msg_addmsghandler_filtered(mod, GNR_MSG_MSGHANDLER_STAGE_ROUTING, 30, totr_msgroutinghandler, "Off-the-record messaging",
+			GNR_MSG_TYPEMASK(GNR_MSG_MSGTYPE_IM),
+			GNR_MSG_MSGFLAG_METAMESSAGE);
 
 	gnr_event_register(mod, totr_nodeeventhandler, GNR_EVENTMASK_NODE);
 
@@ -62,6 +62,9 @@
 #ifdef HAVE_TIME_H
 #include <time.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
 #ifdef HAVE_LINUX_NETFILTER_IPV4_H
 #include <linux/netfilter_ipv4.h> /* XXX */
 #endif
@@ -71,27 +74,95 @@
 #include <naf/nafconfig.h>
 #include <naf/nafconn.h>
 #include <naf/naftag.h>
+#include <naf/naftimer.h>
+#include <naf/nafstats.h>
 
 #include "processes.h" /* for naf_childproc_cleanconn() */
 #include "module.h" /* naf_module__protocoldetect() */
+#include "connio.h"
+#include "resolver.h"
 
 #define NAF_CONN_DEBUG_DEFAULT 0
 static int naf_conn__debug = NAF_CONN_DEBUG_DEFAULT;
 
+/* Cork TCP connections while flushing long Tx queues (epoll backend only) */
+#define NAF_CONN_TXCORK_DEFAULT 0
+static int naf_conn__txcork = NAF_CONN_TXCORK_DEFAULT;
+
+/*
+ * Admission control for incoming connections.
+ *
+ * acceptbudget is the most connections taken off a listener's backlog each
+ * time it comes up readable; whatever's left is picked up on the next pass
+ * through the loop, so a reconnect storm can't starve everything else.
+ *
+ * maxconns (0 for no limit) caps the total number of open connections,
+ * listeners and outgoing connections included.  acceptrate (0 for no limit)
+ * is how many new connections per second a single source address may make,
+ * with bursts of up to acceptburst.  Connections over either limit are
+ * accepted and closed immediately, rather than being left in the backlog to
+ * be retried.
+ */
+#define NAF_CONN_ACCEPTBUDGET_DEFAULT 32
+static int naf_conn__acceptbudget = NAF_CONN_ACCEPTBUDGET_DEFAULT;
+#define NAF_CONN_MAXCONNS_DEFAULT 0
+static int naf_conn__maxconns = NAF_CONN_MAXCONNS_DEFAULT;
+#define NAF_CONN_ACCEPTRATE_DEFAULT 0
+static int naf_conn__acceptrate = NAF_CONN_ACCEPTRATE_DEFAULT;
+#define NAF_CONN_ACCEPTBURST_DEFAULT 10
+static int naf_conn__acceptburst = NAF_CONN_ACCEPTBURST_DEFAULT;
+
+/*
+ * Kept open so that there's always one descriptor we can give up to accept()
+ * and then close a connection with when we've run out (EMFILE/ENFILE).
+ * Otherwise the connection stays in the backlog and the listener stays
+ * readable forever.
+ */
+static int naf_conn__reservefd = -1;
+
+static struct {
+	naf_longstat_t accepted;
+	naf_longstat_t refused_maxconns;
+	naf_longstat_t refused_rate;
+	naf_longstat_t refused_nofiles;
+	naf_longstat_t acceptbatches;
+} acceptstats;
+
+/*
+ * Per-source token buckets for acceptrate.  tokens is in thousandths of a
+ * connection, so the refill can be done in whole milliseconds.
+ */
+struct acceptsrc {
+	naf_u32_t addr;
+	naf_u32_t tokens;
+	naf_u32_t last;
+	struct acceptsrc *next;
+};
+#define ACCEPTSRC_HASHSIZE 256
+static struct acceptsrc *acceptsrc__hash[ACCEPTSRC_HASHSIZE];
+
 
 /*
  * Number of seconds to wait for data while in DETECTING
- * state (before calling protocoldetecttimeout()). Must
- * be >= NAF_TIMER_ACCURACY.
+ * state (before calling protocoldetecttimeout()).
  */
 #define NAF_CONN_DETECT_TIMEOUT NAF_TIMER_ACCURACY
 
+/*
+ * Milliseconds to wait before looking again at a DETECTING connection that
+ * has sent part of a protocol signature.
+ */
+#define NAF_CONN_DETECT_RETRY 50
+
 
 static void naf_conn_free(struct nafconn *conn);
 static int finishconnect(struct nafconn *conn);
 
+/* Only used for libnbio's socket wrappers; connio owns the real one. */
 static nbio_t gnb;
 
+static struct naf_connio *connio = NULL;
+
 static struct nafmodule *ourmodule = NULL;
 
 /*
@@ -101,6 +172,345 @@ static naf_conn_cid_t naf_conn__nextcid = 0;
 static naf_u32_t naf_conn__openconns = 0;
 
 
+/*
+ * The connection registry.
+ *
+ * Every nafconn is really the head of a connent, which links it into:
+ *   - the list of all connections (what naf_conn_find() walks)
+ *   - a hash on CID (naf_conn_findbycid())
+ *   - a list per owning module (naf_conn_findbyowner())
+ *   - a list per indexed type bit (naf_conn_findbytype())
+ *
+ * Connections aren't actually freed until the next conn__reap(), so that
+ * it's always safe to kill connections (even ones other than the current
+ * one) from inside a traversal.  Dead connections are taken out of the CID
+ * hash immediately, and are skipped by all of the find functions.
+ *
+ * The type lists are built from the type a connection had when it was
+ * added, so only bits that are never set after that are indexed: LISTENER,
+ * which never changes, and DETECTING, which is only ever cleared (entries
+ * whose bit has been cleared are dropped as the list is walked).  Modules
+ * add bits like CLIENT and SOAP in takeconn, so those types are found by
+ * walking the whole list.
+ */
+#define CONN_HASH_MINSIZE 64
+
+#define CONNENT_FLAG_DEAD      0x0001
+#define CONNENT_FLAG_RESOLVING 0x0002 /* no fdt yet; see startconnect */
+
+static const naf_u32_t conn__typelists[] = {
+	NAF_CONN_TYPE_DETECTING,
+	NAF_CONN_TYPE_LISTENER,
+};
+#define CONN_TYPELIST_COUNT (sizeof(conn__typelists) / sizeof(conn__typelists[0]))
+
+struct connent;
+
+/*
+ * Buffers handed to reqread/reqwrite before the connection has a socket;
+ * they're passed on to the I/O layer, in order, once it does.
+ */
+struct connpendvec {
+	int tx;
+	unsigned char *buf;
+	int buflen;
+	int offset;
+	struct connpendvec *next;
+};
+
+struct connownerlist {
+	struct nafmodule *owner;
+	struct connent *head;
+	struct connownerlist *next;
+};
+
+struct connent {
+	struct nafconn conn; /* must be first */
+	int flags;
+
+	struct connent *hashnext;
+	struct connent *next, *prev;
+
+	struct connownerlist *ownerlist;
+	struct connent *ownernext, *ownerprev;
+
+	naf_u32_t typelists; /* bit n set if on conn__typelisthead[n] */
+	struct connent *typenext[CONN_TYPELIST_COUNT];
+	struct connent *typeprev[CONN_TYPELIST_COUNT];
+
+	struct naf_timer detecttimer;
+	struct naf_timer detectretry;
+
+	int resolveport;
+	struct connpendvec *pendvecs, **pendvecstail;
+
+	struct connent *deadnext;
+};
+
+static struct connent *conn__list = NULL;
+static struct connent *conn__deadlist = NULL;
+static struct connent **conn__hash = NULL;
+static int conn__hashsize = 0;
+static struct connownerlist *conn__ownerlists = NULL;
+static struct connent *conn__typelisthead[CONN_TYPELIST_COUNT];
+
+/*
+ * Connections (and the buffers queued on them while resolving) come and go
+ * constantly, so they're kept in slabs rather than going back to malloc.
+ */
+#define CONN_SLABOBJS 64
+static naf_slabcache_t *conn__slab = NULL;
+static naf_slabcache_t *conn__pendvecslab = NULL;
+
+#define CONNENT(x) ((struct connent *)(x))
+
+static int conn__hashfunc(naf_conn_cid_t cid, int size)
+{
+	/* CIDs are sequential, but scramble them anyway (Knuth) */
+	return (int)((cid * 2654435761UL) & 0xffffffff) & (size - 1);
+}
+
+static void conn__hashresize(int newsize)
+{
+	struct connent **newhash, *ce;
+	int i;
+
+	if (!(newhash = naf_malloc(ourmodule, sizeof(struct connent *) * newsize)))
+		return; /* just keep using the old one */
+	memset(newhash, 0, sizeof(struct connent *) * newsize);
+
+	for (i = 0; i < conn__hashsize; i++) {
+		while ((ce = conn__hash[i])) {
+			int n;
+
+			conn__hash[i] = ce->hashnext;
+			n = conn__hashfunc(ce->conn.cid, newsize);
+			ce->hashnext = newhash[n];
+			newhash[n] = ce;
+		}
+	}
+
+	if (conn__hash)
+		naf_free(ourmodule, conn__hash);
+	conn__hash = newhash;
+	conn__hashsize = newsize;
+
+	return;
+}
+
+static void conn__hashadd(struct connent *ce)
+{
+	int n;
+
+	if ((naf_conn__openconns >= (naf_u32_t)conn__hashsize) || !conn__hash)
+		conn__hashresize(conn__hashsize ? conn__hashsize * 2 : CONN_HASH_MINSIZE);
+	if (!conn__hash)
+		return;
+
+	n = conn__hashfunc(ce->conn.cid, conn__hashsize);
+	ce->hashnext = conn__hash[n];
+	conn__hash[n] = ce;
+
+	return;
+}
+
+static void conn__hashrem(struct connent *ce)
+{
+	struct connent **cur;
+
+	if (!conn__hash)
+		return;
+
+	for (cur = &conn__hash[conn__hashfunc(ce->conn.cid, conn__hashsize)]; *cur; cur = &(*cur)->hashnext) {
+		if (*cur == ce) {
+			*cur = ce->hashnext;
+			ce->hashnext = NULL;
+			break;
+		}
+	}
+
+	if ((conn__hashsize > CONN_HASH_MINSIZE) &&
+			(naf_conn__openconns < (naf_u32_t)(conn__hashsize / 4)))
+		conn__hashresize(conn__hashsize / 2);
+
+	return;
+}
+
+static struct connownerlist *conn__getownerlist(struct nafmodule *owner, int create)
+{
+	struct connownerlist *ol;
+
+	for (ol = conn__ownerlists; ol; ol = ol->next) {
+		if (ol->owner == owner)
+			return ol;
+	}
+
+	if (!create)
+		return NULL;
+
+	if (!(ol = naf_malloc(ourmodule, sizeof(struct connownerlist))))
+		return NULL;
+	ol->owner = owner;
+	ol->head = NULL;
+	ol->next = conn__ownerlists;
+	conn__ownerlists = ol;
+
+	return ol;
+}
+
+static void conn__ownerunlink(struct connent *ce)
+{
+
+	if (!ce->ownerlist)
+		return;
+
+	if (ce->ownerprev)
+		ce->ownerprev->ownernext = ce->ownernext;
+	else
+		ce->ownerlist->head = ce->ownernext;
+	if (ce->ownernext)
+		ce->ownernext->ownerprev = ce->ownerprev;
+
+	ce->ownerlist = NULL;
+	ce->ownernext = ce->ownerprev = NULL;
+
+	return;
+}
+
+static void conn__ownerlink(struct connent *ce)
+{
+	struct connownerlist *ol;
+
+	conn__ownerunlink(ce);
+
+	if (!ce->conn.owner)
+		return;
+	if (!(ol = conn__getownerlist(ce->conn.owner, 1)))
+		return;
+
+	ce->ownerlist = ol;
+	ce->ownerprev = NULL;
+	if ((ce->ownernext = ol->head))
+		ol->head->ownerprev = ce;
+	ol->head = ce;
+
+	return;
+}
+
+static void conn__typeunlink(struct connent *ce, int i)
+{
+
+	if (!(ce->typelists & (1 << i)))
+		return;
+
+	if (ce->typeprev[i])
+		ce->typeprev[i]->typenext[i] = ce->typenext[i];
+	else
+		conn__typelisthead[i] = ce->typenext[i];
+	if (ce->typenext[i])
+		ce->typenext[i]->typeprev[i] = ce->typeprev[i];
+
+	/* leave typenext alone, someone might be walking past us */
+	ce->typeprev[i] = NULL;
+	ce->typelists &= ~(1 << i);
+
+	return;
+}
+
+static void conn__register(struct connent *ce)
+{
+
+	ce->prev = NULL;
+	if ((ce->next = conn__list))
+		conn__list->prev = ce;
+	conn__list = ce;
+
+	conn__hashadd(ce);
+
+	return;
+}
+
+/* Called once the type and owner have been filled in. */
+static void conn__index(struct connent *ce)
+{
+	int i;
+
+	for (i = 0; i < (int)CONN_TYPELIST_COUNT; i++) {
+		if (!(ce->conn.type & conn__typelists[i]))
+			continue;
+		ce->typeprev[i] = NULL;
+		if ((ce->typenext[i] = conn__typelisthead[i]))
+			conn__typelisthead[i]->typeprev[i] = ce;
+		conn__typelisthead[i] = ce;
+		ce->typelists |= 1 << i;
+	}
+
+	conn__ownerlink(ce);
+
+	return;
+}
+
+/*
+ * Pull a dead connection out of the lookup paths.  It stays on all the
+ * lists (still marked dead) until conn__reap(), so that anyone walking
+ * them can keep going.
+ */
+static void conn__unregister(struct connent *ce)
+{
+
+	ce->flags |= CONNENT_FLAG_DEAD;
+	conn__hashrem(ce);
+
+	ce->deadnext = conn__deadlist;
+	conn__deadlist = ce;
+
+	return;
+}
+
+/* Never call this from inside a traversal. */
+static void conn__reap(void)
+{
+	struct connent *ce;
+	int i;
+
+	while ((ce = conn__deadlist)) {
+		conn__deadlist = ce->deadnext;
+
+		if (ce->prev)
+			ce->prev->next = ce->next;
+		else
+			conn__list = ce->next;
+		if (ce->next)
+			ce->next->prev = ce->prev;
+
+		conn__ownerunlink(ce);
+		for (i = 0; i < (int)CONN_TYPELIST_COUNT; i++)
+			conn__typeunlink(ce, i);
+
+		naf_slab_free(conn__slab, ce);
+	}
+
+	return;
+}
+
+/*
+ * Use this instead of setting conn->owner directly, so that the connection
+ * moves to the right owner list.
+ */
+void naf_conn__setowner(struct nafconn *conn, struct nafmodule *owner)
+{
+
+	if (!conn)
+		return;
+
+	conn->owner = owner;
+	if (!(CONNENT(conn)->flags & CONNENT_FLAG_DEAD))
+		conn__ownerlink(CONNENT(conn));
+
+	return;
+}
+
+
 int naf_conn_tag_add(struct nafmodule *mod, struct nafconn *conn, const char *name, char type, void *data)
 {
 
@@ -149,8 +559,125 @@ int naf_conn_tag_fetch(struct nafmodule *mod, struct nafconn *conn, const char *
 	return naf_tag_fetch(&conn->taglist, mod, name, typeret, dataret);
 }
 
+/* These skip the debug output; they're for the hot paths. */
+int naf_conn_tag_addatom(struct nafmodule *mod, struct nafconn *conn, naf_tagatom_t atom, char type, void *data)
+{
+
+	if (!conn)
+		return -1;
+
+	return naf_tag_addatom(&conn->taglist, mod, atom, type, data);
+}
+
+int naf_conn_tag_removeatom(struct nafmodule *mod, struct nafconn *conn, naf_tagatom_t atom, char *typeret, void **dataret)
+{
+
+	if (!conn)
+		return -1;
+
+	return naf_tag_removeatom(&conn->taglist, mod, atom, typeret, dataret);
+}
+
+int naf_conn_tag_ispresentatom(struct nafmodule *mod, struct nafconn *conn, naf_tagatom_t atom)
+{
+
+	if (!conn)
+		return -1;
+
+	return naf_tag_ispresentatom(&conn->taglist, mod, atom);
+}
+
+int naf_conn_tag_fetchatom(struct nafmodule *mod, struct nafconn *conn, naf_tagatom_t atom, char *typeret, void **dataret)
+{
+
+	if (!conn)
+		return -1;
+
+	return naf_tag_fetchatom(&conn->taglist, mod, atom, typeret, dataret);
+}
+
+/*
+ * Reserve size bytes in every connection allocated from now on.  The
+ * return value is the slot's offset into the connection, to be handed to
+ * naf_conn_extslot(), or -1.
+ */
+int naf_conn_extslot_register(struct nafmodule *mod, int size)
+{
+	int slot;
+
+	if (!mod || (size <= 0) || !conn__slab)
+		return -1;
+
+	if ((slot = naf_slab_extend(conn__slab, size)) == -1)
+		return -1;
+
+	if (naf_conn__debug)
+		dvprintf(ourmodule, "%s registered a %d byte connection slot at offset %d\n", mod->name, size, slot);
+
+	return slot;
+}
+
+/*
+ * The slot's space in conn, zeroed when the connection was allocated.  NULL
+ * if conn was allocated before the slot was registered.
+ */
+void *naf_conn_extslot(struct nafconn *conn, int slot)
+{
+
+	if (!conn || (slot < (int)sizeof(struct connent)) || (slot >= naf_slab_objlen(conn)))
+		return NULL;
+
+	return (naf_u8_t *)conn + slot;
+}
+
 
 
+/*
+ * Pick the I/O backend.  This has to wait until the first connection is
+ * added (or the first poll), since our modinit runs before the config
+ * file has been read.  The choice can't be changed after that.
+ */
+static struct naf_connio *getconnio(void)
+{
+	char *want;
+
+	if (connio)
+		return connio;
+
+	want = naf_config_getmodparmstr(ourmodule, "iobackend");
+
+#ifdef NAF_USEEPOLL
+	connio = &naf_connio_epoll;
+#else
+	connio = &naf_connio_nbio;
+#endif
+	if (want && (strcasecmp(want, naf_connio_nbio.name) == 0))
+		connio = &naf_connio_nbio;
+#ifdef NAF_USEURING
+	if (want && (strcasecmp(want, naf_connio_uring.name) == 0))
+		connio = &naf_connio_uring;
+#endif
+
+	if (want && (strcasecmp(want, connio->name) != 0))
+		dvprintf(ourmodule, "I/O backend '%s' not available\n", want);
+
+	/* io_uring falls back to epoll, and epoll falls back to poll. */
+	while ((connio->init(ourmodule) == -1) && (connio != &naf_connio_nbio)) {
+		struct naf_connio *next = &naf_connio_nbio;
+
+#if defined(NAF_USEURING) && defined(NAF_USEEPOLL)
+		if (connio == &naf_connio_uring)
+			next = &naf_connio_epoll;
+#endif
+		dvprintf(ourmodule, "unable to initialize %s I/O backend, falling back to %s\n", connio->name, next->name);
+		connio = next;
+	}
+
+	dvprintf(ourmodule, "using %s I/O backend\n", connio->name);
+
+	return connio;
+}
+
 static const char *getcidstr(struct nafconn *conn)
 {
 	static char buf[32];
@@ -164,7 +691,65 @@ static const char *getcidstr(struct nafconn *conn)
 void naf_conn_setraw(struct nafconn *conn, int val)
 {
 
-	nbio_setraw(&gnb, conn->fdt, val);
+	if (!conn->fdt)
+		return; /* still resolving; done when it gets one */
+
+	connio->setraw(conn->fdt, val);
+
+	return;
+}
+
+static int addpendvec(struct nafconn *conn, int tx, unsigned char *buf, int buflen, int offset)
+{
+	struct connpendvec *pv;
+
+	if (!(pv = naf_slab_alloc(conn__pendvecslab)))
+		return -1;
+	pv->tx = tx;
+	pv->buf = buf;
+	pv->buflen = buflen;
+	pv->offset = offset;
+	pv->next = NULL;
+
+	if (!CONNENT(conn)->pendvecs)
+		CONNENT(conn)->pendvecstail = &CONNENT(conn)->pendvecs;
+	*CONNENT(conn)->pendvecstail = pv;
+	CONNENT(conn)->pendvecstail = &pv->next;
+
+	return 0;
+}
+
+static void flushpendvecs(struct nafconn *conn)
+{
+	struct connpendvec *pv;
+
+	while ((pv = CONNENT(conn)->pendvecs)) {
+		int ret;
+
+		CONNENT(conn)->pendvecs = pv->next;
+
+		if (pv->tx)
+			ret = connio->addtxvector(conn->fdt, pv->buf, pv->buflen);
+		else
+			ret = connio->addrxvector(conn->fdt, pv->buf, pv->buflen, pv->offset);
+		if (ret == -1)
+			naf_free(NULL, pv->buf);
+
+		naf_slab_free(conn__pendvecslab, pv);
+	}
+
+	return;
+}
+
+static void freependvecs(struct nafconn *conn)
+{
+	struct connpendvec *pv;
+
+	while ((pv = CONNENT(conn)->pendvecs)) {
+		CONNENT(conn)->pendvecs = pv->next;
+		naf_free(NULL, pv->buf);
+		naf_slab_free(conn__pendvecslab, pv);
+	}
 
 	return;
 }
@@ -176,13 +761,13 @@ static void closefdt(nbio_fd_t *fdt)
 	if (!fdt)
 		return;
 
-	while ((buf = nbio_remtoprxvector(&gnb, fdt, NULL, NULL)))
+	while ((buf = connio->remtoprxvector(fdt, NULL, NULL)))
 		naf_free(NULL, buf);
-	while ((buf = nbio_remtoptxvector(&gnb, fdt, NULL, NULL)))
+	while ((buf = connio->remtoptxvector(fdt, NULL, NULL)))
 		naf_free(NULL, buf);
 
 	fdt->priv = NULL;
-	nbio_closefdt(&gnb, fdt);
+	connio->closefdt(fdt);
 
 	return;
 }
@@ -194,15 +779,15 @@ static void closefdt(nbio_fd_t *fdt)
  */
 static void remendpoint(struct nafconn *dead)
 {
-	nbio_fd_t *fdt;
+	struct connent *ce;
 
 	/* so we don't find ourself... */
 	dead->endpoint = NULL;
 
-	for (fdt = gnb.fdlist; fdt; fdt = fdt->next) {
-		struct nafconn *conn = (struct nafconn *)fdt->priv;
+	for (ce = conn__list; ce; ce = ce->next) {
+		struct nafconn *conn = &ce->conn;
 
-		if (fdt->fd == -1)
+		if (ce->flags & CONNENT_FLAG_DEAD)
 			continue;
 
 		if (conn->endpoint == dead) {
@@ -221,14 +806,14 @@ static void remendpoint(struct nafconn *dead)
 
 static void remchildren(struct nafconn *dead)
 {
-	nbio_fd_t *fdt;
+	struct connent *ce;
 
 	dead->parent = NULL;
 
-	for (fdt = gnb.fdlist; fdt; fdt = fdt->next) {
-		struct nafconn *conn = (struct nafconn *)fdt->priv;
+	for (ce = conn__list; ce; ce = ce->next) {
+		struct nafconn *conn = &ce->conn;
 
-		if (fdt->fd == -1)
+		if (ce->flags & CONNENT_FLAG_DEAD)
 			continue;
 
 		if (conn->parent == dead) {
@@ -255,13 +840,20 @@ static void remchildren(struct nafconn *dead)
 static void naf_conn_free(struct nafconn *dead)
 {
 
+	if (CONNENT(dead)->flags & CONNENT_FLAG_DEAD)
+		return;
+
 	if (naf_conn__debug)
 		dvprintf(ourmodule, "naf_conn_free(%p [cid %d])\n", dead, dead->cid);
 
+	conn__unregister(CONNENT(dead));
+	naf_timer_cancel(&CONNENT(dead)->detecttimer);
+	naf_timer_cancel(&CONNENT(dead)->detectretry);
 	naf_conn__openconns--;
 
 	/* This does the very important step of setting fdt->priv to NULL */
 	closefdt(dead->fdt);
+	freependvecs(dead);
 
 	/* Call after its been removed from the list */
 	if (dead->owner && dead->owner->connkill)
@@ -278,7 +870,7 @@ static void naf_conn_free(struct nafconn *dead)
 	remchildren(dead);
 	remendpoint(dead);
 
-	naf_free(ourmodule, dead);
+	/* the memory goes away at the next conn__reap() */
 
 	return;
 }
@@ -286,34 +878,106 @@ static void naf_conn_free(struct nafconn *dead)
 /* XXX this is a hack... a little too "general" */
 struct nafconn *naf_conn_find(struct nafmodule *mod, int (*matcher)(struct nafmodule *, struct nafconn *, const void *), const void *data)
 {
-	nbio_fd_t *fdt;
+	struct connent *ce;
 
 	if (!mod || !matcher)
 		return NULL;
 
-	for (fdt = gnb.fdlist; fdt; fdt = fdt->next) {
-		struct nafconn *conn = (struct nafconn *)fdt->priv;
+	for (ce = conn__list; ce; ce = ce->next) {
 
-		if (fdt->fd == -1)
+		if (ce->flags & CONNENT_FLAG_DEAD)
 			continue; /* closed connection */
 
-		if (matcher(mod, conn, data))
-			return conn;
+		if (matcher(mod, &ce->conn, data))
+			return &ce->conn;
+	}
+
+	return NULL;
+}
+
+struct nafconn *naf_conn_findbyowner(struct nafmodule *mod, struct nafmodule *owner, int (*matcher)(struct nafmodule *, struct nafconn *, const void *), const void *data)
+{
+	struct connownerlist *ol;
+	struct connent *ce;
+
+	if (!mod || !owner || !matcher)
+		return NULL;
+
+	if (!(ol = conn__getownerlist(owner, 0)))
+		return NULL;
+
+	for (ce = ol->head; ce; ce = ce->ownernext) {
+
+		if (ce->flags & CONNENT_FLAG_DEAD)
+			continue;
+
+		if (matcher(mod, &ce->conn, data))
+			return &ce->conn;
 	}
 
 	return NULL;
 }
 
-static int findconnbycid_matcher(struct nafmodule *mod, struct nafconn *conn, const void *data)
+struct nafconn *naf_conn_findbytype(struct nafmodule *mod, naf_u32_t type, int (*matcher)(struct nafmodule *, struct nafconn *, const void *), const void *data)
 {
-	naf_conn_cid_t cid = (naf_conn_cid_t)data;
+	struct connent *ce, *next;
+	int i;
+
+	if (!mod || !matcher)
+		return NULL;
+
+	for (i = 0; i < (int)CONN_TYPELIST_COUNT; i++) {
+		if (conn__typelists[i] == type)
+			break;
+	}
+
+	if (i == (int)CONN_TYPELIST_COUNT) {
+		/* not indexed; do it the hard way */
+		for (ce = conn__list; ce; ce = ce->next) {
+
+			if (ce->flags & CONNENT_FLAG_DEAD)
+				continue;
+			if ((ce->conn.type & type) != type)
+				continue;
 
-	return (conn->cid == cid);
+			if (matcher(mod, &ce->conn, data))
+				return &ce->conn;
+		}
+
+		return NULL;
+	}
+
+	for (ce = conn__typelisthead[i]; ce; ce = next) {
+		next = ce->typenext[i];
+
+		if (ce->flags & CONNENT_FLAG_DEAD)
+			continue;
+
+		if (!(ce->conn.type & type)) {
+			conn__typeunlink(ce, i); /* bit has been cleared */
+			continue;
+		}
+
+		if (matcher(mod, &ce->conn, data))
+			return &ce->conn;
+	}
+
+	return NULL;
 }
 
 struct nafconn *naf_conn_findbycid(struct nafmodule *mod, naf_conn_cid_t cid)
 {
-	return naf_conn_find(mod, findconnbycid_matcher, (const void *)cid);
+	struct connent *ce;
+
+	if (!conn__hash)
+		return NULL;
+
+	for (ce = conn__hash[conn__hashfunc(cid, conn__hashsize)]; ce; ce = ce->hashnext) {
+		if (ce->conn.cid == cid)
+			return &ce->conn;
+	}
+
+	return NULL;
 }
 
 /*
@@ -328,10 +992,15 @@ struct nafconn *naf_conn_findbycid(struct nafmodule *mod, naf_conn_cid_t cid)
 int naf_conn_schedulekill(struct nafconn *conn)
 {
 
+	if (conn && !conn->fdt && (CONNENT(conn)->flags & CONNENT_FLAG_RESOLVING)) {
+		naf_conn_free(conn); /* nothing to flush */
+		return 0;
+	}
+
 	if (!conn || !conn->fdt)
 		return -1;
 
-	return nbio_setcloseonflush(conn->fdt, 1);
+	return connio->setcloseonflush(conn->fdt, 1);
 }
 
 static void updaterawmode(struct nafconn *conn); /* later */
@@ -361,7 +1030,17 @@ static int connhandler_read(nbio_fd_t *fdt)
 		if ((detected = naf_module__protocoldetect(NULL, conn)) == 1) {
 
 			conn->type &= ~NAF_CONN_TYPE_DETECTING;
-			naf_conn_setraw(conn, 0); /* get out of raw mode */
+			updaterawmode(conn); /* out of raw mode, unless it reads for itself */
+
+		} else if (detected == NAF_MODULE__DETECT_NEEDMORE) {
+
+			/*
+			 * The data is still sitting in the socket, so it would
+			 * just keep coming back readable.  Stop listening for
+			 * a bit and then look again.
+			 */
+			naf_conn_setraw(conn, 0);
+			naf_timer_arm(&CONNENT(conn)->detectretry, NAF_CONN_DETECT_RETRY);
 
 		} else {
 
@@ -427,31 +1106,149 @@ static int connhandler_eof(nbio_fd_t *fdt)
 	return die ? -1 : 0;
 }
 
-static int connhandler_incomingconn(nbio_fd_t *fdt)
+static void acceptsrc_refill(struct acceptsrc *src, naf_u32_t now)
+{
+	naf_u32_t max = (naf_u32_t)naf_conn__acceptburst * 1000;
+	naf_u32_t elapsed = now - src->last;
+
+	src->last = now;
+
+	if (elapsed >= (max / naf_conn__acceptrate) + 1)
+		src->tokens = max;
+	else if ((src->tokens += elapsed * naf_conn__acceptrate) > max)
+		src->tokens = max;
+
+	return;
+}
+
+/*
+ * Returns 1 if addr may have another connection, 0 if it's over acceptrate.
+ */
+static int acceptsrc_admit(naf_u32_t addr)
+{
+	struct acceptsrc *src;
+	naf_u32_t now;
+
+	if ((naf_conn__acceptrate <= 0) || (naf_conn__acceptburst <= 0))
+		return 1;
+
+	now = naf_timer_now();
+
+	for (src = acceptsrc__hash[addr % ACCEPTSRC_HASHSIZE]; src; src = src->next) {
+		if (src->addr == addr)
+			break;
+	}
+
+	if (!src) {
+		if (!(src = naf_malloc(ourmodule, sizeof(struct acceptsrc))))
+			return 1; /* fail open */
+		src->addr = addr;
+		src->tokens = (naf_u32_t)naf_conn__acceptburst * 1000;
+		src->last = now;
+		src->next = acceptsrc__hash[addr % ACCEPTSRC_HASHSIZE];
+		acceptsrc__hash[addr % ACCEPTSRC_HASHSIZE] = src;
+	} else
+		acceptsrc_refill(src, now);
+
+	if (src->tokens < 1000)
+		return 0;
+	src->tokens -= 1000;
+
+	return 1;
+}
+
+/*
+ * Forget about any source whose bucket has filled back up; it'd be
+ * recreated in exactly the same state.  If all is set, forget everything.
+ */
+static void acceptsrc_expire(int all)
+{
+	naf_u32_t now;
+	int i;
+
+	now = naf_timer_now();
+
+	for (i = 0; i < ACCEPTSRC_HASHSIZE; i++) {
+		struct acceptsrc *src, **prev;
+
+		for (prev = &acceptsrc__hash[i]; (src = *prev); ) {
+
+			if (!all && (naf_conn__acceptrate > 0)) {
+				acceptsrc_refill(src, now);
+				if (src->tokens < (naf_u32_t)naf_conn__acceptburst * 1000) {
+					prev = &src->next;
+					continue;
+				}
+			}
+
+			*prev = src->next;
+			naf_free(ourmodule, src);
+		}
+	}
+
+	return;
+}
+
+static void reservefd_open(void)
+{
+
+	if (naf_conn__reservefd == -1)
+		naf_conn__reservefd = open("/dev/null", O_RDONLY);
+
+	return;
+}
+
+/*
+ * Out of descriptors.  Give up the reserve one just long enough to take the
+ * next connection off the backlog and close it.
+ */
+static void refusenofiles(nbio_fd_t *fdt)
 {
-	struct nafconn *lconn = (struct nafconn *)fdt->priv;
 	nbio_sockfd_t sfd;
 	struct sockaddr sa;
 	int salen = sizeof(sa);
-	struct nafconn *nconn;
 
-	/* we use this as an incoming connection counter on listeners */
-	lconn->lasttx_hard++;
+	if (naf_conn__reservefd == -1) {
+		dprintf(ourmodule, "cannot accept incoming connection; too many open files\n");
+		reservefd_open(); /* maybe next time */
+		return;
+	}
 
-	if (naf_conn__debug > 1)
-		dvprintf(ourmodule, "connhandler_incomingconn(%p [fd %d, cid %d])\n", fdt, fdt->fd, lconn->cid);
+	close(naf_conn__reservefd);
+	naf_conn__reservefd = -1;
 
+	if ((sfd = connio->getincomingconn(fdt, &sa, &salen)) != -1) {
+		nbio_sfd_close(&gnb, sfd);
+		acceptstats.refused_nofiles++;
+		if (naf_conn__debug > 0)
+			dprintf(ourmodule, "refused incoming connection; too many open files\n");
+	}
 
-	sfd = nbio_getincomingconn(&gnb, fdt, &sa, &salen);
-	if (sfd == -1) {
+	reservefd_open();
 
-#ifdef EMFILE
-		if (errno == EMFILE) { /* too many open files */
-			dprintf(ourmodule, "cannot accept incoming connection; too many open files\n");
-			return 0;
-		}
-#endif
-		return 0; /* most errors here are meaningless. */
+	return;
+}
+
+static int acceptconn(struct nafconn *lconn, nbio_sockfd_t sfd, struct sockaddr *sa)
+{
+	struct nafconn *nconn;
+
+	if ((naf_conn__maxconns > 0) &&
+			(naf_conn__openconns >= (naf_u32_t)naf_conn__maxconns)) {
+		if (naf_conn__debug > 0)
+			dvprintf(ourmodule, "refused incoming connection; already have %lu open\n", naf_conn__openconns);
+		acceptstats.refused_maxconns++;
+		nbio_sfd_close(&gnb, sfd);
+		return -1;
+	}
+
+	if ((sa->sa_family == AF_INET) &&
+			!acceptsrc_admit(((struct sockaddr_in *)sa)->sin_addr.s_addr)) {
+		if (naf_conn__debug > 0)
+			dvprintf(ourmodule, "refused incoming connection from %s; over acceptrate\n", inet_ntoa(((struct sockaddr_in *)sa)->sin_addr));
+		acceptstats.refused_rate++;
+		nbio_sfd_close(&gnb, sfd);
+		return -1;
 	}
 
 	nconn = naf_conn_addconn(NULL /* no owner yet */, sfd,
@@ -460,15 +1257,17 @@ static int connhandler_incomingconn(nbio_fd_t *fdt)
 		if (naf_conn__debug > 0)
 			dprintf(ourmodule, "connhandler_incoming: addconn failed\n");
 		nbio_sfd_close(&gnb, sfd);
-		return 0;
+		return -1;
 	}
 
+	acceptstats.accepted++;
+
 	if (lconn->owner) {
 
 		if (naf_conn__debug > 0) {
 			dvprintf(ourmodule, "[fd %d, cid %lu] forcing ownership to %s\n", nconn->fdt->fd, nconn->cid, lconn->owner);
 		}
-		nconn->owner = lconn->owner;
+		naf_conn__setowner(nconn, lconn->owner);
 
 		/*
 		 * Allow the new owner to set up the connection flags.
@@ -489,37 +1288,119 @@ static int connhandler_incomingconn(nbio_fd_t *fdt)
 		naf_conn_setraw(nconn, 2); /* XXX #define */
 	}
 
-	return 0;
+	return 0;
+}
+
+/*
+ * Take up to acceptbudget connections off the backlog.  Listeners are
+ * non-blocking, so we stop early as soon as it's empty.
+ */
+static int connhandler_incomingconn(nbio_fd_t *fdt)
+{
+	struct nafconn *lconn = (struct nafconn *)fdt->priv;
+	int i;
+
+	if (naf_conn__debug > 1)
+		dvprintf(ourmodule, "connhandler_incomingconn(%p [fd %d, cid %d])\n", fdt, fdt->fd, lconn->cid);
+
+	acceptstats.acceptbatches++;
+
+	for (i = 0; i < naf_conn__acceptbudget; i++) {
+		nbio_sockfd_t sfd;
+		struct sockaddr sa;
+		int salen = sizeof(sa);
+
+		sfd = connio->getincomingconn(fdt, &sa, &salen);
+		if (sfd == -1) {
+#ifdef ECONNABORTED
+			if (errno == ECONNABORTED)
+				continue; /* gone before we got to it */
+#endif
+			if ((errno == EMFILE) || (errno == ENFILE))
+				refusenofiles(fdt);
+			break; /* most errors here are meaningless. */
+		}
+
+		/* we use this as an incoming connection counter on listeners */
+		lconn->lasttx_hard++;
+
+		acceptconn(lconn, sfd, &sa);
+	}
+
+	return 0;
+}
+
+static int connhandler(void *nbv, int event, nbio_fd_t *fdt)
+{
+
+	if (!nbv || !fdt || !fdt->priv)
+		return -1;
+
+	if (naf_conn__debug)
+		dvprintf(ourmodule, "connhandler(event = %d, fdt = %p [fd %d])\n", event, fdt, fdt->fd);
+
+	if (event == NBIO_EVENT_READ)
+		return connhandler_read(fdt);
+	else if (event == NBIO_EVENT_WRITE)
+		return connhandler_write(fdt);
+	else if ((event == NBIO_EVENT_ERROR) || (event == NBIO_EVENT_EOF))
+		return connhandler_eof(fdt);
+	else if (event == NBIO_EVENT_INCOMINGCONN)
+		return connhandler_incomingconn(fdt);
+
+	return -1;
+}
+
+static void detecttimeout(struct nafmodule *mod, struct naf_timer *timer, void *data)
+{
+	struct nafconn *conn = (struct nafconn *)data;
+
+	if (!(conn->type & NAF_CONN_TYPE_DETECTING))
+		return;
+
+	naf_timer_cancel(&CONNENT(conn)->detectretry);
+	naf_conn_setraw(conn, 0); /* clear raw mode */
+
+	if (naf_module__protocoldetecttimeout(mod, conn) <= 0) {
+		dvprintf(mod, "no one wants to deal with timed out protocol detect on %d\n", conn->fdt->fd);
+		naf_conn_schedulekill(conn);
+	}
+
+	return;
 }
 
-static int connhandler(void *nbv, int event, nbio_fd_t *fdt)
+static void detectretry(struct nafmodule *mod, struct naf_timer *timer, void *data)
 {
+	struct nafconn *conn = (struct nafconn *)data;
 
-	if (!nbv || !fdt || !fdt->priv)
-		return -1;
+	if (conn->type & NAF_CONN_TYPE_DETECTING)
+		naf_conn_setraw(conn, 2); /* XXX #define */
 
-	if (naf_conn__debug)
-		dvprintf(ourmodule, "connhandler(event = %d, fdt = %p [fd %d])\n", event, fdt, fdt->fd);
+	return;
+}
 
-	if (event == NBIO_EVENT_READ)
-		return connhandler_read(fdt);
-	else if (event == NBIO_EVENT_WRITE)
-		return connhandler_write(fdt);
-	else if ((event == NBIO_EVENT_ERROR) || (event == NBIO_EVENT_EOF))
-		return connhandler_eof(fdt);
-	else if (event == NBIO_EVENT_INCOMINGCONN)
-		return connhandler_incomingconn(fdt);
+/*
+ * Look at what a DETECTING connection has sent without taking it off the
+ * socket, so whoever ends up owning it still gets all of it.
+ */
+int naf_conn__peek(struct nafconn *conn, naf_u8_t *buf, int buflen)
+{
 
-	return -1;
+	if (!conn || !conn->fdt || !buf || (buflen <= 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return recv(conn->fdt->fd, buf, buflen, MSG_PEEK | MSG_DONTWAIT);
 }
 
 static struct nafconn *naf_conn_alloc(void)
 {
 	struct nafconn *nc;
 
-	if (!(nc = (struct nafconn *)naf_malloc(ourmodule, sizeof(struct nafconn))))
+	if (!(nc = (struct nafconn *)naf_slab_alloc(conn__slab)))
 		return NULL;
-	memset(nc, 0, sizeof(struct nafconn));
+	memset(nc, 0, naf_slab_objlen(nc));
 
 	nc->cid = naf_conn__nextcid++;
 
@@ -527,6 +1408,7 @@ static struct nafconn *naf_conn_alloc(void)
 		dvprintf(ourmodule, "naf_conn_alloc: %p (cid %d)\n", nc, nc->cid);
 
 	naf_conn__openconns++;
+	conn__register(CONNENT(nc));
 
 	return nc;
 }
@@ -581,38 +1463,31 @@ static int fillendpoints(struct nafconn *conn)
 	return 0;
 }
 
-struct nafconn *naf_conn_addconn(struct nafmodule *mod, nbio_sockfd_t fd, naf_u32_t type)
+/*
+ * Everything but the socket.  Only startconnect() uses this directly, to
+ * get an endpoint it can hand back before the name has been resolved.
+ */
+static struct nafconn *conn__new(struct nafmodule *mod, naf_u32_t type)
 {
 	struct nafconn *newconn;
-	int nbtype;
-
-	if (type & NAF_CONN_TYPE_LISTENER)
-		nbtype = NBIO_FDTYPE_LISTENER;
-	else if (type & NAF_CONN_TYPE_DATAGRAM)
-		nbtype = NBIO_FDTYPE_DGRAM;
-	else
-		nbtype = NBIO_FDTYPE_STREAM;
 
 	if (!(newconn = naf_conn_alloc()))
 		return NULL;
 
-	/*
-	 * The Tx buffer length is huge so that we have enough to send out
-	 * lots of buddy updates real fast.  This is necessary for the initial
-	 * presence when resuming sessions, for example.  (Yes, I know this is
-	 * a crappy solution.)
-	 */
-	if (!(newconn->fdt = nbio_addfd(&gnb, nbtype, fd, 0, connhandler, (void *)newconn, 1, 220))) {
-		dperror(NULL, "nbio_addfd");
-		naf_conn_free(newconn);
-		return NULL;
-	}
 	newconn->type = type;
 	newconn->endpoint = NULL;
 
 	newconn->owner = mod;
 	newconn->parent = NULL;
 
+	conn__index(CONNENT(newconn));
+
+	if (newconn->type & NAF_CONN_TYPE_DETECTING) {
+		naf_timer_init(&CONNENT(newconn)->detecttimer, ourmodule, detecttimeout, (void *)newconn);
+		naf_timer_arm(&CONNENT(newconn)->detecttimer, NAF_CONN_DETECT_TIMEOUT * 1000);
+		naf_timer_init(&CONNENT(newconn)->detectretry, ourmodule, detectretry, (void *)newconn);
+	}
+
 	newconn->lastrx = time(NULL);
 	newconn->lastrx2 = 0;
 	newconn->lasttx_soft = newconn->lasttx_hard = 0;
@@ -628,12 +1503,58 @@ struct nafconn *naf_conn_addconn(struct nafmodule *mod, nbio_sockfd_t fd, naf_u3
 	memset(&newconn->remoteendpoint, 0, sizeof(newconn->remoteendpoint));
 	memset(&newconn->localendpoint, 0, sizeof(newconn->localendpoint));
 
-	if ((newconn->type & NAF_CONN_TYPE_CONNECTING))
-		naf_conn_setraw(newconn, 1);
-	else if (newconn->type & NAF_CONN_TYPE_READRAW)
-		naf_conn_setraw(newconn, 2); /* XXX #define */
+	return newconn;
+}
+
+static int conn__attach(struct nafconn *conn, nbio_sockfd_t fd)
+{
+	int nbtype;
+
+	if (conn->type & NAF_CONN_TYPE_LISTENER)
+		nbtype = NBIO_FDTYPE_LISTENER;
+	else if (conn->type & NAF_CONN_TYPE_DATAGRAM)
+		nbtype = NBIO_FDTYPE_DGRAM;
+	else
+		nbtype = NBIO_FDTYPE_STREAM;
+
+	/*
+	 * The Tx buffer length is huge so that we have enough to send out
+	 * lots of buddy updates real fast.  This is necessary for the initial
+	 * presence when resuming sessions, for example.  (Yes, I know this is
+	 * a crappy solution.)
+	 */
+	if (!(conn->fdt = getconnio()->addfd(nbtype, fd, connhandler, (void *)conn, 1, 220))) {
+		dperror(NULL, "addfd");
+		return -1;
+	}
+
+	if ((conn->type & NAF_CONN_TYPE_CONNECTING))
+		naf_conn_setraw(conn, 1);
+	else if (conn->type & NAF_CONN_TYPE_READRAW)
+		naf_conn_setraw(conn, 2); /* XXX #define */
 	else
-		fillendpoints(newconn);
+		fillendpoints(conn);
+
+	if (naf_conn__txcork && (nbtype == NBIO_FDTYPE_STREAM))
+		connio->setcork(conn->fdt, 1);
+
+	flushpendvecs(conn);
+
+	return 0;
+}
+
+struct nafconn *naf_conn_addconn(struct nafmodule *mod, nbio_sockfd_t fd, naf_u32_t type)
+{
+	struct nafconn *newconn;
+
+	if (!(newconn = conn__new(mod, type)))
+		return NULL;
+
+	if (conn__attach(newconn, fd) == -1) {
+		newconn->owner = NULL; /* they never saw it */
+		naf_conn_free(newconn);
+		return NULL;
+	}
 
 	return newconn;
 }
@@ -651,7 +1572,12 @@ struct nafconn *naf_conn_getparent(struct nafconn *conn)
 
 int naf_conn__poll(int timeout)
 {
-	return nbio_poll(&gnb, timeout);
+	int ret;
+
+	ret = getconnio()->poll(timeout);
+	conn__reap();
+
+	return ret;
 }
 
 static void dumpbox(struct nafmodule *mod, const char *prefix, naf_conn_cid_t cid, unsigned char *buf, int len)
@@ -676,19 +1602,25 @@ static void dumpbox(struct nafmodule *mod, const char *prefix, naf_conn_cid_t ci
 int naf_conn_reqread(struct nafconn *conn, unsigned char *buf, int buflen, int offset)
 {
 
-	if (!conn || !conn->fdt || !buf || (buflen <= 0))
+	if (!conn || !buf || (buflen <= 0))
 		return -1;
 
 	if (naf_conn__debug > 2)
 		dvprintf(ourmodule, "adding read buffer (%p) of length %d (offset %d) to cid %ld\n", buf, buflen, offset, conn->cid);
 
-	return nbio_addrxvector(&gnb, conn->fdt, buf, buflen, offset);
+	if (!conn->fdt && (CONNENT(conn)->flags & CONNENT_FLAG_RESOLVING))
+		return addpendvec(conn, 0, buf, buflen, offset);
+	if (!conn->fdt)
+		return -1;
+
+	return connio->addrxvector(conn->fdt, buf, buflen, offset);
 }
 
 int naf_conn_reqwrite(struct nafconn *conn, unsigned char *buf, int buflen)
 {
 
-	if (!conn || !conn->fdt || !buf || (buflen <= 0)) {
+	if (!conn || !buf || (buflen <= 0) ||
+			(!conn->fdt && !(CONNENT(conn)->flags & CONNENT_FLAG_RESOLVING))) {
 		errno = EINVAL;
 		return -1;
 	}
@@ -697,7 +1629,11 @@ int naf_conn_reqwrite(struct nafconn *conn, unsigned char *buf, int buflen)
 		dumpbox(ourmodule, "out", conn->cid, buf, buflen);
 
 	conn->lasttx_soft = time(NULL);
-	return nbio_addtxvector(&gnb, conn->fdt, buf, buflen);
+
+	if (!conn->fdt)
+		return addpendvec(conn, 1, buf, buflen, 0);
+
+	return connio->addtxvector(conn->fdt, buf, buflen);
 }
 
 int naf_conn_takeread(struct nafconn *conn, unsigned char **bufp, int *buflenp)
@@ -709,7 +1645,7 @@ int naf_conn_takeread(struct nafconn *conn, unsigned char **bufp, int *buflenp)
 		return -1;
 	}
 
-	*bufp = nbio_remtoprxvector(&gnb, conn->fdt, buflenp, &offset);
+	*bufp = connio->remtoprxvector(conn->fdt, buflenp, &offset);
 
 	if (naf_conn__debug > 2)
 		dumpbox(ourmodule, "in", conn->cid, *bufp, offset);
@@ -717,6 +1653,41 @@ int naf_conn_takeread(struct nafconn *conn, unsigned char **bufp, int *buflenp)
 	return *bufp ? *buflenp : -1;
 }
 
+/*
+ * For READRAW connections, which do their own reading instead of queueing
+ * buffers: read whatever is waiting, up to buflen.  Returns the number of
+ * bytes read, 0 if there wasn't anything, or -1 on EOF or error.
+ */
+int naf_conn_read(struct nafconn *conn, unsigned char *buf, int buflen)
+{
+	int n;
+
+	if (!conn || !conn->fdt || !buf || (buflen <= 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Anything the backend read before it went raw comes first. */
+	if (connio->readheld && ((n = connio->readheld(conn->fdt, buf, buflen)) > 0)) {
+		if (naf_conn__debug > 2)
+			dumpbox(ourmodule, "in", conn->cid, buf, n);
+		return n;
+	}
+
+	if ((n = nbio_sfd_read(&gnb, conn->fdt->fd, buf, buflen)) == -1) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return 0;
+		return -1;
+	}
+	if (n == 0)
+		return -1;
+
+	if (naf_conn__debug > 2)
+		dumpbox(ourmodule, "in", conn->cid, buf, n);
+
+	return n;
+}
+
 int naf_conn_takewrite(struct nafconn *conn, unsigned char **bufp, int *buflenp)
 {
 	int offset;
@@ -726,7 +1697,7 @@ int naf_conn_takewrite(struct nafconn *conn, unsigned char **bufp, int *buflenp)
 		return -1;
 	}
 
-	*bufp = nbio_remtoptxvector(&gnb, conn->fdt, buflenp, &offset);
+	*bufp = connio->remtoptxvector(conn->fdt, buflenp, &offset);
 
 	if (naf_conn__debug > 2)
 		dumpbox(ourmodule, "backout", conn->cid, *bufp, *buflenp);
@@ -745,9 +1716,9 @@ int naf_conn_setdelim(struct nafmodule *mod, struct nafconn *conn, const unsigne
 		return -1;
 
 	if (!delim || !delimlen)
-		return nbio_cleardelim(conn->fdt);
+		return connio->cleardelim(conn->fdt);
 
-	return nbio_adddelim(&gnb, conn->fdt, delim, delimlen);
+	return connio->adddelim(conn->fdt, delim, delimlen);
 }
 
 static void updaterawmode(struct nafconn *conn)
@@ -831,78 +1802,169 @@ char *naf_conn_getlocaladdrstr(struct nafmodule *mod, struct nafconn *conn)
 	return ret;
 }
 
-/* port can be overridden if the hostname is in host:port syntax */
-int naf_conn_startconnect(struct nafmodule *mod, struct nafconn *localconn, const char *host, int port)
+/*
+ * Open the socket and start the non-blocking connect for an endpoint that
+ * was created by naf_conn_startconnect().
+ */
+static int conn__connect(struct nafconn *conn, struct in_addr *addr, int port)
 {
 	nbio_sockfd_t sfd;
-	struct hostent *h;
-	char newhost[256];
 	struct sockaddr_in sai;
-	int status, inprogress = 0;
-
-	if (!mod || !localconn || !host)
-		return -1;
-
-	strncpy(newhost, host, sizeof(newhost));
-	if (strchr(newhost, ':')) {
-		port = atoi(strchr(newhost, ':')+1);
-		*(strchr(newhost, ':')) = '\0';
-	}
-
-	if (naf_conn__debug)
-		dvprintf(mod, "starting non-blocking connect to %s port %d\n", newhost, port);
-
-
-	/* XXX XXX XXX this blocks!!! */
-	if (!(h = gethostbyname(newhost))) {
-		dvprintf(mod, "gethostbyname failed for %s\n", newhost);
-		return -1;
-	}
-	if (naf_conn__debug)
-		dvprintf(mod, "gethostbyname finished (%s)\n", newhost);
+	int status;
 
 	memset(&sai, 0, sizeof(struct sockaddr_in));
-	memcpy(&sai.sin_addr.s_addr, h->h_addr, 4);
+	memcpy(&sai.sin_addr, addr, sizeof(struct in_addr));
 	sai.sin_family = AF_INET;
 	sai.sin_port = htons((naf_u16_t)port);
 
-
 	/*
 	 * We can't use nbio_connect() because that won't give us a real
-	 * fdt until the connection is finished.  Many naf-using applications
-	 * rely on having a valid conn->endpoint immediately after calling this
-	 * function.  We can still use libnbio's socket primitive wrappers,
-	 * though.
+	 * fdt until the connection is finished.  We can still use libnbio's
+	 * socket primitive wrappers, though.
 	 */
 	if ((sfd = nbio_sfd_new_stream(&gnb)) == -1) {
-		dvprintf(mod, "nbio_sock_new_stream() failed: %s\n", strerror(errno));
+		dvprintf(ourmodule, "nbio_sock_new_stream() failed: %s\n", strerror(errno));
 		return -1;
 	}
 
 	if (nbio_sfd_setnonblocking(&gnb, sfd) == -1) {
-		dvprintf(mod, "nbio_sfd_setnonblocking() failed: %s\n", strerror(errno));
+		dvprintf(ourmodule, "nbio_sfd_setnonblocking() failed: %s\n", strerror(errno));
 		nbio_sfd_close(&gnb, sfd);
 		return -1;
 	}
 
+	/* Some backends start the connect themselves, once it's attached. */
+	if (getconnio()->connect) {
+
+		if (conn__attach(conn, sfd) == -1) {
+			nbio_sfd_close(&gnb, sfd);
+			return -1;
+		}
+
+		/* From here on, naf_conn_free() closes sfd. */
+		if (connio->connect(conn->fdt, (struct sockaddr *)&sai, sizeof(sai)) == -1) {
+			dvprintf(ourmodule, "[cid %lu] connect failed: %s\n", conn->cid, strerror(errno));
+			return -1;
+		}
+
+		if (naf_conn__debug)
+			dvprintf(ourmodule, "[cid %lu] connection started (%s)\n", conn->cid, connio->name);
+
+		return 0;
+	}
+
 	status = nbio_sfd_connect(&gnb, sfd, (struct sockaddr *)&sai, sizeof(sai));
 	if ((status == -1) && (errno != EINPROGRESS)) {
-		dvprintf(mod, "nbio_sfd_connect() failed: %s\n", strerror(errno));
+		dvprintf(ourmodule, "nbio_sfd_connect() failed: %s\n", strerror(errno));
 		nbio_sfd_close(&gnb, sfd);
 		return -1;
 	} else if (status == 0)
-		inprogress = 0;
-	else if ((status == -1) && (errno == EINPROGRESS))
-		inprogress = NAF_CONN_TYPE_CONNECTING;
+		conn->type &= ~NAF_CONN_TYPE_CONNECTING;
 
-	if (!(localconn->endpoint = naf_conn_addconn(NULL, sfd,
-					(localconn->type ^ NAF_CONN_TYPE_CLIENT) |
-					NAF_CONN_TYPE_SERVER |
-					inprogress/*inherit client type*/))) {
+	if (conn__attach(conn, sfd) == -1) {
 		nbio_sfd_close(&gnb, sfd);
 		return -1;
 	}
 
+	if (naf_conn__debug)
+		dvprintf(ourmodule, "[cid %lu] connection started (%d)\n", conn->cid, !!(conn->type & NAF_CONN_TYPE_CONNECTING));
+
+	return 0;
+}
+
+static void conn__resolved(void *data, int status, struct in_addr *addr)
+{
+	struct nafconn *conn;
+
+	/* It may have been killed while we were waiting. */
+	if (!(conn = naf_conn_findbycid(ourmodule, (naf_conn_cid_t)data)) ||
+			!(CONNENT(conn)->flags & CONNENT_FLAG_RESOLVING))
+		return;
+
+	CONNENT(conn)->flags &= ~CONNENT_FLAG_RESOLVING;
+
+	if (status == -1) {
+		dvprintf(ourmodule, "[cid %lu] unable to resolve remote host\n", conn->cid);
+		naf_conn_free(conn);
+		return;
+	}
+
+	if (conn__connect(conn, addr, CONNENT(conn)->resolveport) == -1)
+		naf_conn_free(conn);
+
+	return;
+}
+
+/*
+ * Allocate a connection of the given type and get it connecting to
+ * host:port.  If the hostname has to be looked up first, the connection has
+ * no fdt until the lookup finishes; reads and writes requested on it are
+ * queued up, and naf_conn_schedulekill() just throws it away.  If the lookup
+ * fails, it's killed like any other failed connection.
+ *
+ * port can be overridden if the hostname is in host:port syntax.
+ */
+static struct nafconn *conn__startconnect(struct nafmodule *mod, naf_u32_t type, const char *host, int port)
+{
+	struct nafconn *conn;
+	struct in_addr addr;
+	char newhost[256];
+	int ret;
+
+	strncpy(newhost, host, sizeof(newhost));
+	newhost[sizeof(newhost) - 1] = '\0';
+	if (strchr(newhost, ':')) {
+		port = atoi(strchr(newhost, ':')+1);
+		*(strchr(newhost, ':')) = '\0';
+	}
+
+	if (naf_conn__debug)
+		dvprintf(mod, "starting non-blocking connect to %s port %d\n", newhost, port);
+
+	if (!(conn = conn__new(NULL, type)))
+		return NULL;
+
+	if ((ret = naf_resolver__lookup(newhost, &addr, conn__resolved, (void *)conn->cid)) == -1) {
+		dvprintf(mod, "unable to resolve %s\n", newhost);
+		naf_conn_free(conn);
+		return NULL;
+	}
+
+	if (ret == 1) {
+		if (conn__connect(conn, &addr, port) == -1) {
+			naf_conn_free(conn);
+			return NULL;
+		}
+	} else {
+		if (naf_conn__debug)
+			dvprintf(mod, "[cid %lu] waiting for %s to resolve\n", conn->cid, newhost);
+		CONNENT(conn)->flags |= CONNENT_FLAG_RESOLVING;
+		CONNENT(conn)->resolveport = port;
+	}
+
+	return conn;
+}
+
+/*
+ * Many naf-using applications rely on having a valid conn->endpoint
+ * immediately after calling this function, so one is always returned, even
+ * if the hostname has to be looked up first (see conn__startconnect()).
+ */
+int naf_conn_startconnect(struct nafmodule *mod, struct nafconn *localconn, const char *host, int port)
+{
+	struct nafconn *endpoint;
+
+	if (!mod || !localconn || !host)
+		return -1;
+
+	if (!(endpoint = conn__startconnect(mod, (localconn->type ^ NAF_CONN_TYPE_CLIENT) |
+					NAF_CONN_TYPE_SERVER |
+					NAF_CONN_TYPE_CONNECTING /*inherit client type*/,
+					host, port)))
+		return -1;
+
+	localconn->endpoint = endpoint;
+
 	if (localconn->owner && localconn->owner->takeconn)
 		localconn->owner->takeconn(mod, localconn->endpoint);
 
@@ -913,17 +1975,36 @@ int naf_conn_startconnect(struct nafmodule *mod, struct nafconn *localconn, cons
 	}
 
 	/* endpoint inherits module owner */
-	localconn->endpoint->owner = localconn->owner;
+	naf_conn__setowner(localconn->endpoint, localconn->owner);
 
 	/* loop them together */
 	localconn->endpoint->endpoint = localconn;
 
-	if (naf_conn__debug)
-		dvprintf(mod, "connection started (%d)\n", !!inprogress);
-
 	return 0;
 }
 
+/*
+ * Start a connection of our own, rather than one on behalf of a client: it
+ * belongs to mod from the start, and has no endpoint.  Reads and writes can
+ * be requested on it right away, same as with naf_conn_startconnect().
+ */
+struct nafconn *naf_conn_connect(struct nafmodule *mod, const char *host, int port, naf_u32_t type)
+{
+	struct nafconn *conn;
+
+	if (!mod || !host)
+		return NULL;
+
+	if (!(conn = conn__startconnect(mod, type | NAF_CONN_TYPE_SERVER | NAF_CONN_TYPE_CONNECTING, host, port)))
+		return NULL;
+
+	naf_conn__setowner(conn, mod);
+	if (mod->takeconn)
+		mod->takeconn(mod, conn);
+
+	return conn;
+}
+
 static const char *gettypestr(naf_u32_t type)
 {
 	static char buf[512];
@@ -1049,6 +2130,15 @@ static int listconns_matcher(struct nafmodule *mod, struct nafconn *conn, const
 
 		if (conn->type & NAF_CONN_TYPE_LISTENER)
 			naf_rpc_addarg_scalar(mod, carg, "acceptcount", conn->lasttx_hard);
+		else if (conn->fdt) {
+			naf_u32_t calls, bytes;
+
+			if (connio->gettxstats(conn->fdt, &calls, &bytes) == 0) {
+				naf_rpc_addarg_scalar(mod, carg, "txcalls", calls);
+				naf_rpc_addarg_scalar(mod, carg, "txbytes", bytes);
+				naf_rpc_addarg_scalar(mod, carg, "txbytespercall", calls ? (bytes / calls) : 0);
+			}
+		}
 
 		if (lci->wanttags) {
 			naf_rpc_arg_t **tags;
@@ -1096,7 +2186,13 @@ static void __rpc_conn_getconninfo(struct nafmodule *mod, naf_rpc_req_t *req)
 		lci.wanttags = wt->data.boolean;
 	}
 
-	naf_conn_find(mod, listconns_matcher, (void *)&lci);
+	if (lci.cid) {
+		struct nafconn *conn;
+
+		if ((conn = naf_conn_findbycid(mod, (naf_conn_cid_t)lci.cid->data.scalar)))
+			listconns_matcher(mod, conn, (void *)&lci);
+	} else
+		naf_conn_find(mod, listconns_matcher, (void *)&lci);
 
 	req->status = NAF_RPC_STATUS_SUCCESS;
 
@@ -1108,48 +2204,53 @@ static int modinit(struct nafmodule *mod)
 
 	ourmodule = mod;
 
-	/* XXX some question about the correct value of this number. */
-	nbio_init(&gnb, 32768);
-
 	naf_rpc_register_method(mod, "getconninfo", __rpc_conn_getconninfo, "Retrieve connection information");
 	naf_rpc_register_method(mod, "getconnstats", __rpc_conn_getconnstats, "Retrieve connection statistics");
 
-	return 0;
-}
+	memset(acceptsrc__hash, 0, sizeof(acceptsrc__hash));
+	reservefd_open();
 
-static int modshutdown(struct nafmodule *mod)
-{
+	/*
+	 * These are never destroyed, since connections can outlive the
+	 * module on the way out.
+	 */
+	if (!conn__slab)
+		conn__slab = naf_slab_create(mod, "connections", sizeof(struct connent), CONN_SLABOBJS);
+	if (!conn__pendvecslab)
+		conn__pendvecslab = naf_slab_create(mod, "pendvecs", sizeof(struct connpendvec), CONN_SLABOBJS);
+	if (!conn__slab || !conn__pendvecslab)
+		return -1;
 
-	ourmodule = NULL;
+	naf_stats_register_longstat(mod, "accept.accepted", &acceptstats.accepted);
+	naf_stats_register_longstat(mod, "accept.batches", &acceptstats.acceptbatches);
+	naf_stats_register_longstat(mod, "accept.refused.maxconns", &acceptstats.refused_maxconns);
+	naf_stats_register_longstat(mod, "accept.refused.rate", &acceptstats.refused_rate);
+	naf_stats_register_longstat(mod, "accept.refused.nofiles", &acceptstats.refused_nofiles);
 
 	return 0;
 }
 
-static int timerhandler_matcher(struct nafmodule *mod, struct nafconn *conn, const void *data)
+static int modshutdown(struct nafmodule *mod)
 {
 
-	if (!(conn->type & NAF_CONN_TYPE_DETECTING))
-	       return 0;
-
-	if ((time(NULL) - conn->lastrx) < NAF_CONN_DETECT_TIMEOUT)
-		return 0;
-
-	naf_conn_setraw(conn, 0); /* clear raw mode */
-
-	if (naf_module__protocoldetecttimeout(mod, conn) <= 0) {
-		dvprintf(mod, "no one wants to deal with timed out protocol detect on %d\n", conn->fdt->fd);
-		naf_conn_schedulekill(conn);
+	acceptsrc_expire(1);
+	if (naf_conn__reservefd != -1) {
+		close(naf_conn__reservefd);
+		naf_conn__reservefd = -1;
 	}
 
+	ourmodule = NULL;
+
 	return 0;
 }
 
 static void timerhandler(struct nafmodule *mod)
 {
 
-	naf_conn_find(mod, timerhandler_matcher, NULL);
+	if (connio)
+		connio->cleanuponly();
 
-	nbio_cleanuponly(&gnb);
+	acceptsrc_expire(0);
 
 	return;
 }
@@ -1164,6 +2265,13 @@ static struct nafconn *listenestablish(struct nafmodule *mod, const char *addr,
 		return NULL;
 	}
 
+	/* incomingconn() keeps accepting until the backlog is empty */
+	if (nbio_sfd_setnonblocking(&gnb, sfd) == -1) {
+		dvprintf(mod, "nbio_sfd_setnonblocking() failed: %s\n", strerror(errno));
+		nbio_sfd_close(&gnb, sfd);
+		return NULL;
+	}
+
 	if (!(retconn = naf_conn_addconn(nowner, sfd, NAF_CONN_TYPE_LISTENER))) {
 		dprintf(mod, "unable to add connection for listener\n");
 		nbio_sfd_close(&gnb, sfd);
@@ -1203,7 +2311,7 @@ static struct nafconn *findlistenport(struct nafmodule *mod, const char *addr, u
 	}
 	sin.sin_port = htons(port);
 
-	return naf_conn_find(mod, findlistenport_matcher, (const void *)&sin);
+	return naf_conn_findbytype(mod, NAF_CONN_TYPE_LISTENER, findlistenport_matcher, (const void *)&sin);
 }
 
 static int listenport_isconfigured(struct nafmodule *mod, const char *inaddr, unsigned short inport)
@@ -1274,7 +2382,7 @@ static void cleanlisteners(struct nafmodule *mod)
 
 
 	/* Remove unconfigured ports */
-	naf_conn_find(mod, cleanlisteners_matcher, NULL);
+	naf_conn_findbytype(mod, NAF_CONN_TYPE_LISTENER, cleanlisteners_matcher, NULL);
 
 
 	/* Add newly configured ports */
@@ -1354,6 +2462,16 @@ static void signalhandler(struct nafmodule *mod, struct nafmodule *source, int s
 			dvprintf(mod, "assuming incoming connections on %s\n", extip);
 
 		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "debug", naf_conn__debug, NAF_CONN_DEBUG_DEFAULT);
+		NAFCONFIG_UPDATEBOOLMODPARMDEF(mod, "txcork", naf_conn__txcork, NAF_CONN_TXCORK_DEFAULT);
+
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "acceptbudget", naf_conn__acceptbudget, NAF_CONN_ACCEPTBUDGET_DEFAULT);
+		if (naf_conn__acceptbudget < 1)
+			naf_conn__acceptbudget = 1;
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "maxconns", naf_conn__maxconns, NAF_CONN_MAXCONNS_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "acceptrate", naf_conn__acceptrate, NAF_CONN_ACCEPTRATE_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "acceptburst", naf_conn__acceptburst, NAF_CONN_ACCEPTBURST_DEFAULT);
+		if ((naf_conn__acceptrate <= 0) || (naf_conn__acceptburst <= 0))
+			acceptsrc_expire(1);
 
 		cleanlisteners(mod);
 
@@ -1369,7 +2487,7 @@ static int modfirst(struct nafmodule *mod)
 	mod->init = modinit;
 	mod->shutdown = modshutdown;
 	mod->signal = signalhandler;
-	mod->timerfreq = NAF_CONN_DETECT_TIMEOUT;
+	mod->timerfreq = NAF_TIMER_ACCURACY;
 	mod->timer = timerhandler;
 
 	return 0;
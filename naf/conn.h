@@ -27,6 +27,10 @@
 /* pulled in by daemon.c for the main loop */
 int naf_conn__poll(int timeout);
 
+/* module.c uses this when protocol detection picks an owner */
+void naf_conn__setowner(struct nafconn *conn, struct nafmodule *owner);
+int naf_conn__peek(struct nafconn *conn, naf_u8_t *buf, int buflen);
+
 #endif /* ndef __PLUGINREGONLY */
 
 int naf_conn__register(void);
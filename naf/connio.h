@@ -0,0 +1,89 @@
+/*
+ * naf - Networked Application Framework
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * naf is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * naf is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __CONNIO_H__
+#define __CONNIO_H__
+
+#include <naf/nafmodule.h>
+#include <naf/nafconn.h>
+
+/*
+ * I/O backends for conn.c.
+ *
+ * Every backend speaks the subset of libnbio semantics that conn.c depends
+ * on: per-fd Rx/Tx buffer vectors, delimited reads, raw modes (1 = fully
+ * raw, 2 = READRAW), close-on-flush, and the NBIO_EVENT_* callbacks.  The
+ * handles are plain nbio_fd_t's so that conn->fdt->fd keeps working
+ * everywhere; only the fd, priv, and next fields may be touched outside of
+ * the backend itself.
+ *
+ * The backend is picked the first time a connection is added, which is
+ * after the config file has been read (see conn.c:getconnio()).
+ *
+ * connect() is optional.  If the backend has one, conn.c adds outgoing
+ * sockets before they're connected (in raw mode 1) and leaves the connect
+ * to the backend, which reports the result with a WRITE event (or ERROR,
+ * with errno set).  Otherwise conn.c connects the socket itself and waits
+ * for it to become writable.
+ *
+ * readheld() is optional too: a backend that reads ahead of the owner can
+ * be left holding data when the owner switches to raw mode and reads for
+ * itself.  It hands over up to buflen bytes of that, returning how many (0
+ * if there's nothing held), and naf_conn_read() takes it before going to
+ * the socket.
+ */
+
+typedef int (*naf_connio_handler_t)(void *, int, nbio_fd_t *);
+
+struct naf_connio {
+	const char *name;
+
+	int (*init)(struct nafmodule *mod);
+	nbio_fd_t *(*fdlist)(void);
+	int (*poll)(int timeout);
+	int (*cleanuponly)(void);
+
+	nbio_fd_t *(*addfd)(int type, nbio_sockfd_t fd, naf_connio_handler_t handler, void *priv, int rxlen, int txlen);
+	int (*closefdt)(nbio_fd_t *fdt);
+	nbio_sockfd_t (*getincomingconn)(nbio_fd_t *fdt, struct sockaddr *sa, int *salen);
+	int (*connect)(nbio_fd_t *fdt, const struct sockaddr *sa, int salen); /* optional */
+
+	int (*setraw)(nbio_fd_t *fdt, int val);
+	int (*setcloseonflush)(nbio_fd_t *fdt, int val);
+	int (*setcork)(nbio_fd_t *fdt, int val); /* optional; -1 if unsupported */
+	int (*gettxstats)(nbio_fd_t *fdt, naf_u32_t *callsp, naf_u32_t *bytesp); /* same */
+	int (*adddelim)(nbio_fd_t *fdt, const unsigned char *delim, const unsigned char len);
+	int (*cleardelim)(nbio_fd_t *fdt);
+
+	int (*addrxvector)(nbio_fd_t *fdt, unsigned char *buf, int buflen, int offset);
+	int (*addtxvector)(nbio_fd_t *fdt, unsigned char *buf, int buflen);
+	unsigned char *(*remtoprxvector)(nbio_fd_t *fdt, int *len, int *offset);
+	unsigned char *(*remtoptxvector)(nbio_fd_t *fdt, int *len, int *offset);
+
+	int (*readheld)(nbio_fd_t *fdt, unsigned char *buf, int buflen); /* optional */
+};
+
+extern struct naf_connio naf_connio_nbio; /* connio_nbio.c */
+#ifdef NAF_USEEPOLL
+extern struct naf_connio naf_connio_epoll; /* connio_epoll.c */
+#endif
+#ifdef NAF_USEURING
+extern struct naf_connio naf_connio_uring; /* connio_uring.c */
+#endif
+
+#endif /* __CONNIO_H__ */
@@ -0,0 +1,990 @@
+/*
+ * naf - Networked Application Framework
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * naf is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * naf is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * epoll(7) backend for conn.c.
+ *
+ * libnbio rebuilds a pollfd array and scans every descriptor on every pass
+ * through the main loop, which gets expensive with a few thousand mostly
+ * idle OSCAR connections.  This backend keeps one persistent registration
+ * per descriptor and only touches the ones the kernel says are ready.
+ *
+ * Buffered descriptors (raw mode 0) are registered edge-triggered.  We
+ * remember which edges haven't been drained yet (CIO_FLAG_RREADY and
+ * CIO_FLAG_WREADY) so that buffers queued later by the owner still get
+ * serviced, by way of the pending list.  EPOLLOUT interest is only present
+ * while there is something in the Tx queue that the kernel wouldn't take.
+ *
+ * Raw descriptors (modes 1 and 2) and listeners are registered
+ * level-triggered, since it's the owner doing the reads (or accepts) and we
+ * have no way of knowing whether it drained the descriptor.
+ *
+ * Writes are never done from addtxvector(); the descriptor is put on the
+ * pending list instead, so everything queued during one pass through the
+ * main loop goes out in a single writev().  If the queue is longer than
+ * CIO_MAXIOV, the descriptor can be corked (setcork) so that the kernel
+ * doesn't push out a short segment between calls.
+ */
+
+#define _GNU_SOURCE /* accept4() */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#ifdef NAF_USEEPOLL
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <netinet/tcp.h>
+
+#include <naf/nafmodule.h>
+#include <naf/nafconn.h>
+
+#include "connio.h"
+
+#ifndef EPOLLRDHUP
+#define EPOLLRDHUP 0x2000
+#endif
+
+#define CIO_EPOLL_MAXEVENTS 256
+
+/*
+ * Max number of buffers completed on one descriptor per pass before
+ * moving on to the next, so one busy peer can't starve everyone else.
+ */
+#define CIO_EPOLL_RXBUDGET 16
+
+#define CIO_MAXDELIM 8
+
+/* Buffers per writev(); well under any IOV_MAX. */
+#define CIO_MAXIOV 64
+
+#define CIO_FLAG_CLOSED       0x0001
+#define CIO_FLAG_RREADY       0x0002 /* readable, haven't seen EAGAIN yet */
+#define CIO_FLAG_WREADY       0x0004 /* writable, haven't seen EAGAIN yet */
+#define CIO_FLAG_HUP          0x0008 /* peer closed; read until we get 0 */
+#define CIO_FLAG_CLOSEONFLUSH 0x0010
+#define CIO_FLAG_PENDING      0x0020 /* on pendlist */
+#define CIO_FLAG_NOPEEK       0x0040 /* can't MSG_PEEK (pipes, ttys) */
+#define CIO_FLAG_CORK         0x0080 /* cork around multi-call flushes */
+
+struct ciobuf {
+	unsigned char *data;
+	int len;
+	int offset;
+	struct ciobuf *next;
+};
+
+struct ciofd {
+	nbio_fd_t fdt; /* must be first */
+	int type;
+	int flags;
+	int raw;
+	naf_connio_handler_t handler;
+	naf_u32_t events; /* what's currently registered */
+
+	struct ciobuf *rxchain;
+	int rxcount, rxmax;
+	struct ciobuf *txchain, *txchain_tail;
+	int txcount, txmax;
+	naf_u32_t txcalls, txbytes;
+
+	unsigned char delim[CIO_MAXDELIM];
+	int delimlen;
+
+	struct ciofd *pendnext;
+};
+
+static struct nafmodule *ourmodule = NULL;
+static int cio_epfd = -1;
+static nbio_fd_t *cio_fdlist = NULL;
+static struct ciofd *cio_pendlist = NULL;
+static struct ciobuf *cio_buffreelist = NULL;
+static struct epoll_event cio_events[CIO_EPOLL_MAXEVENTS];
+static int cio_died = 0;
+
+
+static struct ciobuf *ciobuf_alloc(void)
+{
+	struct ciobuf *b;
+
+	if ((b = cio_buffreelist)) {
+		cio_buffreelist = b->next;
+		return b;
+	}
+
+	return (struct ciobuf *)naf_malloc(ourmodule, sizeof(struct ciobuf));
+}
+
+static void ciobuf_free(struct ciobuf *b)
+{
+
+	b->next = cio_buffreelist;
+	cio_buffreelist = b;
+
+	return;
+}
+
+static void cio_pend(struct ciofd *cf)
+{
+
+	if (cf->flags & (CIO_FLAG_PENDING | CIO_FLAG_CLOSED))
+		return;
+
+	cf->flags |= CIO_FLAG_PENDING;
+	cf->pendnext = cio_pendlist;
+	cio_pendlist = cf;
+
+	return;
+}
+
+static naf_u32_t cio_wantevents(struct ciofd *cf)
+{
+	naf_u32_t ev;
+
+	if (cf->type == NBIO_FDTYPE_LISTENER)
+		return EPOLLIN;
+
+	if (cf->raw == 1)
+		return EPOLLIN | EPOLLOUT;
+
+	if (cf->raw == 2)
+		ev = EPOLLIN;
+	else
+		ev = EPOLLIN | EPOLLRDHUP | EPOLLET;
+
+	if (cf->txchain && !(cf->flags & CIO_FLAG_WREADY))
+		ev |= EPOLLOUT;
+
+	return ev;
+}
+
+static int cio_updateevents(struct ciofd *cf)
+{
+	struct epoll_event ev;
+	naf_u32_t want;
+
+	if (cf->flags & CIO_FLAG_CLOSED)
+		return 0;
+
+	if ((want = cio_wantevents(cf)) == cf->events)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = want;
+	ev.data.ptr = cf;
+	if (epoll_ctl(cio_epfd, EPOLL_CTL_MOD, cf->fdt.fd, &ev) == -1) {
+		dvprintf(ourmodule, "epoll_ctl(MOD, %d): %s\n", cf->fdt.fd, strerror(errno));
+		return -1;
+	}
+	cf->events = want;
+
+	return 0;
+}
+
+/* Returns nonzero if the descriptor was closed or the handler wants out. */
+static int cio_fire(struct ciofd *cf, int event)
+{
+
+	if ((cf->flags & CIO_FLAG_CLOSED) || !cf->fdt.priv)
+		return 1;
+
+	if (cf->handler((void *)&cio_epfd, event, &cf->fdt) == -1)
+		cio_died = 1;
+
+	return (cf->flags & CIO_FLAG_CLOSED) || cio_died;
+}
+
+/*
+ * Look for the delimiter in the bytes we just peeked (or read), making
+ * sure to catch one that straddles a previous read.  Returns the index of
+ * the first byte after the delimiter, or -1.
+ */
+static int cio_finddelim(struct ciofd *cf, struct ciobuf *b, int newlen)
+{
+	int i;
+
+	i = b->offset - (cf->delimlen - 1);
+	if (i < 0)
+		i = 0;
+	for (; (i + cf->delimlen) <= (b->offset + newlen); i++) {
+		if (memcmp(b->data + i, cf->delim, cf->delimlen) == 0)
+			return i + cf->delimlen;
+	}
+
+	return -1;
+}
+
+/*
+ * Delimited reads.  The buffer is complete when the delimiter is seen (it's
+ * replaced with NULs so the owner can treat the buffer as a string), or
+ * when it fills up, just like a normal read.  We peek first so that we never
+ * consume anything past the delimiter, since that belongs in the next
+ * buffer.
+ *
+ * Returns the number of bytes read, 0 on EOF, or -1 on error.  *donep is
+ * set if the buffer is complete.
+ */
+static int cio_readdelim(struct ciofd *cf, struct ciobuf *b, int *donep)
+{
+	int n, end, space;
+
+	space = b->len - b->offset;
+	if (space <= 0) {
+		*donep = 1;
+		return 1;
+	}
+
+	n = -1;
+	if (!(cf->flags & CIO_FLAG_NOPEEK)) {
+		if (((n = recv(cf->fdt.fd, b->data + b->offset, space, MSG_PEEK)) == -1) &&
+				(errno == ENOTSOCK))
+			cf->flags |= CIO_FLAG_NOPEEK;
+		else if (n <= 0)
+			return n;
+	}
+
+	if (cf->flags & CIO_FLAG_NOPEEK) {
+		/* Slow path: one byte at a time. */
+		if ((n = read(cf->fdt.fd, b->data + b->offset, 1)) <= 0)
+			return n;
+		end = cio_finddelim(cf, b, n);
+	} else {
+		if ((end = cio_finddelim(cf, b, n)) != -1)
+			n = end - b->offset;
+		if ((n = read(cf->fdt.fd, b->data + b->offset, n)) <= 0)
+			return n;
+	}
+
+	b->offset += n;
+
+	if (end != -1) {
+		memset(b->data + end - cf->delimlen, 0, cf->delimlen);
+		*donep = 1;
+	} else if (b->offset >= b->len)
+		*donep = 1;
+
+	return n;
+}
+
+/*
+ * Fill the top Rx buffer as far as we can.  Returns 1 if the buffer was
+ * completed (READ fired), 0 if we ran out of data, -1 if the descriptor
+ * went away.
+ */
+static int cio_readone(struct ciofd *cf)
+{
+	struct ciobuf *b = cf->rxchain;
+	int want, n, done = 0;
+
+	want = b->len - b->offset;
+
+	if (cf->delimlen)
+		n = cio_readdelim(cf, b, &done);
+	else if (want <= 0)
+		n = done = 1;
+	else if ((n = read(cf->fdt.fd, b->data + b->offset, want)) > 0) {
+
+		b->offset += n;
+
+		/*
+		 * A short read on a stream means we drained it, and the
+		 * kernel will give us a new edge when more shows up.
+		 * Datagrams always complete the buffer.
+		 */
+		if ((cf->type == NBIO_FDTYPE_DGRAM) || (b->offset >= b->len))
+			done = 1;
+		else if ((n < want) && !(cf->flags & CIO_FLAG_HUP))
+			cf->flags &= ~CIO_FLAG_RREADY;
+	}
+
+	if (n > 0) {
+		if (!done)
+			return 0;
+		if (cio_fire(cf, NBIO_EVENT_READ))
+			return -1;
+		return 1;
+	}
+
+	if (n == 0) {
+		cf->flags &= ~CIO_FLAG_RREADY;
+		cio_fire(cf, NBIO_EVENT_EOF);
+		return -1;
+	}
+
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+		cf->flags &= ~CIO_FLAG_RREADY;
+		return 0;
+	}
+	if (errno == EINTR)
+		return 0;
+
+	cio_fire(cf, NBIO_EVENT_ERROR);
+	return -1;
+}
+
+static void cio_setcork(struct ciofd *cf, int val)
+{
+
+#ifdef TCP_CORK
+	setsockopt(cf->fdt.fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+#endif
+
+	return;
+}
+
+/*
+ * Tell the owner about buffers that have been completely written.  The
+ * owner is expected to take each one back as we go.  Returns -1 if the
+ * descriptor went away.
+ */
+static int cio_txdone(struct ciofd *cf, int n)
+{
+
+	while (cf->txchain) {
+		struct ciobuf *b = cf->txchain;
+		int left = b->len - b->offset;
+
+		if (n < left) {
+			b->offset += n;
+			return 0;
+		}
+		n -= left;
+		b->offset = b->len;
+
+		if (cio_fire(cf, NBIO_EVENT_WRITE))
+			return -1;
+
+		if (cf->txchain == b) {
+			dvprintf(ourmodule, "owner of fd %d did not take finished write buffer\n", cf->fdt.fd);
+			if (!(cf->txchain = b->next))
+				cf->txchain_tail = NULL;
+			cf->txcount--;
+			ciobuf_free(b);
+		}
+	}
+
+	return 0;
+}
+
+/* Returns -1 if the descriptor went away. */
+static int cio_flushtx(struct ciofd *cf)
+{
+	struct iovec iov[CIO_MAXIOV];
+	int corked = 0;
+
+	if ((cf->flags & CIO_FLAG_CORK) && (cf->txcount > CIO_MAXIOV)) {
+		cio_setcork(cf, 1);
+		corked = 1;
+	}
+
+	while (cf->txchain && (cf->flags & CIO_FLAG_WREADY)) {
+		struct ciobuf *b;
+		int n, cnt, total = 0;
+
+		for (b = cf->txchain, cnt = 0; b && (cnt < CIO_MAXIOV); b = b->next, cnt++) {
+			iov[cnt].iov_base = b->data + b->offset;
+			iov[cnt].iov_len = b->len - b->offset;
+			total += b->len - b->offset;
+		}
+
+		n = writev(cf->fdt.fd, iov, cnt);
+		if (n == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				cf->flags &= ~CIO_FLAG_WREADY;
+				break;
+			}
+			if (errno == EINTR)
+				continue;
+
+			cio_fire(cf, NBIO_EVENT_ERROR);
+			return -1;
+		}
+
+		cf->txcalls++;
+		cf->txbytes += n;
+
+		/* Socket buffer is full; wait for EPOLLOUT. */
+		if (n < total)
+			cf->flags &= ~CIO_FLAG_WREADY;
+
+		if (cio_txdone(cf, n) == -1)
+			return -1;
+	}
+
+	if (corked)
+		cio_setcork(cf, 0);
+
+	return 0;
+}
+
+static void cio_service(struct ciofd *cf)
+{
+	int budget = CIO_EPOLL_RXBUDGET;
+
+	if (cf->raw == 0) {
+		while ((cf->flags & CIO_FLAG_RREADY) && cf->rxchain) {
+			int ret;
+
+			if ((ret = cio_readone(cf)) == -1)
+				return;
+			if ((ret == 1) && (--budget <= 0)) {
+				/* come back to it on the next pass */
+				if ((cf->flags & CIO_FLAG_RREADY) && cf->rxchain)
+					cio_pend(cf);
+				break;
+			}
+		}
+	}
+
+	if (cf->raw != 1) {
+		if (cio_flushtx(cf) == -1)
+			return;
+	}
+
+	if ((cf->flags & CIO_FLAG_CLOSEONFLUSH) && !cf->txchain) {
+		cio_fire(cf, NBIO_EVENT_EOF);
+		return;
+	}
+
+	cio_updateevents(cf);
+
+	return;
+}
+
+static void cio_handleevent(struct ciofd *cf, naf_u32_t ev)
+{
+
+	if (cf->flags & CIO_FLAG_CLOSED)
+		return;
+
+	if (cf->type == NBIO_FDTYPE_LISTENER) {
+		if (ev & EPOLLERR)
+			cio_fire(cf, NBIO_EVENT_ERROR);
+		else if (ev & EPOLLIN)
+			cio_fire(cf, NBIO_EVENT_INCOMINGCONN);
+		return;
+	}
+
+	if (ev & EPOLLERR) {
+		cio_fire(cf, NBIO_EVENT_ERROR);
+		return;
+	}
+
+	if (cf->raw) {
+
+		if (ev & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) {
+			if (cio_fire(cf, NBIO_EVENT_READ))
+				return;
+		}
+
+		if (ev & EPOLLOUT) {
+			if (cf->raw == 1) {
+				if (cio_fire(cf, NBIO_EVENT_WRITE))
+					return;
+			} else
+				cf->flags |= CIO_FLAG_WREADY;
+		}
+
+		/* raw mode may have been changed by the handlers */
+		cio_service(cf);
+
+		return;
+	}
+
+	if (ev & (EPOLLIN | EPOLLHUP | EPOLLRDHUP))
+		cf->flags |= CIO_FLAG_RREADY;
+	if (ev & (EPOLLHUP | EPOLLRDHUP))
+		cf->flags |= CIO_FLAG_HUP;
+	if (ev & EPOLLOUT)
+		cf->flags |= CIO_FLAG_WREADY;
+
+	cio_service(cf);
+
+	return;
+}
+
+/*
+ * Free descriptors that have been closed.  Never call this while anyone
+ * could be walking the fdlist.
+ */
+static int cio_reap(void)
+{
+	nbio_fd_t *cur, **prev;
+
+	for (prev = &cio_fdlist; (cur = *prev); ) {
+		struct ciofd *cf = (struct ciofd *)cur;
+
+		if (!(cf->flags & CIO_FLAG_CLOSED) ||
+				(cf->flags & CIO_FLAG_PENDING)) {
+			prev = &cur->next;
+			continue;
+		}
+
+		*prev = cur->next;
+		naf_free(ourmodule, cf);
+	}
+
+	return 0;
+}
+
+
+static int cioepoll_init(struct nafmodule *mod)
+{
+
+	ourmodule = mod;
+
+	if (cio_epfd != -1)
+		return 0;
+
+	if ((cio_epfd = epoll_create(1024)) == -1) {
+		dvprintf(mod, "epoll_create: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(cio_epfd, F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+static nbio_fd_t *cioepoll_fdlist(void)
+{
+	return cio_fdlist;
+}
+
+static int cioepoll_poll(int timeout)
+{
+	struct ciofd *cf, *list;
+	int n, i;
+
+	cio_died = 0;
+
+	if (cio_pendlist)
+		timeout = 0;
+
+	if ((n = epoll_wait(cio_epfd, cio_events, CIO_EPOLL_MAXEVENTS, timeout)) == -1) {
+		if (errno == EINTR)
+			return 0;
+		return -1;
+	}
+
+	for (i = 0; (i < n) && !cio_died; i++)
+		cio_handleevent((struct ciofd *)cio_events[i].data.ptr, cio_events[i].events);
+
+	/*
+	 * Now service the descriptors that had buffers queued to them while
+	 * we already knew they were ready.  Anything queued while we're in
+	 * here waits for the next pass.
+	 */
+	list = cio_pendlist;
+	cio_pendlist = NULL;
+	while ((cf = list)) {
+		list = cf->pendnext;
+		cf->pendnext = NULL;
+		cf->flags &= ~CIO_FLAG_PENDING;
+
+		if (!cio_died && !(cf->flags & CIO_FLAG_CLOSED))
+			cio_service(cf);
+	}
+
+	cio_reap();
+
+	if (cio_died) {
+		cio_died = 0;
+		return -1;
+	}
+
+	return n;
+}
+
+static int cioepoll_cleanuponly(void)
+{
+	return cio_reap();
+}
+
+static nbio_fd_t *cioepoll_addfd(int type, nbio_sockfd_t fd, naf_connio_handler_t handler, void *priv, int rxlen, int txlen)
+{
+	struct ciofd *cf;
+	struct epoll_event ev;
+	int flags;
+
+	if ((fd < 0) || !handler) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1)
+		return NULL;
+	if (!(flags & O_NONBLOCK) && (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1))
+		return NULL;
+
+	if (!(cf = (struct ciofd *)naf_malloc(ourmodule, sizeof(struct ciofd)))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(cf, 0, sizeof(struct ciofd));
+
+	cf->fdt.fd = fd;
+	cf->fdt.priv = priv;
+	cf->type = type;
+	cf->handler = handler;
+	cf->rxmax = rxlen;
+	cf->txmax = txlen;
+	cf->flags = CIO_FLAG_WREADY;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = cio_wantevents(cf);
+	ev.data.ptr = cf;
+	if (epoll_ctl(cio_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		naf_free(ourmodule, cf);
+		return NULL;
+	}
+	cf->events = ev.events;
+
+	cf->fdt.next = cio_fdlist;
+	cio_fdlist = &cf->fdt;
+
+	return &cf->fdt;
+}
+
+static int cioepoll_closefdt(nbio_fd_t *fdt)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	struct ciobuf *b;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED))
+		return -1;
+
+	/* conn.c has already taken back the data; these are just the husks */
+	while ((b = cf->rxchain)) {
+		cf->rxchain = b->next;
+		ciobuf_free(b);
+	}
+	while ((b = cf->txchain)) {
+		cf->txchain = b->next;
+		ciobuf_free(b);
+	}
+	cf->txchain_tail = NULL;
+	cf->rxcount = cf->txcount = 0;
+
+	/* Closing would remove it anyway, but not if the fd was dup()'d. */
+	epoll_ctl(cio_epfd, EPOLL_CTL_DEL, fdt->fd, NULL);
+	close(fdt->fd);
+
+	cf->flags |= CIO_FLAG_CLOSED;
+	fdt->fd = -1;
+	fdt->priv = NULL;
+
+	return 0;
+}
+
+static nbio_sockfd_t cioepoll_getincomingconn(nbio_fd_t *fdt, struct sockaddr *sa, int *salen)
+{
+	socklen_t len = *salen;
+	nbio_sockfd_t sfd;
+
+	/*
+	 * Everything handed to addfd() ends up non-blocking anyway, and
+	 * conn.c takes these off the backlog in batches, so this saves an
+	 * fcntl() per connection.
+	 */
+#if defined(HAVE_ACCEPT4) && defined(SOCK_NONBLOCK)
+	if ((sfd = accept4(fdt->fd, sa, &len, SOCK_NONBLOCK)) == -1)
+		return -1;
+#else
+	if ((sfd = accept(fdt->fd, sa, &len)) == -1)
+		return -1;
+#endif
+	*salen = len;
+
+	return sfd;
+}
+
+static int cioepoll_setraw(nbio_fd_t *fdt, int val)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED))
+		return -1;
+
+	if (cf->raw == val)
+		return 0;
+
+	/*
+	 * Whatever edge we were holding onto doesn't mean anything after the
+	 * owner has been reading for itself (or is about to).  The MOD below
+	 * will hand us a fresh one if there's data waiting.
+	 */
+	cf->flags &= ~(CIO_FLAG_RREADY | CIO_FLAG_HUP);
+	cf->raw = val;
+
+	return cio_updateevents(cf);
+}
+
+static int cioepoll_setcloseonflush(nbio_fd_t *fdt, int val)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED))
+		return -1;
+
+	if (val) {
+		cf->flags |= CIO_FLAG_CLOSEONFLUSH;
+		cio_pend(cf);
+	} else
+		cf->flags &= ~CIO_FLAG_CLOSEONFLUSH;
+
+	return 0;
+}
+
+static int cioepoll_setcork(nbio_fd_t *fdt, int val)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt || (cf->type != NBIO_FDTYPE_STREAM)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifndef TCP_CORK
+	errno = ENOSYS;
+	return -1;
+#else
+	if (val)
+		cf->flags |= CIO_FLAG_CORK;
+	else
+		cf->flags &= ~CIO_FLAG_CORK;
+
+	return 0;
+#endif
+}
+
+static int cioepoll_gettxstats(nbio_fd_t *fdt, naf_u32_t *callsp, naf_u32_t *bytesp)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt)
+		return -1;
+
+	if (callsp)
+		*callsp = cf->txcalls;
+	if (bytesp)
+		*bytesp = cf->txbytes;
+
+	return 0;
+}
+
+static int cioepoll_adddelim(nbio_fd_t *fdt, const unsigned char *delim, const unsigned char len)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt || !delim || !len || (len > CIO_MAXDELIM)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(cf->delim, delim, len);
+	cf->delimlen = len;
+
+	return 0;
+}
+
+static int cioepoll_cleardelim(nbio_fd_t *fdt)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt)
+		return -1;
+
+	cf->delimlen = 0;
+
+	return 0;
+}
+
+static int cioepoll_addrxvector(nbio_fd_t *fdt, unsigned char *buf, int buflen, int offset)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	struct ciobuf *b, **cur;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (cf->rxcount >= cf->rxmax) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (!(b = ciobuf_alloc())) {
+		errno = ENOMEM;
+		return -1;
+	}
+	b->data = buf;
+	b->len = buflen;
+	b->offset = offset;
+	b->next = NULL;
+
+	for (cur = &cf->rxchain; *cur; cur = &(*cur)->next)
+		;
+	*cur = b;
+	cf->rxcount++;
+
+	if (cf->flags & CIO_FLAG_RREADY)
+		cio_pend(cf);
+
+	return 0;
+}
+
+static int cioepoll_addtxvector(nbio_fd_t *fdt, unsigned char *buf, int buflen)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	struct ciobuf *b;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (cf->txcount >= cf->txmax) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (!(b = ciobuf_alloc())) {
+		errno = ENOMEM;
+		return -1;
+	}
+	b->data = buf;
+	b->len = buflen;
+	b->offset = 0;
+	b->next = NULL;
+
+	if (cf->txchain_tail)
+		cf->txchain_tail->next = b;
+	else
+		cf->txchain = b;
+	cf->txchain_tail = b;
+	cf->txcount++;
+
+	/*
+	 * Don't write from here, the caller may not be ready for the WRITE
+	 * event yet.  If the socket was already known to be writable, get to
+	 * it at the end of this pass; otherwise EPOLLOUT will tell us.
+	 */
+	if (cf->flags & CIO_FLAG_WREADY)
+		cio_pend(cf);
+	else
+		cio_updateevents(cf);
+
+	return 0;
+}
+
+static unsigned char *cioepoll_remtoprxvector(nbio_fd_t *fdt, int *len, int *offset)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	struct ciobuf *b;
+	unsigned char *data;
+
+	if (!fdt || !(b = cf->rxchain))
+		return NULL;
+
+	cf->rxchain = b->next;
+	cf->rxcount--;
+
+	data = b->data;
+	if (len)
+		*len = b->len;
+	if (offset)
+		*offset = b->offset;
+	ciobuf_free(b);
+
+	return data;
+}
+
+static unsigned char *cioepoll_remtoptxvector(nbio_fd_t *fdt, int *len, int *offset)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	struct ciobuf *b;
+	unsigned char *data;
+
+	if (!fdt || !(b = cf->txchain))
+		return NULL;
+
+	if (!(cf->txchain = b->next))
+		cf->txchain_tail = NULL;
+	cf->txcount--;
+
+	data = b->data;
+	if (len)
+		*len = b->len;
+	if (offset)
+		*offset = b->offset;
+	ciobuf_free(b);
+
+	return data;
+}
+
+struct naf_connio naf_connio_epoll = {
+	"epoll",
+	cioepoll_init,
+	cioepoll_fdlist,
+	cioepoll_poll,
+	cioepoll_cleanuponly,
+	cioepoll_addfd,
+	cioepoll_closefdt,
+	cioepoll_getincomingconn,
+	NULL, /* connect */
+	cioepoll_setraw,
+	cioepoll_setcloseonflush,
+	cioepoll_setcork,
+	cioepoll_gettxstats,
+	cioepoll_adddelim,
+	cioepoll_cleardelim,
+	cioepoll_addrxvector,
+	cioepoll_addtxvector,
+	cioepoll_remtoprxvector,
+	cioepoll_remtoptxvector,
+	NULL, /* readheld */
+};
+
+#endif /* NAF_USEEPOLL */
@@ -0,0 +1,147 @@
+/*
+ * naf - Networked Application Framework
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * naf is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * naf is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * The original poll()-based backend, which is just a thin shim over libnbio.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#include <naf/nafmodule.h>
+#include <naf/nafconn.h>
+
+#include "connio.h"
+
+static nbio_t gnb;
+
+
+static int cionbio_init(struct nafmodule *mod)
+{
+
+	/* XXX some question about the correct value of this number. */
+	return nbio_init(&gnb, 32768);
+}
+
+static nbio_fd_t *cionbio_fdlist(void)
+{
+	return gnb.fdlist;
+}
+
+static int cionbio_poll(int timeout)
+{
+	return nbio_poll(&gnb, timeout);
+}
+
+static int cionbio_cleanuponly(void)
+{
+	return nbio_cleanuponly(&gnb);
+}
+
+static nbio_fd_t *cionbio_addfd(int type, nbio_sockfd_t fd, naf_connio_handler_t handler, void *priv, int rxlen, int txlen)
+{
+	return nbio_addfd(&gnb, type, fd, 0, handler, priv, rxlen, txlen);
+}
+
+static int cionbio_closefdt(nbio_fd_t *fdt)
+{
+	return nbio_closefdt(&gnb, fdt);
+}
+
+static nbio_sockfd_t cionbio_getincomingconn(nbio_fd_t *fdt, struct sockaddr *sa, int *salen)
+{
+	return nbio_getincomingconn(&gnb, fdt, sa, salen);
+}
+
+static int cionbio_setraw(nbio_fd_t *fdt, int val)
+{
+	return nbio_setraw(&gnb, fdt, val);
+}
+
+static int cionbio_setcloseonflush(nbio_fd_t *fdt, int val)
+{
+	return nbio_setcloseonflush(fdt, val);
+}
+
+/* libnbio does its own writes, so these aren't possible. */
+static int cionbio_setcork(nbio_fd_t *fdt, int val)
+{
+	return -1;
+}
+
+static int cionbio_gettxstats(nbio_fd_t *fdt, naf_u32_t *callsp, naf_u32_t *bytesp)
+{
+	return -1;
+}
+
+static int cionbio_adddelim(nbio_fd_t *fdt, const unsigned char *delim, const unsigned char len)
+{
+	return nbio_adddelim(&gnb, fdt, delim, len);
+}
+
+static int cionbio_cleardelim(nbio_fd_t *fdt)
+{
+	return nbio_cleardelim(fdt);
+}
+
+static int cionbio_addrxvector(nbio_fd_t *fdt, unsigned char *buf, int buflen, int offset)
+{
+	return nbio_addrxvector(&gnb, fdt, buf, buflen, offset);
+}
+
+static int cionbio_addtxvector(nbio_fd_t *fdt, unsigned char *buf, int buflen)
+{
+	return nbio_addtxvector(&gnb, fdt, buf, buflen);
+}
+
+static unsigned char *cionbio_remtoprxvector(nbio_fd_t *fdt, int *len, int *offset)
+{
+	return nbio_remtoprxvector(&gnb, fdt, len, offset);
+}
+
+static unsigned char *cionbio_remtoptxvector(nbio_fd_t *fdt, int *len, int *offset)
+{
+	return nbio_remtoptxvector(&gnb, fdt, len, offset);
+}
+
+struct naf_connio naf_connio_nbio = {
+	"poll",
+	cionbio_init,
+	cionbio_fdlist,
+	cionbio_poll,
+	cionbio_cleanuponly,
+	cionbio_addfd,
+	cionbio_closefdt,
+	cionbio_getincomingconn,
+	NULL, /* connect */
+	cionbio_setraw,
+	cionbio_setcloseonflush,
+	cionbio_setcork,
+	cionbio_gettxstats,
+	cionbio_adddelim,
+	cionbio_cleardelim,
+	cionbio_addrxvector,
+	cionbio_addtxvector,
+	cionbio_remtoprxvector,
+	cionbio_remtoptxvector,
+	NULL, /* readheld */
+};
@@ -0,0 +1,1605 @@
+/*
+ * naf - Networked Application Framework
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * naf is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * naf is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * io_uring(7) backend for conn.c.
+ *
+ * Instead of waiting for readiness and then calling read()/write(), every
+ * operation is queued on a submission ring and its result comes back on the
+ * completion ring.  Everything queued during one pass through the main loop
+ * goes to the kernel in the same io_uring_enter() that waits for the next
+ * batch of completions, so a busy connection costs no syscalls of its own.
+ *
+ * Reads.  Each buffered descriptor that has an Rx vector keeps one READ
+ * outstanding, using a buffer the kernel picks out of a shared pool
+ * (IORING_OP_PROVIDE_BUFFERS) only once data actually shows up.  Idle
+ * connections therefore don't tie up any memory.  What comes back is
+ * copied into the owner's Rx vectors -- as many as it covers, so one read
+ * usually carries several FLAPs -- and whatever is left stays in the pool
+ * buffer until the owner queues another vector.  Delimited reads are just a
+ * scan of that buffer, with no MSG_PEEK.
+ *
+ * If the owner switches to reading for itself (raw mode) while a READ is
+ * out, whatever that READ brings back is held in its pool buffer, and the
+ * owner gets a READ event for it; naf_conn_read() takes held data before
+ * going to the socket (see readheld()).
+ *
+ * Writes.  Queued Tx buffers are copied into a staging buffer, which is
+ * written with a single WRITE.  The kernel never sees memory that belongs
+ * to the owner, which matters because conn.c frees whatever is still
+ * queued the moment a connection is closed, whether or not the kernel is
+ * done with it.  The owner still gets its WRITE event (and its buffer
+ * back) only once everything staged from that buffer has been written, so
+ * its idea of when data last went out is the same as with the other
+ * backends.
+ *
+ * Listeners keep a few ACCEPTs outstanding, and outgoing connections are
+ * started with CONNECT (see connio.h).  Raw descriptors get one-shot
+ * POLL_ADDs, rearmed after every event, which behaves like level-triggered
+ * epoll.
+ *
+ * Needs Linux 5.11 or later (for IORING_FEAT_EXT_ARG); init() fails on
+ * anything older and conn.c falls back to another backend.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#ifdef NAF_USEURING
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <naf/nafmodule.h>
+#include <naf/nafconn.h>
+
+#include "connio.h"
+
+#ifndef POLLRDHUP
+#define POLLRDHUP 0x2000
+#endif
+
+#define CIO_URING_ENTRIES 1024
+
+/* Shared Rx buffer pool; see above. */
+#define CIO_URING_BGID    0
+#define CIO_URING_RXBUFS  512
+#define CIO_URING_RXLEN   16384
+
+/* Per-descriptor Tx staging buffer. */
+#define CIO_URING_TXLEN   16384
+
+/* ACCEPTs kept outstanding on each listener. */
+#define CIO_URING_ACCEPTS 4
+
+/*
+ * Max number of Rx buffers completed on one descriptor per pass before
+ * moving on to the next, so one busy peer can't starve everyone else.
+ */
+#define CIO_URING_RXBUDGET 16
+
+#define CIO_MAXDELIM 8
+
+/* Low bits of user_data say which operation completed. */
+#define CIO_OP_MASK     0x7
+#define CIO_OP_PROVIDE  0x0 /* no descriptor */
+#define CIO_OP_READ     0x1
+#define CIO_OP_WRITE    0x2
+#define CIO_OP_POLL     0x3
+#define CIO_OP_ACCEPT   0x4 /* user_data points at the struct cioaccept */
+#define CIO_OP_CONNECT  0x5
+#define CIO_OP_CANCEL   0x6
+
+#define CIO_FLAG_CLOSED       0x0001
+#define CIO_FLAG_CLOSEONFLUSH 0x0002
+#define CIO_FLAG_PENDING      0x0004 /* on pendlist */
+#define CIO_FLAG_CONNECTING   0x0008 /* CONNECT outstanding */
+#define CIO_FLAG_EOF          0x0010 /* read returned 0; don't read again */
+#define CIO_FLAG_NOBUFS       0x0020 /* pool ran dry; retry next pass */
+#define CIO_FLAG_TRYACCEPT    0x0040 /* last ACCEPT failed for lack of fds */
+
+/* Operations outstanding on a descriptor; it can't be freed until zero. */
+#define CIO_INFLIGHT_READ     0x0001
+#define CIO_INFLIGHT_WRITE    0x0002
+#define CIO_INFLIGHT_POLL     0x0004
+#define CIO_INFLIGHT_CONNECT  0x0008
+
+struct ciobuf {
+	unsigned char *data;
+	int len;
+	int offset;
+	struct ciobuf *next;
+};
+
+struct ciofd;
+
+struct cioaccept {
+	struct ciofd *cf;
+	int inflight;
+	int done;
+	int res; /* fd or -errno */
+	struct sockaddr_storage sa;
+	socklen_t salen;
+};
+
+struct ciofd {
+	nbio_fd_t fdt; /* must be first */
+	int type;
+	int flags;
+	int inflight;
+	int raw;
+	naf_connio_handler_t handler;
+
+	struct ciobuf *rxchain;
+	int rxcount, rxmax;
+	struct ciobuf *txchain, *txchain_tail;
+	int txcount, txmax;
+	naf_u32_t txcalls, txbytes;
+
+	unsigned char delim[CIO_MAXDELIM];
+	int delimlen;
+
+	/* pool buffer holding data the owner hasn't taken yet */
+	int rxbid; /* -1 for none */
+	int rxbufoff, rxbuflen;
+
+	/* Tx staging buffer, and how much of it has been written */
+	unsigned char *txstage;
+	int txstageoff, txstagelen;
+	int txstagedbufs; /* Tx buffers at the head that are all staged */
+
+	struct cioaccept *accepts; /* listeners only */
+
+	struct sockaddr_storage connectsa;
+	int connectsalen;
+
+	struct ciofd *pendnext;
+};
+
+struct cioring {
+	int fd;
+	unsigned int features;
+
+	void *sqmap, *cqmap;
+	size_t sqmaplen, cqmaplen;
+	struct io_uring_sqe *sqes;
+	size_t sqeslen;
+
+	unsigned int *sqhead, *sqtail, *sqmask, *sqentries, *sqarray;
+	unsigned int *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+
+	unsigned int sqlocaltail;
+};
+
+static struct nafmodule *ourmodule = NULL;
+static struct cioring cio_ring = { .fd = -1 };
+static nbio_fd_t *cio_fdlist = NULL;
+static struct ciofd *cio_pendlist = NULL;
+static struct ciobuf *cio_buffreelist = NULL;
+static unsigned char *cio_rxpool = NULL;
+static int cio_unprovided[CIO_URING_RXBUFS]; /* bids we couldn't give back yet */
+static int cio_nunprovided = 0;
+static int cio_died = 0;
+
+
+static int cio_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int cio_io_uring_enter(int fd, unsigned int tosubmit, unsigned int mincomplete, unsigned int flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete, flags, arg, argsz);
+}
+
+static int cio_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nargs)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static void cio_ring_free(void)
+{
+
+	if (cio_ring.sqes)
+		munmap(cio_ring.sqes, cio_ring.sqeslen);
+	if (cio_ring.cqmap && (cio_ring.cqmap != cio_ring.sqmap))
+		munmap(cio_ring.cqmap, cio_ring.cqmaplen);
+	if (cio_ring.sqmap)
+		munmap(cio_ring.sqmap, cio_ring.sqmaplen);
+	if (cio_ring.fd != -1)
+		close(cio_ring.fd);
+
+	memset(&cio_ring, 0, sizeof(cio_ring));
+	cio_ring.fd = -1;
+
+	return;
+}
+
+/* Make sure the kernel can do everything we're going to ask of it. */
+static int cio_ring_probe(void)
+{
+	static const int needops[] = {
+		IORING_OP_READ, IORING_OP_WRITE, IORING_OP_POLL_ADD,
+		IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_ASYNC_CANCEL,
+		IORING_OP_PROVIDE_BUFFERS,
+	};
+	struct io_uring_probe *probe;
+	size_t len;
+	int i, ret = 0;
+
+	len = sizeof(struct io_uring_probe) + (256 * sizeof(struct io_uring_probe_op));
+	if (!(probe = (struct io_uring_probe *)naf_malloc(ourmodule, len)))
+		return -1;
+	memset(probe, 0, len);
+
+	if (cio_io_uring_register(cio_ring.fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+		dvprintf(ourmodule, "IORING_REGISTER_PROBE: %s\n", strerror(errno));
+		naf_free(ourmodule, probe);
+		return -1;
+	}
+
+	for (i = 0; i < (int)(sizeof(needops) / sizeof(needops[0])); i++) {
+		if ((needops[i] > probe->last_op) ||
+				!(probe->ops[needops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			dvprintf(ourmodule, "kernel does not support io_uring opcode %d\n", needops[i]);
+			ret = -1;
+		}
+	}
+
+	naf_free(ourmodule, probe);
+
+	return ret;
+}
+
+static int cio_ring_setup(void)
+{
+	struct io_uring_params p;
+	naf_u8_t *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	if ((cio_ring.fd = cio_io_uring_setup(CIO_URING_ENTRIES, &p)) == -1) {
+		dvprintf(ourmodule, "io_uring_setup: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(cio_ring.fd, F_SETFD, FD_CLOEXEC);
+	cio_ring.features = p.features;
+
+	if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+		dvprintf(ourmodule, "kernel io_uring is too old (features 0x%08x)\n", p.features);
+		cio_ring_free();
+		return -1;
+	}
+
+	cio_ring.sqmaplen = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	cio_ring.cqmaplen = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cio_ring.cqmaplen > cio_ring.sqmaplen)
+			cio_ring.sqmaplen = cio_ring.cqmaplen;
+		cio_ring.cqmaplen = cio_ring.sqmaplen;
+	}
+
+	cio_ring.sqmap = mmap(NULL, cio_ring.sqmaplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, cio_ring.fd, IORING_OFF_SQ_RING);
+	if (cio_ring.sqmap == MAP_FAILED) {
+		cio_ring.sqmap = NULL;
+		cio_ring_free();
+		return -1;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cio_ring.cqmap = cio_ring.sqmap;
+	else {
+		cio_ring.cqmap = mmap(NULL, cio_ring.cqmaplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, cio_ring.fd, IORING_OFF_CQ_RING);
+		if (cio_ring.cqmap == MAP_FAILED) {
+			cio_ring.cqmap = NULL;
+			cio_ring_free();
+			return -1;
+		}
+	}
+	cio_ring.sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	cio_ring.sqes = (struct io_uring_sqe *)mmap(NULL, cio_ring.sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, cio_ring.fd, IORING_OFF_SQES);
+	if (cio_ring.sqes == MAP_FAILED) {
+		cio_ring.sqes = NULL;
+		cio_ring_free();
+		return -1;
+	}
+
+	sq = (naf_u8_t *)cio_ring.sqmap;
+	cq = (naf_u8_t *)cio_ring.cqmap;
+	cio_ring.sqhead = (unsigned int *)(sq + p.sq_off.head);
+	cio_ring.sqtail = (unsigned int *)(sq + p.sq_off.tail);
+	cio_ring.sqmask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	cio_ring.sqentries = (unsigned int *)(sq + p.sq_off.ring_entries);
+	cio_ring.sqarray = (unsigned int *)(sq + p.sq_off.array);
+	cio_ring.cqhead = (unsigned int *)(cq + p.cq_off.head);
+	cio_ring.cqtail = (unsigned int *)(cq + p.cq_off.tail);
+	cio_ring.cqmask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	cio_ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	cio_ring.sqlocaltail = *cio_ring.sqtail;
+
+	if (cio_ring_probe() == -1) {
+		cio_ring_free();
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Hand everything queued so far to the kernel, and optionally wait for
+ * completions.  timeout is in milliseconds; -1 waits forever, 0 doesn't
+ * wait at all.
+ */
+static int cio_ring_enter(int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int tosubmit, flags = 0, wait = 0;
+	int ret;
+
+	__atomic_store_n(cio_ring.sqtail, cio_ring.sqlocaltail, __ATOMIC_RELEASE);
+	tosubmit = cio_ring.sqlocaltail - __atomic_load_n(cio_ring.sqhead, __ATOMIC_ACQUIRE);
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if (timeout != 0) {
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		wait = 1;
+		if (timeout > 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000;
+			arg.ts = (__u64)(unsigned long)&ts;
+		}
+	}
+
+	if (!tosubmit && !wait)
+		return 0;
+
+	ret = cio_io_uring_enter(cio_ring.fd, tosubmit, wait, flags, wait ? (void *)&arg : NULL, wait ? sizeof(arg) : 0);
+	if ((ret == -1) && ((errno == ETIME) || (errno == EINTR)))
+		ret = 0;
+
+	return ret;
+}
+
+static struct io_uring_sqe *cio_getsqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if ((cio_ring.sqlocaltail - __atomic_load_n(cio_ring.sqhead, __ATOMIC_ACQUIRE)) >= *cio_ring.sqentries) {
+		/* Full; push what's there now and try again. */
+		if ((cio_ring_enter(0) == -1) ||
+				((cio_ring.sqlocaltail - __atomic_load_n(cio_ring.sqhead, __ATOMIC_ACQUIRE)) >= *cio_ring.sqentries))
+			return NULL;
+	}
+
+	idx = cio_ring.sqlocaltail & *cio_ring.sqmask;
+	sqe = &cio_ring.sqes[idx];
+	cio_ring.sqarray[idx] = idx;
+	cio_ring.sqlocaltail++;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	return sqe;
+}
+
+static __u64 cio_userdata(void *p, int op)
+{
+	return (__u64)(unsigned long)p | (__u64)op;
+}
+
+/*
+ * Give one pool buffer (or all of them, if bid is -1) back to the kernel.
+ * If there's no room in the SQ for that, a single buffer is remembered and
+ * given back by cio_reprovide() on the next pass, rather than lost.
+ */
+static int cio_providebufs(int bid)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = cio_getsqe())) {
+		if ((bid != -1) && (cio_nunprovided < CIO_URING_RXBUFS))
+			cio_unprovided[cio_nunprovided++] = bid;
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = (bid == -1) ? CIO_URING_RXBUFS : 1;
+	sqe->addr = (__u64)(unsigned long)(cio_rxpool + ((bid == -1) ? 0 : (bid * CIO_URING_RXLEN)));
+	sqe->len = CIO_URING_RXLEN;
+	sqe->off = (bid == -1) ? 0 : bid;
+	sqe->buf_group = CIO_URING_BGID;
+	sqe->user_data = cio_userdata(NULL, CIO_OP_PROVIDE);
+
+	return 0;
+}
+
+static void cio_reprovide(void)
+{
+
+	while (cio_nunprovided > 0) {
+		if (cio_providebufs(cio_unprovided[--cio_nunprovided]) == -1)
+			break; /* still full; it went back on the list */
+	}
+
+	return;
+}
+
+static int cio_cancel(struct ciofd *cf, void *p, int op)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = cio_getsqe()))
+		return -1;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = cio_userdata(p, op);
+	sqe->user_data = cio_userdata(cf, CIO_OP_CANCEL);
+
+	return 0;
+}
+
+
+static struct ciobuf *ciobuf_alloc(void)
+{
+	struct ciobuf *b;
+
+	if ((b = cio_buffreelist)) {
+		cio_buffreelist = b->next;
+		return b;
+	}
+
+	return (struct ciobuf *)naf_malloc(ourmodule, sizeof(struct ciobuf));
+}
+
+static void ciobuf_free(struct ciobuf *b)
+{
+
+	b->next = cio_buffreelist;
+	cio_buffreelist = b;
+
+	return;
+}
+
+static void cio_pend(struct ciofd *cf)
+{
+
+	if (cf->flags & (CIO_FLAG_PENDING | CIO_FLAG_CLOSED))
+		return;
+
+	cf->flags |= CIO_FLAG_PENDING;
+	cf->pendnext = cio_pendlist;
+	cio_pendlist = cf;
+
+	return;
+}
+
+/* Returns nonzero if the descriptor was closed or the handler wants out. */
+static int cio_fire(struct ciofd *cf, int event)
+{
+
+	if ((cf->flags & CIO_FLAG_CLOSED) || !cf->fdt.priv)
+		return 1;
+
+	if (cf->handler((void *)&cio_ring, event, &cf->fdt) == -1)
+		cio_died = 1;
+
+	return (cf->flags & CIO_FLAG_CLOSED) || cio_died;
+}
+
+static void cio_releaserxbuf(struct ciofd *cf)
+{
+
+	if (cf->rxbid == -1)
+		return;
+
+	cio_providebufs(cf->rxbid);
+	cf->rxbid = -1;
+	cf->rxbufoff = cf->rxbuflen = 0;
+
+	return;
+}
+
+/*
+ * Copy what we can from the pool buffer into the top Rx vector.  Returns 1
+ * if that completed the vector.
+ */
+static int cio_fillone(struct ciofd *cf)
+{
+	struct ciobuf *b = cf->rxchain;
+	unsigned char *src = cio_rxpool + (cf->rxbid * CIO_URING_RXLEN) + cf->rxbufoff;
+	int avail = cf->rxbuflen - cf->rxbufoff;
+	int n, i;
+
+	if ((n = b->len - b->offset) > avail)
+		n = avail;
+
+	if (cf->delimlen) {
+		/*
+		 * Stop right after the delimiter, making sure to catch one
+		 * that straddles the previous copy.  It's replaced with NULs
+		 * so the owner can treat the buffer as a string.
+		 */
+		memcpy(b->data + b->offset, src, n);
+
+		i = b->offset - (cf->delimlen - 1);
+		if (i < 0)
+			i = 0;
+		for (; (i + cf->delimlen) <= (b->offset + n); i++) {
+			if (memcmp(b->data + i, cf->delim, cf->delimlen) == 0) {
+				n = (i + cf->delimlen) - b->offset;
+				b->offset += n;
+				cf->rxbufoff += n;
+				memset(b->data + i, 0, cf->delimlen);
+				return 1;
+			}
+		}
+
+	} else
+		memcpy(b->data + b->offset, src, n);
+
+	b->offset += n;
+	cf->rxbufoff += n;
+
+	/* Datagrams always complete the buffer; the rest is dropped. */
+	if (cf->type == NBIO_FDTYPE_DGRAM) {
+		cf->rxbufoff = cf->rxbuflen;
+		return 1;
+	}
+
+	return b->offset >= b->len;
+}
+
+/*
+ * Hand the owner whatever has been read.  Returns -1 if the descriptor went
+ * away.
+ */
+static int cio_deliver(struct ciofd *cf)
+{
+	int budget = CIO_URING_RXBUDGET;
+
+	while ((cf->rxbid != -1) && cf->rxchain) {
+
+		if (cio_fillone(cf)) {
+			if (cio_fire(cf, NBIO_EVENT_READ))
+				return -1;
+		}
+
+		if (cf->rxbufoff >= cf->rxbuflen)
+			cio_releaserxbuf(cf);
+
+		if (--budget <= 0) {
+			/* come back to it on the next pass */
+			if ((cf->rxbid != -1) && cf->rxchain)
+				cio_pend(cf);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Copy as much of the Tx queue as fits into the staging buffer.  The
+ * buffers stay queued until the WRITE is done with them.
+ */
+static void cio_stagetx(struct ciofd *cf)
+{
+	struct ciobuf *b;
+
+	if (!cf->txstage) {
+		if (!(cf->txstage = (unsigned char *)naf_malloc_type(ourmodule, NAF_MEM_TYPE_NETBUF, CIO_URING_TXLEN)))
+			return; /* try again later */
+	}
+
+	cf->txstageoff = cf->txstagelen = 0;
+	cf->txstagedbufs = 0;
+
+	for (b = cf->txchain; b && (cf->txstagelen < CIO_URING_TXLEN); b = b->next) {
+		int n;
+
+		if ((n = b->len - b->offset) > (CIO_URING_TXLEN - cf->txstagelen))
+			n = CIO_URING_TXLEN - cf->txstagelen;
+		memcpy(cf->txstage + cf->txstagelen, b->data + b->offset, n);
+		cf->txstagelen += n;
+		b->offset += n;
+
+		if (b->offset < b->len)
+			break;
+		cf->txstagedbufs++;
+	}
+
+	return;
+}
+
+/*
+ * The whole staging buffer has been written: give the owner back the
+ * buffers that were all in it.  Returns -1 if the descriptor went away.
+ */
+static int cio_finishtx(struct ciofd *cf)
+{
+
+	while ((cf->txstagedbufs > 0) && cf->txchain) {
+		struct ciobuf *b = cf->txchain;
+
+		cf->txstagedbufs--;
+
+		if (cio_fire(cf, NBIO_EVENT_WRITE))
+			return -1;
+
+		if (cf->txchain == b) {
+			dvprintf(ourmodule, "owner of fd %d did not take finished write buffer\n", cf->fdt.fd);
+			if (!(cf->txchain = b->next))
+				cf->txchain_tail = NULL;
+			cf->txcount--;
+			ciobuf_free(b);
+		}
+	}
+	cf->txstagedbufs = 0;
+
+	return 0;
+}
+
+static void cio_arm(struct ciofd *cf)
+{
+	struct io_uring_sqe *sqe;
+
+	if (cf->flags & CIO_FLAG_CLOSED)
+		return;
+
+	if (cf->type == NBIO_FDTYPE_LISTENER) {
+		int i;
+
+		for (i = 0; i < CIO_URING_ACCEPTS; i++) {
+			struct cioaccept *ca = &cf->accepts[i];
+
+			if (ca->inflight || ca->done)
+				continue;
+			if (!(sqe = cio_getsqe()))
+				break;
+
+			ca->salen = sizeof(ca->sa);
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->fd = cf->fdt.fd;
+			sqe->addr = (__u64)(unsigned long)&ca->sa;
+			sqe->addr2 = (__u64)(unsigned long)&ca->salen;
+			sqe->accept_flags = SOCK_NONBLOCK;
+			sqe->user_data = cio_userdata(ca, CIO_OP_ACCEPT);
+			ca->inflight = 1;
+		}
+
+		return;
+	}
+
+	if (cf->flags & CIO_FLAG_CONNECTING) {
+		if (!(cf->inflight & CIO_INFLIGHT_CONNECT) && (sqe = cio_getsqe())) {
+			sqe->opcode = IORING_OP_CONNECT;
+			sqe->fd = cf->fdt.fd;
+			sqe->addr = (__u64)(unsigned long)&cf->connectsa;
+			sqe->off = cf->connectsalen;
+			sqe->user_data = cio_userdata(cf, CIO_OP_CONNECT);
+			cf->inflight |= CIO_INFLIGHT_CONNECT;
+		}
+		return;
+	}
+
+	if (cf->raw && !(cf->inflight & CIO_INFLIGHT_POLL) && (sqe = cio_getsqe())) {
+		naf_u32_t events = POLLIN | POLLRDHUP;
+
+		if (cf->raw == 1)
+			events |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+		events = (events << 16) | (events >> 16);
+#endif
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = cf->fdt.fd;
+		sqe->poll32_events = events;
+		sqe->user_data = cio_userdata(cf, CIO_OP_POLL);
+		cf->inflight |= CIO_INFLIGHT_POLL;
+	}
+
+	if (!cf->raw && cf->rxchain && (cf->rxbid == -1) &&
+			!(cf->flags & CIO_FLAG_EOF) &&
+			!(cf->inflight & CIO_INFLIGHT_READ) &&
+			(sqe = cio_getsqe())) {
+		sqe->opcode = IORING_OP_READ;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->fd = cf->fdt.fd;
+		sqe->len = CIO_URING_RXLEN;
+		sqe->off = (__u64)-1;
+		sqe->buf_group = CIO_URING_BGID;
+		sqe->user_data = cio_userdata(cf, CIO_OP_READ);
+		cf->inflight |= CIO_INFLIGHT_READ;
+	}
+
+	if ((cf->raw != 1) && (cf->txstageoff < cf->txstagelen) &&
+			!(cf->inflight & CIO_INFLIGHT_WRITE) &&
+			(sqe = cio_getsqe())) {
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = cf->fdt.fd;
+		sqe->addr = (__u64)(unsigned long)(cf->txstage + cf->txstageoff);
+		sqe->len = cf->txstagelen - cf->txstageoff;
+		sqe->off = (__u64)-1;
+		sqe->user_data = cio_userdata(cf, CIO_OP_WRITE);
+		cf->inflight |= CIO_INFLIGHT_WRITE;
+	}
+
+	return;
+}
+
+static void cio_service(struct ciofd *cf)
+{
+
+	if (cf->flags & CIO_FLAG_CLOSED)
+		return;
+
+	if (cf->type == NBIO_FDTYPE_LISTENER) {
+		cio_arm(cf);
+		return;
+	}
+
+	if (!cf->raw) {
+		if (cio_deliver(cf) == -1)
+			return;
+	} else if (cf->rxbid != -1) {
+		/* read before it went raw; naf_conn_read() will get it */
+		if (cio_fire(cf, NBIO_EVENT_READ))
+			return;
+		if (cf->rxbid != -1)
+			cio_pend(cf); /* still there; like level-triggered */
+	}
+
+	if ((cf->raw != 1) && !(cf->inflight & CIO_INFLIGHT_WRITE) &&
+			(cf->txstageoff >= cf->txstagelen) && cf->txchain)
+		cio_stagetx(cf);
+
+	if ((cf->flags & CIO_FLAG_CLOSEONFLUSH) && !cf->txchain &&
+			(cf->txstageoff >= cf->txstagelen)) {
+		cio_fire(cf, NBIO_EVENT_EOF);
+		return;
+	}
+
+	cio_arm(cf);
+
+	return;
+}
+
+static void cio_complete_read(struct ciofd *cf, int res, naf_u32_t cqflags)
+{
+	int bid = -1;
+
+	cf->inflight &= ~CIO_INFLIGHT_READ;
+
+	if (cqflags & IORING_CQE_F_BUFFER)
+		bid = cqflags >> IORING_CQE_BUFFER_SHIFT;
+
+	if ((cf->flags & CIO_FLAG_CLOSED) || (cf->raw && (res <= 0))) {
+		/*
+		 * Closed while we were waiting, so the data has nowhere to
+		 * go.  (Or gone raw, with nothing read; the owner will see
+		 * the EOF or error for itself.)
+		 */
+		if (bid != -1)
+			cio_providebufs(bid);
+		return;
+	}
+
+	if (res > 0) {
+		if (bid == -1) {
+			/* can't happen */
+			cio_fire(cf, NBIO_EVENT_ERROR);
+			return;
+		}
+		cf->rxbid = bid;
+		cf->rxbufoff = 0;
+		cf->rxbuflen = res;
+		cio_service(cf);
+		return;
+	}
+
+	if (bid != -1)
+		cio_providebufs(bid);
+
+	if (res == 0) {
+		cf->flags |= CIO_FLAG_EOF;
+		cio_fire(cf, NBIO_EVENT_EOF);
+		return;
+	}
+
+	if (res == -ENOBUFS) {
+		/* Every pool buffer is busy.  Try again on the next pass. */
+		cf->flags |= CIO_FLAG_NOBUFS;
+		cio_pend(cf);
+		return;
+	}
+	if ((res == -EAGAIN) || (res == -EINTR) || (res == -ECANCELED)) {
+		cio_pend(cf);
+		return;
+	}
+
+	errno = -res;
+	cio_fire(cf, NBIO_EVENT_ERROR);
+
+	return;
+}
+
+static void cio_complete_write(struct ciofd *cf, int res)
+{
+
+	cf->inflight &= ~CIO_INFLIGHT_WRITE;
+
+	if (cf->flags & CIO_FLAG_CLOSED)
+		return;
+
+	if (res < 0) {
+		if ((res == -EAGAIN) || (res == -EINTR) || (res == -ECANCELED)) {
+			cio_pend(cf);
+			return;
+		}
+		errno = -res;
+		cio_fire(cf, NBIO_EVENT_ERROR);
+		return;
+	}
+
+	cf->txcalls++;
+	cf->txbytes += res;
+	cf->txstageoff += res;
+
+	if (cf->txstageoff >= cf->txstagelen) {
+		if (cio_finishtx(cf) == -1)
+			return;
+	}
+
+	cio_service(cf);
+
+	return;
+}
+
+static void cio_complete_poll(struct ciofd *cf, int res)
+{
+
+	cf->inflight &= ~CIO_INFLIGHT_POLL;
+
+	if (cf->flags & CIO_FLAG_CLOSED)
+		return;
+
+	if (res < 0) {
+		if ((res != -ECANCELED) && (res != -EINTR)) {
+			errno = -res;
+			cio_fire(cf, NBIO_EVENT_ERROR);
+			return;
+		}
+		cio_pend(cf);
+		return;
+	}
+
+	/* raw mode may have been changed since this was armed */
+	if (!cf->raw) {
+		cio_service(cf);
+		return;
+	}
+
+	if (res & POLLERR) {
+		cio_fire(cf, NBIO_EVENT_ERROR);
+		return;
+	}
+
+	if (res & (POLLIN | POLLHUP | POLLRDHUP)) {
+		if (cio_fire(cf, NBIO_EVENT_READ))
+			return;
+	}
+
+	if ((res & POLLOUT) && (cf->raw == 1)) {
+		if (cio_fire(cf, NBIO_EVENT_WRITE))
+			return;
+	}
+
+	cio_service(cf);
+
+	return;
+}
+
+static void cio_complete_accept(struct cioaccept *ca, int res)
+{
+	struct ciofd *cf = ca->cf;
+
+	ca->inflight = 0;
+
+	if (cf->flags & CIO_FLAG_CLOSED) {
+		if (res >= 0)
+			close(res);
+		return;
+	}
+
+	if (res == -ECANCELED)
+		return;
+
+	ca->done = 1;
+	ca->res = res;
+
+	if ((res == -EMFILE) || (res == -ENFILE))
+		cf->flags |= CIO_FLAG_TRYACCEPT;
+
+	if (!cio_fire(cf, NBIO_EVENT_INCOMINGCONN))
+		cio_service(cf);
+
+	return;
+}
+
+static void cio_complete_connect(struct ciofd *cf, int res)
+{
+
+	cf->inflight &= ~CIO_INFLIGHT_CONNECT;
+	cf->flags &= ~CIO_FLAG_CONNECTING;
+
+	if (cf->flags & CIO_FLAG_CLOSED)
+		return;
+
+	if (res < 0) {
+		errno = -res;
+		cio_fire(cf, NBIO_EVENT_ERROR);
+		return;
+	}
+
+	/* conn.c takes it out of raw mode from here */
+	if (cio_fire(cf, NBIO_EVENT_WRITE))
+		return;
+
+	cio_service(cf);
+
+	return;
+}
+
+static int cio_reapcompletions(void)
+{
+	unsigned int head, tail;
+	int n = 0;
+
+	head = *cio_ring.cqhead;
+	tail = __atomic_load_n(cio_ring.cqtail, __ATOMIC_ACQUIRE);
+
+	while ((head != tail) && !cio_died) {
+		struct io_uring_cqe *cqe = &cio_ring.cqes[head & *cio_ring.cqmask];
+		__u64 ud = cqe->user_data;
+		int res = cqe->res;
+		naf_u32_t cqflags = cqe->flags;
+		void *p;
+
+		/* Let go of the slot first; the handlers may queue more. */
+		head++;
+		__atomic_store_n(cio_ring.cqhead, head, __ATOMIC_RELEASE);
+		n++;
+
+		p = (void *)(unsigned long)(ud & ~(__u64)CIO_OP_MASK);
+
+		switch ((int)(ud & CIO_OP_MASK)) {
+		case CIO_OP_PROVIDE:
+			if (res < 0)
+				dvprintf(ourmodule, "IORING_OP_PROVIDE_BUFFERS: %s\n", strerror(-res));
+			break;
+		case CIO_OP_READ:
+			cio_complete_read((struct ciofd *)p, res, cqflags);
+			break;
+		case CIO_OP_WRITE:
+			cio_complete_write((struct ciofd *)p, res);
+			break;
+		case CIO_OP_POLL:
+			cio_complete_poll((struct ciofd *)p, res);
+			break;
+		case CIO_OP_ACCEPT:
+			cio_complete_accept((struct cioaccept *)p, res);
+			break;
+		case CIO_OP_CONNECT:
+			cio_complete_connect((struct ciofd *)p, res);
+			break;
+		case CIO_OP_CANCEL:
+		default:
+			break;
+		}
+
+		if (head == tail)
+			tail = __atomic_load_n(cio_ring.cqtail, __ATOMIC_ACQUIRE);
+	}
+
+	return n;
+}
+
+static void cio_freeciofd(struct ciofd *cf)
+{
+
+	naf_free(ourmodule, cf->txstage);
+	naf_free(ourmodule, cf->accepts);
+	naf_free(ourmodule, cf);
+
+	return;
+}
+
+/*
+ * Free descriptors that have been closed and that the kernel is done with.
+ * Never call this while anyone could be walking the fdlist.
+ */
+static int cio_reap(void)
+{
+	nbio_fd_t *cur, **prev;
+
+	for (prev = &cio_fdlist; (cur = *prev); ) {
+		struct ciofd *cf = (struct ciofd *)cur;
+		int busy = cf->inflight;
+
+		if (cf->accepts) {
+			int i;
+
+			for (i = 0; i < CIO_URING_ACCEPTS; i++)
+				busy |= cf->accepts[i].inflight;
+		}
+
+		if (!(cf->flags & CIO_FLAG_CLOSED) ||
+				(cf->flags & CIO_FLAG_PENDING) || busy) {
+			prev = &cur->next;
+			continue;
+		}
+
+		*prev = cur->next;
+		cio_freeciofd(cf);
+	}
+
+	return 0;
+}
+
+
+static int ciouring_init(struct nafmodule *mod)
+{
+
+	ourmodule = mod;
+
+	if (cio_ring.fd != -1)
+		return 0;
+
+	if (cio_ring_setup() == -1)
+		return -1;
+
+	if (!(cio_rxpool = (unsigned char *)naf_malloc_type(mod, NAF_MEM_TYPE_NETBUF, CIO_URING_RXBUFS * CIO_URING_RXLEN))) {
+		cio_ring_free();
+		return -1;
+	}
+
+	if ((cio_providebufs(-1) == -1) || (cio_ring_enter(0) == -1)) {
+		naf_free(mod, cio_rxpool);
+		cio_rxpool = NULL;
+		cio_ring_free();
+		return -1;
+	}
+
+	return 0;
+}
+
+static nbio_fd_t *ciouring_fdlist(void)
+{
+	return cio_fdlist;
+}
+
+static int ciouring_poll(int timeout)
+{
+	struct ciofd *cf, *list;
+	int n;
+
+	cio_died = 0;
+
+	cio_reprovide();
+
+	/* Arm whatever changed since last time, then sleep. */
+	list = cio_pendlist;
+	cio_pendlist = NULL;
+	while ((cf = list)) {
+		list = cf->pendnext;
+		cf->pendnext = NULL;
+		cf->flags &= ~(CIO_FLAG_PENDING | CIO_FLAG_NOBUFS);
+
+		if (!cio_died && !(cf->flags & CIO_FLAG_CLOSED))
+			cio_service(cf);
+	}
+
+	if (cio_pendlist)
+		timeout = 0;
+
+	if (cio_ring_enter(timeout) == -1) {
+		if (errno == EINTR)
+			return 0;
+		dvprintf(ourmodule, "io_uring_enter: %s\n", strerror(errno));
+		return -1;
+	}
+
+	n = cio_reapcompletions();
+
+	cio_reap();
+
+	if (cio_died) {
+		cio_died = 0;
+		return -1;
+	}
+
+	return n;
+}
+
+static int ciouring_cleanuponly(void)
+{
+	return cio_reap();
+}
+
+static nbio_fd_t *ciouring_addfd(int type, nbio_sockfd_t fd, naf_connio_handler_t handler, void *priv, int rxlen, int txlen)
+{
+	struct ciofd *cf;
+
+	if ((fd < 0) || !handler) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(cf = (struct ciofd *)naf_malloc(ourmodule, sizeof(struct ciofd)))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(cf, 0, sizeof(struct ciofd));
+
+	cf->fdt.fd = fd;
+	cf->fdt.priv = priv;
+	cf->type = type;
+	cf->handler = handler;
+	cf->rxmax = rxlen;
+	cf->txmax = txlen;
+	cf->rxbid = -1;
+
+	if (type == NBIO_FDTYPE_LISTENER) {
+		int i;
+
+		if (!(cf->accepts = (struct cioaccept *)naf_malloc(ourmodule, sizeof(struct cioaccept) * CIO_URING_ACCEPTS))) {
+			naf_free(ourmodule, cf);
+			errno = ENOMEM;
+			return NULL;
+		}
+		memset(cf->accepts, 0, sizeof(struct cioaccept) * CIO_URING_ACCEPTS);
+		for (i = 0; i < CIO_URING_ACCEPTS; i++)
+			cf->accepts[i].cf = cf;
+	}
+
+	cf->fdt.next = cio_fdlist;
+	cio_fdlist = &cf->fdt;
+
+	/* Nothing goes to the kernel until the next poll. */
+	cio_pend(cf);
+
+	return &cf->fdt;
+}
+
+static int ciouring_closefdt(nbio_fd_t *fdt)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	struct ciobuf *b;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED))
+		return -1;
+
+	/* conn.c has already taken back the data; these are just the husks */
+	while ((b = cf->rxchain)) {
+		cf->rxchain = b->next;
+		ciobuf_free(b);
+	}
+	while ((b = cf->txchain)) {
+		cf->txchain = b->next;
+		ciobuf_free(b);
+	}
+	cf->txchain_tail = NULL;
+	cf->rxcount = cf->txcount = 0;
+
+	cio_releaserxbuf(cf);
+
+	/*
+	 * Anything outstanding holds its own reference to the socket, so it
+	 * has to be cancelled as well as closed.  The ciofd (and the staging
+	 * buffer the kernel may still be reading) stays around until the
+	 * last completion comes back.
+	 */
+	if (cf->inflight & CIO_INFLIGHT_READ)
+		cio_cancel(cf, cf, CIO_OP_READ);
+	if (cf->inflight & CIO_INFLIGHT_WRITE)
+		cio_cancel(cf, cf, CIO_OP_WRITE);
+	if (cf->inflight & CIO_INFLIGHT_POLL)
+		cio_cancel(cf, cf, CIO_OP_POLL);
+	if (cf->inflight & CIO_INFLIGHT_CONNECT)
+		cio_cancel(cf, cf, CIO_OP_CONNECT);
+	if (cf->accepts) {
+		int i;
+
+		for (i = 0; i < CIO_URING_ACCEPTS; i++) {
+			struct cioaccept *ca = &cf->accepts[i];
+
+			if (ca->inflight)
+				cio_cancel(cf, ca, CIO_OP_ACCEPT);
+			if (ca->done && (ca->res >= 0))
+				close(ca->res);
+			ca->done = 0;
+		}
+	}
+
+	close(fdt->fd);
+
+	cf->flags |= CIO_FLAG_CLOSED;
+	fdt->fd = -1;
+	fdt->priv = NULL;
+
+	return 0;
+}
+
+/*
+ * Hand out the connections that ACCEPTs have completed.  After running out
+ * of descriptors, though, the ones still waiting are in the listen queue,
+ * so go get one directly (conn.c is trying to refuse it).
+ */
+static nbio_sockfd_t ciouring_getincomingconn(nbio_fd_t *fdt, struct sockaddr *sa, int *salen)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	int i;
+
+	if (!fdt || !cf->accepts) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < CIO_URING_ACCEPTS; i++) {
+		struct cioaccept *ca = &cf->accepts[i];
+
+		if (!ca->done)
+			continue;
+
+		ca->done = 0;
+		cio_pend(cf);
+
+		if (ca->res < 0) {
+			errno = -ca->res;
+			return -1;
+		}
+
+		if ((int)ca->salen < *salen)
+			*salen = ca->salen;
+		memcpy(sa, &ca->sa, *salen);
+
+		return ca->res;
+	}
+
+	if (cf->flags & CIO_FLAG_TRYACCEPT) {
+		socklen_t len = *salen;
+		nbio_sockfd_t sfd;
+
+		cf->flags &= ~CIO_FLAG_TRYACCEPT;
+		if ((sfd = accept(fdt->fd, sa, &len)) == -1)
+			return -1;
+		*salen = len;
+
+		return sfd;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+static int ciouring_connect(nbio_fd_t *fdt, const struct sockaddr *sa, int salen)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED) || !sa ||
+			(salen <= 0) || (salen > (int)sizeof(cf->connectsa))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(&cf->connectsa, sa, salen);
+	cf->connectsalen = salen;
+	cf->flags |= CIO_FLAG_CONNECTING;
+	cio_pend(cf);
+
+	return 0;
+}
+
+static int ciouring_setraw(nbio_fd_t *fdt, int val)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED))
+		return -1;
+
+	if (cf->raw == val)
+		return 0;
+
+	/*
+	 * A READ that's outstanding when the owner takes over reading would
+	 * steal data out from under it; likewise a POLL after it gives
+	 * reading back.  Cancel whichever doesn't belong any more.  A READ
+	 * that completes anyway keeps what it read for readheld().
+	 */
+	if (val && (cf->inflight & CIO_INFLIGHT_READ))
+		cio_cancel(cf, cf, CIO_OP_READ);
+	if ((!val || (val != cf->raw)) && (cf->inflight & CIO_INFLIGHT_POLL))
+		cio_cancel(cf, cf, CIO_OP_POLL);
+
+	cf->raw = val;
+	cio_pend(cf);
+
+	return 0;
+}
+
+/* Data a READ brought back after the owner started reading for itself. */
+static int ciouring_readheld(nbio_fd_t *fdt, unsigned char *buf, int buflen)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	int n;
+
+	if (!fdt || (cf->rxbid == -1))
+		return 0;
+
+	if ((n = cf->rxbuflen - cf->rxbufoff) > buflen)
+		n = buflen;
+	memcpy(buf, cio_rxpool + (cf->rxbid * CIO_URING_RXLEN) + cf->rxbufoff, n);
+	cf->rxbufoff += n;
+
+	if (cf->rxbufoff >= cf->rxbuflen)
+		cio_releaserxbuf(cf);
+
+	return n;
+}
+
+static int ciouring_setcloseonflush(nbio_fd_t *fdt, int val)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED))
+		return -1;
+
+	if (val) {
+		cf->flags |= CIO_FLAG_CLOSEONFLUSH;
+		cio_pend(cf);
+	} else
+		cf->flags &= ~CIO_FLAG_CLOSEONFLUSH;
+
+	return 0;
+}
+
+/* Staging already gathers everything queued into one write. */
+static int ciouring_setcork(nbio_fd_t *fdt, int val)
+{
+
+	errno = ENOSYS;
+	return -1;
+}
+
+static int ciouring_gettxstats(nbio_fd_t *fdt, naf_u32_t *callsp, naf_u32_t *bytesp)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt)
+		return -1;
+
+	if (callsp)
+		*callsp = cf->txcalls;
+	if (bytesp)
+		*bytesp = cf->txbytes;
+
+	return 0;
+}
+
+static int ciouring_adddelim(nbio_fd_t *fdt, const unsigned char *delim, const unsigned char len)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt || !delim || !len || (len > CIO_MAXDELIM)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(cf->delim, delim, len);
+	cf->delimlen = len;
+
+	return 0;
+}
+
+static int ciouring_cleardelim(nbio_fd_t *fdt)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+
+	if (!fdt)
+		return -1;
+
+	cf->delimlen = 0;
+
+	return 0;
+}
+
+static int ciouring_addrxvector(nbio_fd_t *fdt, unsigned char *buf, int buflen, int offset)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	struct ciobuf *b, **cur;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (cf->rxcount >= cf->rxmax) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (!(b = ciobuf_alloc())) {
+		errno = ENOMEM;
+		return -1;
+	}
+	b->data = buf;
+	b->len = buflen;
+	b->offset = offset;
+	b->next = NULL;
+
+	for (cur = &cf->rxchain; *cur; cur = &(*cur)->next)
+		;
+	*cur = b;
+	cf->rxcount++;
+
+	/*
+	 * If there's already data waiting, it gets copied at the end of this
+	 * pass; otherwise this is when the READ goes out.
+	 */
+	cio_pend(cf);
+
+	return 0;
+}
+
+static int ciouring_addtxvector(nbio_fd_t *fdt, unsigned char *buf, int buflen)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	struct ciobuf *b;
+
+	if (!fdt || (cf->flags & CIO_FLAG_CLOSED)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (cf->txcount >= cf->txmax) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if (!(b = ciobuf_alloc())) {
+		errno = ENOMEM;
+		return -1;
+	}
+	b->data = buf;
+	b->len = buflen;
+	b->offset = 0;
+	b->next = NULL;
+
+	if (cf->txchain_tail)
+		cf->txchain_tail->next = b;
+	else
+		cf->txchain = b;
+	cf->txchain_tail = b;
+	cf->txcount++;
+
+	/* Same as epoll: the caller may not be ready for the WRITE event yet. */
+	cio_pend(cf);
+
+	return 0;
+}
+
+static unsigned char *ciouring_remtoprxvector(nbio_fd_t *fdt, int *len, int *offset)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	struct ciobuf *b;
+	unsigned char *data;
+
+	if (!fdt || !(b = cf->rxchain))
+		return NULL;
+
+	cf->rxchain = b->next;
+	cf->rxcount--;
+
+	data = b->data;
+	if (len)
+		*len = b->len;
+	if (offset)
+		*offset = b->offset;
+	ciobuf_free(b);
+
+	return data;
+}
+
+static unsigned char *ciouring_remtoptxvector(nbio_fd_t *fdt, int *len, int *offset)
+{
+	struct ciofd *cf = (struct ciofd *)fdt;
+	struct ciobuf *b;
+	unsigned char *data;
+
+	if (!fdt || !(b = cf->txchain))
+		return NULL;
+
+	if (!(cf->txchain = b->next))
+		cf->txchain_tail = NULL;
+	cf->txcount--;
+
+	data = b->data;
+	if (len)
+		*len = b->len;
+	if (offset)
+		*offset = b->offset;
+	ciobuf_free(b);
+
+	return data;
+}
+
+struct naf_connio naf_connio_uring = {
+	"uring",
+	ciouring_init,
+	ciouring_fdlist,
+	ciouring_poll,
+	ciouring_cleanuponly,
+	ciouring_addfd,
+	ciouring_closefdt,
+	ciouring_getincomingconn,
+	ciouring_connect,
+	ciouring_setraw,
+	ciouring_setcloseonflush,
+	ciouring_setcork,
+	ciouring_gettxstats,
+	ciouring_adddelim,
+	ciouring_cleardelim,
+	ciouring_addrxvector,
+	ciouring_addtxvector,
+	ciouring_remtoprxvector,
+	ciouring_remtoptxvector,
+	ciouring_readheld,
+};
+
+#endif /* NAF_USEURING */
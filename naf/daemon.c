@@ -85,6 +85,8 @@
 #include "logging.h"
 #include "cache.h"
 #include "stats.h"
+#include "timer.h"
+#include "resolver.h"
 #include "httpd.h"
 #include "rpc.h"
 #include "ipv4/net.h"
@@ -289,6 +291,7 @@ int naf_init0(const char *appname, const char *appver, const char *appdesc, cons
 	naf_logging__register();
 	naf_config__register();
 	naf_conn__register();
+	naf_resolver__register();
 
 	/* Fairly independent utility stuff */
 	naf_linuxtun__register();
@@ -476,7 +479,9 @@ int naf_main(void)
 			lasttimerrun = time(NULL);
 		}
 
-		if (naf_conn__poll(NAF_TIMER_ACCURACY*1000) < 0) {
+		naf_timer__run();
+
+		if (naf_conn__poll(naf_timer__nextdelay(NAF_TIMER_ACCURACY*1000)) < 0) {
 			if (errno == EINTR)
 				continue;
 			break;
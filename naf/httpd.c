@@ -1169,6 +1169,10 @@ static int modinit(struct nafmodule *mod)
 
 	ourmodule = mod;
 
+	/* for listeners shared with other protocols */
+	naf_module_addprotosig(mod, (const naf_u8_t *)"GET ", 4);
+	naf_module_addprotosig(mod, (const naf_u8_t *)"POST ", 5);
+
 	naf_httpd_page_register(mod, "/nafrpc", "text/html", NAF_HTTPD_PAGEFLAGS_LOOSEMATCH, nafrpc_page_handler);
 
 	return 0;
@@ -78,6 +78,53 @@ struct module_memory_stats {
 };
 
 
+/*
+ * Every object in a slab is preceded by a pointer back to the slab, so that
+ * freeing doesn't need to search.  The union keeps the objects aligned.
+ */
+union naf_slabobj {
+	struct naf_slab *slab;
+	union naf_slabobj *nextfree;
+	double align_d;
+	void *align_p;
+	long align_l;
+};
+
+/*
+ * A slab remembers the object size it was carved for.  When a cache is
+ * extended, slabs carved at the old size are retired: nothing new is
+ * allocated from them, and each is given back as soon as it empties.
+ */
+struct naf_slab {
+	struct naf_slabcache_s *cache;
+	struct naf_slab *next, **prevp;
+	union naf_slabobj *freelist;
+	int inuse;
+	int objlen;
+	int stride;
+	union naf_slabobj objs[1]; /* objsperslab of them, stride apart */
+};
+
+struct naf_slabcache_s {
+	struct nafmodule *owner;
+	char name[32];
+	int objlen; /* as requested */
+	int stride; /* objlen rounded up, plus the back pointer */
+	int objsperslab;
+	struct naf_slab *partial; /* some objects in use */
+	struct naf_slab *full;
+	struct naf_slab *empty;
+	struct naf_slab *retired; /* carved before the last extend */
+	naf_u32_t slabs;
+	naf_u32_t emptyslabs;
+	naf_u32_t inuse;
+	naf_u32_t maxinuse;
+	naf_u32_t allocs;
+	struct naf_slabcache_s *next;
+};
+static struct naf_slabcache_s *naf_slab__caches = NULL;
+
+
 static int naf_memory__module_init(struct nafmodule *mod)
 {
 
@@ -100,6 +147,38 @@ void naf_memory__module_free(struct nafmodule *mod)
 }
 
 
+/*
+ * Caches without an owner (the tag blocks, for instance) are listed under
+ * core, which is who answers modmemoryuse.
+ */
+static void slabiter(struct nafmodule *mod, struct nafmodule *cur, naf_rpc_arg_t **ptop)
+{
+	struct naf_slabcache_s *sc;
+	naf_rpc_arg_t **slabs = NULL;
+
+	for (sc = naf_slab__caches; sc; sc = sc->next) {
+		naf_rpc_arg_t **ms;
+
+		if (!((sc->owner == cur) || (!sc->owner && (cur == mod))))
+			continue;
+
+		if (!slabs && !(slabs = naf_rpc_addarg_array(mod, ptop, "slabs")))
+			return;
+
+		if ((ms = naf_rpc_addarg_array(mod, slabs, sc->name))) {
+			naf_rpc_addarg_scalar(mod, ms, "objlen", (naf_u32_t)sc->objlen);
+			naf_rpc_addarg_scalar(mod, ms, "slabs", sc->slabs);
+			naf_rpc_addarg_scalar(mod, ms, "slabs_empty", sc->emptyslabs);
+			naf_rpc_addarg_scalar(mod, ms, "objects_inuse", sc->inuse);
+			naf_rpc_addarg_scalar(mod, ms, "objects_free", (sc->slabs * sc->objsperslab) - sc->inuse);
+			naf_rpc_addarg_scalar(mod, ms, "maximum_inuse", sc->maxinuse);
+			naf_rpc_addarg_scalar(mod, ms, "allocations", sc->allocs);
+		}
+	}
+
+	return;
+}
+
 static int memuseiter(struct nafmodule *mod, struct nafmodule *cur, void *udata)
 {
 	naf_rpc_arg_t **top = (naf_rpc_arg_t **)udata;
@@ -128,6 +207,9 @@ static int memuseiter(struct nafmodule *mod, struct nafmodule *cur, void *udata)
 		}
 	}
 
+	if (ptop)
+		slabiter(mod, cur, ptop);
+
 	return 0;
 }
 
@@ -141,6 +223,17 @@ static int memuseiter(struct nafmodule *mod, struct nafmodule *cur, void *udata)
  *          array modulename {
  *              scalar current_outstanding;
  *              scalar maximum_outstanding;
+ *              [optional] array slabs {
+ *                  array cachename {
+ *                      scalar objlen;
+ *                      scalar slabs;
+ *                      scalar slabs_empty;
+ *                      scalar objects_inuse;
+ *                      scalar objects_free;
+ *                      scalar maximum_inuse;
+ *                      scalar allocations;
+ *                  }
+ *              }
  *          }
  *      }
  */
@@ -522,3 +615,246 @@ void naf_flmp_blkfree(struct nafmodule *owner, naf_flmempool_t *flmp, void *bloc
 	return;
 }
 
+
+static void naf_slab__link(struct naf_slab **head, struct naf_slab *slab)
+{
+
+	if ((slab->next = *head))
+		(*head)->prevp = &slab->next;
+	*head = slab;
+	slab->prevp = head;
+
+	return;
+}
+
+static void naf_slab__unlink(struct naf_slab *slab)
+{
+
+	if ((*slab->prevp = slab->next))
+		slab->next->prevp = slab->prevp;
+	slab->next = NULL;
+	slab->prevp = NULL;
+
+	return;
+}
+
+#define SLABOBJ(slab, n) ((union naf_slabobj *)((naf_u8_t *)(slab)->objs + ((n) * (slab)->stride)))
+#define SLABSTRIDE(len) (sizeof(union naf_slabobj) + SLABALIGN(len))
+#define SLABALIGN(len) ((((len) + sizeof(union naf_slabobj) - 1) / sizeof(union naf_slabobj)) * sizeof(union naf_slabobj))
+
+static struct naf_slab *naf_slab__new(struct naf_slabcache_s *sc)
+{
+	struct naf_slab *slab;
+	int i;
+
+	slab = (struct naf_slab *)naf_malloc_type(sc->owner, NAF_MEM_TYPE_GENERIC, sizeof(struct naf_slab) - sizeof(union naf_slabobj) + (sc->objsperslab * sc->stride));
+	if (!slab)
+		return NULL;
+
+	slab->cache = sc;
+	slab->next = NULL;
+	slab->prevp = NULL;
+	slab->inuse = 0;
+	slab->freelist = NULL;
+	slab->objlen = sc->objlen;
+	slab->stride = sc->stride;
+	for (i = sc->objsperslab - 1; i >= 0; i--) {
+		union naf_slabobj *obj = SLABOBJ(slab, i);
+
+		obj->nextfree = slab->freelist;
+		slab->freelist = obj;
+	}
+
+	sc->slabs++;
+
+	return slab;
+}
+
+static void naf_slab__release(struct naf_slabcache_s *sc, struct naf_slab *slab)
+{
+
+	naf_slab__unlink(slab);
+	sc->slabs--;
+	naf_free(sc->owner, slab);
+
+	return;
+}
+
+naf_slabcache_t *naf_slab_create(struct nafmodule *owner, const char *name, int objlen, int objsperslab)
+{
+	struct naf_slabcache_s *sc;
+
+	if (!name || (objlen <= 0) || (objsperslab <= 0))
+		return NULL;
+
+	if (!(sc = (struct naf_slabcache_s *)naf_malloc(owner, sizeof(struct naf_slabcache_s))))
+		return NULL;
+	memset(sc, 0, sizeof(struct naf_slabcache_s));
+
+	sc->owner = owner;
+	strncpy(sc->name, name, sizeof(sc->name) - 1);
+	sc->objlen = objlen;
+	sc->stride = SLABSTRIDE(objlen);
+	sc->objsperslab = objsperslab;
+
+	sc->next = naf_slab__caches;
+	naf_slab__caches = sc;
+
+	return sc;
+}
+
+void naf_slab_destroy(naf_slabcache_t *sc)
+{
+	struct naf_slabcache_s **prev;
+
+	if (!sc)
+		return;
+
+	for (prev = &naf_slab__caches; *prev; prev = &(*prev)->next) {
+		if (*prev == sc) {
+			*prev = sc->next;
+			break;
+		}
+	}
+
+	while (sc->partial)
+		naf_slab__release(sc, sc->partial);
+	while (sc->full)
+		naf_slab__release(sc, sc->full);
+	while (sc->empty)
+		naf_slab__release(sc, sc->empty);
+	while (sc->retired)
+		naf_slab__release(sc, sc->retired);
+
+	naf_free(sc->owner, sc);
+
+	return;
+}
+
+void *naf_slab_alloc(naf_slabcache_t *sc)
+{
+	struct naf_slab *slab;
+	union naf_slabobj *obj;
+
+	if (!sc)
+		return NULL;
+
+	if ((slab = sc->partial))
+		;
+	else if ((slab = sc->empty)) {
+		naf_slab__unlink(slab);
+		naf_slab__link(&sc->partial, slab);
+		sc->emptyslabs--;
+	} else if ((slab = naf_slab__new(sc)))
+		naf_slab__link(&sc->partial, slab);
+	else
+		return NULL;
+
+	obj = slab->freelist;
+	slab->freelist = obj->nextfree;
+	obj->slab = slab;
+
+	if (++slab->inuse == sc->objsperslab) {
+		naf_slab__unlink(slab);
+		naf_slab__link(&sc->full, slab);
+	}
+
+	sc->allocs++;
+	if (++sc->inuse > sc->maxinuse)
+		sc->maxinuse = sc->inuse;
+
+	return obj + 1;
+}
+
+void naf_slab_free(naf_slabcache_t *sc, void *ptr)
+{
+	union naf_slabobj *obj;
+	struct naf_slab *slab;
+
+	if (!sc || !ptr)
+		return;
+
+	obj = (union naf_slabobj *)ptr - 1;
+	slab = obj->slab;
+	if (!slab || (slab->cache != sc))
+		abort(); /* not one of ours, or freed twice */
+
+	if (slab->stride != sc->stride) {
+		obj->nextfree = slab->freelist;
+		slab->freelist = obj;
+		sc->inuse--;
+		if (!--slab->inuse)
+			naf_slab__release(sc, slab);
+		return;
+	}
+
+	if (slab->inuse-- == sc->objsperslab) {
+		naf_slab__unlink(slab);
+		naf_slab__link(&sc->partial, slab);
+	}
+
+	obj->nextfree = slab->freelist;
+	slab->freelist = obj;
+	sc->inuse--;
+
+	if (!slab->inuse) {
+		if (sc->emptyslabs) {
+			naf_slab__release(sc, slab);
+		} else {
+			naf_slab__unlink(slab);
+			naf_slab__link(&sc->empty, slab);
+			sc->emptyslabs++;
+		}
+	}
+
+	return;
+}
+
+/*
+ * Grow every object in the cache by len bytes, returning the offset (from
+ * the start of the object) where the new space begins, or -1.  Objects that
+ * are already allocated keep their old size; use naf_slab_objlen() to tell.
+ */
+int naf_slab_extend(naf_slabcache_t *sc, int len)
+{
+	int offset;
+
+	if (!sc || (len <= 0))
+		return -1;
+
+	offset = SLABALIGN(sc->objlen);
+	sc->objlen = offset + len;
+	sc->stride = SLABSTRIDE(sc->objlen);
+
+	while (sc->empty) {
+		naf_slab__release(sc, sc->empty);
+		sc->emptyslabs--;
+	}
+	while (sc->partial) {
+		struct naf_slab *slab = sc->partial;
+
+		naf_slab__unlink(slab);
+		naf_slab__link(&sc->retired, slab);
+	}
+	while (sc->full) {
+		struct naf_slab *slab = sc->full;
+
+		naf_slab__unlink(slab);
+		naf_slab__link(&sc->retired, slab);
+	}
+
+	return offset;
+}
+
+/* The length obj was allocated with, which may be less than the cache's. */
+int naf_slab_objlen(void *ptr)
+{
+	union naf_slabobj *obj;
+
+	if (!ptr)
+		return 0;
+
+	obj = (union naf_slabobj *)ptr - 1;
+
+	return obj->slab->objlen;
+}
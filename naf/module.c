@@ -41,6 +41,9 @@
 #ifdef HAVE_TIME_H
 #include <time.h>
 #endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
 
 #include <naf/nafmodule.h>
 #include <naf/nafconn.h>
@@ -50,6 +53,8 @@
 
 #include "module.h"
 #include "core.h"
+#include "conn.h" /* naf_conn__setowner() */
+#include "timer.h"
 #include "memory.h"
 
 #define MODULE_MAXFILENAME_LEN 256
@@ -251,6 +256,8 @@ int naf_module__loadall(int minpri)
 	return 0;
 }
 
+static void protosig__remove(struct nafmodule *mod); /* later */
+
 int naf_module__unloadall(void)
 {
 	struct modlist_item *cur;
@@ -269,6 +276,8 @@ int naf_module__unloadall(void)
 		cur->status &= ~MOD_STATUS_LOADED;
 		cur->status |= MOD_STATUS_NOTLOADED;
 		cur->lasttimerrun = 0;
+		naf_timer__cancelall(&cur->module);
+		protosig__remove(&cur->module);
 		naf_memory__module_free(&cur->module);
 		/* XXX free tags */
 	}
@@ -414,11 +423,249 @@ void naf_module__timerrun(void)
 	return;
 }
 
+/*
+ * Protocol signatures.
+ *
+ * Rather than having every module peek at every new connection in turn,
+ * modules register the bytes their protocol always starts with, and those
+ * are compiled into a prefix trie.  The first few bytes on a connection
+ * are then enough to pick an owner in one walk down the trie.  The
+ * protocoldetect callbacks are still tried for anything that doesn't match
+ * a signature.
+ *
+ * The trie is rebuilt the next time it's needed whenever the set of
+ * signatures changes, which in practice means once, after the modules are
+ * loaded.  Each node's children are kept together and sorted by byte.
+ */
+struct protosig {
+	struct nafmodule *owner;
+	naf_u8_t sig[NAF_MODULE_PROTOSIG_MAXLEN];
+	int siglen;
+	int seq; /* for ties: first registered wins */
+	struct protosig *next;
+};
+static struct protosig *protosigs = NULL;
+static int protosigs__count = 0;
+static int protosigs__seq = 0;
+
+struct protonode {
+	struct nafmodule *owner; /* a signature ends here */
+	naf_u16_t firstchild;
+	naf_u16_t nchildren;
+	naf_u8_t byte;
+};
+static struct protonode *protonodes = NULL;
+static int protonodes__count = 0;
+static int protonodes__stale = 1;
+
+int naf_module_addprotosig(struct nafmodule *mod, const naf_u8_t *sig, int siglen)
+{
+	struct protosig *ps;
+
+	if (!mod || !sig || (siglen <= 0) || (siglen > NAF_MODULE_PROTOSIG_MAXLEN))
+		return -1;
+
+	if (!(ps = malloc(sizeof(struct protosig))))
+		return -1;
+	memset(ps, 0, sizeof(struct protosig));
+
+	ps->owner = mod;
+	memcpy(ps->sig, sig, siglen);
+	ps->siglen = siglen;
+	ps->seq = protosigs__seq++;
+
+	ps->next = protosigs;
+	protosigs = ps;
+	protosigs__count++;
+	protonodes__stale = 1;
+
+	return 0;
+}
+
+static void protosig__remove(struct nafmodule *mod)
+{
+	struct protosig *cur, **prev;
+
+	for (prev = &protosigs; (cur = *prev); ) {
+
+		if (cur->owner != mod) {
+			prev = &cur->next;
+			continue;
+		}
+
+		*prev = cur->next;
+		free(cur);
+		protosigs__count--;
+		protonodes__stale = 1;
+	}
+
+	return;
+}
+
+static int protosig__cmp(const void *a, const void *b)
+{
+	const struct protosig *x = *(const struct protosig **)a;
+	const struct protosig *y = *(const struct protosig **)b;
+	int ret;
+
+	if ((ret = memcmp(x->sig, y->sig, (x->siglen < y->siglen) ? x->siglen : y->siglen)))
+		return ret;
+	if (x->siglen != y->siglen)
+		return x->siglen - y->siglen;
+	return x->seq - y->seq;
+}
+
+/*
+ * Fill in node n from sigs[lo..hi), all of which share their first depth
+ * bytes, and then its children.  The sort puts a signature that ends at
+ * this depth before anything longer.
+ */
+static void protosig__compile(struct protosig **sigs, int lo, int hi, int depth, int n)
+{
+	int i, start, child;
+
+	for (; (lo < hi) && (sigs[lo]->siglen == depth); lo++) {
+		if (!protonodes[n].owner)
+			protonodes[n].owner = sigs[lo]->owner;
+		else if (protonodes[n].owner != sigs[lo]->owner)
+			dvprintf(NULL, "protocol signature conflict: %s and %s; using %s\n", protonodes[n].owner->name, sigs[lo]->owner->name, protonodes[n].owner->name);
+	}
+
+	/* allocate all of the children first, so they're contiguous */
+	protonodes[n].firstchild = protonodes__count;
+	for (i = lo; i < hi; i++) {
+		if ((i == lo) || (sigs[i]->sig[depth] != sigs[i - 1]->sig[depth])) {
+			memset(&protonodes[protonodes__count], 0, sizeof(struct protonode));
+			protonodes[protonodes__count].byte = sigs[i]->sig[depth];
+			protonodes__count++;
+			protonodes[n].nchildren++;
+		}
+	}
+
+	for (start = lo, child = protonodes[n].firstchild; start < hi; child++) {
+		for (i = start + 1; (i < hi) && (sigs[i]->sig[depth] == sigs[start]->sig[depth]); i++)
+			;
+		protosig__compile(sigs, start, i, depth + 1, child);
+		start = i;
+	}
+
+	return;
+}
+
+static int protosig__rebuild(void)
+{
+	struct protosig **sigs, *cur;
+	int i, maxnodes = 1;
+
+	free(protonodes);
+	protonodes = NULL;
+	protonodes__count = 0;
+	protonodes__stale = 0;
+
+	if (!protosigs__count)
+		return 0;
+
+	if (!(sigs = malloc(sizeof(struct protosig *) * protosigs__count)))
+		return -1;
+	for (cur = protosigs, i = 0; cur; cur = cur->next, i++) {
+		sigs[i] = cur;
+		maxnodes += cur->siglen;
+	}
+	qsort(sigs, protosigs__count, sizeof(struct protosig *), protosig__cmp);
+
+	if (!(protonodes = malloc(sizeof(struct protonode) * maxnodes))) {
+		free(sigs);
+		protonodes__stale = 1;
+		return -1;
+	}
+	memset(&protonodes[0], 0, sizeof(struct protonode));
+	protonodes__count = 1;
+
+	protosig__compile(sigs, 0, protosigs__count, 0, 0);
+
+	free(sigs);
+
+	return 0;
+}
+
+#define PROTOSIG_NOMATCH  0
+#define PROTOSIG_MATCH    1
+#define PROTOSIG_NEEDMORE 2
+
+static int protosig__lookup(const naf_u8_t *buf, int buflen, struct nafmodule **ownerret)
+{
+	const struct protonode *node;
+	int i;
+
+	if (protonodes__stale && (protosig__rebuild() == -1))
+		return PROTOSIG_NOMATCH;
+	if (!protonodes__count)
+		return PROTOSIG_NOMATCH;
+
+	for (node = &protonodes[0], i = 0; !node->owner; i++) {
+		const struct protonode *child, *end;
+
+		if (i >= buflen)
+			return node->nchildren ? PROTOSIG_NEEDMORE : PROTOSIG_NOMATCH;
+
+		child = &protonodes[node->firstchild];
+		end = child + node->nchildren;
+		for (; (child < end) && (child->byte < buf[i]); child++)
+			;
+		if ((child == end) || (child->byte != buf[i]))
+			return PROTOSIG_NOMATCH;
+
+		node = child;
+	}
+
+	*ownerret = node->owner;
+
+	return PROTOSIG_MATCH;
+}
+
+static int protocoldetect__take(struct nafmodule *owner, struct nafconn *conn)
+{
+
+	naf_conn__setowner(conn, owner);
+	if (owner->takeconn) {
+		if (owner->takeconn(owner, conn) == -1)
+			return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Returns 1 if someone took the connection, 0 if no one wants it, -1 on
+ * error, or NAF_MODULE__DETECT_NEEDMORE if the bytes so far are the start of
+ * a signature but not all of one.
+ */
 int naf_module__protocoldetect(struct nafmodule *mod, struct nafconn *conn)
 {
 	struct modlist_item *cur;
 	int ret = 0;
 
+	if (!conn->owner && protosigs__count) {
+		naf_u8_t buf[NAF_MODULE_PROTOSIG_MAXLEN];
+		struct nafmodule *owner = NULL;
+		int n;
+
+		if ((n = naf_conn__peek(conn, buf, sizeof(buf))) == -1) {
+			if ((errno == EAGAIN) || (errno == EINTR))
+				return NAF_MODULE__DETECT_NEEDMORE;
+			return -1;
+		}
+
+		if (n > 0) {
+			ret = protosig__lookup(buf, n, &owner);
+			if ((ret == PROTOSIG_MATCH) && (owner != mod))
+				return protocoldetect__take(owner, conn);
+			else if (ret == PROTOSIG_NEEDMORE)
+				return NAF_MODULE__DETECT_NEEDMORE;
+		}
+		ret = 0;
+	}
+
 	for (cur = modlist; cur && !conn->owner; cur = cur->next) {
 
 		if (&cur->module == mod)
@@ -428,17 +675,9 @@ int naf_module__protocoldetect(struct nafmodule *mod, struct nafconn *conn)
 			continue;
 
 		if (cur->module.protocoldetect) {
-			if ((ret = cur->module.protocoldetect(&cur->module, conn)) == 1) {
-
-				conn->owner = &cur->module;
-				if (cur->module.takeconn) {
-					if (cur->module.takeconn(&cur->module, conn) == -1)
-						return -1;
-				}
-
-				return 1;
-
-			} else if (ret == -1)
+			if ((ret = cur->module.protocoldetect(&cur->module, conn)) == 1)
+				return protocoldetect__take(&cur->module, conn);
+			else if (ret == -1)
 				return -1;
 		}
 	}
@@ -461,7 +700,7 @@ int naf_module__protocoldetecttimeout(struct nafmodule *mod, struct nafconn *con
 
 		if (cur->module.connready) {
 			if ((ret = cur->module.connready(&cur->module, conn, NAF_CONN_READY_DETECTTO)) == 1) {
-				conn->owner = &cur->module;
+				naf_conn__setowner(conn, &cur->module);
 				return 1;
 			} 
 		}
@@ -29,6 +29,7 @@ int naf_module__unloadall(void);
 int naf_module__registerresident(const char *name, int (*firstproc)(struct nafmodule *), int startuppri);
 void nafsignal(struct nafmodule *source, int signum);
 void naf_module__timerrun(void);
+#define NAF_MODULE__DETECT_NEEDMORE 2
 int naf_module__protocoldetect(struct nafmodule *mod, struct nafconn *conn);
 int naf_module__protocoldetecttimeout(struct nafmodule *mod, struct nafconn *conn);
 
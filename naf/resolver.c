@@ -0,0 +1,1078 @@
+/*
+ * naf - Networked Application Framework
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * naf is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * naf is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Non-blocking hostname resolution.
+ *
+ * gethostbyname() can block the whole process for as long as the resolver
+ * feels like, which is a bad thing to do in a single-threaded daemon.  This
+ * is a tiny stub resolver instead: names are looked up in the hosts file,
+ * then in a cache, and finally by sending an A query over UDP to a single
+ * recursive nameserver.  The reply comes in through the normal conn layer,
+ * so the main loop never waits on it.
+ *
+ * Answers are cached for their TTL (capped at maxttl), and NXDOMAIN/NODATA
+ * answers for negttl seconds.  Timeouts and server failures are not cached.
+ * Lookups for a name that's already being queried are attached to the
+ * outstanding query rather than sending another one.
+ *
+ * Every try of every query goes out on a socket of its own, bound to a
+ * random port and connected to the nameserver, with an ID from
+ * /dev/urandom, and a reply is only taken if it comes from the nameserver's
+ * address and port, has that ID, and asks the question we did.  Anyone
+ * wanting to forge one has to guess both the port and the ID.
+ *
+ * Only IPv4 is supported, there's no search list, and truncated replies are
+ * treated as failures (we don't do TCP).  None of this matters for looking
+ * up the handful of hosts a proxy typically needs.
+ *
+ * Configuration (all in the [resolver] section):
+ *   nameserver - host[:port]; defaults to the first one in /etc/resolv.conf
+ *   hostsfile  - defaults to /etc/hosts
+ *   timeout    - per-try timeout, in milliseconds
+ *   retries    - number of tries before giving up
+ *   negttl     - seconds to remember that a name doesn't exist
+ *   maxttl     - upper bound on how long to cache any answer
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_CTYPE_H
+#include <ctype.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+#include <naf/nafmodule.h>
+#include <naf/nafconfig.h>
+#include <naf/nafconn.h>
+#include <naf/nafstats.h>
+#include <naf/naftimer.h>
+#include <naf/nafbufutils.h>
+
+#include "module.h" /* for naf_module__registerresident() */
+#include "resolver.h"
+
+#define NAF_RESOLVER_DEBUG_DEFAULT 0
+static int naf_resolver__debug = NAF_RESOLVER_DEBUG_DEFAULT;
+#define NAF_RESOLVER_TIMEOUT_DEFAULT 2000 /* msec per try */
+static int naf_resolver__timeout = NAF_RESOLVER_TIMEOUT_DEFAULT;
+#define NAF_RESOLVER_RETRIES_DEFAULT 3
+static int naf_resolver__retries = NAF_RESOLVER_RETRIES_DEFAULT;
+#define NAF_RESOLVER_NEGTTL_DEFAULT 30 /* seconds */
+static int naf_resolver__negttl = NAF_RESOLVER_NEGTTL_DEFAULT;
+#define NAF_RESOLVER_MAXTTL_DEFAULT 3600 /* seconds */
+static int naf_resolver__maxttl = NAF_RESOLVER_MAXTTL_DEFAULT;
+
+#define NAF_RESOLVER_HOSTSFILE_DEFAULT "/etc/hosts"
+#define NAF_RESOLVER_RESOLVCONF "/etc/resolv.conf"
+#define NAF_RESOLVER_PORT 53
+#define NAF_RESOLVER_RANDOMSRC "/dev/urandom"
+
+#define RES_HASHSIZE 256
+#define RES_MAXNAMELEN 255
+#define RES_MAXPACKET 512
+#define RES_PORTMIN 1024
+#define RES_BINDTRIES 8 /* random ports to try before letting the kernel pick */
+
+/* DNS header bits */
+#define RES_FLAG_QR 0x8000
+#define RES_FLAG_TC 0x0200
+#define RES_FLAG_RD 0x0100
+#define RES_RCODE_MASK 0x000f
+#define RES_RCODE_NXDOMAIN 3
+#define RES_TYPE_A 1
+#define RES_TYPE_CNAME 5
+#define RES_CLASS_IN 1
+
+static struct nafmodule *ourmodule = NULL;
+
+struct rescacheent {
+	char *name;
+	int status; /* 0 = positive, -1 = negative */
+	struct in_addr addr;
+	struct naf_timer timer; /* expiry */
+	struct rescacheent *next;
+};
+
+struct reswaiter {
+	naf_resolver__func_t func;
+	void *data;
+	struct reswaiter *next;
+};
+
+struct resquery {
+	naf_u16_t id;
+	char *name;
+	int tries;
+	struct naf_timer timer; /* retransmit */
+	struct nafconn *conn; /* this try's socket */
+	struct reswaiter *waiters;
+	struct resquery *next;
+};
+
+struct reshost {
+	char *name;
+	struct in_addr addr;
+	struct reshost *next;
+};
+
+static struct rescacheent *res__cache[RES_HASHSIZE];
+static struct resquery *res__queries = NULL;
+static struct reshost *res__hosts = NULL;
+static struct sockaddr_in res__server;
+static int res__randomfd = -1;
+
+static struct {
+	naf_longstat_t lookups;
+	naf_longstat_t cachehits;
+	naf_longstat_t queries;
+	naf_longstat_t timeouts;
+	naf_longstat_t failures;
+} resstats = {
+	0, 0, 0, 0, 0,
+};
+
+
+static int res__hashfunc(const char *name)
+{
+	naf_u32_t h = 5381;
+
+	for ( ; *name; name++)
+		h = ((h << 5) + h) + (naf_u8_t)*name;
+
+	return (int)(h % RES_HASHSIZE);
+}
+
+/* Lowercase, strip trailing dot.  Returns -1 if it won't fit in a query. */
+static int res__normalize(const char *name, char *buf, int buflen)
+{
+	int i;
+
+	for (i = 0; name[i]; i++) {
+		if (i >= (buflen - 1))
+			return -1;
+		buf[i] = tolower((unsigned char)name[i]);
+	}
+	if (i && (buf[i - 1] == '.'))
+		i--;
+	buf[i] = '\0';
+
+	if (!i || (i > RES_MAXNAMELEN))
+		return -1;
+
+	return 0;
+}
+
+
+/* -------------------------------- cache -------------------------------- */
+
+
+static void res__cache_free(struct rescacheent *ce)
+{
+
+	naf_timer_cancel(&ce->timer);
+	naf_free(ourmodule, ce->name);
+	naf_free(ourmodule, ce);
+
+	return;
+}
+
+static struct rescacheent *res__cache_find(const char *name, struct rescacheent ***prevp)
+{
+	struct rescacheent *ce, **cep;
+
+	for (cep = &res__cache[res__hashfunc(name)]; (ce = *cep); cep = &ce->next) {
+		if (strcmp(ce->name, name) == 0) {
+			if (prevp)
+				*prevp = cep;
+			return ce;
+		}
+	}
+
+	return NULL;
+}
+
+static void res__cache_timeout(struct nafmodule *mod, struct naf_timer *timer, void *data)
+{
+	struct rescacheent *ce = (struct rescacheent *)data, **cep = NULL;
+
+	if (res__cache_find(ce->name, &cep) != ce)
+		return; /* can't happen */
+	*cep = ce->next;
+
+	if (naf_resolver__debug > 1)
+		dvprintf(mod, "cache entry for %s expired\n", ce->name);
+
+	res__cache_free(ce);
+
+	return;
+}
+
+static void res__cache_add(const char *name, int status, struct in_addr *addr, naf_u32_t ttl)
+{
+	struct rescacheent *ce, **cep = NULL;
+
+	if ((ce = res__cache_find(name, &cep))) {
+		*cep = ce->next;
+		res__cache_free(ce);
+	}
+
+	if (!ttl)
+		return; /* use it once, don't keep it */
+	if (ttl > (naf_u32_t)naf_resolver__maxttl)
+		ttl = naf_resolver__maxttl;
+
+	if (!(ce = naf_malloc(ourmodule, sizeof(struct rescacheent))))
+		return;
+	memset(ce, 0, sizeof(struct rescacheent));
+
+	if (!(ce->name = naf_strdup(ourmodule, name))) {
+		naf_free(ourmodule, ce);
+		return;
+	}
+	ce->status = status;
+	if (addr)
+		ce->addr = *addr;
+
+	naf_timer_init(&ce->timer, ourmodule, res__cache_timeout, (void *)ce);
+	naf_timer_arm(&ce->timer, ttl * 1000);
+
+	cep = &res__cache[res__hashfunc(name)];
+	ce->next = *cep;
+	*cep = ce;
+
+	return;
+}
+
+static void res__cache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < RES_HASHSIZE; i++) {
+		struct rescacheent *ce;
+
+		while ((ce = res__cache[i])) {
+			res__cache[i] = ce->next;
+			res__cache_free(ce);
+		}
+	}
+
+	return;
+}
+
+
+/* ------------------------------ hosts file ----------------------------- */
+
+
+static void res__hosts_free(void)
+{
+	struct reshost *rh;
+
+	while ((rh = res__hosts)) {
+		res__hosts = rh->next;
+		naf_free(ourmodule, rh->name);
+		naf_free(ourmodule, rh);
+	}
+
+	return;
+}
+
+static void res__hosts_load(const char *fn)
+{
+	FILE *f;
+	char line[1024];
+	struct reshost **tail;
+	int count = 0;
+
+	res__hosts_free();
+	tail = &res__hosts;
+
+	if (!(f = fopen(fn, "r"))) {
+		dvprintf(ourmodule, "unable to open hosts file %s: %s\n", fn, strerror(errno));
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char *tok, *sep = " \t\r\n";
+		struct in_addr addr;
+
+		if ((tok = strchr(line, '#')))
+			*tok = '\0';
+
+		if (!(tok = strtok(line, sep)) || !inet_aton(tok, &addr))
+			continue; /* blank, or not IPv4 */
+
+		while ((tok = strtok(NULL, sep))) {
+			char name[RES_MAXNAMELEN + 1];
+			struct reshost *rh;
+
+			if (res__normalize(tok, name, sizeof(name)) == -1)
+				continue;
+
+			if (!(rh = naf_malloc(ourmodule, sizeof(struct reshost))))
+				break;
+			if (!(rh->name = naf_strdup(ourmodule, name))) {
+				naf_free(ourmodule, rh);
+				break;
+			}
+			rh->addr = addr;
+
+			/* In order, so the first entry for a name wins, like libc. */
+			rh->next = NULL;
+			*tail = rh;
+			tail = &rh->next;
+			count++;
+		}
+	}
+
+	fclose(f);
+
+	if (naf_resolver__debug)
+		dvprintf(ourmodule, "loaded %d names from %s\n", count, fn);
+
+	return;
+}
+
+static struct reshost *res__hosts_find(const char *name)
+{
+	struct reshost *rh;
+
+	for (rh = res__hosts; rh; rh = rh->next) {
+		if (strcmp(rh->name, name) == 0)
+			return rh;
+	}
+
+	return NULL;
+}
+
+
+/* ------------------------------ nameserver ----------------------------- */
+
+
+static int res__parseserver(const char *str, struct sockaddr_in *sin)
+{
+	char buf[64], *port;
+
+	strncpy(buf, str, sizeof(buf));
+	buf[sizeof(buf) - 1] = '\0';
+
+	memset(sin, 0, sizeof(struct sockaddr_in));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(NAF_RESOLVER_PORT);
+
+	if ((port = strchr(buf, ':'))) {
+		*(port++) = '\0';
+		sin->sin_port = htons((naf_u16_t)atoi(port));
+	}
+
+	if (!inet_aton(buf, &sin->sin_addr))
+		return -1;
+
+	return 0;
+}
+
+static void res__setserver(void)
+{
+	char *ns;
+	FILE *f;
+
+	if ((ns = naf_config_getmodparmstr(ourmodule, "nameserver"))) {
+		if (res__parseserver(ns, &res__server) == 0)
+			goto out;
+		dvprintf(ourmodule, "invalid nameserver '%s'\n", ns);
+	}
+
+	if ((f = fopen(NAF_RESOLVER_RESOLVCONF, "r"))) {
+		char line[256];
+		int found = 0;
+
+		while (!found && fgets(line, sizeof(line), f)) {
+			char *tok, *sep = " \t\r\n";
+
+			if (!(tok = strtok(line, sep)) || (strcmp(tok, "nameserver") != 0))
+				continue;
+			if ((tok = strtok(NULL, sep)) && (res__parseserver(tok, &res__server) == 0))
+				found = 1;
+		}
+		fclose(f);
+
+		if (found)
+			goto out;
+	}
+
+	res__parseserver("127.0.0.1", &res__server);
+
+out:
+	if (naf_resolver__debug)
+		dvprintf(ourmodule, "using nameserver %s:%u\n", inet_ntoa(res__server.sin_addr), ntohs(res__server.sin_port));
+
+	return;
+}
+
+static int res__random(void *buf, int buflen)
+{
+
+	if ((res__randomfd == -1) &&
+			((res__randomfd = open(NAF_RESOLVER_RANDOMSRC, O_RDONLY)) == -1)) {
+		dvprintf(ourmodule, "%s: %s\n", NAF_RESOLVER_RANDOMSRC, strerror(errno));
+		return -1;
+	}
+
+	if (read(res__randomfd, buf, buflen) != buflen) {
+		dvprintf(ourmodule, "%s: short read\n", NAF_RESOLVER_RANDOMSRC);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void res__closesocket(struct resquery *rq)
+{
+	struct nafconn *conn;
+
+	if ((conn = rq->conn)) {
+		rq->conn = NULL;
+		naf_conn_schedulekill(conn);
+	}
+
+	return;
+}
+
+/* Give rq a new socket (see above), closing the one from its last try. */
+static int res__opensocket(struct resquery *rq)
+{
+	struct sockaddr_in sin;
+	naf_u16_t port;
+	int fd, flags, i;
+
+	res__closesocket(rq);
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		dvprintf(ourmodule, "socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (((flags = fcntl(fd, F_GETFL)) == -1) ||
+			(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+		dvprintf(ourmodule, "fcntl: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	for (i = 0; i < RES_BINDTRIES; i++) {
+		if (res__random(&port, sizeof(port)) == -1) {
+			close(fd);
+			return -1;
+		}
+		sin.sin_port = htons(RES_PORTMIN + (port % (65536 - RES_PORTMIN)));
+		if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0)
+			break;
+	}
+	/* else the kernel picks one when we connect */
+
+	if (connect(fd, (struct sockaddr *)&res__server, sizeof(res__server)) == -1) {
+		dvprintf(ourmodule, "connect: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (!(rq->conn = naf_conn_addconn(ourmodule, fd, NAF_CONN_TYPE_LOCAL | NAF_CONN_TYPE_READRAW))) {
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* -------------------------------- queries ------------------------------ */
+
+
+static struct resquery *res__query_findbyid(naf_u16_t id)
+{
+	struct resquery *rq;
+
+	for (rq = res__queries; rq; rq = rq->next) {
+		if (rq->id == id)
+			return rq;
+	}
+
+	return NULL;
+}
+
+static struct resquery *res__query_findbyconn(struct nafconn *conn)
+{
+	struct resquery *rq;
+
+	for (rq = res__queries; rq; rq = rq->next) {
+		if (rq->conn == conn)
+			return rq;
+	}
+
+	return NULL;
+}
+
+static struct resquery *res__query_findbyname(const char *name)
+{
+	struct resquery *rq;
+
+	for (rq = res__queries; rq; rq = rq->next) {
+		if (strcmp(rq->name, name) == 0)
+			return rq;
+	}
+
+	return NULL;
+}
+
+/* Unlink, run all the callbacks, and free. */
+static void res__query_finish(struct resquery *rq, int status, struct in_addr *addr)
+{
+	struct resquery **rqp;
+	struct reswaiter *rw;
+
+	for (rqp = &res__queries; *rqp; rqp = &(*rqp)->next) {
+		if (*rqp == rq) {
+			*rqp = rq->next;
+			break;
+		}
+	}
+	naf_timer_cancel(&rq->timer);
+	res__closesocket(rq);
+
+	if (status == -1)
+		resstats.failures++;
+
+	if (naf_resolver__debug) {
+		if (status == 0)
+			dvprintf(ourmodule, "query for %s succeeded (%s)\n", rq->name, inet_ntoa(*addr));
+		else
+			dvprintf(ourmodule, "query for %s failed\n", rq->name);
+	}
+
+	while ((rw = rq->waiters)) {
+		rq->waiters = rw->next;
+		rw->func(rw->data, status, addr);
+		naf_free(ourmodule, rw);
+	}
+
+	naf_free(ourmodule, rq->name);
+	naf_free(ourmodule, rq);
+
+	return;
+}
+
+static int res__newid(naf_u16_t *idret)
+{
+	naf_u16_t id;
+
+	do {
+		if (res__random(&id, sizeof(id)) == -1)
+			return -1;
+	} while (res__query_findbyid(id));
+
+	*idret = id;
+
+	return 0;
+}
+
+static int res__query_send(struct resquery *rq)
+{
+	naf_u8_t pkt[RES_MAXPACKET], *p;
+	const char *label, *dot;
+
+	if ((res__newid(&rq->id) == -1) || (res__opensocket(rq) == -1))
+		return -1;
+
+	p = pkt;
+	p += naf_byte_put16(p, rq->id);
+	p += naf_byte_put16(p, RES_FLAG_RD);
+	p += naf_byte_put16(p, 1); /* qdcount */
+	p += naf_byte_put16(p, 0); /* ancount */
+	p += naf_byte_put16(p, 0); /* nscount */
+	p += naf_byte_put16(p, 0); /* arcount */
+
+	for (label = rq->name; *label; label = dot + 1) {
+		int len;
+
+		if (!(dot = strchr(label, '.')))
+			dot = label + strlen(label);
+		len = dot - label;
+		if ((len <= 0) || (len > 63))
+			return -1;
+
+		p += naf_byte_put8(p, len);
+		memcpy(p, label, len);
+		p += len;
+
+		if (!*dot)
+			break;
+	}
+	p += naf_byte_put8(p, 0);
+	p += naf_byte_put16(p, RES_TYPE_A);
+	p += naf_byte_put16(p, RES_CLASS_IN);
+
+	rq->tries++;
+	resstats.queries++;
+
+	if (naf_resolver__debug > 1)
+		dvprintf(ourmodule, "sending query %u for %s (try %d)\n", rq->id, rq->name, rq->tries);
+
+	/* Lost packets (including EAGAIN) are handled by retransmission. */
+	if (send(rq->conn->fdt->fd, pkt, p - pkt, 0) == -1) {
+		if (naf_resolver__debug)
+			dvprintf(ourmodule, "send: %s\n", strerror(errno));
+	}
+
+	naf_timer_arm(&rq->timer, naf_resolver__timeout);
+
+	return 0;
+}
+
+static void res__query_timeout(struct nafmodule *mod, struct naf_timer *timer, void *data)
+{
+	struct resquery *rq = (struct resquery *)data;
+
+	if ((rq->tries < naf_resolver__retries) && (res__query_send(rq) == 0))
+		return;
+
+	resstats.timeouts++;
+
+	if (naf_resolver__debug)
+		dvprintf(mod, "query for %s timed out after %d tries\n", rq->name, rq->tries);
+
+	res__query_finish(rq, -1, NULL);
+
+	return;
+}
+
+/* ------------------------------- replies ------------------------------- */
+
+
+/* Returns offset just past the name, or -1. */
+static int res__skipname(const naf_u8_t *buf, int buflen, int off)
+{
+
+	while (off < buflen) {
+		if (buf[off] == 0)
+			return off + 1;
+		if ((buf[off] & 0xc0) == 0xc0)
+			return ((off + 2) <= buflen) ? (off + 2) : -1;
+		if (buf[off] & 0xc0)
+			return -1;
+		off += buf[off] + 1;
+	}
+
+	return -1;
+}
+
+/* Compare the (uncompressed) name at off against a normalized name. */
+static int res__matchname(const naf_u8_t *buf, int buflen, int off, const char *name)
+{
+	int first = 1;
+
+	while ((off < buflen) && buf[off]) {
+		int len = buf[off++];
+
+		if ((len & 0xc0) || ((off + len) > buflen))
+			return 0;
+
+		if (!first) {
+			if (*name != '.')
+				return 0;
+			name++;
+		}
+		first = 0;
+
+		for ( ; len; len--, off++, name++) {
+			if (tolower(buf[off]) != (unsigned char)*name)
+				return 0;
+		}
+	}
+
+	return (off < buflen) && !*name;
+}
+
+/*
+ * Copy out the (possibly compressed) name at off, normalized.  Returns -1
+ * if it's malformed or won't fit.
+ */
+static int res__getname(const naf_u8_t *buf, int buflen, int off, char *name, int namelen)
+{
+	int pos = 0, jumps = 0;
+
+	while ((off < buflen) && buf[off]) {
+		int len = buf[off];
+
+		if ((len & 0xc0) == 0xc0) {
+			if (((off + 2) > buflen) || (++jumps > 16))
+				return -1;
+			off = ((len & 0x3f) << 8) | buf[off + 1];
+			continue;
+		}
+		if ((len & 0xc0) || ((off + 1 + len) > buflen) ||
+				((pos + (pos ? 1 : 0) + len) >= namelen))
+			return -1;
+
+		if (pos)
+			name[pos++] = '.';
+		for (off++; len; len--, off++)
+			name[pos++] = tolower(buf[off]);
+	}
+	if (off >= buflen)
+		return -1;
+	name[pos] = '\0';
+
+	return 0;
+}
+
+static void res__handlereply(struct resquery *rq, const naf_u8_t *buf, int buflen)
+{
+	naf_u16_t flags, qdcount, ancount;
+	char want[RES_MAXNAMELEN + 1], owner[RES_MAXNAMELEN + 1];
+	int off, i;
+
+	if (buflen < 12)
+		return;
+
+	if (naf_byte_get16(buf) != rq->id) {
+		if (naf_resolver__debug > 1)
+			dvprintf(ourmodule, "reply with wrong ID %u for query %u\n", naf_byte_get16(buf), rq->id);
+		return;
+	}
+
+	flags = naf_byte_get16(buf + 2);
+	qdcount = naf_byte_get16(buf + 4);
+	ancount = naf_byte_get16(buf + 6);
+
+	if (!(flags & RES_FLAG_QR) || (qdcount != 1) ||
+			!res__matchname(buf, buflen, 12, rq->name))
+		return; /* not an answer to what we asked; ignore it */
+
+	if ((flags & RES_RCODE_MASK) == RES_RCODE_NXDOMAIN) {
+		res__cache_add(rq->name, -1, NULL, naf_resolver__negttl);
+		res__query_finish(rq, -1, NULL);
+		return;
+	}
+
+	if ((flags & RES_RCODE_MASK) || (flags & RES_FLAG_TC)) {
+		if (naf_resolver__debug)
+			dvprintf(ourmodule, "query for %s failed: flags 0x%04x\n", rq->name, flags);
+		res__query_finish(rq, -1, NULL);
+		return;
+	}
+
+	if (((off = res__skipname(buf, buflen, 12)) == -1) || ((off + 4) > buflen))
+		return;
+	if ((naf_byte_get16(buf + off) != RES_TYPE_A) ||
+			(naf_byte_get16(buf + off + 2) != RES_CLASS_IN))
+		return; /* not what we asked either */
+	off += 4;
+
+	/*
+	 * Only records for the name we asked about count, or for whatever it's
+	 * a CNAME for.  They come in order: the CNAMEs first, then the records
+	 * for the name they point to.
+	 */
+	strcpy(want, rq->name);
+
+	for (i = 0; i < ancount; i++) {
+		naf_u16_t type, class, rdlen;
+		naf_u32_t ttl;
+		int match;
+
+		if ((res__getname(buf, buflen, off, owner, sizeof(owner)) == -1) ||
+				((off = res__skipname(buf, buflen, off)) == -1) || ((off + 10) > buflen))
+			break;
+		match = (strcmp(owner, want) == 0);
+
+		type = naf_byte_get16(buf + off);
+		class = naf_byte_get16(buf + off + 2);
+		ttl = naf_byte_get32(buf + off + 4);
+		rdlen = naf_byte_get16(buf + off + 8);
+		off += 10;
+
+		if ((off + rdlen) > buflen)
+			break;
+
+		if (match && (type == RES_TYPE_CNAME) && (class == RES_CLASS_IN)) {
+			if (res__getname(buf, buflen, off, want, sizeof(want)) == -1)
+				break;
+		} else if (match && (type == RES_TYPE_A) && (class == RES_CLASS_IN) && (rdlen == 4)) {
+			struct in_addr addr;
+
+			memcpy(&addr.s_addr, buf + off, 4);
+			if (ttl & 0x80000000)
+				ttl = 0;
+
+			res__cache_add(rq->name, 0, &addr, ttl);
+			res__query_finish(rq, 0, &addr);
+			return;
+		}
+
+		off += rdlen;
+	}
+
+	/* No data for this name. */
+	res__cache_add(rq->name, -1, NULL, naf_resolver__negttl);
+	res__query_finish(rq, -1, NULL);
+
+	return;
+}
+
+static int connready(struct nafmodule *mod, struct nafconn *conn, naf_u16_t what)
+{
+
+	if (what & NAF_CONN_READY_READ) {
+		naf_u8_t buf[RES_MAXPACKET];
+		struct sockaddr_in from;
+		socklen_t fromlen = sizeof(from);
+		struct resquery *rq;
+		int len;
+
+		if ((len = recvfrom(conn->fdt->fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen)) == -1) {
+			if ((errno == EAGAIN) || (errno == EINTR) || (errno == ECONNREFUSED))
+				return 0; /* retransmit timer will deal with it */
+			dvprintf(mod, "recvfrom: %s\n", strerror(errno));
+			return -1;
+		}
+
+		if (!(rq = res__query_findbyconn(conn)))
+			return 0; /* already answered */
+
+		if ((from.sin_addr.s_addr != res__server.sin_addr.s_addr) ||
+				(from.sin_port != res__server.sin_port)) {
+			if (naf_resolver__debug)
+				dvprintf(mod, "ignoring packet from %s:%u\n", inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+			return 0;
+		}
+
+		res__handlereply(rq, buf, len);
+	}
+
+	return 0;
+}
+
+static void connkill(struct nafmodule *mod, struct nafconn *conn)
+{
+
+	struct resquery *rq;
+
+	if ((rq = res__query_findbyconn(conn)))
+		rq->conn = NULL; /* another one is opened on the next try */
+
+	return;
+}
+
+
+/* --------------------------------- API --------------------------------- */
+
+
+int naf_resolver__lookup(const char *name, struct in_addr *addr, naf_resolver__func_t func, void *data)
+{
+	char lname[RES_MAXNAMELEN + 1];
+	struct reshost *rh;
+	struct rescacheent *ce;
+	struct resquery *rq;
+	struct reswaiter *rw;
+
+	if (!name || !addr || !func)
+		return -1;
+
+	resstats.lookups++;
+
+	if (inet_aton(name, addr))
+		return 1;
+
+	if (res__normalize(name, lname, sizeof(lname)) == -1)
+		return -1;
+
+	if ((rh = res__hosts_find(lname))) {
+		*addr = rh->addr;
+		return 1;
+	}
+
+	if ((ce = res__cache_find(lname, NULL))) {
+		resstats.cachehits++;
+		if (ce->status == -1)
+			return -1;
+		*addr = ce->addr;
+		return 1;
+	}
+
+	if (!ourmodule)
+		return -1;
+
+	if (!(rw = naf_malloc(ourmodule, sizeof(struct reswaiter))))
+		return -1;
+	rw->func = func;
+	rw->data = data;
+
+	if ((rq = res__query_findbyname(lname))) {
+		rw->next = rq->waiters;
+		rq->waiters = rw;
+		return 0;
+	}
+
+	if (!(rq = naf_malloc(ourmodule, sizeof(struct resquery)))) {
+		naf_free(ourmodule, rw);
+		return -1;
+	}
+	memset(rq, 0, sizeof(struct resquery));
+
+	if (!(rq->name = naf_strdup(ourmodule, lname))) {
+		naf_free(ourmodule, rq);
+		naf_free(ourmodule, rw);
+		return -1;
+	}
+	naf_timer_init(&rq->timer, ourmodule, res__query_timeout, (void *)rq);
+	rw->next = NULL;
+	rq->waiters = rw;
+
+	if (res__query_send(rq) == -1) {
+		res__closesocket(rq);
+		naf_free(ourmodule, rq->name);
+		naf_free(ourmodule, rq);
+		naf_free(ourmodule, rw);
+		return -1;
+	}
+
+	rq->next = res__queries;
+	res__queries = rq;
+
+	return 0;
+}
+
+
+/* -------------------------------- module ------------------------------- */
+
+
+static int modinit(struct nafmodule *mod)
+{
+
+	ourmodule = mod;
+
+	memset(res__cache, 0, sizeof(res__cache));
+
+	naf_stats_register_longstat(mod, "resolver.lookups", &resstats.lookups);
+	naf_stats_register_longstat(mod, "resolver.cachehits", &resstats.cachehits);
+	naf_stats_register_longstat(mod, "resolver.queries", &resstats.queries);
+	naf_stats_register_longstat(mod, "resolver.timeouts", &resstats.timeouts);
+	naf_stats_register_longstat(mod, "resolver.failures", &resstats.failures);
+
+	return 0;
+}
+
+static int modshutdown(struct nafmodule *mod)
+{
+	struct resquery *rq;
+
+	while ((rq = res__queries))
+		res__query_finish(rq, -1, NULL);
+	res__cache_flush();
+	res__hosts_free();
+
+	if (res__randomfd != -1) {
+		close(res__randomfd);
+		res__randomfd = -1;
+	}
+
+	ourmodule = NULL;
+
+	return 0;
+}
+
+static void signalhandler(struct nafmodule *mod, struct nafmodule *source, int signum)
+{
+
+	if (signum == NAF_SIGNAL_CONFCHANGE) {
+		char *hostsfile;
+
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "debug", naf_resolver__debug, NAF_RESOLVER_DEBUG_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "timeout", naf_resolver__timeout, NAF_RESOLVER_TIMEOUT_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "retries", naf_resolver__retries, NAF_RESOLVER_RETRIES_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "negttl", naf_resolver__negttl, NAF_RESOLVER_NEGTTL_DEFAULT);
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "maxttl", naf_resolver__maxttl, NAF_RESOLVER_MAXTTL_DEFAULT);
+
+		if (!(hostsfile = naf_config_getmodparmstr(mod, "hostsfile")))
+			hostsfile = NAF_RESOLVER_HOSTSFILE_DEFAULT;
+		res__hosts_load(hostsfile);
+
+		res__setserver();
+
+		/* The server or the hosts file may have changed. */
+		res__cache_flush();
+	}
+
+	return;
+}
+
+static int modfirst(struct nafmodule *mod)
+{
+
+	naf_module_setname(mod, "resolver");
+	mod->init = modinit;
+	mod->shutdown = modshutdown;
+	mod->signal = signalhandler;
+	mod->connready = connready;
+	mod->connkill = connkill;
+
+	return 0;
+}
+
+int naf_resolver__register(void)
+{
+	return naf_module__registerresident("resolver", modfirst, NAF_MODULE_PRI_SECONDPASS);
+}
@@ -0,0 +1,47 @@
+/*
+ * naf - Networked Application Framework
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * naf is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * naf is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#ifndef __PLUGINREGONLY
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+/*
+ * status is 0 on success (addr is valid), -1 if the name could not be
+ * resolved.  data is whatever was passed to naf_resolver__lookup().
+ */
+typedef void (*naf_resolver__func_t)(void *data, int status, struct in_addr *addr);
+
+/*
+ * Returns 1 if the answer was already known (dotted quad, hosts file, or
+ * cached), in which case addr is filled in and func is never called.
+ * Returns 0 if a query was started; func will be called exactly once, from
+ * the main loop.  Returns -1 on failure (including a cached negative
+ * answer).
+ */
+int naf_resolver__lookup(const char *name, struct in_addr *addr, naf_resolver__func_t func, void *data);
+
+#endif /* ndef __PLUGINREGONLY */
+
+int naf_resolver__register(void);
+
+#endif /* __RESOLVER_H__ */
@@ -34,174 +34,392 @@
 #include <naf/naftag.h>
 
 
-#define MAXTAGNAMELEN 64
+/*
+ * Tag names are interned as atoms: small integers that stand for the
+ * string.  Modules that look tags up often should get the atom once, with
+ * naf_tag_atom(), and then use the *atom() calls, which never look at a
+ * string.  The plain calls look the atom up each time (one hash probe) and
+ * are otherwise the same.
+ *
+ * Each object's tags live in one small array (taglistv points at it), so
+ * a lookup is a scan of a few adjacent entries, not a walk over separately
+ * allocated list nodes.  Newer tags are at the end, and lookups go from the
+ * end, so the newest of two same-named tags (possible with mod == NULL)
+ * wins, like it always has.
+ */
 typedef struct naf_tag_s {
 	struct nafmodule *owner;
-	char name[MAXTAGNAMELEN+1];
-	char type;
 	void *data;
-	struct naf_tag_s *next;
+	naf_tagatom_t atom;
+	char type;
 } naf_tag_t;
 
-int naf_tag_add(void **taglistv, struct nafmodule *mod, const char *name, char type, void *data)
+typedef struct naf_tagblock_s {
+	int count;
+	int alloc;
+	naf_tag_t tags[1];
+} naf_tagblock_t;
+
+#define NAF_TAGBLOCK_SIZE(n) (sizeof(naf_tagblock_t) + (((n) - 1) * sizeof(naf_tag_t)))
+
+/*
+ * Every connection gets a handful of tags, so the first block for each
+ * object is this big and comes out of a slab.  Bigger ones are malloc'd.
+ */
+#define NAF_TAG_INLINE 8
+#define NAF_TAG_SLABOBJS 64
+static naf_slabcache_t *naf_tag__slab = NULL;
+
+struct naf_tagatomname {
+	naf_tagatom_t atom;
+	struct naf_tagatomname *next;
+	char name[1];
+};
+#define NAF_TAGATOM_HASHSIZE 256
+static struct naf_tagatomname *naf_tag__atomhash[NAF_TAGATOM_HASHSIZE];
+static struct naf_tagatomname **naf_tag__atoms = NULL; /* indexed by atom */
+static int naf_tag__atomcount = 0, naf_tag__atomalloc = 0;
+
+
+static unsigned int naf_tag__hashname(const char *name)
+{
+	unsigned int h = 2166136261U;
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 16777619U;
+
+	return h % NAF_TAGATOM_HASHSIZE;
+}
+
+static naf_tagatom_t naf_tag__findatom(const char *name)
+{
+	struct naf_tagatomname *an;
+
+	for (an = naf_tag__atomhash[naf_tag__hashname(name)]; an; an = an->next) {
+		if (strcmp(an->name, name) == 0)
+			return an->atom;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the atom for name, creating it if needed, or -1 on failure.
+ * Atoms are never freed, so they can be kept in statics.  Zero is never a
+ * valid atom.
+ */
+naf_tagatom_t naf_tag_atom(const char *name)
+{
+	struct naf_tagatomname *an;
+	naf_tagatom_t atom;
+	unsigned int h;
+
+	if (!name || !strlen(name))
+		return -1;
+
+	if ((atom = naf_tag__findatom(name)) != -1)
+		return atom;
+
+	if ((naf_tag__atomcount + 1) >= naf_tag__atomalloc) {
+		struct naf_tagatomname **na;
+		int nalloc;
+
+		nalloc = naf_tag__atomalloc ? (naf_tag__atomalloc * 2) : 64;
+		if (!(na = naf_malloc(NULL, sizeof(struct naf_tagatomname *) * nalloc)))
+			return -1;
+		memset(na, 0, sizeof(struct naf_tagatomname *) * nalloc);
+		if (naf_tag__atoms) {
+			memcpy(na, naf_tag__atoms, sizeof(struct naf_tagatomname *) * naf_tag__atomalloc);
+			naf_free(NULL, naf_tag__atoms);
+		}
+		naf_tag__atoms = na;
+		naf_tag__atomalloc = nalloc;
+	}
+
+	if (!(an = naf_malloc(NULL, sizeof(struct naf_tagatomname) + strlen(name))))
+		return -1;
+	strcpy(an->name, name);
+	an->atom = ++naf_tag__atomcount;
+
+	h = naf_tag__hashname(name);
+	an->next = naf_tag__atomhash[h];
+	naf_tag__atomhash[h] = an;
+	naf_tag__atoms[an->atom] = an;
+
+	return an->atom;
+}
+
+const char *naf_tag_atomname(naf_tagatom_t atom)
+{
+
+	if ((atom <= 0) || (atom > naf_tag__atomcount))
+		return NULL;
+
+	return naf_tag__atoms[atom]->name;
+}
+
+static naf_tag_t *naf_tag__find(naf_tagblock_t *tb, struct nafmodule *mod, naf_tagatom_t atom)
+{
+	naf_tag_t *tag;
+
+	if (!tb)
+		return NULL;
+
+	for (tag = tb->tags + tb->count - 1; tag >= tb->tags; tag--) {
+		if ((tag->atom == atom) && (!mod || (tag->owner == mod)))
+			return tag;
+	}
+
+	return NULL;
+}
+
+static void naf_tag__freeblock(naf_tagblock_t *tb)
+{
+
+	if (tb->alloc == NAF_TAG_INLINE)
+		naf_slab_free(naf_tag__slab, tb);
+	else
+		naf_free(NULL, tb);
+
+	return;
+}
+
+/* Make room for one more tag. */
+static naf_tagblock_t *naf_tag__reserve(void **taglistv)
+{
+	naf_tagblock_t *tb = (naf_tagblock_t *)*taglistv, *ntb;
+	int nalloc;
+
+	if (tb && (tb->count < tb->alloc))
+		return tb;
+
+	if (!tb) {
+		if (!naf_tag__slab &&
+				!(naf_tag__slab = naf_slab_create(NULL, "tags", NAF_TAGBLOCK_SIZE(NAF_TAG_INLINE), NAF_TAG_SLABOBJS)))
+			return NULL;
+		if (!(ntb = (naf_tagblock_t *)naf_slab_alloc(naf_tag__slab)))
+			return NULL;
+		ntb->count = 0;
+		ntb->alloc = NAF_TAG_INLINE;
+		*taglistv = ntb;
+		return ntb;
+	}
+
+	nalloc = tb->alloc * 2;
+	if (!(ntb = (naf_tagblock_t *)naf_malloc(NULL, NAF_TAGBLOCK_SIZE(nalloc))))
+		return NULL;
+	memcpy(ntb->tags, tb->tags, sizeof(naf_tag_t) * tb->count);
+	ntb->count = tb->count;
+	ntb->alloc = nalloc;
+	naf_tag__freeblock(tb);
+	*taglistv = ntb;
+
+	return ntb;
+}
+
+int naf_tag_addatom(void **taglistv, struct nafmodule *mod, naf_tagatom_t atom, char type, void *data)
 {
-	naf_tag_t *tag, **taglist;
+	naf_tagblock_t *tb;
+	naf_tag_t *tag;
 
 	/* Having no data is valid. */
-	if (!mod || !taglistv || !name || !strlen(name))
+	if (!mod || !taglistv || (atom <= 0))
 		return -1;
 
-	if (naf_tag_ispresent(taglistv, mod, name) == 1)
+	if (naf_tag__find((naf_tagblock_t *)*taglistv, mod, atom))
 		return -1; /* already exists */
 
-	if (!(tag = malloc(sizeof(naf_tag_t))))
+	if (!(tb = naf_tag__reserve(taglistv)))
 		return -1;
-	memset(tag, 0, sizeof(naf_tag_t));
 
+	tag = &tb->tags[tb->count++];
 	tag->owner = mod;
-	strncpy(tag->name, name, MAXTAGNAMELEN);
+	tag->atom = atom;
 	tag->type = type;
 	tag->data = data;
 
-	taglist = (naf_tag_t **)taglistv;
-	tag->next = *taglist;
-	*taglist = tag;
-
 	return 0;
 }
 
+int naf_tag_add(void **taglistv, struct nafmodule *mod, const char *name, char type, void *data)
+{
+
+	if (!mod || !taglistv || !name || !strlen(name))
+		return -1;
+
+	return naf_tag_addatom(taglistv, mod, naf_tag_atom(name), type, data);
+}
+
 int naf_tag_cloneall(void **desttaglistv, void **srctaglistv)
 {
-	naf_tag_t *cur;
+	naf_tagblock_t *tb;
+	int i;
 
 	if (!desttaglistv || !srctaglistv)
 		return -1;
 
-	for (cur = *((naf_tag_t **)srctaglistv); cur; cur = cur->next) {
+	if (!(tb = (naf_tagblock_t *)*srctaglistv))
+		return 0;
+
+	for (i = 0; i < tb->count; i++) {
+		naf_tag_t *cur = &tb->tags[i];
 
 		if (cur->type == 'S') {
 			char *newstr;
 
 			/* XXX this is very bad if the owner is preserved (naf_malloc issues) */
 			if ((newstr = strdup((char *)cur->data))) {
-				if (naf_tag_add(desttaglistv, cur->owner, cur->name, cur->type, (void *)newstr) == -1)
+				if (naf_tag_addatom(desttaglistv, cur->owner, cur->atom, cur->type, (void *)newstr) == -1)
 					free(newstr);
 			}
 		} else if (cur->type == 'I') {
 			
-			naf_tag_add(desttaglistv, cur->owner, cur->name, cur->type, (void *)cur->data);
+			naf_tag_addatom(desttaglistv, cur->owner, cur->atom, cur->type, (void *)cur->data);
 		} else
 			; /* don't clone non-primitive types */
+
+		/* the add may have moved the source, if it's the same list */
+		tb = (naf_tagblock_t *)*srctaglistv;
 	}
 
 	return 0;
 }
 
+int naf_tag_removeatom(void **taglistv, struct nafmodule *mod, naf_tagatom_t atom, char *typeret, void **dataret)
+{
+	naf_tagblock_t *tb;
+	naf_tag_t *tag;
+
+	if (!mod || !taglistv || (atom <= 0))
+		return -1;
+
+	tb = (naf_tagblock_t *)*taglistv;
+	if (!(tag = naf_tag__find(tb, mod, atom)))
+		return -1;
+
+	if (typeret)
+		*typeret = tag->type;
+	if (dataret)
+		*dataret = tag->data;
+
+	/* keep them in order */
+	memmove(tag, tag + 1, sizeof(naf_tag_t) * ((tb->tags + tb->count) - (tag + 1)));
+	tb->count--;
+
+	return 0;
+}
+
 int naf_tag_remove(void **taglistv, struct nafmodule *mod, const char *name, char *typeret, void **dataret)
 {
-	naf_tag_t *tag, **prev;
 
 	if (!mod || !taglistv || !name || !strlen(name))
 		return -1;
 
-	for (prev = (naf_tag_t **)taglistv; (tag = *prev); ) {
-		if ((tag->owner == mod ) && (strcmp(tag->name, name) == 0)) {
-			*prev = tag->next;
-
-			if (typeret)
-				*typeret = tag->type;
-			if (dataret)
-				*dataret = tag->data;
-			free(tag);
+	return naf_tag_removeatom(taglistv, mod, naf_tag__findatom(name), typeret, dataret);
+}
 
-			return 0;
+int naf_tag_ispresentatom(void **taglistv, struct nafmodule *mod, naf_tagatom_t atom)
+{
 
-		} else
-			prev = &tag->next;
-	}
+	if (!mod || !taglistv || (atom <= 0))
+		return -1;
 
-	return -1;
+	return naf_tag__find((naf_tagblock_t *)*taglistv, mod, atom) ? 1 : 0;
 }
 
 int naf_tag_ispresent(void **taglistv, struct nafmodule *mod, const char *name)
 {
-	naf_tag_t *tag;
+	naf_tagatom_t atom;
 
 	if (!mod || !taglistv || !name || !strlen(name))
 		return -1;
 
-	for (tag = *((naf_tag_t **)taglistv); tag; tag = tag->next) {
-		if ((tag->owner == mod) && (strcmp(tag->name, name) == 0))
-			return 1;
-	}
+	if ((atom = naf_tag__findatom(name)) == -1)
+		return 0; /* no one has ever used that name */
 
-	return 0;
+	return naf_tag_ispresentatom(taglistv, mod, atom);
 }
 
 /* secret feature: pass mod as NULL to get any tag by that name */
-int naf_tag_fetch(void **taglistv, struct nafmodule *mod, const char *name, char *typeret, void **dataret)
+int naf_tag_fetchatom(void **taglistv, struct nafmodule *mod, naf_tagatom_t atom, char *typeret, void **dataret)
 {
 	naf_tag_t *tag;
 
-	if (!taglistv || !name || !strlen(name))
+	if (!taglistv || (atom <= 0))
 		return -1;
 
-	for (tag = *((naf_tag_t **)taglistv); tag; tag = tag->next) {
+	if (!(tag = naf_tag__find((naf_tagblock_t *)*taglistv, mod, atom)))
+		return -1;
 
-		if (mod && (tag->owner != mod))
-			continue;
+	if (typeret)
+		*typeret = tag->type;
+	if (dataret)
+		*dataret = tag->data;
 
-		if (strcmp(tag->name, name) == 0) {
+	return 0;
+}
 
-			if (typeret)
-				*typeret = tag->type;
-			if (dataret)
-				*dataret = tag->data;
+int naf_tag_fetch(void **taglistv, struct nafmodule *mod, const char *name, char *typeret, void **dataret)
+{
 
-			return 0;
-		}
-	}
+	if (!taglistv || !name || !strlen(name))
+		return -1;
 
-	return -1;
+	return naf_tag_fetchatom(taglistv, mod, naf_tag__findatom(name), typeret, dataret);
 }
 
+/*
+ * The callback sees the tags as they were when this was called: it's
+ * walking a copy, since adding a tag can move the block, and removing one
+ * shifts the rest down.
+ */
 void naf_tag_iter(void **taglistv, struct nafmodule *mod, int (*uf)(struct nafmodule *mod, void *ud, const char *tagname, char tagtype, void *tagdata), void *ud)
 {
-	naf_tag_t *tag;
+	naf_tagblock_t *tb;
+	naf_tag_t inlinetags[NAF_TAG_INLINE], *tags = inlinetags;
+	int i, count;
+
+	if (!taglistv || !(tb = (naf_tagblock_t *)*taglistv))
+		return;
 
-	if (!taglistv)
+	if (((count = tb->count) > NAF_TAG_INLINE) &&
+			!(tags = (naf_tag_t *)naf_malloc(NULL, sizeof(naf_tag_t) * count)))
 		return;
+	memcpy(tags, tb->tags, sizeof(naf_tag_t) * count);
 
-	for (tag = *((naf_tag_t **)taglistv); tag; tag = tag->next) {
-		if (uf(mod, ud, tag->name, tag->type, tag->data))
+	for (i = count - 1; i >= 0; i--) {
+		naf_tag_t *tag = &tags[i];
+
+		if (uf(mod, ud, naf_tag_atomname(tag->atom), tag->type, tag->data))
 			break;
 	}
 
+	if (tags != inlinetags)
+		naf_free(NULL, tags);
+
 	return;
 }
 
 void naf_tag_freelist(void **taglistv, void *user)
 {
-	naf_tag_t *tag;
+	naf_tagblock_t *tb;
+	int i;
 
-	if (!taglistv)
+	if (!taglistv || !(tb = (naf_tagblock_t *)*taglistv))
 		return;
 
-	for (tag = *((naf_tag_t **)taglistv); tag; ) {
-		naf_tag_t *tmp;
+	/* freetag handlers can't be allowed to see a half-freed list */
+	*taglistv = NULL;
 
-		tmp = tag->next;
+	for (i = tb->count - 1; i >= 0; i--) {
+		naf_tag_t *tag = &tb->tags[i];
 
 		/* XXX this is confusing for non-conn tags */
 		if (tag->owner && tag->owner->freetag)
-			tag->owner->freetag(tag->owner, user, tag->name, tag->type, tag->data);
-		free(tag);
-
-		tag = tmp;
+			tag->owner->freetag(tag->owner, user, naf_tag_atomname(tag->atom), tag->type, tag->data);
 	}
-	taglistv = NULL;
+
+	naf_tag__freeblock(tb);
 
 	return;
 }
-
-
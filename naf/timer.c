@@ -0,0 +1,320 @@
+/*
+ * naf - Networked Application Framework
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * naf is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * naf is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * This is the same scheme the Linux kernel uses for its timer lists: one
+ * fine-grained wheel of 256 one-millisecond slots, and four coarser wheels
+ * of 64 slots each above it.  Timers are hashed into a slot by expiry time,
+ * and each time the fine wheel wraps the next slot of the wheel above it is
+ * cascaded down.  Arming and cancelling are O(1), and the main loop only
+ * ever looks at slots that are actually due.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <naf/nafmodule.h>
+#include <naf/naftimer.h>
+
+#include "timer.h"
+
+#define TVN_BITS 6
+#define TVR_BITS 8
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_COUNT 4
+
+#define TIMER_MAXDELAY 0x7fffffff
+
+#define TVN_INDEX(j, n) (((j) >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+static struct naf_timer *naf_timer__tvr[TVR_SIZE];
+static struct naf_timer *naf_timer__tvn[TVN_COUNT][TVN_SIZE];
+static naf_u32_t naf_timer__jiffies = 0; /* next tick to be processed */
+static int naf_timer__started = 0;
+static int naf_timer__count = 0;
+
+
+naf_u32_t naf_timer_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ((naf_u32_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+#endif
+#ifdef HAVE_SYS_TIME_H
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return ((naf_u32_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+	}
+#else
+	return (naf_u32_t)time(NULL) * 1000;
+#endif
+}
+
+static void naf_timer__link(struct naf_timer **head, struct naf_timer *timer)
+{
+
+	if ((timer->next = *head))
+		(*head)->prevp = &timer->next;
+	*head = timer;
+	timer->prevp = head;
+
+	return;
+}
+
+static void naf_timer__unlink(struct naf_timer *timer)
+{
+
+	if ((*timer->prevp = timer->next))
+		timer->next->prevp = timer->prevp;
+	timer->next = NULL;
+	timer->prevp = NULL;
+
+	return;
+}
+
+static void naf_timer__add(struct naf_timer *timer)
+{
+	naf_u32_t expires = timer->expires;
+	naf_u32_t idx = expires - naf_timer__jiffies;
+	struct naf_timer **head;
+
+	if ((naf_s32_t)idx < 0) {
+		/* already late; fire on the very next tick */
+		head = &naf_timer__tvr[naf_timer__jiffies & TVR_MASK];
+	} else if (idx < TVR_SIZE) {
+		head = &naf_timer__tvr[expires & TVR_MASK];
+	} else if (idx < (1 << (TVR_BITS + TVN_BITS))) {
+		head = &naf_timer__tvn[0][TVN_INDEX(expires, 0)];
+	} else if (idx < (1 << (TVR_BITS + 2 * TVN_BITS))) {
+		head = &naf_timer__tvn[1][TVN_INDEX(expires, 1)];
+	} else if (idx < (1 << (TVR_BITS + 3 * TVN_BITS))) {
+		head = &naf_timer__tvn[2][TVN_INDEX(expires, 2)];
+	} else {
+		head = &naf_timer__tvn[3][TVN_INDEX(expires, 3)];
+	}
+
+	naf_timer__link(head, timer);
+
+	return;
+}
+
+/* Move everything in one slot of an upper wheel down to where it belongs. */
+static int naf_timer__cascade(int n, int index)
+{
+	struct naf_timer *list, *timer;
+
+	if ((list = naf_timer__tvn[n][index]))
+		list->prevp = &list;
+	naf_timer__tvn[n][index] = NULL;
+
+	while ((timer = list)) {
+		naf_timer__unlink(timer);
+		naf_timer__add(timer);
+	}
+
+	return index;
+}
+
+void naf_timer_init(struct naf_timer *timer, struct nafmodule *owner, naf_timer_func_t func, void *data)
+{
+
+	if (!timer)
+		return;
+
+	memset(timer, 0, sizeof(struct naf_timer));
+	timer->owner = owner;
+	timer->func = func;
+	timer->data = data;
+
+	return;
+}
+
+int naf_timer_isarmed(struct naf_timer *timer)
+{
+	return timer && timer->prevp;
+}
+
+void naf_timer_cancel(struct naf_timer *timer)
+{
+
+	if (!naf_timer_isarmed(timer))
+		return;
+
+	naf_timer__unlink(timer);
+	naf_timer__count--;
+
+	return;
+}
+
+int naf_timer_arm(struct naf_timer *timer, naf_u32_t msec)
+{
+
+	if (!timer || !timer->func)
+		return -1;
+
+	naf_timer_cancel(timer);
+
+	/* If the wheel is empty, there's no reason to make run() catch up. */
+	if (!naf_timer__started || !naf_timer__count) {
+		naf_timer__jiffies = naf_timer_now();
+		naf_timer__started = 1;
+	}
+
+	if (msec > TIMER_MAXDELAY)
+		msec = TIMER_MAXDELAY;
+	timer->expires = naf_timer_now() + msec;
+
+	naf_timer__add(timer);
+	naf_timer__count++;
+
+	return 0;
+}
+
+/*
+ * Run everything that's due.  Called from the main loop.
+ */
+void naf_timer__run(void)
+{
+	naf_u32_t now;
+
+	if (!naf_timer__started)
+		return;
+
+	now = naf_timer_now();
+
+	while ((naf_s32_t)(now - naf_timer__jiffies) >= 0) {
+		int index = naf_timer__jiffies & TVR_MASK;
+		struct naf_timer *list, *timer;
+
+		if (!naf_timer__count) {
+			/* nothing to do; skip right ahead */
+			naf_timer__jiffies = now + 1;
+			break;
+		}
+
+		if (!index &&
+				!naf_timer__cascade(0, TVN_INDEX(naf_timer__jiffies, 0)) &&
+				!naf_timer__cascade(1, TVN_INDEX(naf_timer__jiffies, 1)) &&
+				!naf_timer__cascade(2, TVN_INDEX(naf_timer__jiffies, 2)))
+			naf_timer__cascade(3, TVN_INDEX(naf_timer__jiffies, 3));
+
+		naf_timer__jiffies++;
+
+		/*
+		 * Take the whole slot at once.  Callbacks may cancel (or
+		 * rearm) anything, including other timers still on it.
+		 */
+		if ((list = naf_timer__tvr[index]))
+			list->prevp = &list;
+		naf_timer__tvr[index] = NULL;
+
+		while ((timer = list)) {
+			naf_timer__unlink(timer);
+			naf_timer__count--;
+
+			timer->func(timer->owner, timer, timer->data);
+		}
+	}
+
+	return;
+}
+
+/*
+ * How long the main loop can sleep before the next timer is due, capped at
+ * maxdelay (milliseconds).  Only the fine wheel is looked at; if there's
+ * nothing there, we wake up at the next cascade, which is at most 256ms
+ * away.
+ */
+int naf_timer__nextdelay(int maxdelay)
+{
+	int i, index;
+
+	if (!naf_timer__count)
+		return maxdelay;
+
+	index = naf_timer__jiffies & TVR_MASK;
+	for (i = 0; i < TVR_SIZE; i++) {
+		int delay;
+
+		if (((index + i) & TVR_MASK) == 0 && i)
+			break; /* cascade point */
+
+		if (naf_timer__tvr[(index + i) & TVR_MASK]) {
+			delay = (int)((naf_s32_t)(naf_timer__jiffies + i - naf_timer_now()));
+			if (delay < 0)
+				delay = 0;
+			return (delay < maxdelay) ? delay : maxdelay;
+		}
+	}
+
+	return (i < maxdelay) ? i : maxdelay;
+}
+
+static void naf_timer__cancelall_list(struct naf_timer **head, struct nafmodule *owner)
+{
+	struct naf_timer *timer, *next;
+
+	for (timer = *head; timer; timer = next) {
+		next = timer->next;
+
+		if (timer->owner == owner)
+			naf_timer_cancel(timer);
+	}
+
+	return;
+}
+
+void naf_timer__cancelall(struct nafmodule *owner)
+{
+	int i, n;
+
+	for (i = 0; i < TVR_SIZE; i++)
+		naf_timer__cancelall_list(&naf_timer__tvr[i], owner);
+	for (n = 0; n < TVN_COUNT; n++) {
+		for (i = 0; i < TVN_SIZE; i++)
+			naf_timer__cancelall_list(&naf_timer__tvn[n][i], owner);
+	}
+
+	return;
+}
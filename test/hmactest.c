@@ -0,0 +1,119 @@
+/*
+ * gnr - Generic interNode message Routing
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * gnr is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * gnr is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Known-answer test for gnr's HMAC-SHA256, using the test cases from
+ * RFC 4231 (all but case 5, which truncates the output).  Each one is run
+ * with the data given all at once and a byte at a time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <naf/naftypes.h>
+
+#include "hmac.h"
+
+struct hmactest {
+	int num;
+	naf_u8_t keybyte; /* key is keylen of these, unless key is set */
+	const char *key;
+	int keylen;
+	naf_u8_t databyte; /* ditto */
+	const char *data;
+	int datalen;
+	const char *expect;
+};
+
+static const struct hmactest hmactests[] = {
+	{1, 0x0b, NULL, 20, 0, "Hi There", 8,
+		"b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7"},
+	{2, 0, "Jefe", 4, 0, "what do ya want for nothing?", 28,
+		"5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843"},
+	{3, 0xaa, NULL, 20, 0xdd, NULL, 50,
+		"773ea91e36800e46854db8ebd09181a72959098b3ef8c122d9635514ced565fe"},
+	{4, 0, "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19", 25, 0xcd, NULL, 50,
+		"82558a389a443c0ea4cc819899f2083a85f0faa3e578f8077a2e3ff46729665b"},
+	{6, 0xaa, NULL, 131, 0, "Test Using Larger Than Block-Size Key - Hash Key First", 54,
+		"60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54"},
+	{7, 0xaa, NULL, 131, 0, "This is a test using a larger than block-size key and a larger than block-size data. The key needs to be hashed before being used by the HMAC algorithm.", 152,
+		"9b09ffa71b942fcb27635fbcd5b0e944bfdc63644f0713938a7f51535c3a35e2"},
+	{0, 0, NULL, 0, 0, NULL, 0, NULL}
+};
+
+static int hmactest__run(const struct hmactest *ht, int bytewise)
+{
+	naf_u8_t key[256], data[256], out[GNR_HMAC_LEN], expect[GNR_HMAC_LEN];
+	struct gnr_hmac hm;
+	char got[GNR_HMAC_LEN * 2 + 1];
+	unsigned int x;
+	int i;
+
+	if (ht->key)
+		memcpy(key, ht->key, ht->keylen);
+	else
+		memset(key, ht->keybyte, ht->keylen);
+	if (ht->data)
+		memcpy(data, ht->data, ht->datalen);
+	else
+		memset(data, ht->databyte, ht->datalen);
+
+	for (i = 0; i < GNR_HMAC_LEN; i++) {
+		sscanf(ht->expect + i * 2, "%2x", &x);
+		expect[i] = (naf_u8_t)x;
+	}
+
+	gnr_hmac_init(&hm, key, ht->keylen);
+	if (bytewise) {
+		for (i = 0; i < ht->datalen; i++)
+			gnr_hmac_update(&hm, data + i, 1);
+	} else
+		gnr_hmac_update(&hm, data, ht->datalen);
+	gnr_hmac_final(&hm, out);
+
+	if (gnr_hmac_equal(out, expect)) {
+		printf("case %d%s: ok\n", ht->num, bytewise ? " (bytewise)" : "");
+		return 0;
+	}
+
+	for (i = 0; i < GNR_HMAC_LEN; i++)
+		sprintf(got + i * 2, "%02x", out[i]);
+	printf("case %d%s: FAILED\n  got    %s\n  expect %s\n", ht->num, bytewise ? " (bytewise)" : "", got, ht->expect);
+
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	const struct hmactest *ht;
+	int failed = 0;
+
+	for (ht = hmactests; ht->expect; ht++) {
+		if (hmactest__run(ht, 0) == -1)
+			failed++;
+		if (hmactest__run(ht, 1) == -1)
+			failed++;
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# Runs three timpsd's on localhost linked with gnrpeer (peer1.conf through
+# peer3.conf) and checks that every pair ends up with exactly one link, even
+# where both sides connect to each other.  Then starts a fourth with the wrong
+# secret (peerbad.conf) and checks that it's refused.
+#
+# Uses 127.0.0.1 ports 15191-15194 and 15301-15304.  Set TIMPSD to the
+# binary to test (defaults to the one in this build tree).
+#
+
+srcdir=${srcdir:-.}
+srcdir=`cd "$srcdir" && pwd`
+TIMPSD=${TIMPSD:-`pwd`/../timps/timpsd}
+work=`pwd`/peertest.work
+pids=
+failed=0
+
+cleanup()
+{
+	for pid in $pids; do
+		kill $pid 2>/dev/null
+	done
+	wait 2>/dev/null
+}
+trap cleanup 0
+trap 'exit 1' 1 2 15
+
+start()
+{
+	"$TIMPSD" -c "$srcdir/$1.conf" -d > "$work/$1.out" 2>&1 &
+	pids="$pids $!"
+}
+
+count()
+{
+	grep -c "$2" "$work/$1.out"
+}
+
+expect()
+{
+	if [ "$3" -eq "$4" ]; then
+		echo "$1: $2: ok"
+	else
+		echo "$1: $2: FAILED (got $3, expected $4)"
+		failed=1
+	fi
+}
+
+if [ ! -x "$TIMPSD" ]; then
+	echo "no timpsd at $TIMPSD"
+	exit 1
+fi
+
+rm -rf "$work"
+mkdir "$work" || exit 1
+cd "$work" || exit 1
+
+start peer1
+start peer2
+start peer3
+sleep 4
+
+# alpha and bravo both connect to each other, so one of those links gets
+# dropped; whatever's left has to be one link per pair, agreed on both ends.
+for p in peer1:alpha peer2:bravo peer3:charlie; do
+	conf=${p%%:*}
+	name=${p##*:}
+	for o in alpha bravo charlie; do
+		[ "$o" = "$name" ] && continue
+		linked=`count $conf "] linked to $o\$"`
+		dups=`count $conf "] already linked to $o\$"`
+		lost=`count $conf "] lost link to $o\$"`
+		# refused duplicates get "lost" too, once they're closed
+		expect $name "links to $o" `expr $linked + $dups - $lost` 1
+		[ $dups -gt 0 ] && echo "$name: dropped $dups duplicate link(s) to $o"
+	done
+done
+
+start peerbad
+sleep 2
+
+expect alpha "not linked to mallory" `count peer1 "] linked to mallory\$"` 0
+expect mallory "not linked to alpha" `count peerbad "] linked to alpha\$"` 0
+expect mallory "secret refused" `count peerbad "alpha doesn't know the secret" | sed 's/^[1-9][0-9]*$/1/'` 1
+
+if [ $failed -ne 0 ]; then
+	echo "logs are in $work"
+	exit 1
+fi
+
+exit 0
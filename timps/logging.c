@@ -61,6 +61,8 @@ static FILE *timps_logging__adminlogstream = NULL;
 
 #define TLOGGING_ENABLEPERUSERLOGS_DEFAULT 0
 static int timps_logging__enableuserlogs = TLOGGING_ENABLEPERUSERLOGS_DEFAULT;
+#define TLOGGING_BATCHNODEEVENTS_DEFAULT 0
+static int timps_logging__batchnodeevents = TLOGGING_BATCHNODEEVENTS_DEFAULT;
 
 
 static char *myctime(void)
@@ -301,6 +303,22 @@ tlogging_nodeeventhandler(struct nafmodule *mod, struct gnr_event_info *gei)
 	return;
 }
 
+/*
+ * With batchnodeevents on, node events come in here once per pass of the
+ * main loop instead, and a user who's only on for a moment doesn't get a
+ * log file opened and closed for them (or show up at all).
+ */
+static void
+tlogging_nodeeventbatch(struct nafmodule *mod, int count, struct gnr_event_info **geis)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		tlogging_nodeeventhandler(mod, geis[i]);
+
+	return;
+}
+
 
 static void
 freetag(struct nafmodule *mod, void *object, const char *tagname, char tagtype, void *tagdata)
@@ -352,6 +370,7 @@ modshutdown(struct nafmodule *mod)
 	}
 
 	gnr_event_unregister(mod, tlogging_nodeeventhandler);
+	gnr_event_unregister_batch(mod, tlogging_nodeeventbatch);
 	gnr_msg_remmsghandler(mod, GNR_MSG_MSGHANDLER_STAGE_POSTROUTING, tlogging_msglogger);
 	gnr_msg_unregister(mod);
 
@@ -420,6 +439,19 @@ signalhandler(struct nafmodule *mod, struct nafmodule *source, int signum)
 		NAFCONFIG_UPDATEBOOLMODPARMDEF(mod, "enableperuserlogs",
 					       timps_logging__enableuserlogs,
 					       TLOGGING_ENABLEPERUSERLOGS_DEFAULT);
+
+		NAFCONFIG_UPDATEBOOLMODPARMDEF(mod, "batchnodeevents",
+					       i, TLOGGING_BATCHNODEEVENTS_DEFAULT);
+		if (i != timps_logging__batchnodeevents) {
+			if (i) {
+				gnr_event_unregister(mod, tlogging_nodeeventhandler);
+				gnr_event_register_batch(mod, tlogging_nodeeventbatch, GNR_EVENTMASK_NODE);
+			} else {
+				gnr_event_unregister_batch(mod, tlogging_nodeeventbatch);
+				gnr_event_register(mod, tlogging_nodeeventhandler, GNR_EVENTMASK_NODE);
+			}
+			timps_logging__batchnodeevents = i;
+		}
 	}
 
 	return;
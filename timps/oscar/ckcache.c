@@ -32,29 +32,77 @@
 
 #include <naf/nafmodule.h>
 #include <naf/naftypes.h>
+#include <naf/naftimer.h>
+#include <naf/nafstats.h>
 
 #include "oscar_internal.h"
 #include "ckcache.h"
 
+/*
+ * Login cookies handed out by the authorizer, kept until the client shows
+ * up at the BOS port with one.  During a login storm there can be
+ * thousands of these outstanding, so they're hashed on the cookie bytes.
+ * Every entry lives for the same CKCACHE_TIMEOUT, so the insertion order is
+ * also the expiry order: they're kept on one list, oldest first, with a
+ * single timer for whichever is at the head.  Past ckcachemax, the oldest
+ * is thrown out to make room.
+ */
+
 #define CKCACHE_TIMEOUT 60
+#define CKCACHE_HASH_MINSIZE 256
 
 struct ckcache {
 
 	/* key */
 	naf_u8_t *ck;
 	naf_u16_t cklen;
+	naf_u32_t hash;
 
 	/* values */
 	char *ip;
 	char *sn;
 	naf_u16_t servtype;
 
-	time_t addtime;
+	naf_u32_t expires; /* naf_timer_now() */
 
-	struct ckcache *next;
+	struct ckcache *hnext; /* hash chain */
+	struct ckcache *next; /* by age, oldest first */
+	struct ckcache **prevp;
 };
-static struct ckcache *timps_oscar__ckcache = NULL;
 
+static struct ckcache **toscar__ckcache = NULL;
+static int toscar__ckcache_size = 0;
+static int toscar__ckcache_count = 0;
+static struct ckcache *toscar__ckcache_oldest = NULL;
+static struct ckcache **toscar__ckcache_newest = &toscar__ckcache_oldest;
+static struct naf_timer toscar__ckcache_timer;
+
+static struct {
+	naf_longstat_t hits;
+	naf_longstat_t misses;
+	naf_longstat_t expirations;
+	naf_longstat_t evictions;
+} ckstats = {0, 0, 0, 0};
+
+
+static naf_u32_t
+ckc__hash(const naf_u8_t *ck, naf_u16_t cklen)
+{
+	naf_u32_t h = 2166136261UL;
+
+	while (cklen--) {
+		h ^= *ck++;
+		h *= 16777619UL;
+	}
+
+	return h;
+}
+
+static struct ckcache **
+ckc__bucket(naf_u32_t hash)
+{
+	return &toscar__ckcache[hash & (toscar__ckcache_size - 1)];
+}
 
 static void
 ckc__free(struct nafmodule *mod, struct ckcache *ckc)
@@ -79,23 +127,62 @@ ckc__alloc(struct nafmodule *mod, naf_u8_t *ck, naf_u16_t cklen, const char *ip,
 
 	if (!(ckc->ck = naf_malloc(mod, cklen)) ||
 			!(ckc->ip = naf_strdup(mod, ip)) ||
-			!(ckc->sn = naf_strdup(mod, sn))) {
+			(sn && !(ckc->sn = naf_strdup(mod, sn)))) {
 		ckc__free(mod, ckc);
 		return NULL;
 	}
 	memcpy(ckc->ck, ck, cklen);
 	ckc->cklen = cklen;
+	ckc->hash = ckc__hash(ck, cklen);
+	ckc->servtype = servtype;
 
 	return ckc;
 }
 
+/* Double the table when it gets as full as it is big. */
+static void
+ckc__grow(struct nafmodule *mod)
+{
+	struct ckcache **oldv = toscar__ckcache, *ckc;
+	int oldsize = toscar__ckcache_size, i;
+
+	if (toscar__ckcache && (toscar__ckcache_count < toscar__ckcache_size))
+		return;
+
+	toscar__ckcache_size = oldsize ? (oldsize * 2) : CKCACHE_HASH_MINSIZE;
+	if (!(toscar__ckcache = naf_malloc(mod, sizeof(struct ckcache *) * toscar__ckcache_size))) {
+		/* keep using the old one; it's just slower */
+		toscar__ckcache = oldv;
+		toscar__ckcache_size = oldsize;
+		return;
+	}
+	memset(toscar__ckcache, 0, sizeof(struct ckcache *) * toscar__ckcache_size);
+
+	for (i = 0; i < oldsize; i++) {
+		while ((ckc = oldv[i])) {
+			struct ckcache **bucket;
+
+			oldv[i] = ckc->hnext;
+			bucket = ckc__bucket(ckc->hash);
+			ckc->hnext = *bucket;
+			*bucket = ckc;
+		}
+	}
+	naf_free(mod, oldv);
+
+	return;
+}
+
 static struct ckcache *
-toscar_ckcache__find(struct nafmodule *mod, naf_u8_t *ck, naf_u16_t cklen)
+toscar_ckcache__find(naf_u8_t *ck, naf_u16_t cklen, naf_u32_t hash)
 {
 	struct ckcache *ckc;
 
-	for (ckc = timps_oscar__ckcache; ckc; ckc = ckc->next) {
-		if ((ckc->cklen == cklen) &&
+	if (!toscar__ckcache)
+		return NULL;
+
+	for (ckc = *ckc__bucket(hash); ckc; ckc = ckc->hnext) {
+		if ((ckc->hash == hash) && (ckc->cklen == cklen) &&
 				(memcmp(ckc->ck, ck, cklen) == 0))
 			return ckc;
 	}
@@ -103,26 +190,134 @@ toscar_ckcache__find(struct nafmodule *mod, naf_u8_t *ck, naf_u16_t cklen)
 	return NULL;
 }
 
+/* Keep the timer pointed at the oldest entry. */
+static void
+toscar_ckcache__rearm(void)
+{
+	naf_u32_t now;
+
+	if (!toscar__ckcache_oldest) {
+		naf_timer_cancel(&toscar__ckcache_timer);
+		return;
+	}
+
+	now = naf_timer_now();
+	if ((naf_s32_t)(toscar__ckcache_oldest->expires - now) <= 0)
+		naf_timer_arm(&toscar__ckcache_timer, 0);
+	else
+		naf_timer_arm(&toscar__ckcache_timer, toscar__ckcache_oldest->expires - now);
+
+	return;
+}
+
+/* Take it out of the hash and the age list; caller frees. */
+static void
+toscar_ckcache__unlink(struct ckcache *ckc)
+{
+	struct ckcache *cur, **prev;
+
+	for (prev = ckc__bucket(ckc->hash); (cur = *prev); prev = &cur->hnext) {
+		if (cur == ckc) {
+			*prev = cur->hnext;
+			break;
+		}
+	}
+	toscar__ckcache_count--;
+
+	if (ckc->next)
+		ckc->next->prevp = ckc->prevp;
+	else
+		toscar__ckcache_newest = ckc->prevp;
+	*ckc->prevp = ckc->next;
+	ckc->next = NULL;
+	ckc->prevp = NULL;
+
+	return;
+}
+
+static void
+toscar_ckcache__timeout(struct nafmodule *mod, struct naf_timer *timer, void *data)
+{
+	struct ckcache *ckc;
+	naf_u32_t now;
+
+	now = naf_timer_now();
+
+	while ((ckc = toscar__ckcache_oldest) &&
+			((naf_s32_t)(ckc->expires - now) <= 0)) {
+
+		toscar_ckcache__unlink(ckc);
+		ckstats.expirations++;
+
+		if (timps_oscar__debug > 1) {
+			dvprintf(mod, "ckcache: expired cookie %02x %02x %02x %02x\n",
+					ckc->ck[0], ckc->ck[1],
+					ckc->ck[2], ckc->ck[3]);
+		}
+
+		ckc__free(mod, ckc);
+	}
+
+	toscar_ckcache__rearm();
+
+	return;
+}
+
 int
 toscar_ckcache_add(struct nafmodule *mod, naf_u8_t *ck, naf_u16_t cklen, const char *ip, const char *sn, naf_u16_t servtype)
 {
-	struct ckcache *ckc;
+	struct ckcache *ckc, **bucket;
+	int wasempty;
 
 	if (!mod || !ck || !cklen || !ip)
 		return -1;
 
-	if (toscar_ckcache__find(mod, ck, cklen)) {
+	if (toscar_ckcache__find(ck, cklen, ckc__hash(ck, cklen))) {
 		if (timps_oscar__debug > 0)
 			dprintf(mod, "ckcache: attempted to add duplicate cookie\n");
 		return -1; /* dups are bad... */
 	}
 
+	ckc__grow(mod);
+	if (!toscar__ckcache)
+		return -1;
+
 	if (!(ckc = ckc__alloc(mod, ck, cklen, ip, sn, servtype)))
 		return -1;
-	ckc->addtime = time(NULL);
+	ckc->expires = naf_timer_now() + (CKCACHE_TIMEOUT * 1000);
+
+	/* make room */
+	while ((timps_oscar__ckcachemax > 0) &&
+			(toscar__ckcache_count >= timps_oscar__ckcachemax) &&
+			toscar__ckcache_oldest) {
+		struct ckcache *old = toscar__ckcache_oldest;
+
+		toscar_ckcache__unlink(old);
+		ckstats.evictions++;
+
+		if (timps_oscar__debug > 0) {
+			dvprintf(mod, "ckcache: full (%d), evicted cookie %02x %02x %02x %02x\n",
+					timps_oscar__ckcachemax,
+					old->ck[0], old->ck[1],
+					old->ck[2], old->ck[3]);
+		}
+
+		ckc__free(mod, old);
+	}
 
-	ckc->next = timps_oscar__ckcache;
-	timps_oscar__ckcache = ckc;
+	bucket = ckc__bucket(ckc->hash);
+	ckc->hnext = *bucket;
+	*bucket = ckc;
+	toscar__ckcache_count++;
+
+	wasempty = !toscar__ckcache_oldest;
+	ckc->prevp = toscar__ckcache_newest;
+	*toscar__ckcache_newest = ckc;
+	toscar__ckcache_newest = &ckc->next;
+
+	/* anything still ahead of it expires first, so the timer's right */
+	if (wasempty || !naf_timer_isarmed(&toscar__ckcache_timer))
+		toscar_ckcache__rearm();
 
 	if (timps_oscar__debug > 1) {
 		dvprintf(mod, "ckcache: added cookie %02x %02x %02x %02x\n",
@@ -133,36 +328,31 @@ toscar_ckcache_add(struct nafmodule *mod, naf_u8_t *ck, naf_u16_t cklen, const c
 	return 0;
 }
 
-static struct ckcache *
-toscar_ckcache__remove(struct nafmodule *mod, naf_u8_t *ck, naf_u16_t cklen)
-{
-	struct ckcache *cur, **prev;
-
-	for (prev = &timps_oscar__ckcache; (cur = *prev); ) {
-		if ((cur->cklen == cklen) &&
-				(memcmp(cur->ck, ck, cklen) == 0)) {
-			*prev = cur->next;
-			return cur;
-		}
-		prev = &cur->next;
-	}
-
-	return NULL;
-}
-
 int
 toscar_ckcache_rem(struct nafmodule *mod, naf_u8_t *ck, naf_u16_t cklen, char **ipret, char **snret, naf_u16_t *servtyperet)
 {
 	struct ckcache *ckc;
 
+	if (!mod || !ck || !cklen)
+		return -1;
+
 	if (timps_oscar__debug > 1) {
 		dvprintf(mod, "ckcache: looking to remove cookie %02x %02x %02x %02x\n",
 				ck[0], ck[1],
 				ck[2], ck[3]);
 	}
 
-	if (!(ckc = toscar_ckcache__remove(mod, ck, cklen)))
+	if (!(ckc = toscar_ckcache__find(ck, cklen, ckc__hash(ck, cklen)))) {
+		ckstats.misses++;
 		return -1;
+	}
+	ckstats.hits++;
+
+	if (ckc == toscar__ckcache_oldest) {
+		toscar_ckcache__unlink(ckc);
+		toscar_ckcache__rearm();
+	} else
+		toscar_ckcache__unlink(ckc);
 
 	if (ipret) {
 		*ipret = ckc->ip;
@@ -180,19 +370,40 @@ toscar_ckcache_rem(struct nafmodule *mod, naf_u8_t *ck, naf_u16_t cklen, char **
 	return 0;
 }
 
+int
+toscar_ckcache_init(struct nafmodule *mod)
+{
+
+	naf_timer_init(&toscar__ckcache_timer, mod, toscar_ckcache__timeout, NULL);
+
+	naf_stats_register_longstat(mod, "ckcache.hits", &ckstats.hits);
+	naf_stats_register_longstat(mod, "ckcache.misses", &ckstats.misses);
+	naf_stats_register_longstat(mod, "ckcache.expirations", &ckstats.expirations);
+	naf_stats_register_longstat(mod, "ckcache.evictions", &ckstats.evictions);
+
+	return 0;
+}
+
 void
-toscar_ckcache_timer(struct nafmodule *mod, time_t now)
+toscar_ckcache_shutdown(struct nafmodule *mod)
 {
-	struct ckcache *cur, **prev;
+	struct ckcache *ckc;
+
+	naf_stats_unregisterstat(mod, "ckcache.hits");
+	naf_stats_unregisterstat(mod, "ckcache.misses");
+	naf_stats_unregisterstat(mod, "ckcache.expirations");
+	naf_stats_unregisterstat(mod, "ckcache.evictions");
+
+	naf_timer_cancel(&toscar__ckcache_timer);
 
-	for (prev = &timps_oscar__ckcache; (cur = *prev); ) {
-		if ((now - cur->addtime) > CKCACHE_TIMEOUT) {
-			*prev = cur->next;
-			ckc__free(mod, cur);
-		} else
-			prev = &cur->next;
+	while ((ckc = toscar__ckcache_oldest)) {
+		toscar_ckcache__unlink(ckc);
+		ckc__free(mod, ckc);
 	}
 
+	naf_free(mod, toscar__ckcache);
+	toscar__ckcache = NULL;
+	toscar__ckcache_size = 0;
+
 	return;
 }
-
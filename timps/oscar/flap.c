@@ -23,17 +23,25 @@
 #include <configwin32.h>
 #endif
 
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
 #include <naf/nafmodule.h>
 #include <naf/naftlv.h>
+#include <naf/naftimer.h>
+#include <naf/nafstats.h>
 
 #include "oscar_internal.h"
 #include "flap.h"
 #include "snac.h"
 #include "ckcache.h"
+#include "session.h"
 
 #define FLAPHDRLEN 6
 #define MAXSNACLEN 8192
-#define MAXFLAPLEN (FLAPHDRLEN + MAXSNACLEN) /* size of all flap buffers */
+#define MAXFLAPLEN (FLAPHDRLEN + MAXSNACLEN)
+#define FLAPBUFLEN (MAXFLAPLEN + 1) /* plus a spare byte (see struct toscar_snac) */
 
 #define FLAP_MAGIC '*'
 #define FLAPHDR_MAGIC(x) naf_byte_get8(x)
@@ -41,19 +49,158 @@
 #define FLAPHDR_SEQNUM(x) naf_byte_get16((x) + 2)
 #define FLAPHDR_LEN(x) naf_byte_get16((x) + 4)
 
+/*
+ * Streaming receive.
+ *
+ * Reading a FLAP at a time takes two reads (header, then the rest) and two
+ * trips through the main loop, and at login the server sends dozens of
+ * them back to back.  So instead, unless streamreceive is off, OSCAR
+ * connections are READRAW: we read as much as there is into a buffer kept
+ * with the connection, and deal with every whole FLAP in it at once.
+ *
+ * Most FLAPs don't need anything done to them besides a new sequence
+ * number (see toscar_snac_passthrough()), and runs of those are forwarded
+ * straight out of the buffer.  If the run starts at the front of the
+ * buffer and fills at least RXHANDOFF of it, the buffer itself is handed
+ * to the endpoint, and whatever's left after the run (usually the start of
+ * a FLAP that isn't all here yet) is moved to a new one.  Shorter runs are
+ * copied into a buffer their own size, so a slow endpoint's write queue
+ * isn't holding RXBUFLEN for every keepalive.  Everything else is copied out and goes through
+ * toscar_flap__handleflap(), same as before, since the handlers write into
+ * the buffer and may keep it.  Only RXBUDGET of those are done per pass
+ * through the main loop, since each can queue a write on some other
+ * connection, and writes only go out once per pass; the rest are left for
+ * a zero-length timer, and the socket isn't read again until they're done.
+ */
+#define RXBUFLEN 16384 /* has to be more than MAXFLAPLEN */
+#define RXREADS 4 /* most reads per readiness, if they keep filling it */
+#define RXBUDGET 16 /* most FLAPs to copy out and handle per pass */
+#define RXHANDOFF (RXBUFLEN / 2) /* shortest run to hand the buffer off for */
+
+struct toscar_rxbuf {
+	naf_u8_t *buf; /* RXBUFLEN; NULL when there's nothing in it */
+	int start; /* where the next FLAP starts */
+	int len; /* how much has been read into buf */
+	struct naf_timer more; /* RXBUDGET ran out; finish up next pass */
+	int postlen; /* without streamreceive: what the posted buffer was got for */
+};
+static int toscar__slot_rxbuf = -1; /* a struct toscar_rxbuf */
+
+static struct toscar_rxbuf *
+toscar_flap__rxbuf(struct nafconn *conn)
+{
+	return (struct toscar_rxbuf *)naf_conn_extslot(conn, toscar__slot_rxbuf);
+}
+
+static void toscar_flap__streammore(struct nafmodule *mod, struct naf_timer *timer, void *data);
+
+/*
+ * Receive buffer pool.
+ *
+ * Receive buffers come in a few sizes, and the ones that are given back are
+ * kept (up to RXPOOLKEEP of each size) for the next FLAP that needs one.
+ * They're plain NETBUFs, so one that gets forwarded or kept by a SNAC
+ * handler is freed like any other by whoever ends up with it, and just
+ * doesn't come back.
+ *
+ * Without streamreceive, this is what lets an idle connection do with only
+ * enough buffer posted for a FLAP header (unless lazyreceive is off): a
+ * buffer big enough for the rest is borrowed when the header says how big
+ * that is, and given back once the FLAP has been dealt with.
+ */
+#define RXPOOLKEEP 32 /* most buffers of each size kept around */
+static const int toscar__rxpoolsizes[] = {64, 512, 2048, FLAPBUFLEN, RXBUFLEN};
+#define RXPOOLSIZES ((int)(sizeof(toscar__rxpoolsizes) / sizeof(toscar__rxpoolsizes[0])))
+
+struct toscar_rxpoolbuf {
+	struct toscar_rxpoolbuf *next;
+};
+static struct {
+	struct toscar_rxpoolbuf *free;
+	int count;
+} toscar__rxpool[RXPOOLSIZES];
+
+static struct {
+	naf_longstat_t hits;
+	naf_longstat_t misses;
+} rxpoolstats = {0, 0};
+
 static int
-toscar_flap__reqflap(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *oldbuf)
+toscar_flap__poolsize(int len)
+{
+	int i;
+
+	for (i = 0; i < RXPOOLSIZES; i++) {
+		if (len <= toscar__rxpoolsizes[i])
+			return i;
+	}
+
+	return -1;
+}
+
+/* A buffer of at least len bytes. */
+static naf_u8_t *
+toscar_flap__bufget(struct nafmodule *mod, int len)
 {
+	struct toscar_rxpoolbuf *pb;
+	int i;
+
+	if ((i = toscar_flap__poolsize(len)) == -1)
+		return NULL;
+
+	if ((pb = toscar__rxpool[i].free)) {
+		toscar__rxpool[i].free = pb->next;
+		toscar__rxpool[i].count--;
+		rxpoolstats.hits++;
+		return (naf_u8_t *)pb;
+	}
+
+	rxpoolstats.misses++;
+	return naf_malloc_type(mod, NAF_MEM_TYPE_NETBUF, toscar__rxpoolsizes[i]);
+}
+
+/* Give back a buffer from toscar_flap__bufget() of the same len. */
+static void
+toscar_flap__bufput(struct nafmodule *mod, naf_u8_t *buf, int len)
+{
+	struct toscar_rxpoolbuf *pb = (struct toscar_rxpoolbuf *)buf;
+	int i;
+
+	if (!buf)
+		return;
+
+	if (((i = toscar_flap__poolsize(len)) == -1) ||
+			(toscar__rxpool[i].count >= RXPOOLKEEP)) {
+		naf_free(mod, buf);
+		return;
+	}
+
+	pb->next = toscar__rxpool[i].free;
+	toscar__rxpool[i].free = pb;
+	toscar__rxpool[i].count++;
+
+	return;
+}
+
+static int
+toscar_flap__reqflap(struct nafmodule *mod, struct nafconn *conn)
+{
+	struct toscar_rxbuf *rx;
 	naf_u8_t *buf;
+	int len = FLAPBUFLEN;
 
-	if (!oldbuf)
-		buf = naf_malloc_type(mod, NAF_MEM_TYPE_NETBUF, MAXFLAPLEN);
+	if ((rx = toscar_flap__rxbuf(conn)) && timps_oscar__lazyreceive)
+		len = FLAPHDRLEN + 1; /* the rest comes later */
 
-	if (naf_conn_reqread(conn, oldbuf ? oldbuf : buf, FLAPHDRLEN, 0) == -1) {
-		if (buf)
-			naf_free(mod, buf);
+	if (!(buf = toscar_flap__bufget(mod, len)))
+		return -1;
+
+	if (naf_conn_reqread(conn, buf, FLAPHDRLEN, 0) == -1) {
+		toscar_flap__bufput(mod, buf, len);
 		return -1;
 	}
+	if (rx)
+		rx->postlen = len;
 
 	return 0;
 }
@@ -200,6 +347,7 @@ toscar_flap_sendnop(struct nafmodule *mod, struct nafconn *conn)
 int
 toscar_flap_prepareconn(struct nafmodule *mod, struct nafconn *conn)
 {
+	struct toscar_rxbuf *rx;
 
 	conn->flags = TOSCAR_FLAG_NONE;
 
@@ -211,7 +359,15 @@ toscar_flap_prepareconn(struct nafmodule *mod, struct nafconn *conn)
 			return -1;
 	}
 
-	return toscar_flap__reqflap(mod, conn, NULL);
+	/* conn.c puts it in raw mode (see toscar_flap__streamread()) */
+	if (timps_oscar__streamreceive && (rx = toscar_flap__rxbuf(conn))) {
+		naf_timer_init(&rx->more, mod, toscar_flap__streammore, (void *)conn);
+		conn->type |= NAF_CONN_TYPE_READRAW;
+		return 0;
+	}
+	conn->type &= ~NAF_CONN_TYPE_READRAW;
+
+	return toscar_flap__reqflap(mod, conn);
 }
 
 static int
@@ -291,10 +447,15 @@ toscar_flap_handlechan1__newconn(struct nafmodule *mod, struct nafconn *conn, na
 	if (sn) {
 		/* XXX store full userinfo here */
 		/* Note that the user information is attached to the server connection. */
-		if (naf_conn_tag_add(mod, conn->endpoint, "conn.screenname", 'S', sn) == -1) {
+		if (naf_conn_tag_addatom(mod, conn->endpoint, toscar__atom_screenname, 'S', sn) == -1) {
 			ret = HRET_ERROR;
 			goto out;
 		}
+		if (toscar_session_add(mod, conn->endpoint, sn) == -1) {
+			ret = HRET_ERROR;
+			sn = NULL; /* freed with the tag */
+			goto out;
+		}
 		sn = NULL;
 	}
 
@@ -365,20 +526,15 @@ toscar_flap_handlechan5(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *b
 	return HRET_FORWARD;
 }
 
-int
-toscar_flap_handleread(struct nafmodule *mod, struct nafconn *conn)
+/* Returns -1 if the header is no good. */
+static int
+toscar_flap__checkhdr(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *buf)
 {
-	naf_u8_t *buf;
-	int buflen;
-	int hret = HRET_FORWARD;
-
-	if (naf_conn_takeread(conn, &buf, &buflen) == -1)
-		return -1;
 
 	if (FLAPHDR_MAGIC(buf) != FLAP_MAGIC) {
 		if (timps_oscar__debug > 0)
 			dvprintf(mod, "[cid %lu] FLAP packet did not start with correct magic\n", conn->cid);
-		goto errout;
+		return -1;
 	}
 
 	/* XXX check seqnums */
@@ -389,23 +545,28 @@ toscar_flap_handleread(struct nafmodule *mod, struct nafconn *conn)
 				(FLAPHDR_CHAN(buf) == 0x05) ) ) {
 		if (timps_oscar__debug > 0)
 			dvprintf(mod, "[cid %lu] FLAP packet on invalid channel\n", conn->cid);
-		goto errout;
+		return -1;
 	}
 
 	if (FLAPHDR_LEN(buf) > MAXSNACLEN) {
 		if (timps_oscar__debug > 0)
 			dvprintf(mod, "[cid %lu] FLAP packet contained invalid length\n", conn->cid);
-		goto errout;
+		return -1;
 	}
 
-	if (buflen != (FLAPHDR_LEN(buf) + FLAPHDRLEN)) {
-		if (naf_conn_reqread(conn, buf, buflen + FLAPHDR_LEN(buf), buflen) == -1) {
-			if (timps_oscar__debug > 0)
-				dvprintf(mod, "[cid %lu] naf refused further read request\n", conn->cid);
-			goto errout;
-		}
-		return 0; /* continue later */
-	}
+	return 0;
+}
+
+/*
+ * Deal with one whole FLAP, with a byte to spare after it.  If the buffer
+ * gets used up (forwarded, or kept by a SNAC handler), *bufp is set to NULL;
+ * otherwise it's still the caller's.
+ */
+static int
+toscar_flap__handleflap(struct nafmodule *mod, struct nafconn *conn, naf_u8_t **bufp, int buflen)
+{
+	naf_u8_t *buf = *bufp;
+	int hret = HRET_FORWARD;
 
 	if (timps_oscar__debug > 1)
 		dvprintf(mod, "[cid %lu] received full FLAP packet on channel 0x%02x, seqnum 0x%04lx, length 0x%04lx (%d bytes)\n", conn->cid, FLAPHDR_CHAN(buf), FLAPHDR_SEQNUM(buf), FLAPHDR_LEN(buf), FLAPHDR_LEN(buf));
@@ -414,7 +575,7 @@ toscar_flap_handleread(struct nafmodule *mod, struct nafconn *conn)
 	if (FLAPHDR_CHAN(buf) == 0x01)
 		hret = toscar_flap_handlechan1(mod, conn, buf, (naf_u16_t)buflen);
 	else if (FLAPHDR_CHAN(buf) == 0x02)
-		hret = toscar_flap_handlesnac(mod, conn, buf + FLAPHDRLEN, (naf_u16_t)(buflen - FLAPHDRLEN));
+		hret = toscar_flap_handlesnac(mod, conn, buf + FLAPHDRLEN, (naf_u16_t)(buflen - FLAPHDRLEN), bufp);
 	else if (FLAPHDR_CHAN(buf) == 0x04)
 		hret = toscar_flap_handlechan4(mod, conn, buf, (naf_u16_t)buflen);
 	else if (FLAPHDR_CHAN(buf) == 0x05)
@@ -422,21 +583,272 @@ toscar_flap_handleread(struct nafmodule *mod, struct nafconn *conn)
 
 
 	if (hret == HRET_ERROR)
-		goto errout;
-	else if ((hret == HRET_FORWARD) && conn->endpoint) {
-		if (toscar_flap__sendraw(mod, conn->endpoint, buf, (naf_u16_t)buflen) == -1)
-			goto errout;
-		buf = NULL; /* consumed by sendraw */
+		return -1;
+	else if ((hret == HRET_FORWARD) && conn->endpoint && *bufp) {
+		if (toscar_flap__sendraw(mod, conn->endpoint, *bufp, (naf_u16_t)buflen) == -1)
+			return -1;
+		*bufp = NULL; /* consumed by sendraw */
 	}
 	/*
 	 * HRET_DIGESTED means the packet was processed but should not be
 	 * forwarded -- it was not consumed, in the memory management sense, so
-	 * we can reuse it.
+	 * we can reuse it.  (Unless the SNAC handler kept it, in which case
+	 * *bufp is NULL and we get a new one.)
 	 */
 
-	/* go again... */
-	if (toscar_flap__reqflap(mod, conn, buf) == -1)
+	return 0;
+}
+
+static int
+toscar_flap__passthrough(struct nafconn *conn, naf_u8_t *buf, int buflen)
+{
+
+	if ((FLAPHDR_CHAN(buf) == 0x04) || (FLAPHDR_CHAN(buf) == 0x05))
+		return 1;
+	if (FLAPHDR_CHAN(buf) == 0x02)
+		return toscar_snac_passthrough(conn, buf + FLAPHDRLEN, (naf_u16_t)(buflen - FLAPHDRLEN));
+	return 0;
+}
+
+/* Send the len bytes of whole FLAPs at rx->start on to the endpoint. */
+static int
+toscar_flap__forwardrun(struct nafmodule *mod, struct nafconn *conn, struct toscar_rxbuf *rx, int len)
+{
+	naf_u8_t *run = rx->buf + rx->start, *nbuf = NULL;
+	int i, left;
+
+	if (!conn->endpoint) {
+		rx->start += len;
+		return 0; /* nowhere to send it */
+	}
+
+	for (i = 0; i < len; i += FLAPHDRLEN + FLAPHDR_LEN(run + i))
+		naf_byte_put16(run + i + 2, conn->endpoint->nextseqnum++);
+
+	left = rx->len - (rx->start + len);
+
+	if ((rx->start == 0) && (len >= RXHANDOFF) && (left <= len)) {
+
+		if (left && !(nbuf = toscar_flap__bufget(mod, RXBUFLEN)))
+			return -1;
+
+		if (naf_conn_reqwrite(conn->endpoint, rx->buf, len) == -1) {
+			toscar_flap__bufput(mod, nbuf, RXBUFLEN);
+			return -1;
+		}
+
+		if (left)
+			memcpy(nbuf, run + len, left);
+		rx->buf = nbuf;
+		rx->start = 0;
+		rx->len = left;
+
+	} else {
+
+		if (!(nbuf = naf_malloc_type(mod, NAF_MEM_TYPE_NETBUF, len)))
+			return -1;
+		memcpy(nbuf, run, len);
+
+		if (naf_conn_reqwrite(conn->endpoint, nbuf, len) == -1) {
+			naf_free(mod, nbuf);
+			return -1;
+		}
+
+		rx->start += len;
+	}
+
+	return 0;
+}
+
+/* Copy a FLAP out of the buffer and give it the full treatment. */
+static int
+toscar_flap__handlecopy(struct nafmodule *mod, struct nafconn *conn, struct toscar_rxbuf *rx, int len)
+{
+	naf_u8_t *buf;
+	int ret;
+
+	if (!(buf = toscar_flap__bufget(mod, len + 1)))
+		return -1;
+	memcpy(buf, rx->buf + rx->start, len);
+	rx->start += len;
+
+	ret = toscar_flap__handleflap(mod, conn, &buf, len);
+
+	toscar_flap__bufput(mod, buf, len + 1);
+	return ret;
+}
+
+/*
+ * Returns 1 if it stopped because RXBUDGET ran out, with whole FLAPs still
+ * in the buffer.
+ */
+static int
+toscar_flap__streamparse(struct nafmodule *mod, struct nafconn *conn, struct toscar_rxbuf *rx)
+{
+	int pos = rx->start, budget = RXBUDGET;
+
+	while ((rx->len - pos) >= FLAPHDRLEN) {
+		naf_u8_t *flap = rx->buf + pos;
+		int flaplen;
+
+		if (toscar_flap__checkhdr(mod, conn, flap) == -1)
+			return -1;
+		flaplen = FLAPHDRLEN + FLAPHDR_LEN(flap);
+		if ((rx->len - pos) < flaplen)
+			break; /* rest isn't here yet */
+
+		if (toscar_flap__passthrough(conn, flap, flaplen)) {
+			pos += flaplen;
+			continue;
+		}
+
+		/* anything it sends has to go after what came before it */
+		if (pos > rx->start) {
+			if (toscar_flap__forwardrun(mod, conn, rx, pos - rx->start) == -1)
+				return -1;
+		}
+
+		if (budget-- <= 0)
+			return 1;
+
+		if (toscar_flap__handlecopy(mod, conn, rx, flaplen) == -1)
+			return -1;
+		pos = rx->start;
+	}
+
+	if (pos > rx->start) {
+		if (toscar_flap__forwardrun(mod, conn, rx, pos - rx->start) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Returns 1 if there's more to do before reading again. */
+static int
+toscar_flap__streamprocess(struct nafmodule *mod, struct nafconn *conn, struct toscar_rxbuf *rx)
+{
+	int ret;
+
+	if ((ret = toscar_flap__streamparse(mod, conn, rx)) == -1)
+		return -1;
+
+	if (ret == 1) {
+		naf_timer_arm(&rx->more, 0);
+		return 1;
+	}
+
+	if (rx->buf && (rx->start == rx->len)) {
+		toscar_flap__bufput(mod, rx->buf, RXBUFLEN);
+		rx->buf = NULL;
+	} else if (rx->buf && rx->start) {
+		/* just the start of one FLAP left; move it up front */
+		memmove(rx->buf, rx->buf + rx->start, rx->len - rx->start);
+		rx->len -= rx->start;
+		rx->start = 0;
+	}
+
+	return 0;
+}
+
+static void
+toscar_flap__streammore(struct nafmodule *mod, struct naf_timer *timer, void *data)
+{
+	struct nafconn *conn = (struct nafconn *)data;
+	struct toscar_rxbuf *rx;
+
+	if (!(rx = toscar_flap__rxbuf(conn)) || !rx->buf)
+		return;
+
+	if (toscar_flap__streamprocess(mod, conn, rx) == -1)
+		naf_conn_schedulekill(conn);
+
+	return;
+}
+
+static int
+toscar_flap__streamread(struct nafmodule *mod, struct nafconn *conn)
+{
+	struct toscar_rxbuf *rx;
+	int i, n, room, ret;
+
+	if (!(rx = toscar_flap__rxbuf(conn)))
+		return -1;
+
+	if (naf_timer_isarmed(&rx->more))
+		return 0; /* the socket can wait until we're through what we have */
+
+	for (i = 0; i < RXREADS; i++) {
+
+		if (!rx->buf) {
+			if (!(rx->buf = toscar_flap__bufget(mod, RXBUFLEN)))
+				return -1;
+			rx->start = rx->len = 0;
+		}
+
+		room = RXBUFLEN - rx->len;
+		if ((n = naf_conn_read(conn, rx->buf + rx->len, room)) == -1)
+			return -1;
+		rx->len += n;
+
+		if ((ret = toscar_flap__streamprocess(mod, conn, rx)) == -1)
+			return -1;
+
+		if ((ret == 1) || (n < room))
+			break; /* that's all for now, or all there is */
+	}
+
+	return 0;
+}
+
+int
+toscar_flap_handleread(struct nafmodule *mod, struct nafconn *conn)
+{
+	struct toscar_rxbuf *rx;
+	naf_u8_t *buf, *nbuf;
+	int buflen, flaplen, postlen;
+
+	if (conn->type & NAF_CONN_TYPE_READRAW)
+		return toscar_flap__streamread(mod, conn);
+
+	if (naf_conn_takeread(conn, &buf, &buflen) == -1)
+		return -1;
+	rx = toscar_flap__rxbuf(conn);
+	postlen = rx ? rx->postlen : FLAPBUFLEN;
+
+	if (toscar_flap__checkhdr(mod, conn, buf) == -1)
 		goto errout;
+	flaplen = FLAPHDRLEN + FLAPHDR_LEN(buf);
+
+	if (buflen != flaplen) {
+
+		/* just the header; borrow something bigger if the rest won't fit */
+		if (toscar_flap__poolsize(flaplen + 1) > toscar_flap__poolsize(postlen)) {
+			if (!(nbuf = toscar_flap__bufget(mod, flaplen + 1)))
+				goto errout;
+			memcpy(nbuf, buf, buflen);
+			toscar_flap__bufput(mod, buf, postlen);
+			buf = nbuf;
+			postlen = flaplen + 1;
+			if (rx)
+				rx->postlen = postlen;
+		}
+
+		if (naf_conn_reqread(conn, buf, flaplen, buflen) == -1) {
+			if (timps_oscar__debug > 0)
+				dvprintf(mod, "[cid %lu] naf refused further read request\n", conn->cid);
+			goto errout;
+		}
+		return 0; /* continue later */
+	}
+
+	if (toscar_flap__handleflap(mod, conn, &buf, buflen) == -1)
+		goto errout;
+	toscar_flap__bufput(mod, buf, postlen);
+
+	/* go again... */
+	if (toscar_flap__reqflap(mod, conn) == -1)
+		return -1;
 
 	return 0;
 errout:
@@ -445,45 +857,75 @@ errout:
 }
 
 int
-toscar_flap_handlewrite(struct nafmodule *mod, struct nafconn *conn)
+toscar_flap_init(struct nafmodule *mod)
 {
-	naf_u8_t *buf;
-	int buflen;
 
-	if (naf_conn_takewrite(conn, &buf, &buflen) == -1)
+	if ((toscar__slot_rxbuf = naf_conn_extslot_register(mod, sizeof(struct toscar_rxbuf))) == -1)
 		return -1;
 
-	naf_free(mod, buf);
+	naf_stats_register_longstat(mod, "rxpool.hits", &rxpoolstats.hits);
+	naf_stats_register_longstat(mod, "rxpool.misses", &rxpoolstats.misses);
 
 	return 0;
 }
 
+void
+toscar_flap_shutdown(struct nafmodule *mod)
+{
+	struct toscar_rxpoolbuf *pb;
+	int i;
 
-static int
-toscar__findconn__matcher(struct nafmodule *mod, struct nafconn *conn, const void *udata)
+	for (i = 0; i < RXPOOLSIZES; i++) {
+		while ((pb = toscar__rxpool[i].free)) {
+			toscar__rxpool[i].free = pb->next;
+			naf_free(mod, pb);
+		}
+		toscar__rxpool[i].count = 0;
+	}
+
+	return;
+}
+
+/* Called from connkill. */
+void
+toscar_flap_freeconn(struct nafmodule *mod, struct nafconn *conn)
 {
-	const char *sn = (const char *)udata;
-	char *cursn = NULL;
+	struct toscar_rxbuf *rx;
 
-	if (!(conn->type & NAF_CONN_TYPE_SERVER))
-		return 0;
+	if (!(rx = toscar_flap__rxbuf(conn)))
+		return;
 
-	if ((naf_conn_tag_fetch(mod, conn, "conn.screenname", NULL, (void **)&cursn) == -1) || !cursn)
-		return 0;
-	if (toscar_sncmp(sn, cursn) != 0)
-		return 0;
+	naf_timer_cancel(&rx->more);
+	naf_free(mod, rx->buf);
+	rx->buf = NULL;
 
-	return 1; /* found it */
+	return;
 }
 
+int
+toscar_flap_handlewrite(struct nafmodule *mod, struct nafconn *conn)
+{
+	naf_u8_t *buf;
+	int buflen;
+
+	if (naf_conn_takewrite(conn, &buf, &buflen) == -1)
+		return -1;
+
+	naf_free(mod, buf);
+
+	return 0;
+}
+
+
 /*
- * !!! Avoid using this, in its current state.  To be suitable for larger
- * installations, this needs some accounting added so it's less than O(n).
+ * The server connection for sn, if there is one.  If there's more than one
+ * (BOS and other services, or a prorogued session and a new one), this is
+ * the newest.
  */
 struct nafconn *
 toscar__findconn(struct nafmodule *mod, const char *sn)
 {
-	return naf_conn_find(mod, toscar__findconn__matcher, (void *)sn);
+	return toscar_session_conns(mod, sn);
 }
 
 int
@@ -499,72 +941,56 @@ toscar__force_disconnect(struct nafmodule *mod, const char *sn)
 	return 0;
 }
 
-struct userhasotherclient_info {
-	const char *sn;
-	struct nafconn *conn;
-};
-
-static int
-toscar__userhasotherclient__matcher(struct nafmodule *mod, struct nafconn *conn, const void *udata)
-{
-	struct userhasotherclient_info *uhoci = (struct userhasotherclient_info *)udata;
-	char *cursn = NULL;
-
-	if (!(conn->type & NAF_CONN_TYPE_SERVER))
-		return 0;
-	if (conn == uhoci->conn)
-		return 0; /* this connection is dying, ignoring it */
-
-	if ((naf_conn_tag_fetch(mod, conn, "conn.screenname", NULL, (void **)&cursn) == -1) || !cursn)
-		return 0;
-	if (toscar_sncmp(uhoci->sn, cursn) != 0)
-		return 0;
-	if (!conn->endpoint)
-		return 0; /* doesn't have a client */
-
-	return 1; /* found one */
-}
-
-/* !!! Avoid using this. */
+/*
+ * Whether sn has a server connection, other than conn (which is usually
+ * the one that's dying), with a client on the other end.
+ */
 int
 toscar__userhasotherclient(struct nafmodule *mod, const char *sn, struct nafconn *conn)
 {
-	struct userhasotherclient_info uhoci;
+	struct nafconn *cur;
 
-	uhoci.sn = sn;
-	uhoci.conn = conn; /* server connection */
-	return !!naf_conn_find(mod, toscar__userhasotherclient__matcher, &uhoci);
+	for (cur = toscar_session_conns(mod, sn); cur; cur = toscar_session_next(cur)) {
+		if ((cur != conn) && cur->endpoint)
+			return 1;
+	}
+
+	return 0;
 }
 
-static int
-toscar__detacholdconns__matcher(struct nafmodule *mod, struct nafconn *conn, const void *udata)
+/*
+ * The server connection for sn that has a client on the other end, if any.
+ * A prorogued session whose client went away doesn't count.
+ */
+struct nafconn *
+toscar__findattachedconn(struct nafmodule *mod, const char *sn)
 {
-	const char *sn = (const char *)udata;
-	char *cursn = NULL;
-
-	if (!(conn->type & NAF_CONN_TYPE_SERVER))
-		return 0;
-	if (conn->endpoint)
-		return 0;
-
-	if ((naf_conn_tag_fetch(mod, conn, "conn.screenname", NULL, (void **)&cursn) == -1) || !cursn)
-		return 0;
-	if (toscar_sncmp(sn, cursn) != 0)
-		return 0;
+	struct nafconn *cur;
 
-	if (timps_oscar__debug) {
-		dvprintf(mod, "disconnecting old server connection %lu for '%s'\n", conn->cid, cursn);
+	for (cur = toscar_session_conns(mod, sn); cur; cur = toscar_session_next(cur)) {
+		if (cur->endpoint)
+			return cur;
 	}
 
-	naf_conn_schedulekill(conn);
-
-	return 0; /* keep going */
+	return NULL;
 }
 
 struct nafconn *
 toscar__detacholdconns(struct nafmodule *mod, const char *sn)
 {
-	return naf_conn_find(mod, toscar__detacholdconns__matcher, (void *)sn);
-}
+	struct nafconn *cur;
+
+	/* schedulekill doesn't take it off the session until later */
+	for (cur = toscar_session_conns(mod, sn); cur; cur = toscar_session_next(cur)) {
+		if (cur->endpoint)
+			continue;
 
+		if (timps_oscar__debug) {
+			dvprintf(mod, "disconnecting old server connection %lu for '%s'\n", cur->cid, sn);
+		}
+
+		naf_conn_schedulekill(cur);
+	}
 
+	return NULL;
+}
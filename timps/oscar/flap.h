@@ -31,11 +31,15 @@
 #include <naf/naftypes.h>
 #include <naf/nafbufutils.h>
 
+int toscar_flap_init(struct nafmodule *mod);
+void toscar_flap_shutdown(struct nafmodule *mod);
+void toscar_flap_freeconn(struct nafmodule *mod, struct nafconn *conn);
 int toscar_flap_prepareconn(struct nafmodule *mod, struct nafconn *conn);
 int toscar_flap_handleread(struct nafmodule *mod, struct nafconn *conn);
 int toscar_flap_handlewrite(struct nafmodule *mod, struct nafconn *conn);
 
 struct nafconn *toscar__findconn(struct nafmodule *mod, const char *sn);
+struct nafconn *toscar__findattachedconn(struct nafmodule *mod, const char *sn);
 struct nafconn *toscar__detacholdconns(struct nafmodule *mod, const char *sn);
 int toscar__userhasotherclient(struct nafmodule *mod, const char *sn, struct nafconn *conn);
 
@@ -46,85 +46,152 @@
 
 #define MSGCOOKIELEN 8
 
-/* YYY could probably use sbufs instead of strings for this. */
+/*
+ * The messages built by the ICBM handlers below live in their own arenas
+ * (see gnr_msg_alloc()), which are also handed the FLAP buffer the SNAC came
+ * in, so most of a message can just point into the packet.  Strings in the
+ * packet are length-prefixed, not NUL-terminated; they're terminated in place
+ * by overwriting the byte after them, which is only done once that byte has
+ * been parsed.
+ */
 static int
-extendstr(struct nafmodule *mod, char **s, char **e, int n)
+toscar_icbm__keepflap(struct nafmodule *mod, struct toscar_snac *snac, struct gnrmsg *gm)
 {
-	char *ns;
 
-	if (!*s) {
-		if (!(*s = naf_malloc(mod, n + 1)))
-			return -1;
-		**s = '\0';
-		*e = *s;
-		return 0;
-	}
+	if (!snac->flapbuf || !*snac->flapbuf)
+		return -1;
 
-	/* XXX it would help if there were a naf_realloc(). */
-	if (!(ns = naf_malloc(mod, (*e - *s) + n + 1)))
+	if (gnr_msg_adopt(mod, gm, *snac->flapbuf) == -1)
 		return -1;
-	memcpy(ns, *s, (*e - *s) + 1);
-	*e = ns + (*e - *s);
-	naf_free(mod, *s);
-	*s = ns;
+	*snac->flapbuf = NULL;
 
 	return 0;
 }
 
+/*
+ * Same as naf_tlv_parse_limit(), except that the TLVs are allocated from gm,
+ * and their values point into sb.  They must not be passed to naf_tlv_free().
+ */
+static naf_tlv_t *
+toscar_icbm__parsetlvs(struct gnrmsg *gm, naf_sbuf_t *sb, int limit)
+{
+	naf_tlv_t *tlvhead = NULL, **tlvtail = &tlvhead;
+
+	if (limit == 0)
+		return NULL;
+
+	while (naf_sbuf_bytesremaining(sb) >= 4) {
+		naf_tlv_t *tlv;
+
+		if (!(tlv = gnr_msg_alloc(gm, sizeof(naf_tlv_t))))
+			break;
+
+		tlv->tlv_type = naf_sbuf_get16(sb);
+		tlv->tlv_length = naf_sbuf_get16(sb);
+		if (naf_sbuf_bytesremaining(sb) < tlv->tlv_length)
+			break;
+		tlv->tlv_value = tlv->tlv_length ? naf_sbuf_getposptr(sb) : NULL;
+		naf_sbuf_advance(sb, tlv->tlv_length);
+		tlv->tlv_next = NULL;
+
+		*tlvtail = tlv;
+		tlvtail = &tlv->tlv_next;
+
+		if (limit != -1) {
+			limit--;
+			if (limit <= 0)
+				break;
+		}
+	}
+
+	return tlvhead;
+}
+
+/* touserinfo_extract(), for the same purpose. */
+static struct touserinfo *
+toscar_icbm__parseuserinfo(struct gnrmsg *gm, naf_sbuf_t *sb, naf_u8_t *snlenret)
+{
+	struct touserinfo *toui;
+	naf_u16_t tlvcnt;
+
+	if (!(toui = gnr_msg_alloc(gm, sizeof(struct touserinfo))))
+		return NULL;
+
+	*snlenret = naf_sbuf_get8(sb);
+	if (!*snlenret || (naf_sbuf_bytesremaining(sb) < *snlenret))
+		return NULL;
+	toui->sn = (char *)naf_sbuf_getposptr(sb); /* terminated later */
+	naf_sbuf_advance(sb, *snlenret);
+
+	toui->evillevel = naf_sbuf_get16(sb);
+	tlvcnt = naf_sbuf_get16(sb);
+	toui->tlvh = toscar_icbm__parsetlvs(gm, sb, tlvcnt);
+
+	return toui;
+}
+
+/*
+ * Walk the sections of an ICBM message block, converting what can be
+ * converted to text.  If msgtext is NULL, this only works out how long the
+ * text will be.  Returns that length, or -1 if the block is malformed.
+ */
 static int
-toscar_icbm__extractmsgtext(struct nafmodule *mod, naf_tlv_t *msgtlv, char **msgtextret)
+toscar_icbm__convertmsgtext(naf_sbuf_t *sb, char *msgtext, int *sectionsret, int *unrepresentableret, naf_u8_t **plainret)
 {
-	naf_sbuf_t sb;
-	char *msgtext = NULL, *msgtextend = NULL;
 	naf_u16_t featlen;
-	int unrepresentable = 0;
+	int len = 0;
 
-	if (!msgtextret)
-		return -1;
-	if (naf_sbuf_init(mod, &sb, msgtlv->tlv_value, msgtlv->tlv_length) == -1)
-		return -1;
+	*sectionsret = *unrepresentableret = 0;
+	*plainret = NULL;
+
+	naf_sbuf_rewind(sb);
 
 	/* 0501 */
-	if (naf_sbuf_get8(&sb) != 0x05)
-		goto out;
-	if (naf_sbuf_get8(&sb) != 0x01)
-		goto out;
+	if (naf_sbuf_get8(sb) != 0x05)
+		return -1;
+	if (naf_sbuf_get8(sb) != 0x01)
+		return -1;
 
 	/* features */
-	featlen = naf_sbuf_get16(&sb);
-	naf_sbuf_advance(&sb, featlen);
+	featlen = naf_sbuf_get16(sb);
+	if (naf_sbuf_advance(sb, featlen) == -1)
+		return -1;
 
-	while (naf_sbuf_bytesremaining(&sb) > 0) {
-		naf_u16_t plen, f1, f2;
+	while (naf_sbuf_bytesremaining(sb) > 0) {
+		naf_u16_t plen, f1;
 
 		/* 0101 */
-		if (naf_sbuf_get8(&sb) != 0x01)
-			goto out;
-		if (naf_sbuf_get8(&sb) != 0x01)
-			goto out;
+		if (naf_sbuf_get8(sb) != 0x01)
+			return -1;
+		if (naf_sbuf_get8(sb) != 0x01)
+			return -1;
 
-		plen = naf_sbuf_get16(&sb);
-		if (!plen)
-			continue;
-		if (plen < 4)
+		plen = naf_sbuf_get16(sb);
+		if (naf_sbuf_bytesremaining(sb) < plen)
+			return -1;
+		(*sectionsret)++;
+		if (plen < 4) {
+			naf_sbuf_advance(sb, plen);
 			continue;
+		}
 
 		/* encoding flags */
-		f1 = naf_sbuf_get16(&sb);
-		f2 = naf_sbuf_get16(&sb);
+		f1 = naf_sbuf_get16(sb);
+		naf_sbuf_get16(sb);
 		plen -= 4;
 
 		if ((f1 == 0x0000) || (f1 == 0x0003)) { /* ASCII7, ISO-8859-1 */
 
-			if (extendstr(mod, &msgtext, &msgtextend, plen) == -1)
-				goto out;
-
-			naf_sbuf_getrawbuf(&sb, (naf_u8_t *)msgtextend, (naf_u16_t)plen);
-			msgtextend += plen;
-			*msgtextend = '\0';
+			if (msgtext)
+				naf_sbuf_getrawbuf(sb, (naf_u8_t *)msgtext + len, plen);
+			else {
+				*plainret = naf_sbuf_getposptr(sb);
+				naf_sbuf_advance(sb, plen);
+			}
+			len += plen;
 
 		} else if ((f1 == 0x0002) && ((plen % 2) == 0)) { /* 16bit UNICODE */
-			int n, start, i;
+			int i;
 
 			/*
 			 * The idea is to convert the 16bit UNICODE sections
@@ -134,41 +201,65 @@ toscar_icbm__extractmsgtext(struct nafmodule *mod, naf_tlv_t *msgtlv, char **msg
 			 * use the HTML entity syntax for characters that are
 			 * in ISO-8859-1, which is the first 128 glyphs.
 			 */
-			if (naf_sbuf_bytesremaining(&sb) < plen)
-				goto out;
-			start = naf_sbuf_getpos(&sb);
-			for (i = n = 0; i < plen; i += 2) {
-				naf_u16_t c;
-
-				c = naf_sbuf_get16(&sb);
-				n += (c < 128) ? 1 : 7; /* &#nnnn; */
-			}
-			naf_sbuf_setpos(&sb, start);
-
-			if (extendstr(mod, &msgtext, &msgtextend, n) == -1)
-				goto out;
-
 			for (i = 0; i < plen; i += 2) {
 				naf_u16_t c;
 
-				c = naf_sbuf_get16(&sb);
+				c = naf_sbuf_get16(sb);
 				if (c < 128) {
-					*msgtextend = (char)(c & 0xff);
-					msgtextend++;
+					if (msgtext)
+						msgtext[len] = (char)(c & 0xff);
+					len++;
 				} else {
-					if (snprintf(msgtextend, 7+1, "&#%04x;", c) > 0)
-						msgtextend += 7;
+					if (msgtext)
+						snprintf(msgtext + len, 7+1, "&#%04x;", c);
+					len += 7; /* &#nnnn; */
 				}
 			}
 
-			*msgtextend = '\0';
-
 		} else {
-			unrepresentable++;
-			naf_sbuf_advance(&sb, (naf_u16_t)plen);
+			(*unrepresentableret)++;
+			naf_sbuf_advance(sb, (naf_u16_t)plen);
 		}
 	}
 
+	return len;
+}
+
+/*
+ * If the block is just one plain text section, which it usually is, the text
+ * is left where it is, and terminated by overwriting the byte after msgtlv.
+ * Otherwise, it's converted into a new string allocated from gm.
+ */
+static int
+toscar_icbm__extractmsgtext(struct nafmodule *mod, struct gnrmsg *gm, naf_tlv_t *msgtlv, char **msgtextret)
+{
+	naf_sbuf_t sb;
+	char *msgtext;
+	naf_u8_t *plain;
+	int len, sections, unrepresentable;
+
+	if (!msgtextret)
+		return -1;
+	if (naf_sbuf_init(mod, &sb, msgtlv->tlv_value, msgtlv->tlv_length) == -1)
+		return -1;
+
+	if ((len = toscar_icbm__convertmsgtext(&sb, NULL, &sections, &unrepresentable, &plain)) == -1)
+		goto out;
+
+	if ((sections == 1) && plain)
+		msgtext = (char *)plain;
+	else if (!len && unrepresentable)
+		msgtext = NULL;
+	else {
+		if (!(msgtext = gnr_msg_alloc(gm, len + 1)))
+			goto out;
+		toscar_icbm__convertmsgtext(&sb, msgtext, &sections, &unrepresentable, &plain);
+	}
+	if (msgtext)
+		msgtext[len] = '\0';
+
+	naf_sbuf_free(mod, &sb);
+
 	*msgtextret = msgtext;
 	if (unrepresentable)
 		return 1;
@@ -227,15 +318,13 @@ toscar_icbm__parsechan1(struct nafmodule *mod, struct nafconn *conn, struct gnrm
 	if ((tlv = naf_tlv_remove(mod, tlvh, 0x0002))) {
 
 		gm->msgtexttype = "text/html";
-		if (toscar_icbm__extractmsgtext(mod, tlv, &gm->msgtext) != 0) {
+		if (toscar_icbm__extractmsgtext(mod, gm, tlv, &gm->msgtext) != 0) {
 			/*
 			 * If there was information in the msgtlv that couldn't
 			 * be expressed in the msgtext, pass it along to use
 			 * later.
 			 */
-			if (gnr_msg_tag_add(mod, gm, "gnrmsg.oscarmsgtlv", 'V', (void *)tlv) == -1)
-				naf_tlv_free(mod, tlv);
-			tlv = NULL;
+			gnr_msg_tag_add(mod, gm, "gnrmsg.oscarmsgtlv", 'V', (void *)tlv);
 		}
 	}
 
@@ -297,16 +386,16 @@ toscar_snachandler_0004_0006(struct nafmodule *mod, struct nafconn *conn, struct
 {
 	int ret = HRET_DIGESTED;
 
-	naf_u8_t *msgck = NULL;
+	naf_u8_t *msgck;
 	naf_u16_t msgchan;
 	naf_u8_t destsnlen;
-	char *destsn = NULL, *srcsn = NULL;
+	char *destsn, *srcsn = NULL;
 	naf_tlv_t *tlvh = NULL;
 
 	struct gnrmsg *gm = NULL;
 
 
-	if ((naf_conn_tag_fetch(mod, conn->endpoint, "conn.screenname", NULL, (void **)&srcsn) == -1) || !srcsn) {
+	if ((naf_conn_tag_fetchatom(mod, conn->endpoint, toscar__atom_screenname, NULL, (void **)&srcsn) == -1) || !srcsn) {
 		if (timps_oscar__debug > 0)
 			dvprintf(mod, "[cid %lu] 0004/0006: unable to find conn.screenname tag\n", conn->cid);
 		ret = HRET_ERROR;
@@ -314,24 +403,38 @@ toscar_snachandler_0004_0006(struct nafmodule *mod, struct nafconn *conn, struct
 	}
 
 
-	if (!(msgck = naf_sbuf_getraw(mod, &snac->payload, MSGCOOKIELEN))) {
+	if (naf_sbuf_bytesremaining(&snac->payload) < MSGCOOKIELEN + 2 + 1) {
 		ret = HRET_ERROR;
 		goto out;
 	}
+	msgck = naf_sbuf_getposptr(&snac->payload);
+	naf_sbuf_advance(&snac->payload, MSGCOOKIELEN);
 	msgchan = naf_sbuf_get16(&snac->payload);
 	destsnlen = naf_sbuf_get8(&snac->payload);
-	if (!(destsn = naf_sbuf_getstr(mod, &snac->payload, destsnlen))) {
+	if (!destsnlen || (naf_sbuf_bytesremaining(&snac->payload) < destsnlen)) {
 		ret = HRET_ERROR;
 		goto out;
 	}
-	tlvh = naf_tlv_parse(mod, &snac->payload);
+	destsn = (char *)naf_sbuf_getposptr(&snac->payload);
+	naf_sbuf_advance(&snac->payload, destsnlen);
+
+	if (msgchan != 0x0001) {
+		if (timps_oscar__debug > 0)
+			dvprintf(mod, "[cid %lu] [%s] ignoring outgoing message to '%.*s' on unknown channel %u\n", conn->cid, srcsn, destsnlen, destsn, msgchan);
+		ret = HRET_FORWARD;
+		goto out;
+	}
 
 
-	if (!(gm = gnr_msg_new(mod))) {
+	if (!(gm = gnr_msg_new(mod)) ||
+			(toscar_icbm__keepflap(mod, snac, gm) == -1)) {
 		ret = HRET_ERROR;
 		goto out;
 	}
 
+	tlvh = toscar_icbm__parsetlvs(gm, &snac->payload, -1);
+	destsn[destsnlen] = '\0';
+
 	/* Add various hints to build context for rewriting the message later */
 	if (gnr_msg_tag_add(mod, gm, "gnrmsg.snacid", 'I', (void *)snac->id) == -1) {
 		ret = HRET_ERROR;
@@ -341,24 +444,19 @@ toscar_snachandler_0004_0006(struct nafmodule *mod, struct nafconn *conn, struct
 		ret = HRET_ERROR;
 		goto out;
 	}
-	msgck = NULL;
 
 	/* generic routing info */
-	gm->srcname = srcsn;
+	if (!(gm->srcname = gnr_msg_strdup(gm, srcsn))) {
+		ret = HRET_ERROR;
+		goto out;
+	}
 	gm->srcnameservice = OSCARSERVICE;
 	gm->destname = destsn;
 	gm->destnameservice = OSCARSERVICE;
 
 	/* extract channel-specific data */
-	if (msgchan == 0x0001) {
-		if (toscar_icbm__parsechan1(mod, conn, gm, &tlvh) == -1) {
-			ret = HRET_ERROR;
-			goto out;
-		}
-	} else {
-		if (timps_oscar__debug > 0)
-			dvprintf(mod, "[cid %lu] [%s] ignoring outgoing message to '%s' on unknown channel %u\n", conn->cid, srcsn, destsn, msgchan);
-		ret = HRET_FORWARD;
+	if (toscar_icbm__parsechan1(mod, conn, gm, &tlvh) == -1) {
+		ret = HRET_ERROR;
 		goto out;
 	}
 
@@ -368,8 +466,7 @@ toscar_snachandler_0004_0006(struct nafmodule *mod, struct nafconn *conn, struct
 	 * along as hints.  These probably include silly things like user
 	 * icon data, etc, and aren't a big deal.
 	 */
-	if (gnr_msg_tag_add(mod, gm, "gnrmsg.extraoscartlvs", 'V', (void *)tlvh) != -1)
-		tlvh = NULL;
+	gnr_msg_tag_add(mod, gm, "gnrmsg.extraoscartlvs", 'V', (void *)tlvh);
 
 
 	if (!gnr_node_findbyname(gm->destname, OSCARSERVICE)) {
@@ -382,17 +479,13 @@ toscar_snachandler_0004_0006(struct nafmodule *mod, struct nafconn *conn, struct
 	}
 
 
-	gnr_msg_route(mod, gm);
+	if (gnr_msg_enqueue(mod, gm, gnr_msg_free) != -1)
+		gm = NULL;
 
 
 out:
-	if (gm) {
-		naf_free(mod, gm->msgtext);
+	if (gm)
 		gnr_msg_free(mod, gm);
-	}
-	naf_tlv_free(mod, tlvh);
-	naf_free(mod, destsn);
-	naf_free(mod, msgck);
 	return ret;
 }
 
@@ -408,16 +501,17 @@ toscar_snachandler_0004_0007(struct nafmodule *mod, struct nafconn *conn, struct
 {
 	int ret = HRET_DIGESTED;
 
-	naf_u8_t *msgck = NULL;
+	naf_u8_t *msgck;
 	naf_u16_t msgchan;
+	naf_u8_t srcsnlen;
 	char *destsn = NULL;
-	struct touserinfo *srcinfo = NULL;
+	struct touserinfo *srcinfo;
 	naf_tlv_t *tlvh = NULL;
 
 	struct gnrmsg *gm = NULL;
 
 
-	if ((naf_conn_tag_fetch(mod, conn, "conn.screenname", NULL, (void **)&destsn) == -1) || !destsn) {
+	if ((naf_conn_tag_fetchatom(mod, conn, toscar__atom_screenname, NULL, (void **)&destsn) == -1) || !destsn) {
 		if (timps_oscar__debug > 0)
 			dvprintf(mod, "[cid %lu] 0004/0007: unable to find conn.screenname tag\n", conn->cid);
 		ret = HRET_ERROR;
@@ -425,22 +519,34 @@ toscar_snachandler_0004_0007(struct nafmodule *mod, struct nafconn *conn, struct
 	}
 
 
-	if (!(msgck = naf_sbuf_getraw(mod, &snac->payload, MSGCOOKIELEN))) {
+	if (naf_sbuf_bytesremaining(&snac->payload) < MSGCOOKIELEN + 2) {
 		ret = HRET_ERROR;
 		goto out;
 	}
+	msgck = naf_sbuf_getposptr(&snac->payload);
+	naf_sbuf_advance(&snac->payload, MSGCOOKIELEN);
 	msgchan = naf_sbuf_get16(&snac->payload);
-	if (!(srcinfo = touserinfo_extract(mod, &snac->payload))) {
-		ret = HRET_ERROR;
+
+	if (msgchan != 0x0001) {
+		if (timps_oscar__debug > 0)
+			dvprintf(mod, "[cid %lu] [%s] ignoring incoming message on unknown channel %u\n", conn->cid, destsn, msgchan);
+		ret = HRET_FORWARD;
 		goto out;
 	}
-	tlvh = naf_tlv_parse(mod, &snac->payload);
 
 
-	if (!(gm = gnr_msg_new(mod))) {
+	if (!(gm = gnr_msg_new(mod)) ||
+			(toscar_icbm__keepflap(mod, snac, gm) == -1)) {
+		ret = HRET_ERROR;
+		goto out;
+	}
+
+	if (!(srcinfo = toscar_icbm__parseuserinfo(gm, &snac->payload, &srcsnlen))) {
 		ret = HRET_ERROR;
 		goto out;
 	}
+	tlvh = toscar_icbm__parsetlvs(gm, &snac->payload, -1);
+	srcinfo->sn[srcsnlen] = '\0';
 
 	/* Add various hints to build context for rewriting the message later */
 	if (gnr_msg_tag_add(mod, gm, "gnrmsg.snacid", 'I', (void *)snac->id) == -1) {
@@ -451,24 +557,19 @@ toscar_snachandler_0004_0007(struct nafmodule *mod, struct nafconn *conn, struct
 		ret = HRET_ERROR;
 		goto out;
 	}
-	msgck = NULL;
 
 	/* generic routing info */
+	if (!(gm->destname = gnr_msg_strdup(gm, destsn))) {
+		ret = HRET_ERROR;
+		goto out;
+	}
 	gm->srcname = srcinfo->sn;
 	gm->srcnameservice = OSCARSERVICE;
-	gm->destname = destsn;
 	gm->destnameservice = OSCARSERVICE;
 
 	/* extract channel-specific data */
-	if (msgchan == 0x0001) {
-		if (toscar_icbm__parsechan1(mod, conn, gm, &tlvh) == -1) {
-			ret = HRET_ERROR;
-			goto out;
-		}
-	} else {
-		if (timps_oscar__debug > 0)
-			dvprintf(mod, "[cid %lu] [%s] ignoring incoming message from '%s' on unknown channel %u\n", conn->cid, destsn, srcinfo->sn, msgchan);
-		ret = HRET_FORWARD;
+	if (toscar_icbm__parsechan1(mod, conn, gm, &tlvh) == -1) {
+		ret = HRET_ERROR;
 		goto out;
 	}
 
@@ -476,13 +577,11 @@ toscar_snachandler_0004_0007(struct nafmodule *mod, struct nafconn *conn, struct
 		ret = HRET_ERROR;
 		goto out;
 	}
-	srcinfo = NULL;
 
 	/*
 	 * Pass along remaining unknown TLVs;
 	 */
-	if (gnr_msg_tag_add(mod, gm, "gnrmsg.extraoscartlvs", 'V', (void *)tlvh) != -1)
-		tlvh = NULL;
+	gnr_msg_tag_add(mod, gm, "gnrmsg.extraoscartlvs", 'V', (void *)tlvh);
 
 	if (!gnr_node_findbyname(gm->srcname, OSCARSERVICE)) {
 		/*
@@ -494,18 +593,14 @@ toscar_snachandler_0004_0007(struct nafmodule *mod, struct nafconn *conn, struct
 		gnr_node_online(mod, gm->srcname, OSCARSERVICE, GNR_NODE_FLAG_NONE, GNR_NODE_METRIC_MAX);
 	}
 
-	gnr_msg_route(mod, gm);
+	if (gnr_msg_enqueue(mod, gm, gnr_msg_free) != -1)
+		gm = NULL;
 
 
 out:
 	if (gm)
-		naf_free(mod, gm->msgtext);
-	gnr_msg_free(mod, gm);
-	naf_tlv_free(mod, tlvh);
-	touserinfo_free(mod, srcinfo);
-	naf_free(mod, msgck);
+		gnr_msg_free(mod, gm);
 	return ret;
-	return HRET_FORWARD;
 }
 
 int
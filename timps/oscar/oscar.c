@@ -42,11 +42,14 @@
 #include <gnr/gnrmsg.h>
 #include <gnr/gnrnode.h>
 #include <naf/naftlv.h>
+#include <naf/naftimer.h>
 
 #include "oscar.h"
 #include "oscar_internal.h"
 #include "flap.h"
+#include "snac.h"
 #include "ckcache.h"
+#include "session.h"
 #include "im.h"
 
 
@@ -57,10 +60,18 @@ struct nafmodule *timps_oscar__module = NULL;
 char *timps_oscar__authorizer = NULL;
 #define TIMPS_OSCAR_ENABLEPROROGUEALL_DEFAULT 0
 int timps_oscar__enableprorogueall = TIMPS_OSCAR_ENABLEPROROGUEALL_DEFAULT;
+naf_tagatom_t toscar__atom_screenname = -1;
+static int toscar__slot_keepalive = -1; /* a struct naf_timer */
 #define TIMPS_OSCAR_KEEPALIVE_FREQUENCY_DEFAULT 15
 int timps_oscar__keepalive_frequency = TIMPS_OSCAR_KEEPALIVE_FREQUENCY_DEFAULT;
 #define TIMPS_OSCAR_TXTIMEOUT_DEFAULT 30
 int timps_oscar__txtimeout = TIMPS_OSCAR_TXTIMEOUT_DEFAULT;
+#define TIMPS_OSCAR_CKCACHEMAX_DEFAULT 4096
+int timps_oscar__ckcachemax = TIMPS_OSCAR_CKCACHEMAX_DEFAULT;
+#define TIMPS_OSCAR_STREAMRECEIVE_DEFAULT 1
+int timps_oscar__streamreceive = TIMPS_OSCAR_STREAMRECEIVE_DEFAULT;
+#define TIMPS_OSCAR_LAZYRECEIVE_DEFAULT 1
+int timps_oscar__lazyreceive = TIMPS_OSCAR_LAZYRECEIVE_DEFAULT;
 
 static int
 toscar_msgrouting(struct nafmodule *mod, int stage, struct gnrmsg *gm, struct gnrmsg_handler_info *gmhi)
@@ -126,9 +137,14 @@ toscar_gnroutputfunc(struct nafmodule *mod, struct gnrmsg *gm, struct gnrmsg_han
 	if (gmhi->destnode->metric == GNR_NODE_METRIC_LOCAL) {
 		struct nafconn *conn;
 
-		if (!(conn = toscar__findconn(mod, gmhi->destnode->name))) {
+		/*
+		 * If they're between clients (a prorogued session, or one
+		 * that's on its way out), gnr can hold on to it for them.
+		 */
+		if (!(conn = toscar__findattachedconn(mod, gmhi->destnode->name))) {
 			if (timps_oscar__debug > 0)
-				dvprintf(mod, "gnroutputfunc(local): unable to find connection for local node '%s'[%s]\n", gmhi->destnode->name, gmhi->destnode->service);
+				dvprintf(mod, "gnroutputfunc(local): no client for local node '%s'[%s]; delaying\n", gmhi->destnode->name, gmhi->destnode->service);
+			gm->routeflags |= GNR_MSG_ROUTEFLAG_DELAYED;
 			return -1;
 		}
 
@@ -149,6 +165,41 @@ toscar_gnroutputfunc(struct nafmodule *mod, struct gnrmsg *gm, struct gnrmsg_han
 	return 0;
 }
 
+/*
+ * With queued routing, everything headed for the same node comes through
+ * here together, so a local user's connection is only looked up once.
+ */
+static int
+toscar_gnrbatchoutputfunc(struct nafmodule *mod, int count, struct gnrmsg **gms, struct gnrmsg_handler_info **gmhis)
+{
+	struct nafconn *conn = NULL;
+	int i;
+
+	for (i = 0; i < count; i++) {
+
+		if (!gmhis[i]->destnode ||
+				(gmhis[i]->destnode->metric != GNR_NODE_METRIC_LOCAL)) {
+			toscar_gnroutputfunc(mod, gms[i], gmhis[i]);
+			continue;
+		}
+
+		if (!conn && !(conn = toscar__findattachedconn(mod, gmhis[i]->destnode->name))) {
+			if (timps_oscar__debug > 0)
+				dvprintf(mod, "gnrbatchoutputfunc: no client for local node '%s'[%s], delaying %d messages\n", gmhis[i]->destnode->name, gmhis[i]->destnode->service, count - i);
+			for (; i < count; i++)
+				gms[i]->routeflags |= GNR_MSG_ROUTEFLAG_DELAYED;
+			return -1;
+		}
+
+		if (timps_oscar__debug > 1)
+			dvprintf(mod, "toscar_gnrbatchoutputfunc: to = '%s', from = '%s', msg = '%s'\n", gms[i]->destname, gms[i]->srcname, gms[i]->msgtext);
+
+		toscar_icbm_sendincoming(mod, conn->endpoint, gms[i], gmhis[i]);
+	}
+
+	return 0;
+}
+
 static void
 freetag(struct nafmodule *mod, void *object, const char *tagname, char tagtype, void *tagdata)
 {
@@ -169,28 +220,13 @@ freetag(struct nafmodule *mod, void *object, const char *tagname, char tagtype,
 
 		naf_free(mod, sn);
 
-	} else if (strcmp(tagname, "gnrmsg.oscarmsgcookie") == 0) {
-		naf_u8_t *msgck = (naf_u8_t *)tagdata;
-
-		naf_free(mod, msgck);
-
+	} else if ((strcmp(tagname, "gnrmsg.oscarmsgcookie") == 0) ||
+			(strcmp(tagname, "gnrmsg.oscarmsgtlv") == 0) ||
+			(strcmp(tagname, "gnrmsg.extraoscartlvs") == 0) ||
+			(strcmp(tagname, "gnrmsg.srcuserinfo") == 0)) {
+		/* these live in the message's arena (see im.c) */
 	} else if (strcmp(tagname, "gnrmsg.snacid") == 0) {
 		/* an int */
-	} else if (strcmp(tagname, "gnrmsg.oscarmsgtlv") == 0) {
-		naf_tlv_t *msgtlv = (naf_tlv_t *)tagdata;
-
-		naf_tlv_free(mod, msgtlv);
-
-	} else if (strcmp(tagname, "gnrmsg.extraoscartlvs") == 0) {
-		naf_tlv_t *tlvs = (naf_tlv_t *)tagdata;
-
-		naf_tlv_free(mod, tlvs);
-
-	} else if (strcmp(tagname, "gnrmsg.srcuserinfo") == 0) {
-		struct touserinfo *toui = (struct touserinfo *)tagdata;
-
-		touserinfo_free(mod, toui);
-
 	} else
 		dvprintf(mod, "freetag: unknown tagname '%s'\n", tagname);
 
@@ -257,11 +293,33 @@ modinit(struct nafmodule *mod)
 
 	timps_oscar__module = mod;
 
+	if ((toscar__atom_screenname = naf_tag_atom("conn.screenname")) == -1)
+		return -1;
+	if ((toscar__slot_keepalive = naf_conn_extslot_register(mod, sizeof(struct naf_timer))) == -1)
+		return -1;
+	if (toscar_session_init(mod) == -1)
+		return -1;
+	if (toscar_flap_init(mod) == -1)
+		return -1;
+	if (toscar_ckcache_init(mod) == -1)
+		return -1;
+	if (toscar_snac_init(mod) == -1)
+		return -1;
+
+	/* Clients always start with a FLAP on channel 1 (signon). */
+	naf_module_addprotosig(mod, (const naf_u8_t *)"\x2a\x01", 2);
+
 	if (gnr_msg_register(mod, toscar_gnroutputfunc) == -1) {
 		dprintf(mod, "modinit: gsr_msg_register failed\n");
 		return -1;
 	}
-	gnr_msg_addmsghandler(mod, GNR_MSG_MSGHANDLER_STAGE_ROUTING, 75, toscar_msgrouting, "Route AIM/OSCAR messages");
+	gnr_msg_register_batch(mod, toscar_gnrbatchoutputfunc);
+	/* Only the ICBM types can be put on the wire (see im.c). */
+	gnr_msg_addmsghandler_filtered(mod, GNR_MSG_MSGHANDLER_STAGE_ROUTING, 75, toscar_msgrouting, "Route AIM/OSCAR messages",
+			GNR_MSG_TYPEMASK(GNR_MSG_MSGTYPE_IM) |
+			GNR_MSG_TYPEMASK(GNR_MSG_MSGTYPE_GROUPINVITE) |
+			GNR_MSG_TYPEMASK(GNR_MSG_MSGTYPE_RENDEZVOUS),
+			GNR_MSG_MSGFLAG_NONE);
 
 	naf_rpc_register_method(mod, "disconnectuser", __rpc_oscar_disconnectuser, "Forcefully disconnect an OSCAR user");
 
@@ -276,6 +334,11 @@ modshutdown(struct nafmodule *mod)
 	gnr_msg_remmsghandler(mod, GNR_MSG_MSGHANDLER_STAGE_ROUTING, toscar_msgrouting);
 	gnr_msg_unregister(mod);
 
+	toscar_snac_shutdown(mod);
+	toscar_ckcache_shutdown(mod);
+	toscar_flap_shutdown(mod);
+	toscar_session_shutdown(mod);
+
 	timps_oscar__module = NULL;
 
 	return 0;
@@ -307,24 +370,38 @@ signalhandler(struct nafmodule *mod, struct nafmodule *source, int signum)
 					      timps_oscar__txtimeout,
 					      TIMPS_OSCAR_TXTIMEOUT_DEFAULT);
 
+		NAFCONFIG_UPDATEINTMODPARMDEF(mod, "ckcachemax",
+					      timps_oscar__ckcachemax,
+					      TIMPS_OSCAR_CKCACHEMAX_DEFAULT);
+
+		NAFCONFIG_UPDATEBOOLMODPARMDEF(mod, "streamreceive",
+					       timps_oscar__streamreceive,
+					       TIMPS_OSCAR_STREAMRECEIVE_DEFAULT);
+
+		NAFCONFIG_UPDATEBOOLMODPARMDEF(mod, "lazyreceive",
+					       timps_oscar__lazyreceive,
+					       TIMPS_OSCAR_LAZYRECEIVE_DEFAULT);
+
 	}
 
 	return;
 }
 
-static int
-toscar__keepalive_matcher(struct nafmodule *mod, struct nafconn *conn, const void *ud)
+/*
+ * Runs keepalivefrequency seconds after the last write was queued on a READY
+ * server connection (or txtimeout seconds after the last one was actually
+ * sent, if that's sooner).
+ */
+static void
+toscar__keepalive_timeout(struct nafmodule *mod, struct naf_timer *timer, void *data)
 {
-	const time_t now = (time_t)ud;
-
-	if (!(conn->type & NAF_CONN_TYPE_FLAP) ||
-	    !(conn->type & NAF_CONN_TYPE_SERVER))
-		return 0;
+	struct nafconn *conn = (struct nafconn *)data;
+	time_t now;
+	long next;
 
-	if (!(conn->flags & TOSCAR_FLAG_READY))
-		return 0;
+	now = time(NULL);
 
-	if ((now - conn->lasttx_soft) > timps_oscar__keepalive_frequency) {
+	if ((now - conn->lasttx_soft) >= timps_oscar__keepalive_frequency) {
 		if (timps_oscar__debug > 1) {
 			dvprintf(mod, "[%lu] sending nop (%d seconds since last tx)\n",
 				 conn->cid,
@@ -347,20 +424,52 @@ toscar__keepalive_matcher(struct nafmodule *mod, struct nafconn *conn, const voi
 			 conn->cid,
 			 now - conn->lasttx_hard);
 		naf_conn_schedulekill(conn);
+		return;
 	}
 
-	return 0;
+	next = timps_oscar__keepalive_frequency - (now - conn->lasttx_soft);
+	if ((timps_oscar__txtimeout - (now - conn->lasttx_hard) + 1) < next)
+		next = timps_oscar__txtimeout - (now - conn->lasttx_hard) + 1;
+	if (next < 1)
+		next = 1;
+
+	naf_timer_arm(timer, next * 1000);
+
+	return;
+}
+
+/*
+ * Called when a server connection becomes READY.  The timer lives in the
+ * connection's keepalive slot, and is cancelled by connkill().
+ */
+int
+toscar__keepalive_start(struct nafmodule *mod, struct nafconn *conn)
+{
+	struct naf_timer *timer;
+
+	if (!(conn->type & NAF_CONN_TYPE_FLAP) ||
+	    !(conn->type & NAF_CONN_TYPE_SERVER))
+		return 0;
+
+	if (!(timer = naf_conn_extslot(conn, toscar__slot_keepalive)))
+		return -1;
+
+	if (!timer->func)
+		naf_timer_init(timer, mod, toscar__keepalive_timeout, (void *)conn);
+
+	return naf_timer_arm(timer, timps_oscar__keepalive_frequency * 1000);
 }
 
 static void
-timerhandler(struct nafmodule *mod)
+connkill(struct nafmodule *mod, struct nafconn *conn)
 {
-	time_t now;
+	struct naf_timer *timer;
 
-	now = time(NULL);
+	if ((timer = naf_conn_extslot(conn, toscar__slot_keepalive)))
+		naf_timer_cancel(timer);
 
-	toscar_ckcache_timer(mod, now);
-	naf_conn_find(mod, toscar__keepalive_matcher, (void *)now);
+	toscar_session_rem(mod, conn);
+	toscar_flap_freeconn(mod, conn);
 
 	return;
 }
@@ -376,8 +485,7 @@ modfirst(struct nafmodule *mod)
 	mod->signal = signalhandler;
 	mod->connready = connready;
 	mod->takeconn = takeconn;
-	mod->timer = timerhandler;
-	mod->timerfreq = 5;
+	mod->connkill = connkill;
 
 	return 0;
 }
@@ -27,11 +27,18 @@
 #endif
 
 #include <naf/nafmodule.h>
+#include <naf/naftag.h>
 
 extern int timps_oscar__debug;
 extern struct nafmodule *timps_oscar__module;
 extern char *timps_oscar__authorizer;
 extern int timps_oscar__enableprorogueall;
+extern int timps_oscar__ckcachemax;
+extern int timps_oscar__streamreceive;
+extern int timps_oscar__lazyreceive;
+
+/* "conn.screenname", interned at init; it's fetched on every SNAC */
+extern naf_tagatom_t toscar__atom_screenname;
 
 #define TIMPS_OSCAR_DEFAULTPORT 5190
 
@@ -40,12 +47,16 @@ extern int timps_oscar__enableprorogueall;
 #define TOSCAR_SERVTYPE_AUTH    0x0017
 
 #define TOSCAR_FLAG_NONE        0x00000000
-#define TOSCAR_FLAG_READY       0x00000001
+#define TOSCAR_FLAG_READY       0x00000001 /* server: Host Online received */
+#define TOSCAR_FLAG_ONLINE      0x00000002 /* client: Client Online sent */
 
 /* the service name we use for gnr nodes/messages */
 #define OSCARSERVICE "AIM"
 
 int toscar_sncmp(const char *sn1, const char *sn2);
 
+/* oscar.c */
+int toscar__keepalive_start(struct nafmodule *mod, struct nafconn *conn);
+
 #endif /* ndef __OSCAR_INTERNAL_H__ */
 
@@ -0,0 +1,285 @@
+/*
+ * timps - Transparent Instant Messaging Proxy Server
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * timps is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * timps is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+/*
+ * Index of OSCAR sessions by screen name.
+ *
+ * Every server connection that was opened for a known screen name (that
+ * is, with a cookie from the authorizer; see
+ * toscar_flap_handlechan1__newconn()) is put on its session, and taken off
+ * again when it's freed.  Whether it has a client attached is just whether
+ * it has an endpoint, so a client going away (and leaving a prorogued
+ * connection behind) doesn't need any accounting here.
+ *
+ * A user normally has only a handful of connections (BOS plus whatever
+ * services they're using), so finding one is a hash lookup and a very short
+ * walk, rather than a walk over every connection.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <naf/nafmodule.h>
+#include <naf/nafconn.h>
+#include <gnr/gnrnode.h>
+
+#include "oscar_internal.h"
+#include "session.h"
+
+#define SESSION_HASH_MINSIZE 256
+
+struct toscar_session {
+	char *sn; /* as first seen */
+	naf_u32_t hash; /* gnr_node_namehash(sn) */
+	struct nafconn *conns; /* server connections, newest first */
+	struct toscar_session *next;
+};
+
+/* Kept in each server connection's session slot. */
+struct toscar_sessionlink {
+	struct toscar_session *sess;
+	struct nafconn *next;
+	struct nafconn **prevp;
+};
+
+static struct toscar_session **toscar__sessions = NULL;
+static int toscar__sessions_size = 0;
+static int toscar__sessions_count = 0;
+static int toscar__slot_session = -1;
+
+
+static struct toscar_sessionlink *
+toscar_session__link(struct nafconn *conn)
+{
+	return (struct toscar_sessionlink *)naf_conn_extslot(conn, toscar__slot_session);
+}
+
+static struct toscar_session **
+toscar_session__bucket(naf_u32_t hash)
+{
+	return &toscar__sessions[hash & (toscar__sessions_size - 1)];
+}
+
+static struct toscar_session *
+toscar_session__find(const char *sn, naf_u32_t hash)
+{
+	struct toscar_session *sess;
+
+	if (!toscar__sessions)
+		return NULL;
+
+	for (sess = *toscar_session__bucket(hash); sess; sess = sess->next) {
+		if ((sess->hash == hash) && (toscar_sncmp(sess->sn, sn) == 0))
+			return sess;
+	}
+
+	return NULL;
+}
+
+/* Double the table when it gets as full as it is big. */
+static void
+toscar_session__grow(struct nafmodule *mod)
+{
+	struct toscar_session **oldv = toscar__sessions, *sess;
+	int oldsize = toscar__sessions_size, i;
+
+	if (toscar__sessions && (toscar__sessions_count < toscar__sessions_size))
+		return;
+
+	toscar__sessions_size = oldsize ? (oldsize * 2) : SESSION_HASH_MINSIZE;
+	if (!(toscar__sessions = naf_malloc(mod, sizeof(struct toscar_session *) * toscar__sessions_size))) {
+		/* keep using the old one; it's just slower */
+		toscar__sessions = oldv;
+		toscar__sessions_size = oldsize;
+		return;
+	}
+	memset(toscar__sessions, 0, sizeof(struct toscar_session *) * toscar__sessions_size);
+
+	for (i = 0; i < oldsize; i++) {
+		while ((sess = oldv[i])) {
+			struct toscar_session **bucket;
+
+			oldv[i] = sess->next;
+			bucket = toscar_session__bucket(sess->hash);
+			sess->next = *bucket;
+			*bucket = sess;
+		}
+	}
+	naf_free(mod, oldv);
+
+	return;
+}
+
+static void
+toscar_session__free(struct nafmodule *mod, struct toscar_session *sess)
+{
+	struct toscar_session *cur, **prev;
+
+	for (prev = toscar_session__bucket(sess->hash); (cur = *prev); prev = &cur->next) {
+		if (cur == sess) {
+			*prev = cur->next;
+			toscar__sessions_count--;
+			break;
+		}
+	}
+
+	naf_free(mod, sess->sn);
+	naf_free(mod, sess);
+
+	return;
+}
+
+/*
+ * Put a server connection on sn's session.  It comes off by itself when
+ * it's freed (see toscar_session_rem()).
+ */
+int
+toscar_session_add(struct nafmodule *mod, struct nafconn *conn, const char *sn)
+{
+	struct toscar_sessionlink *link;
+	struct toscar_session *sess;
+	naf_u32_t hash;
+
+	if (!conn || !sn || !(link = toscar_session__link(conn)))
+		return -1;
+	if (link->sess)
+		return -1; /* already on one */
+
+	hash = gnr_node_namehash(sn);
+
+	if (!(sess = toscar_session__find(sn, hash))) {
+		struct toscar_session **bucket;
+
+		toscar_session__grow(mod);
+		if (!toscar__sessions)
+			return -1;
+
+		if (!(sess = naf_malloc(mod, sizeof(struct toscar_session))))
+			return -1;
+		memset(sess, 0, sizeof(struct toscar_session));
+		if (!(sess->sn = naf_strdup(mod, sn))) {
+			naf_free(mod, sess);
+			return -1;
+		}
+		sess->hash = hash;
+
+		bucket = toscar_session__bucket(hash);
+		sess->next = *bucket;
+		*bucket = sess;
+		toscar__sessions_count++;
+	}
+
+	link->sess = sess;
+	link->prevp = &sess->conns;
+	if ((link->next = sess->conns))
+		toscar_session__link(link->next)->prevp = &link->next;
+	sess->conns = conn;
+
+	return 0;
+}
+
+void
+toscar_session_rem(struct nafmodule *mod, struct nafconn *conn)
+{
+	struct toscar_sessionlink *link;
+	struct toscar_session *sess;
+
+	if (!(link = toscar_session__link(conn)) || !(sess = link->sess))
+		return;
+
+	*link->prevp = link->next;
+	if (link->next)
+		toscar_session__link(link->next)->prevp = link->prevp;
+	link->sess = NULL;
+	link->next = NULL;
+	link->prevp = NULL;
+
+	if (!sess->conns)
+		toscar_session__free(mod, sess);
+
+	return;
+}
+
+/*
+ * The server connections for sn, newest first; go through the rest with
+ * toscar_session_next().
+ */
+struct nafconn *
+toscar_session_conns(struct nafmodule *mod, const char *sn)
+{
+	struct toscar_session *sess;
+
+	if (!sn || !(sess = toscar_session__find(sn, gnr_node_namehash(sn))))
+		return NULL;
+
+	return sess->conns;
+}
+
+struct nafconn *
+toscar_session_next(struct nafconn *conn)
+{
+	struct toscar_sessionlink *link;
+
+	if (!(link = toscar_session__link(conn)))
+		return NULL;
+
+	return link->next;
+}
+
+int
+toscar_session_init(struct nafmodule *mod)
+{
+
+	if ((toscar__slot_session = naf_conn_extslot_register(mod, sizeof(struct toscar_sessionlink))) == -1)
+		return -1;
+
+	return 0;
+}
+
+void
+toscar_session_shutdown(struct nafmodule *mod)
+{
+	int i;
+
+	/* Connections still on them are on their way out anyway. */
+	for (i = 0; i < toscar__sessions_size; i++) {
+		struct toscar_session *sess;
+
+		while ((sess = toscar__sessions[i])) {
+			struct nafconn *conn;
+
+			while ((conn = sess->conns))
+				toscar_session_rem(mod, conn); /* frees sess with the last */
+		}
+	}
+
+	naf_free(mod, toscar__sessions);
+	toscar__sessions = NULL;
+	toscar__sessions_size = 0;
+	toscar__sessions_count = 0;
+
+	return;
+}
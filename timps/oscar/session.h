@@ -0,0 +1,40 @@
+/*
+ * timps - Transparent Instant Messaging Proxy Server
+ * Copyright (c) 2003-2005 Adam Fritzler <mid@zigamorph.net>
+ *
+ * timps is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License (version 2) as published by the Free
+ * Software Foundation.
+ *
+ * timps is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifdef WIN32
+#include <configwin32.h>
+#endif
+
+#include <naf/nafmodule.h>
+#include <naf/nafconn.h>
+
+int toscar_session_init(struct nafmodule *mod);
+void toscar_session_shutdown(struct nafmodule *mod);
+
+int toscar_session_add(struct nafmodule *mod, struct nafconn *conn, const char *sn);
+void toscar_session_rem(struct nafmodule *mod, struct nafconn *conn);
+struct nafconn *toscar_session_conns(struct nafmodule *mod, const char *sn);
+struct nafconn *toscar_session_next(struct nafconn *conn);
+
+#endif /* ndef __SESSION_H__ */
@@ -156,7 +156,7 @@ toscar_snachandler_0001_0002(struct nafmodule *mod, struct nafconn *conn, struct
 	if (!(conn->type & NAF_CONN_TYPE_CLIENT))
 		return HRET_ERROR;
 
-	if ((naf_conn_tag_fetch(mod, conn->endpoint, "conn.screenname", NULL, (void **)&sn) == -1) || !sn) {
+	if ((naf_conn_tag_fetchatom(mod, conn->endpoint, toscar__atom_screenname, NULL, (void **)&sn) == -1) || !sn) {
 		if (timps_oscar__debug > 0)
 			dvprintf(mod, "[cid %lu] received Client Online on connection with no user info; killing\n", conn->cid);
 		return HRET_ERROR;
@@ -178,6 +178,15 @@ toscar_snachandler_0001_0002(struct nafmodule *mod, struct nafconn *conn, struct
 		return HRET_ERROR;
 	}
 
+	/*
+	 * If the node was only being held up by a prorogued session, gnr
+	 * may have messages waiting for it.
+	 */
+	if ((node->ownermod == mod) && (node->metric == GNR_NODE_METRIC_LOCAL))
+		gnr_node_reattached(node);
+
+	conn->flags |= TOSCAR_FLAG_ONLINE;
+
 	return HRET_FORWARD;
 }
 
@@ -192,6 +201,7 @@ toscar_snachandler_0001_0003(struct nafmodule *mod, struct nafconn *conn, struct
 {
 
 	conn->flags |= TOSCAR_FLAG_READY;
+	toscar__keepalive_start(mod, conn);
 
 	if (timps_oscar__debug > 0)
 		dvprintf(mod, "[%lu] received Host Online\n", conn->cid);
@@ -211,7 +221,7 @@ toscar_snachandler_0001_000b(struct nafmodule *mod, struct nafconn *conn, struct
 {
 	char *sn = NULL;
 
-	naf_conn_tag_fetch(mod, conn, "conn.screenname", NULL, (void **)&sn);
+	naf_conn_tag_fetchatom(mod, conn, toscar__atom_screenname, NULL, (void **)&sn);
 
 	dvprintf(mod, "[cid %lu] [%s] received server pause; disconnecting for safety\n", conn->cid, sn);
 
@@ -423,6 +433,8 @@ out:
 }
 
 
+#define SNACHDRLEN 10
+
 typedef int (*toscar_snachandler_t)(struct nafmodule *, struct nafconn *, struct toscar_snac *);
 static struct snachandler {
 	naf_u16_t group;
@@ -439,14 +451,178 @@ static struct snachandler {
 	{0x0000, 0x0000, NULL}
 };
 
+/*
+ * Which SNACs a connection may send depends on how far along login it is.
+ * Server connections can send anything; the server does its own checks
+ * on what clients send it, but anything we act on locally (an IM to a
+ * local user, say) has to be checked here.
+ */
+#define SNACSTATE_SERVER    0 /* from the server; trusted */
+#define SNACSTATE_SIGNON    1 /* client, before it's told us where it's going */
+#define SNACSTATE_AUTH      2 /* client, talking to the authorizer */
+#define SNACSTATE_PREONLINE 3 /* client at BOS, before Client Online */
+#define SNACSTATE_ONLINE    4 /* client at BOS, after */
+#define SNACSTATE_NSTATES   5
+
+#define SNAC_ANY 0xffff
+static const struct snacrule {
+	int state;
+	naf_u16_t group; /* or SNAC_ANY */
+	naf_u16_t subtype; /* or SNAC_ANY */
+	int permit;
+} toscar__snacrules[] = {
+	/* applied in order; later ones override */
+	{SNACSTATE_SERVER,    SNAC_ANY, SNAC_ANY, 1},
+	{SNACSTATE_SIGNON,    0x0017,   SNAC_ANY, 1},
+	{SNACSTATE_AUTH,      0x0017,   SNAC_ANY, 1},
+	{SNACSTATE_PREONLINE, SNAC_ANY, SNAC_ANY, 1},
+	{SNACSTATE_PREONLINE, 0x0017,   SNAC_ANY, 0},
+	{SNACSTATE_PREONLINE, 0x0004,   0x0006,   0}, /* no IMs until online */
+	{SNACSTATE_ONLINE,    SNAC_ANY, SNAC_ANY, 1},
+	{SNACSTATE_ONLINE,    0x0017,   SNAC_ANY, 0},
+	{-1, 0, 0, 0}
+};
+
+/*
+ * Handlers and permissions are looked up by group and subtype, directly.
+ * Everything outside of the table (which no current SNAC is) is
+ * unhandled, and permitted wherever SNAC_ANY/SNAC_ANY is.
+ */
+#define SNAC_NGROUPS   0x0040
+#define SNAC_NSUBTYPES 0x0040
+#define SNAC_PERMWORDS (SNAC_NSUBTYPES / 32)
+
+/* only groups that have handlers get a row */
+static toscar_snachandler_t *toscar__snacjump[SNAC_NGROUPS];
+
+static struct snacstate {
+	naf_u32_t perm[SNAC_NGROUPS][SNAC_PERMWORDS];
+	int permitother;
+} toscar__snacstates[SNACSTATE_NSTATES];
+
+#define SNAC_PERMITTED(st, g, s) \
+	((((g) < SNAC_NGROUPS) && ((s) < SNAC_NSUBTYPES)) ? \
+	 ((st)->perm[(g)][(s) >> 5] & (1UL << ((s) & 0x1f))) : \
+	 (st)->permitother)
+
+static void
+toscar_snac__setperm(struct snacstate *st, naf_u16_t group, naf_u16_t subtype, int permit)
+{
+	naf_u16_t g, s;
+
+	for (g = 0; g < SNAC_NGROUPS; g++) {
+		if ((group != SNAC_ANY) && (group != g))
+			continue;
+		for (s = 0; s < SNAC_NSUBTYPES; s++) {
+			if ((subtype != SNAC_ANY) && (subtype != s))
+				continue;
+			if (permit)
+				st->perm[g][s >> 5] |= 1UL << (s & 0x1f);
+			else
+				st->perm[g][s >> 5] &= ~(1UL << (s & 0x1f));
+		}
+	}
+	if ((group == SNAC_ANY) && (subtype == SNAC_ANY))
+		st->permitother = permit;
+
+	return;
+}
+
 int
-toscar_flap_handlesnac(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *buf, naf_u16_t buflen)
+toscar_snac_init(struct nafmodule *mod)
+{
+	const struct snacrule *r;
+	struct snachandler *i;
+
+	memset(toscar__snacjump, 0, sizeof(toscar__snacjump));
+	memset(toscar__snacstates, 0, sizeof(toscar__snacstates));
+
+	for (i = toscar__snachandlers; i->group != 0x0000; i++) {
+
+		if ((i->group >= SNAC_NGROUPS) || (i->subtype >= SNAC_NSUBTYPES)) {
+			dvprintf(mod, "snac_init: handler for %04x/%04x is outside of the table\n", i->group, i->subtype);
+			toscar_snac_shutdown(mod);
+			return -1;
+		}
+
+		if (!toscar__snacjump[i->group]) {
+			if (!(toscar__snacjump[i->group] = naf_malloc(mod, sizeof(toscar_snachandler_t) * SNAC_NSUBTYPES))) {
+				toscar_snac_shutdown(mod);
+				return -1;
+			}
+			memset(toscar__snacjump[i->group], 0, sizeof(toscar_snachandler_t) * SNAC_NSUBTYPES);
+		}
+		toscar__snacjump[i->group][i->subtype] = i->handler;
+	}
+
+	for (r = toscar__snacrules; r->state != -1; r++)
+		toscar_snac__setperm(&toscar__snacstates[r->state], r->group, r->subtype, r->permit);
+
+	return 0;
+}
+
+void
+toscar_snac_shutdown(struct nafmodule *mod)
+{
+	int g;
+
+	for (g = 0; g < SNAC_NGROUPS; g++) {
+		naf_free(mod, toscar__snacjump[g]);
+		toscar__snacjump[g] = NULL;
+	}
+
+	return;
+}
+
+static struct snacstate *
+toscar_snac__state(struct nafconn *conn)
+{
+
+	if (!(conn->type & NAF_CONN_TYPE_CLIENT))
+		return &toscar__snacstates[SNACSTATE_SERVER];
+	if (conn->servtype == TOSCAR_SERVTYPE_AUTH)
+		return &toscar__snacstates[SNACSTATE_AUTH];
+	if (conn->servtype == TOSCAR_SERVTYPE_UNKNOWN)
+		return &toscar__snacstates[SNACSTATE_SIGNON];
+	if (conn->flags & TOSCAR_FLAG_ONLINE)
+		return &toscar__snacstates[SNACSTATE_ONLINE];
+	return &toscar__snacstates[SNACSTATE_PREONLINE];
+}
+
+/*
+ * Returns 1 if the SNAC in buf (a FLAP payload) would just be forwarded
+ * by toscar_flap_handlesnac(): it's permitted, and nothing here handles
+ * it.  Those can be passed along without being parsed or copied.
+ */
+int
+toscar_snac_passthrough(struct nafconn *conn, naf_u8_t *buf, naf_u16_t buflen)
+{
+	naf_u16_t group, subtype;
+
+	if (buflen < SNACHDRLEN)
+		return 0;
+
+	group = naf_byte_get16(buf);
+	subtype = naf_byte_get16(buf + 2);
+
+	if (!SNAC_PERMITTED(toscar_snac__state(conn), group, subtype))
+		return 0;
+
+	if ((group < SNAC_NGROUPS) && (subtype < SNAC_NSUBTYPES) &&
+			toscar__snacjump[group] &&
+			toscar__snacjump[group][subtype])
+		return 0;
+
+	return 1;
+}
+
+int
+toscar_flap_handlesnac(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *buf, naf_u16_t buflen, naf_u8_t **flapbuf)
 {
 	naf_u16_t exthdrlen = 0;
 	struct toscar_snac snac;
 	int hret = HRET_FORWARD;
 
-#define SNACHDRLEN 10
 	if (buflen < SNACHDRLEN) {
 		if (timps_oscar__debug > 0)
 			dvprintf(mod, "[cid %ld] runt SNAC\n", conn->cid);
@@ -459,6 +635,7 @@ toscar_flap_handlesnac(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *bu
 	snac.subtype = naf_byte_get16(buf + 2);
 	snac.flags = naf_byte_get16(buf + 4);
 	snac.id = naf_byte_get32(buf + 6);
+	snac.flapbuf = flapbuf;
 	if (snac.flags & 0x8000) { /* extended SNAC header */
 		exthdrlen = naf_byte_get16(buf + SNACHDRLEN);
 		if (exthdrlen)
@@ -481,29 +658,22 @@ toscar_flap_handlesnac(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *bu
 				naf_sbuf_bytesremaining(&snac.payload));
 	}
 
-	/*
-	 * XXX We need a generalized way of saying "only these snacs are
-	 * permitted right now".  As it stands, a rogue client can, say,
-	 * send messages before even logging in, or at any time during the
-	 * login process.  They won't make it to the server ('cause it
-	 * actually does these checks), but if they send to a local user,
-	 * that message will go through without authentication.
-	 */
-
-	{ /* dispatch */
-		struct snachandler *i;
-
-		for (i = toscar__snachandlers; i->group != 0x0000; i++) {
-			if ((i->group == snac.group) &&
-					(i->subtype == snac.subtype)) {
-				break;
-			}
-		}
-
-		if (i && i->handler)
-			hret = i->handler(mod, conn, &snac);
+	if (!SNAC_PERMITTED(toscar_snac__state(conn), snac.group, snac.subtype)) {
+		/*
+		 * Dropped, rather than killing the connection, since a client
+		 * that jumps the gun isn't necessarily rogue.
+		 */
+		if (timps_oscar__debug > 0)
+			dvprintf(mod, "[cid %lu] dropping SNAC %04x/%04x not permitted at this point in login\n", conn->cid, snac.group, snac.subtype);
+		hret = HRET_DIGESTED;
+		goto out;
 	}
 
+	if ((snac.group < SNAC_NGROUPS) && (snac.subtype < SNAC_NSUBTYPES) &&
+			toscar__snacjump[snac.group] &&
+			toscar__snacjump[snac.group][snac.subtype])
+		hret = toscar__snacjump[snac.group][snac.subtype](mod, conn, &snac);
+
 out:
 	if (timps_oscar__debug > 1) {
 		dvprintf(mod, "[cid %lu] SNAC handler returned %s%s%s (%d)\n",
@@ -42,9 +42,19 @@ struct toscar_snac {
 	naf_u32_t id;
 	naf_sbuf_t extinfo;
 	naf_sbuf_t payload;
+	/*
+	 * The buffer holding the whole FLAP.  A handler that digests the SNAC
+	 * may keep it (and point into it) by setting *flapbuf to NULL, after
+	 * which it's responsible for freeing it.  There's always at least one
+	 * byte past the end of the SNAC to spare, for a terminating NUL.
+	 */
+	naf_u8_t **flapbuf;
 };
 
-int toscar_flap_handlesnac(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *buf, naf_u16_t buflen);
+int toscar_snac_init(struct nafmodule *mod);
+void toscar_snac_shutdown(struct nafmodule *mod);
+int toscar_snac_passthrough(struct nafconn *conn, naf_u8_t *buf, naf_u16_t buflen);
+int toscar_flap_handlesnac(struct nafmodule *mod, struct nafconn *conn, naf_u8_t *buf, naf_u16_t buflen, naf_u8_t **flapbuf);
 int toscar_newsnacsb(struct nafmodule *mod, naf_sbuf_t *sb, naf_u16_t group, naf_u16_t subtype, naf_u16_t flags, naf_u32_t id);
 
 int toscar_auth_sendauthinforequest(struct nafmodule *mod, struct nafconn *conn, naf_u32_t snacid, naf_tlv_t *tlvh);